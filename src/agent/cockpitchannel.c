@@ -21,6 +21,7 @@
 
 #include "cockpitchannel.h"
 #include "cockpitdbusjson.h"
+#include "cockpitjournalstream.h"
 #include "cockpitrestjson.h"
 #include "cockpittextstream.h"
 
@@ -353,6 +354,8 @@ cockpit_channel_open (CockpitTransport *transport,
     channel_type = COCKPIT_TYPE_REST_JSON;
   else if (g_strcmp0 (payload, "text-stream") == 0)
     channel_type = COCKPIT_TYPE_TEXT_STREAM;
+  else if (g_strcmp0 (payload, "journal-stream") == 0)
+    channel_type = COCKPIT_TYPE_JOURNAL_STREAM;
   else
     channel_type = COCKPIT_TYPE_CHANNEL;
 
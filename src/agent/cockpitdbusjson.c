@@ -45,6 +45,11 @@
  *
  * A #CockpitChannel that sends DBus messages with the dbus-json1 payload
  * type.
+ *
+ * The agent talks to the bus on one connection for all its channels,
+ * so a service can't tell when one of them goes away. Subscribe() calls
+ * that succeeded are remembered, and the channel calls Unsubscribe()
+ * with the same arguments for each of them that is left when it closes.
  */
 
 #define COCKPIT_DBUS_JSON(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_DBUS_JSON, CockpitDBusJson))
@@ -55,6 +60,7 @@ typedef struct {
   GCancellable             *cancellable;
   GList                    *active_calls;
   GHashTable               *introspect_cache;
+  GList                    *subscriptions;
 } CockpitDBusJson;
 
 typedef struct {
@@ -689,6 +695,10 @@ typedef struct
   const gchar *method_name;
   const gchar *objpath;
   JsonArray *args;
+
+  /* Set once the call is made */
+  GVariant *parameters;
+  gchar *owner;
 } CallData;
 
 static void
@@ -696,9 +706,78 @@ call_data_free (CallData *data)
 {
   g_object_unref (data->connection);
   json_object_unref (data->request);
+  if (data->parameters)
+    g_variant_unref (data->parameters);
+  g_free (data->owner);
   g_free (data);
 }
 
+typedef struct {
+  gchar *objpath;
+  gchar *iface_name;
+  GVariant *parameters;
+} Subscription;
+
+static void
+subscription_free (gpointer data)
+{
+  Subscription *subscription = data;
+  g_free (subscription->objpath);
+  g_free (subscription->iface_name);
+  g_variant_unref (subscription->parameters);
+  g_slice_free (Subscription, subscription);
+}
+
+static void
+call_unsubscribe (GDBusConnection *connection,
+                  const gchar *owner,
+                  const gchar *objpath,
+                  const gchar *iface_name,
+                  GVariant *parameters)
+{
+  /* The service is gone, and its subscriptions with it */
+  if (owner == NULL)
+    return;
+
+  g_debug ("unsubscribing from %s %s", objpath, iface_name);
+  g_dbus_connection_call (connection, owner, objpath, iface_name, "Unsubscribe",
+                          parameters, NULL, G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                          -1, NULL, NULL, NULL);
+}
+
+/* Keep count of the subscriptions this channel holds */
+static void
+track_subscription (CockpitDBusJson *self,
+                    CallData *data)
+{
+  Subscription *subscription;
+  GList *l;
+
+  if (g_str_equal (data->method_name, "Subscribe"))
+    {
+      subscription = g_slice_new0 (Subscription);
+      subscription->objpath = g_strdup (data->objpath);
+      subscription->iface_name = g_strdup (data->iface_name);
+      subscription->parameters = g_variant_ref (data->parameters);
+      self->subscriptions = g_list_prepend (self->subscriptions, subscription);
+    }
+  else if (g_str_equal (data->method_name, "Unsubscribe"))
+    {
+      for (l = self->subscriptions; l != NULL; l = g_list_next (l))
+        {
+          subscription = l->data;
+          if (g_str_equal (subscription->objpath, data->objpath) &&
+              g_str_equal (subscription->iface_name, data->iface_name) &&
+              g_variant_equal (subscription->parameters, data->parameters))
+            {
+              self->subscriptions = g_list_delete_link (self->subscriptions, l);
+              subscription_free (subscription);
+              break;
+            }
+        }
+    }
+}
+
 static void
 dbus_call_cb (GDBusConnection *connection,
               GAsyncResult *res,
@@ -713,10 +792,20 @@ dbus_call_cb (GDBusConnection *connection,
 
   if (data->dbus_json)
     {
+      if (result)
+        track_subscription (data->dbus_json, data);
       send_dbus_reply (data->dbus_json, data->cookie, result, error);
       data->dbus_json->active_calls = g_list_delete_link (data->dbus_json->active_calls, data->link);
     }
 
+  /* The channel closed during a Subscribe() that may still have happened */
+  else if (g_str_equal (data->method_name, "Subscribe") &&
+           (result || !g_dbus_error_is_remote_error (error)))
+    {
+      call_unsubscribe (connection, data->owner, data->objpath,
+                        data->iface_name, data->parameters);
+    }
+
   if (result)
     g_variant_unref (result);
   g_clear_error (&error);
@@ -808,10 +897,14 @@ handle_dbus_call_on_interface (CockpitDBusJson *self,
 
   reply_type = compute_complete_signature (method_info->out_args);
 
+  /* Kept for tracking subscriptions */
+  call_data->parameters = g_variant_ref_sink (g_variant_builder_end (&arg_builder));
+  call_data->owner = owner;
+
   /* and now, issue the call */
   g_dbus_connection_call (call_data->connection, owner, call_data->objpath,
                           call_data->iface_name, call_data->method_name,
-                          g_variant_builder_end (&arg_builder),
+                          call_data->parameters,
                           reply_type,
                           G_DBUS_CALL_FLAGS_NO_AUTO_START,
                           G_MAXINT, /* timeout */
@@ -821,8 +914,6 @@ handle_dbus_call_on_interface (CockpitDBusJson *self,
 
   g_variant_type_free (reply_type);
 
-  g_free (owner);
-
 out:
   if (error)
     {
@@ -1201,8 +1292,30 @@ static void
 cockpit_dbus_json_dispose (GObject *object)
 {
   CockpitDBusJson *self = COCKPIT_DBUS_JSON (object);
+  GDBusConnection *connection;
+  Subscription *subscription;
+  gchar *owner;
   GList *l;
 
+  /* Give back whatever this channel is still subscribed to */
+  if (self->subscriptions)
+    {
+      g_object_get (self->object_manager,
+                    "connection", &connection,
+                    "name-owner", &owner,
+                    NULL);
+      for (l = self->subscriptions; l != NULL; l = g_list_next (l))
+        {
+          subscription = l->data;
+          call_unsubscribe (connection, owner, subscription->objpath,
+                            subscription->iface_name, subscription->parameters);
+        }
+      g_list_free_full (self->subscriptions, subscription_free);
+      self->subscriptions = NULL;
+      g_object_unref (connection);
+      g_free (owner);
+    }
+
   g_signal_handlers_disconnect_by_func (self->object_manager,
                                         G_CALLBACK (on_object_added),
                                         self);
@@ -0,0 +1,690 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitjournalstream.h"
+
+#include "cockpit/cockpittextsearch.h"
+#include "cockpit/cockpitunixfd.h"
+
+#include <systemd/sd-journal.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * CockpitJournalStream:
+ *
+ * A #CockpitChannel that reads the journal directly and sends entries
+ * as JSON objects, one per line. Entries are sent in batches of at most
+ * 'batch-size' entries, and an entry waits at most 'batch-latency'
+ * milliseconds before its batch is sent.
+ *
+ * Options are:
+ *  - "match": matches like journalctl takes them, "+" separates
+ *    disjunctions
+ *  - "seek": "head", "tail" or a cursor to continue after
+ *  - "skip": skip this many entries first, or when negative start
+ *    this many entries before the seek position
+ *  - "count": the most entries to send
+ *  - "fields": only send these fields, otherwise all of them
+ *  - "filter": only send entries with a field value that contains
+ *    this text, ignoring case unless it has upper case letters
+ *  - "follow": keep sending entries as they're added to the journal
+ *
+ * Only 'window' batches are sent before the other end acknowledges
+ * them, by sending one message on the channel for every batch it has
+ * processed. When not following, the channel closes once it reaches the
+ * end of the journal. The close message has the "cursor" of the last
+ * entry looked at.
+ *
+ * The payload type for this channel is 'journal-stream'.
+ */
+
+#define COCKPIT_JOURNAL_STREAM(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_JOURNAL_STREAM, CockpitJournalStream))
+
+/* Entries looked at per main loop iteration, so filtering doesn't block */
+#define MAX_SCAN_PER_ITERATION 1000
+
+typedef struct {
+  CockpitChannel parent;
+  sd_journal *journal;
+  gboolean at_entry;
+
+  const gchar **fields;
+  CockpitTextSearch *filter;
+  gint64 remaining;
+  gboolean follow;
+
+  guint batch_size;
+  guint batch_latency;
+  guint window;
+  guint in_flight;
+
+  GString *batch;
+  guint batch_count;
+  gboolean flush_pending;
+
+  guint read_sig;
+  guint latency_sig;
+  GSource *journal_source;
+  gboolean waiting;
+  gboolean closed;
+} CockpitJournalStream;
+
+typedef struct {
+  CockpitChannelClass parent_class;
+} CockpitJournalStreamClass;
+
+G_DEFINE_TYPE (CockpitJournalStream, cockpit_journal_stream, COCKPIT_TYPE_CHANNEL);
+
+static gchar *journal_directory = NULL;
+
+static void journal_stream_schedule (CockpitJournalStream *self);
+
+static void
+append_json_string (GString *string,
+                    const gchar *data,
+                    gsize length)
+{
+  const gchar *end = data + length;
+  const gchar *p;
+
+  if (!g_utf8_validate (data, length, NULL))
+    {
+      g_string_append (string, "null");
+      return;
+    }
+
+  g_string_append_c (string, '"');
+  for (p = data; p < end; p++)
+    {
+      switch (*p)
+        {
+        case '"':
+        case '\\':
+          g_string_append_c (string, '\\');
+          g_string_append_c (string, *p);
+          break;
+        case '\n':
+          g_string_append (string, "\\n");
+          break;
+        case '\r':
+          g_string_append (string, "\\r");
+          break;
+        case '\t':
+          g_string_append (string, "\\t");
+          break;
+        default:
+          if ((guchar)*p < 0x20 || *p == 0x7f)
+            g_string_append_printf (string, "\\u%04x", (guint)(guchar)*p);
+          else
+            g_string_append_c (string, *p);
+          break;
+        }
+    }
+  g_string_append_c (string, '"');
+}
+
+static void
+append_field (GString *string,
+              const gchar *data,
+              gsize length)
+{
+  const gchar *eq;
+
+  eq = memchr (data, '=', length);
+  if (!eq)
+    return;
+
+  g_string_append_c (string, ',');
+  append_json_string (string, data, eq - data);
+  g_string_append_c (string, ':');
+  append_json_string (string, eq + 1, length - (eq - data) - 1);
+}
+
+static gboolean
+append_entry (CockpitJournalStream *self)
+{
+  sd_journal *j = self->journal;
+  const void *data;
+  gchar *cursor;
+  guint64 usec;
+  size_t length;
+  gint i;
+  int ret;
+
+  ret = sd_journal_get_cursor (j, &cursor);
+  if (ret < 0)
+    {
+      g_message ("couldn't get journal cursor: %s", g_strerror (-ret));
+      return FALSE;
+    }
+
+  g_string_append (self->batch, "{\"__CURSOR\":");
+  append_json_string (self->batch, cursor, strlen (cursor));
+  free (cursor);
+
+  if (sd_journal_get_realtime_usec (j, &usec) >= 0)
+    g_string_append_printf (self->batch, ",\"__REALTIME_TIMESTAMP\":\"%" G_GUINT64_FORMAT "\"", usec);
+
+  if (self->fields)
+    {
+      for (i = 0; self->fields[i] != NULL; i++)
+        {
+          if (sd_journal_get_data (j, self->fields[i], &data, &length) >= 0)
+            append_field (self->batch, data, length);
+        }
+    }
+  else
+    {
+      sd_journal_restart_data (j);
+      while (sd_journal_enumerate_data (j, &data, &length) > 0)
+        append_field (self->batch, data, length);
+    }
+
+  g_string_append (self->batch, "}\n");
+  return TRUE;
+}
+
+static gboolean
+entry_matches_filter (CockpitJournalStream *self)
+{
+  const void *data;
+  const gchar *value;
+  size_t length;
+
+  if (!self->filter)
+    return TRUE;
+
+  sd_journal_restart_data (self->journal);
+  while (sd_journal_enumerate_data (self->journal, &data, &length) > 0)
+    {
+      /* Only look at the value, not the field name */
+      value = memchr (data, '=', length);
+      if (value)
+        {
+          value++;
+          length -= value - (const gchar *)data;
+          data = value;
+        }
+      if (cockpit_text_search_match (self->filter, data, length))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+can_send (CockpitJournalStream *self)
+{
+  return self->window == 0 || self->in_flight < self->window;
+}
+
+static void
+journal_stream_flush (CockpitJournalStream *self)
+{
+  GBytes *bytes;
+
+  if (self->latency_sig)
+    {
+      g_source_remove (self->latency_sig);
+      self->latency_sig = 0;
+    }
+
+  self->flush_pending = FALSE;
+  if (self->batch_count == 0)
+    return;
+
+  bytes = g_bytes_new_take (self->batch->str, self->batch->len);
+  g_string_free (self->batch, FALSE);
+  self->batch = g_string_sized_new (4096);
+  self->batch_count = 0;
+  self->in_flight++;
+
+  cockpit_channel_send (COCKPIT_CHANNEL (self), bytes);
+  g_bytes_unref (bytes);
+}
+
+static void
+journal_stream_finish (CockpitJournalStream *self,
+                       const gchar *problem)
+{
+  CockpitChannel *channel = COCKPIT_CHANNEL (self);
+  gchar *cursor;
+
+  if (!problem)
+    {
+      journal_stream_flush (self);
+      if (sd_journal_get_cursor (self->journal, &cursor) >= 0)
+        {
+          cockpit_channel_close_option (channel, "cursor", cursor);
+          free (cursor);
+        }
+    }
+
+  cockpit_channel_close (channel, problem);
+}
+
+static gboolean
+on_batch_latency (gpointer user_data)
+{
+  CockpitJournalStream *self = user_data;
+
+  self->latency_sig = 0;
+  if (can_send (self))
+    journal_stream_flush (self);
+  else
+    self->flush_pending = TRUE;
+
+  return FALSE;
+}
+
+static gboolean
+on_read_entries (gpointer user_data)
+{
+  CockpitJournalStream *self = user_data;
+  guint scanned = 0;
+  int ret;
+
+  while (can_send (self))
+    {
+      if (self->remaining == 0)
+        {
+          self->read_sig = 0;
+          journal_stream_finish (self, NULL);
+          return FALSE;
+        }
+
+      if (scanned++ >= MAX_SCAN_PER_ITERATION)
+        return TRUE;
+
+      if (self->at_entry)
+        {
+          ret = 1;
+          self->at_entry = FALSE;
+        }
+      else
+        {
+          ret = sd_journal_next (self->journal);
+        }
+
+      if (ret < 0)
+        {
+          g_message ("couldn't read journal: %s", g_strerror (-ret));
+          self->read_sig = 0;
+          journal_stream_finish (self, "internal-error");
+          return FALSE;
+        }
+      else if (ret == 0)
+        {
+          self->read_sig = 0;
+          if (!self->follow)
+            {
+              journal_stream_finish (self, NULL);
+            }
+          else
+            {
+              /* The journal fd tells us when there is more */
+              self->waiting = TRUE;
+            }
+          return FALSE;
+        }
+
+      if (!entry_matches_filter (self))
+        continue;
+
+      if (!append_entry (self))
+        {
+          self->read_sig = 0;
+          journal_stream_finish (self, "internal-error");
+          return FALSE;
+        }
+
+      self->batch_count++;
+      if (self->remaining > 0)
+        self->remaining--;
+
+      if (self->batch_count >= self->batch_size)
+        journal_stream_flush (self);
+      else if (self->batch_count == 1)
+        self->latency_sig = g_timeout_add (self->batch_latency, on_batch_latency, self);
+    }
+
+  /* Window is full, acknowledgements continue reading */
+  self->read_sig = 0;
+  return FALSE;
+}
+
+static void
+journal_stream_schedule (CockpitJournalStream *self)
+{
+  if (self->closed || self->waiting || self->read_sig || !can_send (self))
+    return;
+
+  /* Below the default priority, so other channels get a turn */
+  self->read_sig = g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, on_read_entries, self, NULL);
+}
+
+static gboolean
+on_journal_changed (gint fd,
+                    GIOCondition cond,
+                    gpointer user_data)
+{
+  CockpitJournalStream *self = user_data;
+
+  if (sd_journal_process (self->journal) != SD_JOURNAL_NOP && self->waiting)
+    {
+      self->waiting = FALSE;
+      journal_stream_schedule (self);
+    }
+
+  return TRUE;
+}
+
+static void
+cockpit_journal_stream_recv (CockpitChannel *channel,
+                             GBytes *message)
+{
+  CockpitJournalStream *self = COCKPIT_JOURNAL_STREAM (channel);
+
+  /* Each message acknowledges a batch */
+  if (self->in_flight == 0)
+    {
+      g_warning ("received unexpected acknowledgement on journal channel");
+      cockpit_channel_close (channel, "protocol-error");
+      return;
+    }
+
+  self->in_flight--;
+  if (self->flush_pending)
+    journal_stream_flush (self);
+  journal_stream_schedule (self);
+}
+
+static void
+journal_stream_stop (CockpitJournalStream *self)
+{
+  self->closed = TRUE;
+
+  if (self->read_sig)
+    g_source_remove (self->read_sig);
+  if (self->latency_sig)
+    g_source_remove (self->latency_sig);
+  self->read_sig = self->latency_sig = 0;
+
+  if (self->journal_source)
+    {
+      g_source_destroy (self->journal_source);
+      g_source_unref (self->journal_source);
+      self->journal_source = NULL;
+    }
+}
+
+static void
+cockpit_journal_stream_close (CockpitChannel *channel,
+                              const gchar *problem)
+{
+  journal_stream_stop (COCKPIT_JOURNAL_STREAM (channel));
+  COCKPIT_CHANNEL_CLASS (cockpit_journal_stream_parent_class)->close (channel, problem);
+}
+
+static gboolean
+on_idle_close (gpointer user_data)
+{
+  CockpitChannel *channel = COCKPIT_CHANNEL (user_data);
+  const gchar *problem = g_object_get_data (user_data, "problem");
+  cockpit_channel_close (channel, problem);
+  return FALSE;
+}
+
+static void
+close_later (CockpitChannel *channel,
+             const gchar *problem)
+{
+  g_object_set_data (G_OBJECT (channel), "problem", (gpointer)problem);
+  g_idle_add_full (G_PRIORITY_DEFAULT, on_idle_close,
+                   g_object_ref (channel), g_object_unref);
+}
+
+static int
+add_matches (sd_journal *j,
+             const gchar **matches)
+{
+  gint i;
+  int ret = 0;
+
+  for (i = 0; matches && matches[i] && ret >= 0; i++)
+    {
+      if (g_str_equal (matches[i], "+"))
+        ret = sd_journal_add_disjunction (j);
+      else
+        ret = sd_journal_add_match (j, matches[i], 0);
+    }
+
+  return ret;
+}
+
+static int
+seek_journal (CockpitJournalStream *self,
+              const gchar *seek,
+              gint64 skip)
+{
+  sd_journal *j = self->journal;
+  int ret;
+
+  if (seek == NULL || g_str_equal (seek, "head"))
+    {
+      ret = sd_journal_seek_head (j);
+    }
+  else if (g_str_equal (seek, "tail"))
+    {
+      ret = sd_journal_seek_tail (j);
+    }
+  else
+    {
+      ret = sd_journal_seek_cursor (j, seek);
+      if (ret >= 0)
+        ret = sd_journal_next (j);
+
+      /* If the entry itself is gone, start at the one after it */
+      if (ret > 0 && sd_journal_test_cursor (j, seek) <= 0)
+        self->at_entry = TRUE;
+    }
+
+  if (ret < 0 || skip == 0)
+    return ret;
+
+  if (skip < 0)
+    {
+      ret = sd_journal_previous_skip (j, (uint64_t)-skip);
+      if (ret > 0)
+        self->at_entry = TRUE;
+    }
+  else
+    {
+      ret = sd_journal_next_skip (j, (uint64_t)skip);
+      self->at_entry = FALSE;
+    }
+
+  return ret;
+}
+
+static gint64
+get_int_option (CockpitChannel *channel,
+                const gchar *name,
+                gint64 defawlt,
+                gint64 min,
+                gint64 max)
+{
+  gint64 value;
+
+  value = cockpit_channel_get_int_option (channel, name);
+  if (value == G_MAXINT64)
+    return defawlt;
+  if (value < min || value > max)
+    {
+      g_warning ("invalid \"%s\" option for journal channel", name);
+      return -1;
+    }
+  return value;
+}
+
+static void
+cockpit_journal_stream_init (CockpitJournalStream *self)
+{
+  self->batch = g_string_sized_new (4096);
+}
+
+static void
+cockpit_journal_stream_constructed (GObject *object)
+{
+  CockpitJournalStream *self = COCKPIT_JOURNAL_STREAM (object);
+  CockpitChannel *channel = COCKPIT_CHANNEL (self);
+  const gchar *filter;
+  gint64 batch_size;
+  gint64 batch_latency;
+  gint64 window;
+  gint64 count;
+  gint64 skip;
+  int ret;
+
+  G_OBJECT_CLASS (cockpit_journal_stream_parent_class)->constructed (object);
+
+  self->fields = cockpit_channel_get_strv_option (channel, "fields");
+  filter = cockpit_channel_get_option (channel, "filter");
+  if (filter && filter[0])
+    self->filter = cockpit_text_search_new (filter, COCKPIT_TEXT_SEARCH_SMART_CASE);
+  self->follow = cockpit_channel_get_bool_option (channel, "follow");
+
+  batch_size = get_int_option (channel, "batch-size", 100, 1, 100000);
+  batch_latency = get_int_option (channel, "batch-latency", 100, 0, 60000);
+  window = get_int_option (channel, "window", 4, 0, 1000);
+  count = get_int_option (channel, "count", G_MAXINT64, 0, G_MAXINT64);
+  if (batch_size < 0 || batch_latency < 0 || window < 0 || count < 0)
+    {
+      close_later (channel, "protocol-error");
+      return;
+    }
+
+  self->batch_size = batch_size;
+  self->batch_latency = batch_latency;
+  self->window = window;
+  self->remaining = count == G_MAXINT64 ? -1 : count;
+
+  skip = cockpit_channel_get_int_option (channel, "skip");
+  if (skip == G_MAXINT64)
+    skip = 0;
+
+  if (journal_directory)
+    ret = sd_journal_open_directory (&self->journal, journal_directory, 0);
+  else
+    ret = sd_journal_open (&self->journal, 0);
+  if (ret < 0)
+    {
+      g_message ("couldn't open journal: %s", g_strerror (-ret));
+      close_later (channel, "internal-error");
+      return;
+    }
+
+  /* Watch before looking, so nothing added in between is missed */
+  if (self->follow)
+    {
+      ret = sd_journal_get_fd (self->journal);
+      if (ret < 0)
+        {
+          g_message ("couldn't watch journal: %s", g_strerror (-ret));
+          close_later (channel, "internal-error");
+          return;
+        }
+
+      self->journal_source = cockpit_unix_fd_source_new (ret, G_IO_IN);
+      g_source_set_callback (self->journal_source, (GSourceFunc)on_journal_changed, self, NULL);
+      g_source_attach (self->journal_source, NULL);
+    }
+
+  ret = add_matches (self->journal, cockpit_channel_get_strv_option (channel, "match"));
+  if (ret < 0)
+    {
+      g_warning ("invalid journal match: %s", g_strerror (-ret));
+      close_later (channel, "protocol-error");
+      return;
+    }
+
+  ret = seek_journal (self, cockpit_channel_get_option (channel, "seek"), skip);
+  if (ret < 0)
+    {
+      g_message ("couldn't seek journal: %s", g_strerror (-ret));
+      close_later (channel, ret == -EINVAL ? "protocol-error" : "internal-error");
+      return;
+    }
+
+  cockpit_channel_ready (channel);
+  journal_stream_schedule (self);
+}
+
+static void
+cockpit_journal_stream_dispose (GObject *object)
+{
+  journal_stream_stop (COCKPIT_JOURNAL_STREAM (object));
+  G_OBJECT_CLASS (cockpit_journal_stream_parent_class)->dispose (object);
+}
+
+static void
+cockpit_journal_stream_finalize (GObject *object)
+{
+  CockpitJournalStream *self = COCKPIT_JOURNAL_STREAM (object);
+
+  if (self->journal)
+    sd_journal_close (self->journal);
+  g_string_free (self->batch, TRUE);
+  cockpit_text_search_free (self->filter);
+
+  G_OBJECT_CLASS (cockpit_journal_stream_parent_class)->finalize (object);
+}
+
+static void
+cockpit_journal_stream_class_init (CockpitJournalStreamClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  CockpitChannelClass *channel_class = COCKPIT_CHANNEL_CLASS (klass);
+
+  gobject_class->constructed = cockpit_journal_stream_constructed;
+  gobject_class->dispose = cockpit_journal_stream_dispose;
+  gobject_class->finalize = cockpit_journal_stream_finalize;
+
+  channel_class->recv = cockpit_journal_stream_recv;
+  channel_class->close = cockpit_journal_stream_close;
+}
+
+/**
+ * cockpit_journal_stream_set_directory:
+ * @directory: (allow-none): a directory with journal files
+ *
+ * Open journals from @directory rather than the system journal.
+ * Used for testing.
+ */
+void
+cockpit_journal_stream_set_directory (const gchar *directory)
+{
+  g_free (journal_directory);
+  journal_directory = g_strdup (directory);
+}
@@ -158,7 +158,8 @@ struct _CockpitRestResponse {
   guint status;
   gchar *message;
   GString *failure;
-  GHashTable *headers;
+  gboolean got_headers;
+  gboolean keep_alive;
   gssize remaining_length;
 
   /* Whether body is valid for parsing */
@@ -263,8 +264,6 @@ cockpit_rest_response_destroy (gpointer data)
       cockpit_pipe_close (resp->pipe, NULL);
       g_object_unref (resp->pipe);
     }
-  if (resp->headers)
-    g_hash_table_unref (resp->headers);
   if (resp->req)
     resp->req->resp = NULL;
   if (resp->failure)
@@ -472,21 +471,32 @@ cockpit_rest_response_parse (CockpitRestJson *self,
 
 static gboolean
 parse_content_length (CockpitRestRequest *req,
-                      GHashTable *headers,
+                      const WebSocketHeaders *headers,
                       gssize *length)
 {
-  const gchar *header;
+  const WebSocketSlice *header;
   guint64 value;
   gchar *end;
+  gchar buf[24];
 
-  header = g_hash_table_lookup (headers, "Content-Length");
+  header = web_socket_headers_lookup (headers, "Content-Length");
   if (header == NULL)
     {
       *length = -1;
       return TRUE;
     }
 
-  value = g_ascii_strtoull (header, &end, 10);
+  /* Null terminate on the stack for parsing */
+  if (header->length >= sizeof (buf))
+    {
+      g_message ("%s: %s: received Content-Length that was too big",
+                 req->channel->name, req->label);
+      return FALSE;
+    }
+  memcpy (buf, header->data, header->length);
+  buf[header->length] = '\0';
+
+  value = g_ascii_strtoull (buf, &end, 10);
   if (end[0] != '\0')
     {
       g_message ("%s: %s: received invalid Content-Length in REST JSON response",
@@ -511,13 +521,17 @@ cockpit_rest_response_process (CockpitRestJson *self,
                                gboolean end_of_data)
 {
   gboolean done = FALSE;
+  WebSocketHeaders headers;
+  const WebSocketSlice *header;
+  WebSocketSlice type;
   guint replies;
   gssize off;
   gsize at = 0;
-  const gchar *type;
   const gchar *data;
   gsize block;
 
+  web_socket_headers_init (&headers);
+
   if (!resp->got_status)
     {
       off = web_socket_util_parse_status_line ((const gchar *)buffer->data,
@@ -548,10 +562,10 @@ cockpit_rest_response_process (CockpitRestJson *self,
         }
     }
 
-  if (!resp->headers)
+  if (!resp->got_headers)
     {
-      off = web_socket_util_parse_headers ((const gchar *)buffer->data + at,
-                                           buffer->len - at, &resp->headers);
+      off = web_socket_util_parse_header_slices ((const gchar *)buffer->data + at,
+                                                 buffer->len - at, &headers);
       if (off == 0)
         goto out;
       if (off < 0)
@@ -562,26 +576,35 @@ cockpit_rest_response_process (CockpitRestJson *self,
           goto out;
         }
       at += off;
+      resp->got_headers = TRUE;
 
       /* How much do we have to read? */
-      if (!parse_content_length (resp->req, resp->headers, &resp->remaining_length))
+      if (!parse_content_length (resp->req, &headers, &resp->remaining_length))
         {
           cockpit_channel_close (COCKPIT_CHANNEL (self), "protocol-error");
           goto out;
         }
 
+      header = web_socket_headers_lookup (&headers, "Connection");
+      resp->keep_alive = header && g_strstr_len (header->data, header->length, "keep-alive");
+
       /* If status is 2XX, then we expect json body */
-      type = g_hash_table_lookup (resp->headers, "Content-Type");
-      if (type == NULL)
+      header = web_socket_headers_lookup (&headers, "Content-Type");
+      if (header)
+        {
+          type = *header;
+        }
+      else
         {
           if (resp->status >= 200 && resp->status <= 299)
-            type = "application/json";
+            type.data = "application/json";
           else
-            type = "text/plain";
+            type.data = "text/plain";
+          type.length = strlen (type.data);
         }
 
-      if (!g_str_has_prefix (type, "text/json") &&
-          !g_str_has_prefix (type, "application/json"))
+      if (!web_socket_slice_has_prefix (&type, "text/json") &&
+          !web_socket_slice_has_prefix (&type, "application/json"))
         {
           resp->skip_body = TRUE;
         }
@@ -591,7 +614,7 @@ cockpit_rest_response_process (CockpitRestJson *self,
        * detailed message. This lets us return something better
        * than "Internal Server Error" in those cases.
        */
-      if (g_str_has_prefix (type, "text/plain") &&
+      if (web_socket_slice_has_prefix (&type, "text/plain") &&
           (resp->status < 200 || resp->status > 299))
         {
           resp->failure = g_string_new ("");
@@ -646,6 +669,7 @@ cockpit_rest_response_process (CockpitRestJson *self,
     cockpit_rest_response_reply (self, resp, NULL, TRUE);
 
 out:
+  web_socket_headers_clear (&headers);
   if (at > 0)
     cockpit_pipe_skip (buffer, at);
   return done;
@@ -660,7 +684,6 @@ on_pipe_read (CockpitPipe *pipe,
   CockpitRestJson *self = user_data;
   CockpitRestResponse *resp;
   CockpitRestRequest *req;
-  const gchar *keep_alive;
 
   /* Lookup active response */
   resp = g_hash_table_lookup (self->responses, pipe);
@@ -674,20 +697,16 @@ on_pipe_read (CockpitPipe *pipe,
 
   if (cockpit_rest_response_process (self, resp, buffer, end_of_data))
     {
-      if (self->inactive == NULL && resp->headers)
+      if (self->inactive == NULL && resp->keep_alive)
         {
-          keep_alive = g_hash_table_lookup (resp->headers, "Connection");
-          if (keep_alive && strstr (keep_alive, "keep-alive"))
-            {
 #if 0
-              g_debug ("%s: keeping pipe around due to keep-alive", self->name);
+          g_debug ("%s: keeping pipe around due to keep-alive", self->name);
 #endif
-              g_signal_handler_disconnect (resp->pipe, resp->sig_read);
-              self->inactive = resp->pipe;
-              self->inactive_close = resp->sig_close;
-              resp->sig_read = resp->sig_close = 0;
-              resp->pipe = NULL;
-            }
+          g_signal_handler_disconnect (resp->pipe, resp->sig_read);
+          self->inactive = resp->pipe;
+          self->inactive_close = resp->sig_close;
+          resp->sig_read = resp->sig_close = 0;
+          resp->pipe = NULL;
         }
 
       /* This will destroy the response, and remove it from request */
@@ -28,8 +28,6 @@
 
 #include <security/pam_appl.h>
 #include <sys/signal.h>
-#include <sys/resource.h>
-#include <dirent.h>
 #include <utmp.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -37,6 +35,8 @@
 #include <sys/wait.h>
 #include <grp.h>
 
+#include "cockpit/cockpitspawn.h"
+
 /* This program opens a session for a given user and runs the agent in
  * it.  It is used to manage localhost; for remote hosts sshd does
  * this job.
@@ -225,6 +225,7 @@ static void
 usage (void)
 {
   fprintf (stderr, "usage: cockpit-session [-p FD] USER REMOTE-HOST AGENT\n");
+  fprintf (stderr, "       cockpit-session -p FD - - AGENT\n");
   exit (2);
 }
 
@@ -268,98 +269,11 @@ utmp_log (int login)
   updwtmp (_PATH_WTMP, &ut);
 }
 
-static int
-closefd (void *data,
-         int fd)
-{
-  int *from = data;
-  if (fd >= *from)
-    {
-      while (close (fd) < 0)
-        {
-          if (errno == EAGAIN || errno == EINTR)
-            continue;
-          if (errno == EBADF || errno == EINVAL)
-            break;
-          warnx ("couldn't close fd in agent process: %m");
-          return -1;
-        }
-    }
-
-  return 0;
-}
-
-#ifndef HAVE_FDWALK
-
-static int
-fdwalk (int (*cb)(void *data, int fd),
-        void *data)
-{
-  int open_max;
-  int fd;
-  int res = 0;
-
-  struct rlimit rl;
-
-#ifdef __linux__
-  DIR *d;
-
-  if ((d = opendir ("/proc/self/fd"))) {
-      struct dirent *de;
-
-      while ((de = readdir (d))) {
-          long l;
-          char *e = NULL;
-
-          if (de->d_name[0] == '.')
-              continue;
-
-          errno = 0;
-          l = strtol (de->d_name, &e, 10);
-          if (errno != 0 || !e || *e)
-              continue;
-
-          fd = (int) l;
-
-          if ((long) fd != l)
-              continue;
-
-          if (fd == dirfd (d))
-              continue;
-
-          if ((res = cb (data, fd)) != 0)
-              break;
-        }
-
-      closedir (d);
-      return res;
-  }
-
-  /* If /proc is not mounted or not accessible we fall back to the old
-   * rlimit trick */
-
-#endif
-
-  if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_max != RLIM_INFINITY)
-      open_max = rl.rlim_max;
-  else
-      open_max = sysconf (_SC_OPEN_MAX);
-
-  for (fd = 0; fd < open_max; fd++)
-      if ((res = cb (data, fd)) != 0)
-          break;
-
-  return res;
-}
-
-#endif /* HAVE_FDWALK */
-
 static int
 fork_session (struct passwd *pw,
               int (*func) (void))
 {
   int status;
-  int from;
 
   fflush (stderr);
 
@@ -393,10 +307,9 @@ fork_session (struct passwd *pw,
 
       debug ("dropped privileges");
 
-      from = 3;
-      if (fdwalk (closefd, &from) < 0)
+      if (cockpit_close_from (3) < 0)
         {
-          warnx ("couldn't close all file descirptors");
+          warn ("couldn't close all file descriptors");
           _exit (42);
         }
 
@@ -433,7 +346,10 @@ main (int argc,
   struct pam_conv conv = { pam_conv_func, };
   const char *pam_user = NULL;
   int want_session;
+  int pooled = 0;
   char *password = NULL;
+  char *input = NULL;
+  char *pos;
   struct passwd *pw;
   char login[256];
   int pwfd = 0;
@@ -466,6 +382,17 @@ main (int argc,
   rhost = argv[1];
   agent = argv[2];
 
+  /*
+   * Started ahead of time, the user and remote host come from cockpit-ws
+   * along with the password, once someone logs in.
+   */
+  if (strcmp (user, "-") == 0)
+    {
+      if (!pwfd)
+        usage ();
+      pooled = 1;
+    }
+
   signal (SIGALRM, SIG_DFL);
   signal (SIGQUIT, SIG_DFL);
   signal (SIGTSTP, SIG_IGN);
@@ -475,14 +402,50 @@ main (int argc,
   snprintf (line, UT_LINESIZE, "cockpit-%d", getpid ());
   line[UT_LINESIZE] = '\0';
 
-  if (pwfd)
+  if (pooled)
     {
-      debug ("reading password from cockpit-ws");
-      password = read_until_eof (pwfd);
+      /* Load the PAM configuration and modules while waiting */
       conv.appdata_ptr = &password;
+      check (pam_start ("cockpit", NULL, &conv, &pamh));
+
+      debug ("waiting for login from cockpit-ws");
+      input = read_until_eof (pwfd);
+
+      /* Discarded by cockpit-ws without being used */
+      if (input[0] == '\0')
+        exit (0);
+
+      /* The input is: user \n remote-host \n password */
+      user = input;
+      pos = strchr (input, '\n');
+      if (!pos)
+        errx (2, "invalid login from cockpit-ws");
+      *pos = '\0';
+      rhost = pos + 1;
+      pos = strchr (rhost, '\n');
+      if (!pos)
+        errx (2, "invalid login from cockpit-ws");
+      *pos = '\0';
+
+      password = strdup (pos + 1);
+      if (!password)
+        errx (EX, "couldn't allocate memory for password");
+      memset (pos + 1, 0, strlen (pos + 1));
+
+      check (pam_set_item (pamh, PAM_USER, user));
+    }
+  else
+    {
+      if (pwfd)
+        {
+          debug ("reading password from cockpit-ws");
+          password = read_until_eof (pwfd);
+          conv.appdata_ptr = &password;
+        }
+
+      check (pam_start ("cockpit", user, &conv, &pamh));
     }
 
-  check (pam_start ("cockpit", user, &conv, &pamh));
   check (pam_set_item (pamh, PAM_RHOST, rhost));
 
   if (pwfd)
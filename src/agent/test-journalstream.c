@@ -0,0 +1,654 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitjournalstream.h"
+
+#include "cockpit/cockpitjson.h"
+#include "cockpit/cockpittest.h"
+
+#include <json-glib/json-glib.h>
+
+#include <glib/gstdio.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* -----------------------------------------------------------------------------
+ * Mock
+ */
+
+static GType mock_transport_get_type (void) G_GNUC_CONST;
+
+typedef struct {
+  CockpitTransport parent;
+  guint payloads_sent;
+  GQueue *payloads;
+  JsonObject *close_sent;
+} MockTransport;
+
+typedef CockpitTransportClass MockTransportClass;
+
+G_DEFINE_TYPE (MockTransport, mock_transport, COCKPIT_TYPE_TRANSPORT);
+
+static void
+mock_transport_init (MockTransport *self)
+{
+  self->payloads = g_queue_new ();
+}
+
+static void
+mock_transport_finalize (GObject *object)
+{
+  MockTransport *self = (MockTransport *)object;
+
+  g_queue_free_full (self->payloads, (GDestroyNotify)g_bytes_unref);
+  if (self->close_sent)
+    json_object_unref (self->close_sent);
+
+  G_OBJECT_CLASS (mock_transport_parent_class)->finalize (object);
+}
+
+static void
+mock_transport_get_property (GObject *object,
+                             guint prop_id,
+                             GValue *value,
+                             GParamSpec *pspec)
+{
+  switch (prop_id)
+    {
+    case 1:
+      g_value_set_string (value, "mock-name");
+      break;
+    default:
+      g_assert_not_reached ();
+      break;
+    }
+}
+
+static void
+mock_transport_set_property (GObject *object,
+                             guint prop_id,
+                             const GValue *value,
+                             GParamSpec *pspec)
+{
+  switch (prop_id)
+    {
+    case 1:
+      break;
+    default:
+      g_assert_not_reached ();
+      break;
+    }
+}
+
+static void
+mock_transport_send (CockpitTransport *transport,
+                     const gchar *channel_id,
+                     GBytes *data)
+{
+  MockTransport *self = (MockTransport *)transport;
+  GError *error = NULL;
+  JsonObject *object;
+
+  if (channel_id)
+    {
+      self->payloads_sent++;
+      g_queue_push_tail (self->payloads, g_bytes_ref (data));
+    }
+  else
+    {
+      object = cockpit_json_parse_bytes (data, &error);
+      g_assert_no_error (error);
+      if (g_strcmp0 (json_object_get_string_member (object, "command"), "close") == 0)
+        {
+          g_assert (self->close_sent == NULL);
+          self->close_sent = object;
+        }
+      else
+        {
+          json_object_unref (object);
+        }
+    }
+}
+
+static void
+mock_transport_close (CockpitTransport *transport,
+                      const gchar *problem)
+{
+  cockpit_transport_emit_closed (transport, problem);
+}
+
+static void
+mock_transport_class_init (MockTransportClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  CockpitTransportClass *transport_class = COCKPIT_TRANSPORT_CLASS (klass);
+  object_class->finalize = mock_transport_finalize;
+  object_class->get_property = mock_transport_get_property;
+  object_class->set_property = mock_transport_set_property;
+  g_object_class_override_property (object_class, 1, "name");
+  transport_class->send = mock_transport_send;
+  transport_class->close = mock_transport_close;
+}
+
+/* -----------------------------------------------------------------------------
+ * Test
+ */
+
+typedef struct {
+  MockTransport *transport;
+  CockpitChannel *channel;
+  gchar *problem;
+  gchar *directory;
+} TestCase;
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  tc->transport = g_object_new (mock_transport_get_type (), NULL);
+}
+
+static void
+setup_journal (TestCase *tc,
+               gconstpointer data)
+{
+  setup (tc, data);
+
+  tc->directory = g_strdup ("/tmp/cockpit-test-XXXXXX");
+  g_assert (g_mkdtemp (tc->directory) != NULL);
+  cockpit_journal_stream_set_directory (tc->directory);
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  g_object_unref (tc->transport);
+
+  if (tc->channel)
+    {
+      g_object_add_weak_pointer (G_OBJECT (tc->channel), (gpointer *)&tc->channel);
+      g_object_unref (tc->channel);
+      g_assert (tc->channel == NULL);
+    }
+
+  g_free (tc->problem);
+  cockpit_assert_expected ();
+}
+
+static void
+teardown_journal (TestCase *tc,
+                  gconstpointer data)
+{
+  gchar *cmd;
+
+  teardown (tc, data);
+
+  cockpit_journal_stream_set_directory (NULL);
+  g_assert_cmpstr (strstr (tc->directory, "/tmp"), ==, tc->directory);
+  g_assert_cmpint (system (cmd = g_strdup_printf ("rm -r '%s'", tc->directory)), ==, 0);
+  g_free (tc->directory);
+  g_free (cmd);
+}
+
+static void
+on_closed_get_problem (CockpitChannel *channel,
+                       const gchar *problem,
+                       gpointer user_data)
+{
+  gchar **retval = user_data;
+  g_assert (retval != NULL && *retval == NULL);
+  *retval = g_strdup (problem ? problem : "");
+}
+
+static void
+open_channel (TestCase *tc,
+              const gchar *json)
+{
+  GError *error = NULL;
+  JsonObject *options;
+
+  options = cockpit_json_parse_object (json, -1, &error);
+  g_assert_no_error (error);
+
+  tc->channel = cockpit_channel_open (COCKPIT_TRANSPORT (tc->transport), "548", options);
+  g_signal_connect (tc->channel, "closed", G_CALLBACK (on_closed_get_problem), &tc->problem);
+  json_object_unref (options);
+}
+
+static void
+test_no_entries (TestCase *tc,
+                 gconstpointer unused)
+{
+  open_channel (tc, "{ \"payload\": \"journal-stream\","
+                "  \"match\": [ \"COCKPIT_TEST_NON_EXISTANT=1\" ] }");
+
+  while (tc->problem == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpstr (tc->problem, ==, "");
+  g_assert_cmpuint (tc->transport->payloads_sent, ==, 0);
+}
+
+static void
+test_follow_no_entries (TestCase *tc,
+                        gconstpointer unused)
+{
+  gint i;
+
+  open_channel (tc, "{ \"payload\": \"journal-stream\", \"follow\": true,"
+                "  \"match\": [ \"COCKPIT_TEST_NON_EXISTANT=1\" ] }");
+
+  /* Stays open waiting for entries */
+  for (i = 0; i < 10; i++)
+    g_main_context_iteration (NULL, FALSE);
+
+  g_assert (tc->problem == NULL);
+
+  cockpit_channel_close (tc->channel, "terminated");
+  g_assert_cmpstr (tc->problem, ==, "terminated");
+}
+
+static void
+test_invalid_option (TestCase *tc,
+                     gconstpointer unused)
+{
+  cockpit_expect_warning ("*invalid \"batch-size\" option*");
+
+  open_channel (tc, "{ \"payload\": \"journal-stream\", \"batch-size\": 0 }");
+
+  /* Doesn't close right away */
+  g_assert (tc->problem == NULL);
+
+  while (tc->problem == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpstr (tc->problem, ==, "protocol-error");
+}
+
+static void
+test_invalid_match (TestCase *tc,
+                    gconstpointer unused)
+{
+  cockpit_expect_warning ("*invalid journal match*");
+
+  open_channel (tc, "{ \"payload\": \"journal-stream\", \"match\": [ \"no equals\" ] }");
+
+  while (tc->problem == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpstr (tc->problem, ==, "protocol-error");
+}
+
+static void
+test_unexpected_ack (TestCase *tc,
+                     gconstpointer unused)
+{
+  GBytes *sent;
+
+  cockpit_expect_warning ("*unexpected acknowledgement*");
+
+  open_channel (tc, "{ \"payload\": \"journal-stream\", \"follow\": true,"
+                "  \"match\": [ \"COCKPIT_TEST_NON_EXISTANT=1\" ] }");
+
+  sent = g_bytes_new_static ("ack", 3);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "548", sent);
+  g_bytes_unref (sent);
+
+  g_assert_cmpstr (tc->problem, ==, "protocol-error");
+}
+
+static const gchar *ten_entries[] = {
+  "MESSAGE=one", "PRIORITY=6", NULL,
+  "MESSAGE=two", "PRIORITY=6", NULL,
+  "MESSAGE=three", "PRIORITY=6", NULL,
+  "MESSAGE=four", "PRIORITY=6", NULL,
+  "MESSAGE=five", "PRIORITY=6", NULL,
+  "MESSAGE=six", "PRIORITY=6", NULL,
+  "MESSAGE=seven", "PRIORITY=6", NULL,
+  "MESSAGE=eight", "PRIORITY=6", NULL,
+  "MESSAGE=nine", "PRIORITY=6", NULL,
+  "MESSAGE=ten", "PRIORITY=6", NULL,
+  NULL
+};
+
+static gboolean
+write_journal (TestCase *tc,
+               const gchar **fields)
+{
+  if (cockpit_test_write_journal (tc->directory, fields))
+    return TRUE;
+
+  cockpit_test_skip ("systemd-journal-remote not available");
+  return FALSE;
+}
+
+/* Parses every line of a payload, and returns them in a new array */
+static GPtrArray *
+parse_entries (GBytes *payload)
+{
+  GError *error = NULL;
+  GPtrArray *entries;
+  JsonObject *object;
+  gchar **lines;
+  gchar *text;
+  gint i;
+
+  text = g_strndup (g_bytes_get_data (payload, NULL), g_bytes_get_size (payload));
+  g_assert (g_str_has_suffix (text, "\n"));
+
+  entries = g_ptr_array_new_with_free_func ((GDestroyNotify)json_object_unref);
+  lines = g_strsplit (text, "\n", -1);
+  for (i = 0; lines[i] != NULL && lines[i][0] != '\0'; i++)
+    {
+      object = cockpit_json_parse_object (lines[i], -1, &error);
+      g_assert_no_error (error);
+      g_ptr_array_add (entries, object);
+    }
+
+  /* Nothing after the last newline */
+  g_assert (lines[i] != NULL && lines[i + 1] == NULL);
+
+  g_strfreev (lines);
+  g_free (text);
+  return entries;
+}
+
+static guint
+count_entries (GBytes *payload)
+{
+  GPtrArray *entries = parse_entries (payload);
+  guint count = entries->len;
+  g_ptr_array_free (entries, TRUE);
+  return count;
+}
+
+static void
+send_ack (TestCase *tc)
+{
+  GBytes *sent = g_bytes_new_static ("ack", 3);
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "548", sent);
+  g_bytes_unref (sent);
+}
+
+static gboolean
+on_timeout_set_flag (gpointer user_data)
+{
+  gboolean *flag = user_data;
+  *flag = TRUE;
+  return FALSE;
+}
+
+static void
+wait_a_while (guint msec)
+{
+  gboolean timed_out = FALSE;
+
+  g_timeout_add (msec, on_timeout_set_flag, &timed_out);
+  while (!timed_out)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+test_batches (TestCase *tc,
+              gconstpointer unused)
+{
+  GPtrArray *entries;
+  GBytes *payload;
+
+  if (!write_journal (tc, ten_entries))
+    return;
+
+  open_channel (tc, "{ \"payload\": \"journal-stream\", \"batch-size\": 3, \"window\": 0 }");
+
+  while (tc->problem == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (tc->problem, ==, "");
+
+  /* Full batches, and the rest when reaching the end */
+  g_assert_cmpuint (g_queue_get_length (tc->transport->payloads), ==, 4);
+  g_assert_cmpuint (count_entries (g_queue_peek_nth (tc->transport->payloads, 0)), ==, 3);
+  g_assert_cmpuint (count_entries (g_queue_peek_nth (tc->transport->payloads, 1)), ==, 3);
+  g_assert_cmpuint (count_entries (g_queue_peek_nth (tc->transport->payloads, 2)), ==, 3);
+  g_assert_cmpuint (count_entries (g_queue_peek_nth (tc->transport->payloads, 3)), ==, 1);
+
+  /* In journal order */
+  payload = g_queue_peek_head (tc->transport->payloads);
+  entries = parse_entries (payload);
+  g_assert_cmpstr (json_object_get_string_member (entries->pdata[0], "MESSAGE"), ==, "one");
+  g_assert_cmpstr (json_object_get_string_member (entries->pdata[2], "MESSAGE"), ==, "three");
+  g_assert (json_object_has_member (entries->pdata[0], "__CURSOR"));
+  g_assert (json_object_has_member (entries->pdata[0], "__REALTIME_TIMESTAMP"));
+  g_ptr_array_free (entries, TRUE);
+
+  payload = g_queue_peek_tail (tc->transport->payloads);
+  entries = parse_entries (payload);
+  g_assert_cmpstr (json_object_get_string_member (entries->pdata[0], "MESSAGE"), ==, "ten");
+  g_ptr_array_free (entries, TRUE);
+}
+
+static void
+test_window (TestCase *tc,
+             gconstpointer unused)
+{
+  guint i;
+
+  if (!write_journal (tc, ten_entries))
+    return;
+
+  open_channel (tc, "{ \"payload\": \"journal-stream\", \"batch-size\": 2, \"window\": 2 }");
+
+  /* Stops reading with two batches unacknowledged */
+  wait_a_while (100);
+  g_assert (tc->problem == NULL);
+  g_assert_cmpuint (g_queue_get_length (tc->transport->payloads), ==, 2);
+
+  /* Every acknowledgement lets one more batch through */
+  for (i = 3; i <= 5; i++)
+    {
+      send_ack (tc);
+      while (g_queue_get_length (tc->transport->payloads) < i)
+        g_main_context_iteration (NULL, TRUE);
+      wait_a_while (20);
+      g_assert_cmpuint (g_queue_get_length (tc->transport->payloads), ==, i);
+    }
+
+  /* Even noticing the end waits for room in the window */
+  wait_a_while (20);
+  g_assert (tc->problem == NULL);
+  send_ack (tc);
+
+  while (tc->problem == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (tc->problem, ==, "");
+  g_assert_cmpuint (g_queue_get_length (tc->transport->payloads), ==, 5);
+}
+
+static void
+test_latency (TestCase *tc,
+              gconstpointer unused)
+{
+  const gchar *more[] = {
+    "MESSAGE=eleven", NULL,
+    "MESSAGE=twelve", NULL,
+    NULL
+  };
+
+  if (!write_journal (tc, ten_entries))
+    return;
+
+  open_channel (tc, "{ \"payload\": \"journal-stream\", \"follow\": true,"
+                "  \"batch-size\": 100, \"batch-latency\": 300 }");
+
+  /* The batch isn't full, so it waits */
+  wait_a_while (100);
+  g_assert_cmpuint (g_queue_get_length (tc->transport->payloads), ==, 0);
+
+  while (g_queue_get_length (tc->transport->payloads) < 1)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpuint (count_entries (g_queue_peek_head (tc->transport->payloads)), ==, 10);
+
+  /* New entries come along while following */
+  if (!write_journal (tc, more))
+    return;
+  while (g_queue_get_length (tc->transport->payloads) < 2)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpuint (count_entries (g_queue_peek_tail (tc->transport->payloads)), ==, 2);
+
+  g_assert (tc->problem == NULL);
+  cockpit_channel_close (tc->channel, "terminated");
+  g_assert_cmpstr (tc->problem, ==, "terminated");
+}
+
+static void
+test_json (TestCase *tc,
+           gconstpointer unused)
+{
+  const gchar *fields[] = {
+    "MESSAGE=\"quoted\" back\\slash\ttab", "PRIORITY=3", "OTHER=x", NULL,
+    "MESSAGE=two\nlines\r", "PRIORITY=4", NULL,
+    "MESSAGE=control \x01 and \x7f", NULL,
+    "MESSAGE=bad \xff\xfe utf8", NULL,
+    "MESSAGE=unicode \xc3\xa9", NULL,
+    NULL
+  };
+
+  GPtrArray *entries;
+  GBytes *payload;
+  gchar *text;
+
+  if (!write_journal (tc, fields))
+    return;
+
+  open_channel (tc, "{ \"payload\": \"journal-stream\", \"fields\": [ \"MESSAGE\", \"PRIORITY\" ] }");
+
+  while (tc->problem == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (tc->problem, ==, "");
+
+  g_assert_cmpuint (g_queue_get_length (tc->transport->payloads), ==, 1);
+  payload = g_queue_peek_head (tc->transport->payloads);
+
+  /* Control characters never appear raw */
+  text = g_strndup (g_bytes_get_data (payload, NULL), g_bytes_get_size (payload));
+  cockpit_assert_strmatch (text, "*\\u0001*\\u007f*");
+  g_free (text);
+
+  entries = parse_entries (payload);
+  g_assert_cmpuint (entries->len, ==, 5);
+
+  g_assert_cmpstr (json_object_get_string_member (entries->pdata[0], "MESSAGE"), ==,
+                   "\"quoted\" back\\slash\ttab");
+  g_assert_cmpstr (json_object_get_string_member (entries->pdata[0], "PRIORITY"), ==, "3");
+  g_assert (!json_object_has_member (entries->pdata[0], "OTHER"));
+  g_assert (json_object_has_member (entries->pdata[0], "__CURSOR"));
+
+  g_assert_cmpstr (json_object_get_string_member (entries->pdata[1], "MESSAGE"), ==, "two\nlines\r");
+  g_assert_cmpstr (json_object_get_string_member (entries->pdata[2], "MESSAGE"), ==, "control \x01 and \x7f");
+  g_assert (!json_object_has_member (entries->pdata[2], "PRIORITY"));
+
+  /* Not UTF-8, so not a JSON string */
+  g_assert (json_object_get_null_member (entries->pdata[3], "MESSAGE"));
+  g_assert_cmpstr (json_object_get_string_member (entries->pdata[4], "MESSAGE"), ==, "unicode \xc3\xa9");
+
+  g_ptr_array_free (entries, TRUE);
+}
+
+static void
+test_close_cursor (TestCase *tc,
+                   gconstpointer unused)
+{
+  GPtrArray *entries;
+  const gchar *last;
+  gchar *cursor;
+  gchar *json;
+
+  if (!write_journal (tc, ten_entries))
+    return;
+
+  open_channel (tc, "{ \"payload\": \"journal-stream\", \"count\": 4 }");
+  while (tc->problem == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (tc->problem, ==, "");
+
+  g_assert_cmpuint (g_queue_get_length (tc->transport->payloads), ==, 1);
+  entries = parse_entries (g_queue_peek_head (tc->transport->payloads));
+  g_assert_cmpuint (entries->len, ==, 4);
+  last = json_object_get_string_member (entries->pdata[3], "__CURSOR");
+
+  /* The close message says where to continue */
+  g_assert (tc->transport->close_sent != NULL);
+  cursor = g_strdup (json_object_get_string_member (tc->transport->close_sent, "cursor"));
+  g_assert_cmpstr (cursor, ==, last);
+  g_ptr_array_free (entries, TRUE);
+
+  /* And continuing there starts with the next entry */
+  g_object_unref (tc->channel);
+  g_object_unref (tc->transport);
+  g_free (tc->problem);
+  tc->problem = NULL;
+  tc->transport = g_object_new (mock_transport_get_type (), NULL);
+
+  json = g_strdup_printf ("{ \"payload\": \"journal-stream\", \"seek\": \"%s\", \"count\": 1 }", cursor);
+  open_channel (tc, json);
+  g_free (json);
+  while (tc->problem == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (tc->problem, ==, "");
+
+  entries = parse_entries (g_queue_peek_head (tc->transport->payloads));
+  g_assert_cmpuint (entries->len, ==, 1);
+  g_assert_cmpstr (json_object_get_string_member (entries->pdata[0], "MESSAGE"), ==, "five");
+  g_ptr_array_free (entries, TRUE);
+
+  g_free (cursor);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/journal-stream/no-entries", TestCase, NULL,
+              setup, test_no_entries, teardown);
+  g_test_add ("/journal-stream/follow-no-entries", TestCase, NULL,
+              setup, test_follow_no_entries, teardown);
+  g_test_add ("/journal-stream/invalid-option", TestCase, NULL,
+              setup, test_invalid_option, teardown);
+  g_test_add ("/journal-stream/invalid-match", TestCase, NULL,
+              setup, test_invalid_match, teardown);
+  g_test_add ("/journal-stream/unexpected-ack", TestCase, NULL,
+              setup, test_unexpected_ack, teardown);
+  g_test_add ("/journal-stream/batches", TestCase, NULL,
+              setup_journal, test_batches, teardown_journal);
+  g_test_add ("/journal-stream/window", TestCase, NULL,
+              setup_journal, test_window, teardown_journal);
+  g_test_add ("/journal-stream/latency", TestCase, NULL,
+              setup_journal, test_latency, teardown_journal);
+  g_test_add ("/journal-stream/json", TestCase, NULL,
+              setup_journal, test_json, teardown_journal);
+  g_test_add ("/journal-stream/close-cursor", TestCase, NULL,
+              setup_journal, test_close_cursor, teardown_journal);
+
+  return g_test_run ();
+}
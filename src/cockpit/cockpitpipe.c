@@ -20,17 +20,17 @@
 #include "config.h"
 
 #include "cockpitpipe.h"
+#include "cockpitspawn.h"
 #include "cockpitunixfd.h"
 
 #include <glib-unix.h>
 
-#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <sys/wait.h>
 
-#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pty.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -832,7 +832,7 @@ cockpit_pipe_connect (const gchar *name,
 
   g_return_val_if_fail (G_IS_SOCKET_ADDRESS (address), NULL);
 
-  sock = socket (g_socket_address_get_family (address), SOCK_STREAM, 0);
+  sock = socket (g_socket_address_get_family (address), SOCK_STREAM | SOCK_CLOEXEC, 0);
   if (sock < 0)
     {
       errn = errno;
@@ -877,6 +877,32 @@ cockpit_pipe_connect (const gchar *name,
   return pipe;
 }
 
+static void
+set_problem_from_spawn_errno (CockpitPipe *self,
+                              const gchar *command,
+                              int errn)
+{
+  const gchar *problem = NULL;
+
+  if (errn == ENOENT)
+    problem = "not-found";
+  else if (errn == EPERM || errn == EACCES)
+    problem = "not-authorized";
+
+  if (problem)
+    {
+      g_debug ("%s: couldn't run %s: %s", self->priv->name, command, g_strerror (errn));
+    }
+  else
+    {
+      g_message ("%s: couldn't run %s: %s", self->priv->name, command, g_strerror (errn));
+      problem = "internal-error";
+    }
+
+  self->priv->problem = g_strdup (problem);
+  cockpit_close_later (self);
+}
+
 /**
  * cockpit_pipe_spawn:
  * @argv: null terminated string array of command arguments
@@ -902,19 +928,41 @@ cockpit_pipe_spawn (const gchar **argv,
                     const gchar *directory)
 {
   CockpitPipe *pipe = NULL;
-  int session_stdin = -1;
-  int session_stdout = -1;
-  GError *error = NULL;
-  const gchar *problem = NULL;
+  int child_stdin[2] = { -1, -1 };
+  int child_stdout[2] = { -1, -1 };
   gchar *name;
   GPid pid = 0;
+  int errn = 0;
 
-  GSpawnFlags flags = G_SPAWN_DO_NOT_REAP_CHILD;
+  /* Our ends are close-on-exec, so other children never inherit them */
+  if (pipe2 (child_stdin, O_CLOEXEC) < 0 ||
+      pipe2 (child_stdout, O_CLOEXEC) < 0)
+    {
+      errn = errno;
+    }
+  else
+    {
+      pid = cockpit_spawn (argv, env, directory, 0, child_stdin[0], child_stdout[1], -1);
+      if (pid < 0)
+        {
+          errn = errno;
+          pid = 0;
+        }
+    }
 
-  g_spawn_async_with_pipes (directory, (gchar **)argv, (gchar **)env,
-                            flags, NULL, NULL,
-                            &pid, &session_stdin, &session_stdout, NULL,
-                            &error);
+  if (child_stdin[0] >= 0)
+    close (child_stdin[0]);
+  if (child_stdout[1] >= 0)
+    close (child_stdout[1]);
+
+  if (errn != 0)
+    {
+      if (child_stdin[1] >= 0)
+        close (child_stdin[1]);
+      if (child_stdout[0] >= 0)
+        close (child_stdout[0]);
+      child_stdin[1] = child_stdout[0] = -1;
+    }
 
   name = g_path_get_basename (argv[0]);
   if (name == NULL)
@@ -922,128 +970,24 @@ cockpit_pipe_spawn (const gchar **argv,
 
   pipe = g_object_new (COCKPIT_TYPE_PIPE,
                        "name", name,
-                       "in-fd", session_stdout,
-                       "out-fd", session_stdin,
+                       "in-fd", child_stdout[0],
+                       "out-fd", child_stdin[1],
                        "pid", pid,
                        NULL);
 
   /* Regardless of whether spawn succeeded or not */
   pipe->priv->is_process = TRUE;
 
-  if (error)
-    {
-      if (g_error_matches (error, G_SPAWN_ERROR, G_SPAWN_ERROR_NOENT))
-        problem = "not-found";
-      else if (g_error_matches (error, G_SPAWN_ERROR, G_SPAWN_ERROR_PERM) ||
-               g_error_matches (error, G_SPAWN_ERROR, G_SPAWN_ERROR_ACCES))
-        problem = "not-authorized";
-
-      if (problem)
-        {
-          g_debug ("%s: couldn't run %s: %s", name, argv[0], error->message);
-        }
-      else
-        {
-          g_message ("%s: couldn't run %s: %s", name, argv[0], error->message);
-          problem = "internal-error";
-        }
-      pipe->priv->problem = g_strdup (problem);
-      cockpit_close_later (pipe);
-      g_error_free (error);
-    }
+  if (errn != 0)
+    set_problem_from_spawn_errno (pipe, argv[0], errn);
   else
-    {
-      g_debug ("%s: spawned: %s", name, argv[0]);
-    }
+    g_debug ("%s: spawned: %s", name, argv[0]);
 
   g_free (name);
 
   return pipe;
 }
 
-static int
-closefd (void *data,
-         gint fd)
-{
-  if (fd >= GPOINTER_TO_INT (data))
-    {
-      while (close (fd) < 0)
-        {
-          if (errno == EAGAIN || errno == EINTR)
-            continue;
-          if (errno == EBADF || errno == EINVAL)
-            break;
-          g_critical ("couldn't close fd in child process: %s", g_strerror (errno));
-          return -1;
-        }
-    }
-
-  return 0;
-}
-
-#ifndef HAVE_FDWALK
-static int
-fdwalk (int (*cb)(void *data, int fd), void *data)
-{
-  gint open_max;
-  gint fd;
-  gint res = 0;
-
-  struct rlimit rl;
-
-#ifdef __linux__
-  DIR *d;
-
-  if ((d = opendir("/proc/self/fd"))) {
-      struct dirent *de;
-
-      while ((de = readdir(d))) {
-          glong l;
-          gchar *e = NULL;
-
-          if (de->d_name[0] == '.')
-              continue;
-
-          errno = 0;
-          l = strtol(de->d_name, &e, 10);
-          if (errno != 0 || !e || *e)
-              continue;
-
-          fd = (gint) l;
-
-          if ((glong) fd != l)
-              continue;
-
-          if (fd == dirfd(d))
-              continue;
-
-          if ((res = cb (data, fd)) != 0)
-              break;
-        }
-
-      closedir(d);
-      return res;
-  }
-
-  /* If /proc is not mounted or not accessible we fall back to the old
-   * rlimit trick */
-
-#endif
-
-  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_max != RLIM_INFINITY)
-      open_max = rl.rlim_max;
-  else
-      open_max = sysconf (_SC_OPEN_MAX);
-
-  for (fd = 0; fd < open_max; fd++)
-      if ((res = cb (data, fd)) != 0)
-          break;
-
-  return res;
-}
-
-#endif /* HAVE_FDWALK */
-
 /**
  * cockpit_pipe_pty:
  * @argv: null terminated string array of command arguments
@@ -1064,49 +1008,45 @@ cockpit_pipe_pty (const gchar **argv,
 {
   CockpitPipe *pipe = NULL;
   GPid pid = 0;
-  int fd;
+  int master = -1;
+  int slave = -1;
+  int errn = 0;
 
-  pid = forkpty (&fd, NULL, NULL, NULL);
-  if (pid == 0)
+  if (openpty (&master, &slave, NULL, NULL, NULL) < 0 ||
+      fcntl (master, F_SETFD, FD_CLOEXEC) < 0 ||
+      fcntl (slave, F_SETFD, FD_CLOEXEC) < 0)
     {
-      if (fdwalk (closefd, GINT_TO_POINTER (3)) < 0)
-        {
-          g_printerr ("couldn't close file descriptors");
-          _exit (127);
-        }
-      if (directory)
+      errn = errno;
+    }
+  else
+    {
+      pid = cockpit_spawn (argv, env, directory,
+                           COCKPIT_SPAWN_SEARCH_PATH | COCKPIT_SPAWN_CONTROLLING_TTY,
+                           slave, slave, slave);
+      if (pid < 0)
         {
-          if (chdir (directory) < 0)
-            {
-              g_printerr ("couldn't change to directory: %s", g_strerror (errno));
-              _exit (127);
-            }
+          errn = errno;
+          pid = 0;
         }
-      if (env)
-        execvpe (argv[0], (char *const *)argv, (char *const *)env);
-      else
-        execvp (argv[0], (char *const *)argv);
-      g_printerr ("couldn't execute: %s: %s", argv[0], g_strerror (errno));
-      _exit (127);
     }
-  else if (pid == 0)
+
+  if (slave >= 0)
+    close (slave);
+  if (errn != 0 && master >= 0)
     {
-      g_warning ("forkpty failed: %s", g_strerror (errno));
-      fd = -1;
+      close (master);
+      master = -1;
     }
 
   pipe = g_object_new (COCKPIT_TYPE_PIPE,
                        "name", argv[0],
-                       "in-fd", fd,
-                       "out-fd", fd,
+                       "in-fd", master,
+                       "out-fd", master,
                        "pid", pid,
                        NULL);
 
-  if (fd < 0)
-    {
-      pipe->priv->problem = g_strdup ("internal-error");
-      cockpit_close_later (pipe);
-    }
+  if (errn != 0)
+    set_problem_from_spawn_errno (pipe, argv[0], errn);
 
   return pipe;
 }
@@ -0,0 +1,166 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitqueue.h"
+
+/**
+ * CockpitQueue:
+ *
+ * An unbounded queue for passing pointers from exactly one producer
+ * thread to exactly one consumer thread without taking a lock.
+ *
+ * The queue is a linked list that always contains at least one node.
+ * The first node has already been consumed, and only the consumer
+ * touches it. The producer only ever touches the last node. The two
+ * meet at the next pointer of a node, which is accessed atomically.
+ */
+
+typedef struct _CockpitQueueNode {
+  gpointer data;
+  struct _CockpitQueueNode *next;
+} CockpitQueueNode;
+
+struct _CockpitQueue {
+  /* Only touched by the consumer */
+  CockpitQueueNode *head;
+
+  /* Only touched by the producer */
+  CockpitQueueNode *tail;
+
+  GDestroyNotify destroy;
+};
+
+/**
+ * cockpit_queue_new:
+ * @destroy: called for items still in the queue when it's freed
+ *
+ * Create a new single producer, single consumer queue.
+ *
+ * Returns: (transfer full): the new queue
+ */
+CockpitQueue *
+cockpit_queue_new (GDestroyNotify destroy)
+{
+  CockpitQueue *queue;
+
+  queue = g_new0 (CockpitQueue, 1);
+  queue->head = queue->tail = g_slice_new0 (CockpitQueueNode);
+  queue->destroy = destroy;
+
+  return queue;
+}
+
+/**
+ * cockpit_queue_push:
+ * @queue: the queue
+ * @data: the item, not %NULL
+ *
+ * Add an item to the end of the queue. Only call this from the
+ * producer thread.
+ */
+void
+cockpit_queue_push (CockpitQueue *queue,
+                    gpointer data)
+{
+  CockpitQueueNode *node;
+
+  g_return_if_fail (queue != NULL);
+  g_return_if_fail (data != NULL);
+
+  node = g_slice_new (CockpitQueueNode);
+  node->data = data;
+  node->next = NULL;
+
+  /* Publishes the node and its data to the consumer */
+  g_atomic_pointer_set (&queue->tail->next, node);
+  queue->tail = node;
+}
+
+/**
+ * cockpit_queue_pop:
+ * @queue: the queue
+ *
+ * Remove the item at the front of the queue. Only call this from
+ * the consumer thread.
+ *
+ * Returns: (transfer full): the item or %NULL if the queue is empty
+ */
+gpointer
+cockpit_queue_pop (CockpitQueue *queue)
+{
+  CockpitQueueNode *node;
+  gpointer data;
+
+  g_return_val_if_fail (queue != NULL, NULL);
+
+  node = g_atomic_pointer_get (&queue->head->next);
+  if (!node)
+    return NULL;
+
+  /* The node becomes the new consumed first node */
+  data = node->data;
+  node->data = NULL;
+  g_slice_free (CockpitQueueNode, queue->head);
+  queue->head = node;
+
+  return data;
+}
+
+/**
+ * cockpit_queue_is_empty:
+ * @queue: the queue
+ *
+ * Check whether there is anything to pop. Only call this from
+ * the consumer thread.
+ *
+ * Returns: whether the queue is empty
+ */
+gboolean
+cockpit_queue_is_empty (CockpitQueue *queue)
+{
+  g_return_val_if_fail (queue != NULL, TRUE);
+  return g_atomic_pointer_get (&queue->head->next) == NULL;
+}
+
+/**
+ * cockpit_queue_free:
+ * @queue: the queue
+ *
+ * Free the queue and any items in it. Neither the producer nor the
+ * consumer may be using the queue any longer.
+ */
+void
+cockpit_queue_free (CockpitQueue *queue)
+{
+  gpointer data;
+
+  if (!queue)
+    return;
+
+  while ((data = cockpit_queue_pop (queue)) != NULL)
+    {
+      if (queue->destroy)
+        (queue->destroy) (data);
+    }
+
+  g_slice_free (CockpitQueueNode, queue->head);
+  g_free (queue);
+}
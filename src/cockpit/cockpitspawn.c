@@ -0,0 +1,325 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitspawn.h"
+
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/*
+ * Everything here may run in a vfork() child, which shares memory and
+ * stack with the parent. So no allocation, no stdio and no locks, only
+ * plain system calls.
+ */
+
+extern char **environ;
+
+static int
+close_fd (int fd)
+{
+  /* On Linux the fd is gone even if close() is interrupted */
+  if (close (fd) < 0 && errno != EINTR && errno != EBADF)
+    return -1;
+  return 0;
+}
+
+#ifdef __linux__
+
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+static int
+close_from_proc (int from)
+{
+  struct linux_dirent64 *de;
+  char buffer[4096];
+  long count;
+  long pos;
+  int res = 0;
+  int dir;
+  int fd;
+  char *p;
+
+  dir = open ("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir < 0)
+    return -1;
+
+  /* getdents64() rather than readdir(), which allocates */
+  while ((count = syscall (SYS_getdents64, dir, buffer, sizeof (buffer))) > 0)
+    {
+      for (pos = 0; pos < count; pos += de->d_reclen)
+        {
+          de = (struct linux_dirent64 *)(buffer + pos);
+          if (de->d_name[0] < '0' || de->d_name[0] > '9')
+            continue;
+
+          fd = 0;
+          for (p = de->d_name; *p >= '0' && *p <= '9'; p++)
+            fd = fd * 10 + (*p - '0');
+
+          if (fd >= from && fd != dir && close_fd (fd) < 0)
+            res = -1;
+        }
+    }
+
+  if (count < 0)
+    res = -1;
+
+  close (dir);
+  return res;
+}
+
+#endif /* __linux__ */
+
+/**
+ * cockpit_close_from:
+ * @from: the lowest file descriptor to close
+ *
+ * Close all file descriptors numbered @from or higher. Uses
+ * close_range() when the kernel has it, and otherwise looks at
+ * /proc/self/fd or finally tries every possible descriptor.
+ *
+ * This is safe to call in a vfork() child.
+ *
+ * Returns: zero on success, -1 on failure with errno set
+ */
+int
+cockpit_close_from (int from)
+{
+  struct rlimit rl;
+  int open_max;
+  int res = 0;
+  int fd;
+
+#if defined (HAVE_CLOSE_RANGE)
+  if (close_range (from, ~0U, 0) == 0)
+    return 0;
+#elif defined (__NR_close_range)
+  if (syscall (__NR_close_range, from, ~0U, 0) == 0)
+    return 0;
+#endif
+
+#ifdef __linux__
+  /* Older kernel without close_range() */
+  if (close_from_proc (from) == 0)
+    return 0;
+
+  /* If /proc is not mounted or not accessible we fall back to the old
+   * rlimit trick */
+#endif
+
+  if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_max != RLIM_INFINITY)
+    open_max = rl.rlim_max;
+  else
+    open_max = sysconf (_SC_OPEN_MAX);
+
+  for (fd = from; fd < open_max; fd++)
+    {
+      if (close_fd (fd) < 0)
+        res = -1;
+    }
+
+  return res;
+}
+
+typedef struct {
+  const char **argv;
+  const char **env;
+  const char *directory;
+  int flags;
+  int fds[3];
+  sigset_t old_mask;
+
+  /* Written by the child, read by the parent once it resumes */
+  volatile int errn;
+} SpawnChild;
+
+static int
+move_fd (int fd,
+         int target)
+{
+  int flags;
+
+  if (fd == target)
+    {
+      /* dup2() would leave FD_CLOEXEC in place */
+      flags = fcntl (fd, F_GETFD);
+      if (flags < 0 || fcntl (fd, F_SETFD, flags & ~FD_CLOEXEC) < 0)
+        return -1;
+      return 0;
+    }
+
+  while (dup2 (fd, target) < 0)
+    {
+      if (errno != EINTR)
+        return -1;
+    }
+
+  return 0;
+}
+
+static void __attribute__((noreturn))
+spawn_child (SpawnChild *child)
+{
+  struct sigaction sa;
+  int sig;
+  int i;
+
+  /*
+   * A handler installed by the parent would run on the shared stack,
+   * so put all handled signals back to their defaults. The table of
+   * handlers itself is not shared with the parent.
+   */
+  for (sig = 1; sig < NSIG; sig++)
+    {
+      if (sigaction (sig, NULL, &sa) < 0)
+        continue;
+      if (sa.sa_handler == SIG_IGN || sa.sa_handler == SIG_DFL)
+        continue;
+      sa.sa_handler = SIG_DFL;
+      sa.sa_flags = 0;
+      sigemptyset (&sa.sa_mask);
+      sigaction (sig, &sa, NULL);
+    }
+
+  if (child->flags & COCKPIT_SPAWN_CONTROLLING_TTY)
+    {
+      if (setsid () < 0 || ioctl (child->fds[0], TIOCSCTTY, 0) < 0)
+        goto out;
+    }
+
+  /* Move any source out of the way of the standard fds */
+  for (i = 0; i < 3; i++)
+    {
+      if (child->fds[i] >= 0 && child->fds[i] < 3 && child->fds[i] != i)
+        {
+          child->fds[i] = fcntl (child->fds[i], F_DUPFD_CLOEXEC, 3);
+          if (child->fds[i] < 0)
+            goto out;
+        }
+    }
+
+  for (i = 0; i < 3; i++)
+    {
+      if (child->fds[i] >= 0 && move_fd (child->fds[i], i) < 0)
+        goto out;
+    }
+
+  if (child->directory && chdir (child->directory) < 0)
+    goto out;
+
+  if (cockpit_close_from (3) < 0)
+    goto out;
+
+  sigprocmask (SIG_SETMASK, &child->old_mask, NULL);
+
+  if (child->flags & COCKPIT_SPAWN_SEARCH_PATH)
+    {
+      execvpe (child->argv[0], (char *const *)child->argv,
+               child->env ? (char *const *)child->env : environ);
+    }
+  else
+    {
+      execve (child->argv[0], (char *const *)child->argv,
+              child->env ? (char *const *)child->env : environ);
+    }
+
+out:
+  child->errn = errno ? errno : ECHILD;
+  _exit (127);
+}
+
+/**
+ * cockpit_spawn:
+ * @argv: null terminated command arguments
+ * @env: optional null terminated child environment
+ * @directory: optional working directory of child
+ * @flags: COCKPIT_SPAWN_SEARCH_PATH to look up argv[0] in PATH,
+ *         COCKPIT_SPAWN_CONTROLLING_TTY to start a new session with
+ *         @in_fd as its terminal
+ * @in_fd: becomes standard in of the child, or -1 to inherit
+ * @out_fd: becomes standard out of the child, or -1 to inherit
+ * @err_fd: becomes standard error of the child, or -1 to inherit
+ *
+ * Start a process with vfork(), so the cost doesn't depend on how
+ * much memory the caller has mapped. All file descriptors other than
+ * the three standard ones are closed in the child. Failure to execute
+ * the command is reported here rather than by an exit status.
+ *
+ * The caller must reap the child.
+ *
+ * Returns: the pid of the child, or -1 with errno set
+ */
+pid_t
+cockpit_spawn (const char **argv,
+               const char **env,
+               const char *directory,
+               int flags,
+               int in_fd,
+               int out_fd,
+               int err_fd)
+{
+  SpawnChild child = { argv, env, directory, flags, { in_fd, out_fd, err_fd }, };
+  sigset_t all;
+  pid_t pid;
+  int errn;
+
+  /* No signal handlers may run in the child while it shares our stack */
+  sigfillset (&all);
+  sigprocmask (SIG_BLOCK, &all, &child.old_mask);
+
+  child.errn = 0;
+  pid = vfork ();
+  if (pid == 0)
+    spawn_child (&child);
+
+  errn = errno;
+  sigprocmask (SIG_SETMASK, &child.old_mask, NULL);
+
+  if (pid < 0)
+    {
+      errno = errn;
+      return -1;
+    }
+
+  /* The child failed before or during exec */
+  if (child.errn != 0)
+    {
+      while (waitpid (pid, NULL, 0) < 0 && errno == EINTR);
+      errno = child.errn;
+      return -1;
+    }
+
+  return pid;
+}
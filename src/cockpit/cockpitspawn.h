@@ -0,0 +1,52 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_SPAWN_H__
+#define __COCKPIT_SPAWN_H__
+
+/*
+ * This doesn't use GLib, since cockpit-session builds it as well.
+ */
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+  COCKPIT_SPAWN_SEARCH_PATH = 1 << 0,
+  COCKPIT_SPAWN_CONTROLLING_TTY = 1 << 1,
+};
+
+int        cockpit_close_from      (int from);
+
+pid_t      cockpit_spawn           (const char **argv,
+                                    const char **env,
+                                    const char *directory,
+                                    int flags,
+                                    int in_fd,
+                                    int out_fd,
+                                    int err_fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __COCKPIT_SPAWN_H__ */
@@ -22,6 +22,7 @@
 #include "cockpittest.h"
 
 #include <glib-object.h>
+#include <glib/gstdio.h>
 
 #include <string.h>
 
@@ -323,3 +324,102 @@ cockpit_test_skip (const gchar *reason)
     g_print ("SKIP: %s ", reason);
 }
 
+
+static const gchar *journal_remote_paths[] = {
+  "/usr/lib/systemd/systemd-journal-remote",
+  "/lib/systemd/systemd-journal-remote",
+};
+
+/**
+ * cockpit_test_write_journal()
+ *
+ * Write a journal file with the given entries into @directory, for
+ * opening with sd_journal_open_directory(). The @fields are of the
+ * form "NAME=value", every entry ends with a NULL, and the list with
+ * another one. Values can contain any bytes, including newlines.
+ *
+ * Each call writes a new file, which a journal that is watching the
+ * directory picks up as new entries.
+ *
+ * The journal is written by systemd-journal-remote. Returns FALSE when
+ * that isn't available, and the test should be skipped.
+ */
+gboolean
+cockpit_test_write_journal (const gchar *directory,
+                            const gchar **fields)
+{
+  static guint64 realtime = 0;
+  static guint serial = 0;
+  const gchar *journal_remote = NULL;
+  GError *error = NULL;
+  const gchar *eq;
+  GString *export;
+  gchar *export_path;
+  gchar *output;
+  gchar *argv[5];
+  guint64 length;
+  gint status;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (journal_remote_paths); i++)
+    {
+      if (g_file_test (journal_remote_paths[i], G_FILE_TEST_IS_EXECUTABLE))
+        journal_remote = journal_remote_paths[i];
+    }
+  if (!journal_remote)
+    return FALSE;
+
+  /* Later calls write later entries */
+  if (realtime == 0)
+    realtime = g_get_real_time ();
+
+  /* The journal export format, every field in its binary form */
+  export = g_string_new ("");
+  for (i = 0; fields[i] != NULL || (i > 0 && fields[i - 1] != NULL); i++)
+    {
+      if (i == 0 || fields[i - 1] == NULL)
+        {
+          realtime += 1000;
+          g_string_append_printf (export, "__REALTIME_TIMESTAMP=%" G_GUINT64_FORMAT "\n", realtime);
+          g_string_append_printf (export, "__MONOTONIC_TIMESTAMP=%" G_GUINT64_FORMAT "\n", realtime);
+          g_string_append (export, "_BOOT_ID=a2a4e8a6f3c24bc8b6f9e7e3b3d3a5c1\n");
+        }
+
+      if (fields[i] == NULL)
+        {
+          g_string_append_c (export, '\n');
+          continue;
+        }
+
+      eq = strchr (fields[i], '=');
+      g_assert (eq != NULL);
+      g_string_append_len (export, fields[i], eq - fields[i]);
+      g_string_append_c (export, '\n');
+      length = GUINT64_TO_LE (strlen (eq + 1));
+      g_string_append_len (export, (const gchar *)&length, sizeof (length));
+      g_string_append (export, eq + 1);
+      g_string_append_c (export, '\n');
+    }
+
+  export_path = g_build_filename (directory, "test.export", NULL);
+  g_file_set_contents (export_path, export->str, export->len, &error);
+  g_assert_no_error (error);
+  g_string_free (export, TRUE);
+
+  output = g_strdup_printf ("--output=%s/test-%u.journal", directory, serial++);
+  argv[0] = (gchar *)journal_remote;
+  argv[1] = "--split-mode=none";
+  argv[2] = output;
+  argv[3] = export_path;
+  argv[4] = NULL;
+
+  g_spawn_sync (NULL, argv, NULL, G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                NULL, NULL, NULL, NULL, &status, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (status, ==, 0);
+
+  g_unlink (export_path);
+  g_free (export_path);
+  g_free (output);
+  return TRUE;
+}
@@ -63,6 +63,9 @@ void     _cockpit_assert_strmatch_msg       (const char *domain,
 
 void     cockpit_test_skip                  (const gchar *reason);
 
+gboolean cockpit_test_write_journal         (const gchar *directory,
+                                             const gchar **fields);
+
 G_END_DECLS
 
 #endif /* __COCKPIT_TEST_H__ */
@@ -0,0 +1,176 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpittextsearch.h"
+
+#include <string.h>
+
+/**
+ * CockpitTextSearch:
+ *
+ * Looks for a fixed string in many haystacks, such as all the fields
+ * of journal entries. Everything that only depends on the needle is
+ * worked out once, up front.
+ *
+ * Case sensitive searches use memmem(), which glibc implements with
+ * vectorized code. Case insensitive searches use Horspool's algorithm
+ * with a case folded shift table, so that most bytes of the haystack
+ * are never looked at. Only ASCII letters are folded.
+ */
+
+struct _CockpitTextSearch {
+  gboolean ignore_case;
+  gsize length;
+  guchar *needle;
+
+  /* How far the window can move when its last byte is a given value */
+  gsize shift[256];
+};
+
+static inline guchar
+fold (guchar ch)
+{
+  return (ch >= 'A' && ch <= 'Z') ? ch + ('a' - 'A') : ch;
+}
+
+static gboolean
+has_upper (const gchar *text)
+{
+  for (; *text; text++)
+    {
+      if (*text >= 'A' && *text <= 'Z')
+        return TRUE;
+    }
+  return FALSE;
+}
+
+/**
+ * cockpit_text_search_new:
+ * @needle: the text to look for
+ * @flags: COCKPIT_TEXT_SEARCH_IGNORE_CASE to always ignore case, or
+ *         COCKPIT_TEXT_SEARCH_SMART_CASE to ignore case only when
+ *         @needle has no upper case letters
+ *
+ * Prepare for searching for @needle.
+ *
+ * Returns: (transfer full): the new search
+ */
+CockpitTextSearch *
+cockpit_text_search_new (const gchar *needle,
+                         CockpitTextSearchFlags flags)
+{
+  CockpitTextSearch *search;
+  gsize i;
+
+  g_return_val_if_fail (needle != NULL, NULL);
+
+  search = g_new0 (CockpitTextSearch, 1);
+  search->length = strlen (needle);
+  search->needle = (guchar *)g_strdup (needle);
+
+  if (flags & COCKPIT_TEXT_SEARCH_IGNORE_CASE)
+    search->ignore_case = TRUE;
+  else if (flags & COCKPIT_TEXT_SEARCH_SMART_CASE)
+    search->ignore_case = !has_upper (needle);
+
+  if (search->ignore_case)
+    {
+      for (i = 0; i < search->length; i++)
+        search->needle[i] = fold (search->needle[i]);
+
+      for (i = 0; i < 256; i++)
+        search->shift[i] = search->length;
+      for (i = 0; i + 1 < search->length; i++)
+        {
+          search->shift[search->needle[i]] = search->length - 1 - i;
+          if (search->needle[i] >= 'a' && search->needle[i] <= 'z')
+            search->shift[search->needle[i] - ('a' - 'A')] = search->length - 1 - i;
+        }
+    }
+
+  return search;
+}
+
+/**
+ * cockpit_text_search_match:
+ * @search: the search
+ * @data: the haystack
+ * @length: length of the haystack
+ *
+ * Check whether the needle occurs in @data.
+ *
+ * Returns: whether it was found
+ */
+gboolean
+cockpit_text_search_match (CockpitTextSearch *search,
+                           gconstpointer data,
+                           gsize length)
+{
+  const guchar *haystack = data;
+  const guchar *needle;
+  gsize last;
+  gsize pos;
+  gsize i;
+
+  g_return_val_if_fail (search != NULL, FALSE);
+
+  if (search->length == 0)
+    return TRUE;
+  if (length < search->length)
+    return FALSE;
+
+  if (!search->ignore_case)
+    return memmem (data, length, search->needle, search->length) != NULL;
+
+  needle = search->needle;
+  last = search->length - 1;
+
+  for (pos = 0; pos + last < length; pos += search->shift[haystack[pos + last]])
+    {
+      if (fold (haystack[pos + last]) != needle[last])
+        continue;
+      for (i = 0; i < last; i++)
+        {
+          if (fold (haystack[pos + i]) != needle[i])
+            break;
+        }
+      if (i == last)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/**
+ * cockpit_text_search_free:
+ * @search: the search
+ *
+ * Free the search.
+ */
+void
+cockpit_text_search_free (CockpitTextSearch *search)
+{
+  if (!search)
+    return;
+
+  g_free (search->needle);
+  g_free (search);
+}
@@ -0,0 +1,45 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_TEXT_SEARCH_H__
+#define __COCKPIT_TEXT_SEARCH_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+  COCKPIT_TEXT_SEARCH_IGNORE_CASE = 1 << 0,
+  COCKPIT_TEXT_SEARCH_SMART_CASE = 1 << 1,
+} CockpitTextSearchFlags;
+
+typedef struct _CockpitTextSearch CockpitTextSearch;
+
+CockpitTextSearch *   cockpit_text_search_new        (const gchar *needle,
+                                                      CockpitTextSearchFlags flags);
+
+gboolean              cockpit_text_search_match      (CockpitTextSearch *search,
+                                                      gconstpointer data,
+                                                      gsize length);
+
+void                  cockpit_text_search_free       (CockpitTextSearch *search);
+
+G_END_DECLS
+
+#endif /* __COCKPIT_TEXT_SEARCH_H__ */
@@ -0,0 +1,479 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpittimerwheel.h"
+
+/*
+ * A hierarchical timer wheel, in the style of the classic Linux kernel
+ * timers. Thousands of timeouts (one per connection or session) then
+ * cost a single GSource in the main context, and adding, removing and
+ * expiring a timer is constant time.
+ *
+ * Level 0 has a slot for each of the next 64 ticks. Each slot in the
+ * higher levels covers 64 times the span of a slot in the level below,
+ * and its timers are cascaded down a level whenever the lower level
+ * wraps around.
+ *
+ * The wheel and its timers must only be used from the thread that
+ * runs the main context the wheel is attached to.
+ */
+
+#define WHEEL_BITS    6
+#define WHEEL_SIZE    (1 << WHEEL_BITS)
+#define WHEEL_MASK    (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS  4
+#define WHEEL_MAX     ((G_GUINT64_CONSTANT (1) << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+typedef struct _CockpitWheelSource CockpitWheelSource;
+
+struct _CockpitTimer {
+  CockpitTimer *next;
+  CockpitTimer *prev;
+  CockpitTimer **list;
+  CockpitWheelSource *wheel;
+  guint64 deadline;
+  guint64 expires;
+  guint64 interval;
+  GSourceFunc callback;
+  gpointer user_data;
+  gboolean dispatching;
+  gboolean removed;
+};
+
+struct _CockpitWheelSource {
+  GSource source;
+  gint64 tick;
+  gint64 base;
+  guint64 next;
+  guint count;
+  GMainContext *registered;
+  CockpitTimer *slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+/* Shared wheels, one per main context */
+G_LOCK_DEFINE_STATIC (wheels);
+static GHashTable *wheels = NULL;
+
+static guint64
+elapsed_ticks (CockpitWheelSource *ws,
+               gint64 now)
+{
+  if (now < ws->base)
+    return 0;
+  return (now - ws->base) / ws->tick;
+}
+
+static void
+timer_link (CockpitTimer **list,
+            CockpitTimer *timer)
+{
+  timer->list = list;
+  timer->prev = NULL;
+  timer->next = *list;
+  if (timer->next)
+    timer->next->prev = timer;
+  *list = timer;
+}
+
+static void
+timer_unlink (CockpitTimer *timer)
+{
+  if (timer->prev)
+    timer->prev->next = timer->next;
+  else
+    *(timer->list) = timer->next;
+  if (timer->next)
+    timer->next->prev = timer->prev;
+  timer->list = NULL;
+  timer->next = timer->prev = NULL;
+}
+
+static void
+timer_insert (CockpitWheelSource *ws,
+              CockpitTimer *timer)
+{
+  guint64 expires = timer->expires;
+  guint64 idx;
+  guint level;
+
+  if (expires < ws->next)
+    expires = timer->expires = ws->next;
+
+  idx = expires - ws->next;
+  if (idx > WHEEL_MAX)
+    {
+      expires = timer->expires = ws->next + WHEEL_MAX;
+      idx = WHEEL_MAX;
+    }
+
+  for (level = 0; level < WHEEL_LEVELS - 1; level++)
+    {
+      if (idx < (G_GUINT64_CONSTANT (1) << (WHEEL_BITS * (level + 1))))
+        break;
+    }
+
+  timer_link (&ws->slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK], timer);
+}
+
+static void
+timer_schedule (CockpitWheelSource *ws,
+                CockpitTimer *timer,
+                gint64 now)
+{
+  guint64 limit;
+  gint64 when;
+
+  limit = (G_MAXINT64 - now) / 1000;
+  when = now + (gint64)(MIN (timer->interval, limit) * 1000);
+  timer->deadline = (when - ws->base + ws->tick - 1) / ws->tick;
+  timer->expires = timer->deadline;
+  timer_insert (ws, timer);
+}
+
+static void
+timer_free (CockpitTimer *timer)
+{
+  g_source_unref ((GSource *)timer->wheel);
+  g_slice_free (CockpitTimer, timer);
+}
+
+static guint
+cascade (CockpitWheelSource *ws,
+         guint level,
+         guint index)
+{
+  CockpitTimer *timer;
+  CockpitTimer *list;
+
+  list = ws->slots[level][index];
+  ws->slots[level][index] = NULL;
+
+  while (list)
+    {
+      timer = list;
+      list = timer->next;
+      timer_insert (ws, timer);
+    }
+
+  return index;
+}
+
+static void
+expire_tick (CockpitWheelSource *ws)
+{
+  CockpitTimer *expiring;
+  CockpitTimer *timer;
+  guint index;
+  guint level;
+  gboolean ret;
+
+  index = ws->next & WHEEL_MASK;
+  for (level = 1; index == 0 && level < WHEEL_LEVELS; level++)
+    index = cascade (ws, level, (ws->next >> (WHEEL_BITS * level)) & WHEEL_MASK);
+
+  index = ws->next & WHEEL_MASK;
+  ws->next++;
+
+  /* Callbacks can remove any of these, so give them their own list */
+  expiring = NULL;
+  while (ws->slots[0][index])
+    {
+      timer = ws->slots[0][index];
+      timer_unlink (timer);
+      timer_link (&expiring, timer);
+    }
+
+  while (expiring)
+    {
+      timer = expiring;
+      timer_unlink (timer);
+
+      /* Too far in the future to have fit on the wheel */
+      if (timer->deadline >= ws->next)
+        {
+          timer->expires = timer->deadline;
+          timer_insert (ws, timer);
+          continue;
+        }
+
+      timer->dispatching = TRUE;
+      ret = (timer->callback) (timer->user_data);
+      timer->dispatching = FALSE;
+
+      if (timer->removed)
+        {
+          timer_free (timer);
+        }
+      else if (ret)
+        {
+          timer_schedule (ws, timer, g_source_get_time ((GSource *)ws));
+        }
+      else
+        {
+          ws->count--;
+          timer_free (timer);
+        }
+    }
+}
+
+static gint64
+next_wakeup (CockpitWheelSource *ws)
+{
+  guint64 tick;
+
+  /*
+   * Don't wake up for empty ticks, up until the next time the
+   * higher levels cascade down.
+   */
+  for (tick = ws->next; ; tick++)
+    {
+      if (ws->slots[0][tick & WHEEL_MASK] || (tick & WHEEL_MASK) == 0)
+        break;
+    }
+
+  return ws->base + (gint64)tick * ws->tick;
+}
+
+static gboolean
+wheel_prepare (GSource *source,
+               gint *timeout)
+{
+  CockpitWheelSource *ws = (CockpitWheelSource *)source;
+  gint64 now;
+  gint64 wakeup;
+
+  *timeout = -1;
+  if (ws->count == 0)
+    return FALSE;
+
+  now = g_source_get_time (source);
+  wakeup = next_wakeup (ws);
+  if (wakeup <= now)
+    {
+      *timeout = 0;
+      return TRUE;
+    }
+
+  *timeout = (gint)MIN ((wakeup - now + 999) / 1000, G_MAXINT);
+  return FALSE;
+}
+
+static gboolean
+wheel_check (GSource *source)
+{
+  CockpitWheelSource *ws = (CockpitWheelSource *)source;
+
+  return ws->count > 0 &&
+         next_wakeup (ws) <= g_source_get_time (source);
+}
+
+static gboolean
+wheel_dispatch (GSource *source,
+                GSourceFunc callback,
+                gpointer user_data)
+{
+  CockpitWheelSource *ws = (CockpitWheelSource *)source;
+  guint64 target;
+
+  target = elapsed_ticks (ws, g_source_get_time (source));
+  while (ws->count > 0 && ws->next <= target)
+    expire_tick (ws);
+
+  return TRUE;
+}
+
+static void
+wheel_finalize (GSource *source)
+{
+  CockpitWheelSource *ws = (CockpitWheelSource *)source;
+
+  /* Every timer holds a reference, so none are left */
+  g_assert (ws->count == 0);
+
+  if (ws->registered)
+    {
+      G_LOCK (wheels);
+      if (g_hash_table_lookup (wheels, ws->registered) == ws)
+        g_hash_table_remove (wheels, ws->registered);
+      G_UNLOCK (wheels);
+    }
+}
+
+static GSourceFuncs wheel_funcs = {
+  wheel_prepare,
+  wheel_check,
+  wheel_dispatch,
+  wheel_finalize,
+};
+
+/**
+ * cockpit_timer_wheel_new:
+ * @tick_ms: resolution of the timers in milliseconds
+ *
+ * Create a new timer wheel. Attach it to a main context with
+ * g_source_attach() before adding timers to it.
+ *
+ * Timers on the wheel fire no earlier than requested, and at most
+ * one tick late.
+ *
+ * Returns: (transfer full): the new wheel source
+ */
+GSource *
+cockpit_timer_wheel_new (guint tick_ms)
+{
+  CockpitWheelSource *ws;
+  GSource *source;
+
+  g_return_val_if_fail (tick_ms > 0, NULL);
+
+  source = g_source_new (&wheel_funcs, sizeof (CockpitWheelSource));
+  g_source_set_name (source, "timer-wheel");
+
+  ws = (CockpitWheelSource *)source;
+  ws->tick = (gint64)tick_ms * 1000;
+  ws->base = g_get_monotonic_time ();
+  ws->next = 0;
+
+  return source;
+}
+
+/**
+ * cockpit_timer_wheel_for_context:
+ * @context: the main context, or NULL for the global default
+ *
+ * Get a timer wheel attached to @context, with a resolution of one
+ * second, that's shared by everything using that context. The wheel
+ * goes away along with the context once it has no timers.
+ *
+ * Returns: (transfer none): the wheel source
+ */
+GSource *
+cockpit_timer_wheel_for_context (GMainContext *context)
+{
+  CockpitWheelSource *ws;
+  GSource *source;
+
+  if (context == NULL)
+    context = g_main_context_default ();
+
+  G_LOCK (wheels);
+
+  if (wheels == NULL)
+    wheels = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  source = g_hash_table_lookup (wheels, context);
+  if (source == NULL || g_source_is_destroyed (source))
+    {
+      source = cockpit_timer_wheel_new (1000);
+      ws = (CockpitWheelSource *)source;
+      ws->registered = context;
+      g_hash_table_replace (wheels, context, source);
+      g_source_attach (source, context);
+
+      /* The context holds the reference */
+      g_source_unref (source);
+    }
+
+  G_UNLOCK (wheels);
+
+  return source;
+}
+
+/**
+ * cockpit_timer_wheel_add:
+ * @wheel: a wheel from cockpit_timer_wheel_new() or similar
+ * @interval_ms: time until the callback is called
+ * @callback: the callback to call
+ * @user_data: data to pass to the callback
+ *
+ * Add a timer to the wheel. As with a GSource, the @callback returns
+ * TRUE to be called again after another @interval_ms, or FALSE to
+ * remove the timer. It's fine for the callback to remove its own timer
+ * with cockpit_timer_remove() and return either value.
+ *
+ * Returns: (transfer none): the timer, valid until removed
+ */
+CockpitTimer *
+cockpit_timer_wheel_add (GSource *wheel,
+                         guint64 interval_ms,
+                         GSourceFunc callback,
+                         gpointer user_data)
+{
+  CockpitWheelSource *ws = (CockpitWheelSource *)wheel;
+  CockpitTimer *timer;
+  gint64 now;
+
+  g_return_val_if_fail (wheel != NULL, NULL);
+  g_return_val_if_fail (callback != NULL, NULL);
+
+  now = g_get_monotonic_time ();
+
+  /* Nothing is pending, so skip over the ticks that passed while idle */
+  if (ws->count == 0)
+    ws->next = MAX (ws->next, elapsed_ticks (ws, now));
+
+  timer = g_slice_new0 (CockpitTimer);
+  timer->wheel = (CockpitWheelSource *)g_source_ref (wheel);
+  timer->interval = interval_ms;
+  timer->callback = callback;
+  timer->user_data = user_data;
+
+  timer_schedule (ws, timer, now);
+  ws->count++;
+
+  return timer;
+}
+
+/**
+ * cockpit_timer_wheel_count:
+ * @wheel: the wheel
+ *
+ * Returns: the number of timers pending on the wheel
+ */
+guint
+cockpit_timer_wheel_count (GSource *wheel)
+{
+  g_return_val_if_fail (wheel != NULL, 0);
+  return ((CockpitWheelSource *)wheel)->count;
+}
+
+/**
+ * cockpit_timer_remove:
+ * @timer: the timer
+ *
+ * Remove a timer so that its callback won't be called again. The
+ * @timer is no longer valid after this.
+ */
+void
+cockpit_timer_remove (CockpitTimer *timer)
+{
+  g_return_if_fail (timer != NULL);
+  g_return_if_fail (!timer->removed);
+
+  if (timer->list)
+    timer_unlink (timer);
+
+  timer->removed = TRUE;
+  timer->wheel->count--;
+
+  if (!timer->dispatching)
+    timer_free (timer);
+}
@@ -0,0 +1,181 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmark for process spawn latency, as the agent has for every
+ * text-stream channel and every spawned command. Compares the fork()
+ * based g_spawn_async_with_pipes() that cockpit_pipe_spawn() used to
+ * call with the vfork() based cockpit_spawn().
+ *
+ * The cost of fork() grows with the memory mapped by the parent, and the
+ * cost of closing fds in the child grows with the number of fds open, so
+ * both can be increased with --memory and --fds.
+ */
+
+#include "config.h"
+
+#include "cockpitspawn.h"
+
+#include <glib.h>
+
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+static const gchar *command[] = { "/bin/true", NULL };
+
+static void
+reap (GPid pid)
+{
+  while (waitpid (pid, NULL, 0) < 0)
+    {
+      if (errno != EINTR)
+        g_error ("couldn't wait for child: %s", g_strerror (errno));
+    }
+}
+
+static GPid
+spawn_glib (int in_fd,
+            int out_fd)
+{
+  GError *error = NULL;
+  GPid pid;
+  int child_in;
+  int child_out;
+
+  if (!g_spawn_async_with_pipes (NULL, (gchar **)command, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+                                 NULL, NULL, &pid, &child_in, &child_out, NULL, &error))
+    g_error ("couldn't spawn: %s", error->message);
+
+  close (child_in);
+  close (child_out);
+  return pid;
+}
+
+static GPid
+spawn_vfork (int in_fd,
+             int out_fd)
+{
+  GPid pid;
+
+  pid = cockpit_spawn (command, NULL, NULL, 0, in_fd, out_fd, -1);
+  if (pid < 0)
+    g_error ("couldn't spawn: %s", g_strerror (errno));
+
+  return pid;
+}
+
+static void
+measure (const gchar *name,
+         GPid (* spawn) (int, int),
+         guint count)
+{
+  gint64 start;
+  gint64 spawned = 0;
+  gint64 total;
+  int fds[2];
+  GPid pid;
+  guint i;
+
+  if (pipe2 (fds, O_CLOEXEC) < 0)
+    g_error ("couldn't create pipe: %s", g_strerror (errno));
+
+  total = g_get_monotonic_time ();
+  for (i = 0; i < count; i++)
+    {
+      start = g_get_monotonic_time ();
+      pid = spawn (fds[0], fds[1]);
+      spawned += g_get_monotonic_time () - start;
+      reap (pid);
+    }
+  total = g_get_monotonic_time () - total;
+
+  close (fds[0]);
+  close (fds[1]);
+
+  g_print ("%-8s spawn %8.1f us, spawn and exit %8.1f us\n", name,
+           (gdouble)spawned / count, (gdouble)total / count);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *options;
+  GError *error = NULL;
+  GArray *fds;
+  gchar *memory = NULL;
+  gint fd;
+  gint i;
+
+  gint opt_count = 1000;
+  gint opt_fds = 0;
+  gint opt_memory = 0;
+
+  GOptionEntry entries[] = {
+    { "count", 'n', 0, G_OPTION_ARG_INT, &opt_count, "Number of processes to spawn (1000)", "count" },
+    { "fds", 0, 0, G_OPTION_ARG_INT, &opt_fds, "Extra fds to have open", "count" },
+    { "memory", 'm', 0, G_OPTION_ARG_INT, &opt_memory, "Megabytes of memory to touch", "megabytes" },
+    { NULL }
+  };
+
+  options = g_option_context_new (NULL);
+  g_option_context_add_main_entries (options, entries, NULL);
+  if (!g_option_context_parse (options, &argc, &argv, &error))
+    {
+      g_printerr ("frob-spawn: %s\n", error->message);
+      return 2;
+    }
+
+  if (opt_count <= 0)
+    {
+      g_printerr ("frob-spawn: invalid number of processes\n");
+      return 2;
+    }
+
+  fds = g_array_new (FALSE, FALSE, sizeof (gint));
+  for (i = 0; i < opt_fds; i++)
+    {
+      fd = open ("/dev/null", O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        g_error ("couldn't open /dev/null: %s", g_strerror (errno));
+      g_array_append_val (fds, fd);
+    }
+
+  if (opt_memory > 0)
+    {
+      memory = g_malloc ((gsize)opt_memory * 1024 * 1024);
+      memset (memory, 0xAA, (gsize)opt_memory * 1024 * 1024);
+    }
+
+  g_print ("%d processes, %d extra fds, %d MB touched\n", opt_count, opt_fds, opt_memory);
+  measure ("glib", spawn_glib, opt_count);
+  measure ("vfork", spawn_vfork, opt_count);
+
+  for (i = 0; i < fds->len; i++)
+    close (g_array_index (fds, gint, i));
+  g_array_free (fds, TRUE);
+  g_free (memory);
+  g_option_context_free (options);
+
+  return 0;
+}
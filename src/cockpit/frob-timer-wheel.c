@@ -0,0 +1,180 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmark for main loop iteration cost with many pending timeouts,
+ * as cockpit-ws has with many connections. Each connection has a request
+ * timeout, a ping and a session expiry. Compares a GSource per timeout
+ * with a shared timer wheel.
+ */
+
+#include "config.h"
+
+#include "cockpittimerwheel.h"
+
+static gboolean
+on_timeout (gpointer user_data)
+{
+  g_assert_not_reached ();
+  return FALSE;
+}
+
+static gboolean
+on_idle (gpointer user_data)
+{
+  guint *count = user_data;
+  (*count)++;
+  return TRUE;
+}
+
+static gdouble
+measure_iterations (GMainContext *context,
+                    guint iterations)
+{
+  GSource *idle;
+  guint count = 0;
+  gint64 start;
+
+  /* Something to wake up the loop each iteration */
+  idle = g_idle_source_new ();
+  g_source_set_callback (idle, on_idle, &count, NULL);
+  g_source_attach (idle, context);
+
+  start = g_get_monotonic_time ();
+  while (count < iterations)
+    g_main_context_iteration (context, FALSE);
+
+  g_source_destroy (idle);
+  g_source_unref (idle);
+  return (g_get_monotonic_time () - start) * 1000.0 / iterations;
+}
+
+static gdouble
+measure_sources (guint connections,
+                 guint iterations,
+                 gdouble *add_ns)
+{
+  GMainContext *context;
+  GSource **sources;
+  gdouble result;
+  gint64 start;
+  guint count;
+  guint i;
+
+  context = g_main_context_new ();
+  count = connections * 3;
+  sources = g_new (GSource *, count);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < count; i++)
+    {
+      sources[i] = g_timeout_source_new_seconds (30 + i % 3);
+      g_source_set_callback (sources[i], on_timeout, NULL, NULL);
+      g_source_attach (sources[i], context);
+    }
+  *add_ns = (g_get_monotonic_time () - start) * 1000.0 / count;
+
+  result = measure_iterations (context, iterations);
+
+  for (i = 0; i < count; i++)
+    {
+      g_source_destroy (sources[i]);
+      g_source_unref (sources[i]);
+    }
+
+  g_free (sources);
+  g_main_context_unref (context);
+  return result;
+}
+
+static gdouble
+measure_wheel (guint connections,
+               guint iterations,
+               gdouble *add_ns)
+{
+  GMainContext *context;
+  CockpitTimer **timers;
+  GSource *wheel;
+  gdouble result;
+  gint64 start;
+  guint count;
+  guint i;
+
+  context = g_main_context_new ();
+  wheel = cockpit_timer_wheel_for_context (context);
+  count = connections * 3;
+  timers = g_new (CockpitTimer *, count);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < count; i++)
+    timers[i] = cockpit_timer_wheel_add (wheel, (30 + i % 3) * 1000, on_timeout, NULL);
+  *add_ns = (g_get_monotonic_time () - start) * 1000.0 / count;
+
+  result = measure_iterations (context, iterations);
+
+  for (i = 0; i < count; i++)
+    cockpit_timer_remove (timers[i]);
+
+  g_free (timers);
+  g_main_context_unref (context);
+  return result;
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *options;
+  GError *error = NULL;
+  gint connections = 10000;
+  gint iterations = 10000;
+  gdouble iteration;
+  gdouble add;
+
+  GOptionEntry entries[] = {
+    { "connections", 'c', 0, G_OPTION_ARG_INT, &connections, "Number of connections to simulate", "count" },
+    { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Number of main loop iterations", "count" },
+    { NULL }
+  };
+
+  options = g_option_context_new (NULL);
+  g_option_context_add_main_entries (options, entries, NULL);
+  if (!g_option_context_parse (options, &argc, &argv, &error))
+    {
+      g_printerr ("frob-timer-wheel: %s\n", error->message);
+      return 2;
+    }
+
+  if (connections <= 0 || iterations <= 0)
+    {
+      g_printerr ("frob-timer-wheel: invalid number of connections or iterations\n");
+      return 2;
+    }
+
+  g_print ("%d connections, %d timeouts\n", connections, connections * 3);
+
+  iteration = measure_sources (connections, iterations, &add);
+  g_print ("sources: %10.1f ns/iteration %8.1f ns/add\n", iteration, add);
+
+  iteration = measure_wheel (connections, iterations, &add);
+  g_print ("wheel:   %10.1f ns/iteration %8.1f ns/add\n", iteration, add);
+
+  g_option_context_free (options);
+  return 0;
+}
@@ -29,7 +29,9 @@
 
 #include <sys/uio.h>
 #include <sys/wait.h>
+#include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
 
 /* ----------------------------------------------------------------------------
  * Mock
@@ -706,6 +708,39 @@ test_spawn_and_fail (void)
   g_object_unref (pipe);
 }
 
+static void
+test_spawn_close_fds (void)
+{
+  gboolean closed = FALSE;
+  GByteArray *buffer;
+  CockpitPipe *pipe;
+  gchar *script;
+  int fd;
+
+  const gchar *argv[] = { "/bin/sh", "-c", NULL, NULL };
+
+  /* Not close-on-exec, the child should still not get it */
+  fd = open ("/dev/null", O_RDONLY);
+  g_assert (fd >= 0);
+
+  script = g_strdup_printf ("test -e /dev/fd/%d && echo leaked || echo closed", fd);
+  argv[2] = script;
+
+  pipe = cockpit_pipe_spawn (argv, NULL, NULL);
+  g_signal_connect (pipe, "close", G_CALLBACK (on_close_get_flag), &closed);
+
+  while (closed == FALSE)
+    g_main_context_iteration (NULL, TRUE);
+
+  buffer = cockpit_pipe_get_buffer (pipe);
+  g_byte_array_append (buffer, (const guint8 *)"\0", 1);
+  g_assert_cmpstr ((gchar *)buffer->data, ==, "closed\n");
+
+  g_object_unref (pipe);
+  g_free (script);
+  close (fd);
+}
+
 static void
 test_pty_shell (void)
 {
@@ -1048,6 +1083,7 @@ main (int argc,
   g_test_add_func ("/pipe/spawn/and-read", test_spawn_and_read);
   g_test_add_func ("/pipe/spawn/and-write", test_spawn_and_write);
   g_test_add_func ("/pipe/spawn/and-fail", test_spawn_and_fail);
+  g_test_add_func ("/pipe/spawn/close-fds", test_spawn_close_fds);
 
   g_test_add_func ("/pipe/pty/shell", test_pty_shell);
 
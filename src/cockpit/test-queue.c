@@ -0,0 +1,117 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitqueue.h"
+
+#include "cockpit/cockpittest.h"
+
+#include <glib.h>
+
+#define THREADED_ITEMS 1000000
+
+static void
+test_order (void)
+{
+  CockpitQueue *queue;
+
+  queue = cockpit_queue_new (NULL);
+  g_assert (cockpit_queue_is_empty (queue));
+  g_assert (cockpit_queue_pop (queue) == NULL);
+
+  cockpit_queue_push (queue, "one");
+  cockpit_queue_push (queue, "two");
+  g_assert (!cockpit_queue_is_empty (queue));
+
+  g_assert_cmpstr (cockpit_queue_pop (queue), ==, "one");
+  cockpit_queue_push (queue, "three");
+  g_assert_cmpstr (cockpit_queue_pop (queue), ==, "two");
+  g_assert_cmpstr (cockpit_queue_pop (queue), ==, "three");
+
+  g_assert (cockpit_queue_is_empty (queue));
+  g_assert (cockpit_queue_pop (queue) == NULL);
+
+  cockpit_queue_free (queue);
+}
+
+static void
+test_free_items (void)
+{
+  CockpitQueue *queue;
+
+  /* Leftover items are freed, valgrind checks this */
+  queue = cockpit_queue_new (g_free);
+  cockpit_queue_push (queue, g_strdup ("one"));
+  cockpit_queue_push (queue, g_strdup ("two"));
+  g_free (cockpit_queue_pop (queue));
+  cockpit_queue_push (queue, g_strdup ("three"));
+  cockpit_queue_free (queue);
+}
+
+static gpointer
+produce_items (gpointer user_data)
+{
+  CockpitQueue *queue = user_data;
+  gsize i;
+
+  for (i = 1; i <= THREADED_ITEMS; i++)
+    cockpit_queue_push (queue, GSIZE_TO_POINTER (i));
+
+  return NULL;
+}
+
+static void
+test_threaded (void)
+{
+  CockpitQueue *queue;
+  GThread *thread;
+  gpointer data;
+  gsize expect = 1;
+
+  queue = cockpit_queue_new (NULL);
+  thread = g_thread_new ("producer", produce_items, queue);
+
+  /* Everything arrives, exactly once and in order */
+  while (expect <= THREADED_ITEMS)
+    {
+      data = cockpit_queue_pop (queue);
+      if (data == NULL)
+        continue;
+      g_assert_cmpuint (GPOINTER_TO_SIZE (data), ==, expect);
+      expect++;
+    }
+
+  g_thread_join (thread);
+  g_assert (cockpit_queue_is_empty (queue));
+  cockpit_queue_free (queue);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add_func ("/queue/order", test_order);
+  g_test_add_func ("/queue/free-items", test_free_items);
+  g_test_add_func ("/queue/threaded", test_threaded);
+
+  return g_test_run ();
+}
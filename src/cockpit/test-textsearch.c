@@ -0,0 +1,104 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpittextsearch.h"
+
+#include "cockpit/cockpittest.h"
+
+#include <glib.h>
+
+#include <string.h>
+
+typedef struct {
+  const gchar *needle;
+  CockpitTextSearchFlags flags;
+  const gchar *haystack;
+  gboolean found;
+} Fixture;
+
+static const Fixture fixtures[] = {
+  { "", 0, "", TRUE },
+  { "", 0, "anything", TRUE },
+  { "a", 0, "", FALSE },
+  { "needle", 0, "needle", TRUE },
+  { "needle", 0, "a needle in a haystack", TRUE },
+  { "needle", 0, "a Needle in a haystack", FALSE },
+  { "needle", 0, "needl", FALSE },
+  { "needle", COCKPIT_TEXT_SEARCH_IGNORE_CASE, "a NEEDLE in a haystack", TRUE },
+  { "NeEdLe", COCKPIT_TEXT_SEARCH_IGNORE_CASE, "a needle in a haystack", TRUE },
+  { "needle", COCKPIT_TEXT_SEARCH_IGNORE_CASE, "a needl in a haystack", FALSE },
+  { "x", COCKPIT_TEXT_SEARCH_IGNORE_CASE, "abcX", TRUE },
+  { "aab", COCKPIT_TEXT_SEARCH_IGNORE_CASE, "aaAaAB", TRUE },
+  { "abab", COCKPIT_TEXT_SEARCH_IGNORE_CASE, "abaAbAbx", TRUE },
+  { "a-b", COCKPIT_TEXT_SEARCH_IGNORE_CASE, "A_B a-B", TRUE },
+  { "needle", COCKPIT_TEXT_SEARCH_SMART_CASE, "a NEEDLE in a haystack", TRUE },
+  { "Needle", COCKPIT_TEXT_SEARCH_SMART_CASE, "a NEEDLE in a haystack", FALSE },
+  { "Needle", COCKPIT_TEXT_SEARCH_SMART_CASE, "a Needle in a haystack", TRUE },
+  { "\xc3\xa4", COCKPIT_TEXT_SEARCH_IGNORE_CASE, "b\xc3\xa4r", TRUE },
+  { "\xc3\xa4", COCKPIT_TEXT_SEARCH_IGNORE_CASE, "b\xc3\x84r", FALSE },
+};
+
+static void
+test_match (gconstpointer data)
+{
+  const Fixture *fixture = data;
+  CockpitTextSearch *search;
+
+  search = cockpit_text_search_new (fixture->needle, fixture->flags);
+  g_assert (cockpit_text_search_match (search, fixture->haystack,
+                                       strlen (fixture->haystack)) == fixture->found);
+  cockpit_text_search_free (search);
+}
+
+static void
+test_length (void)
+{
+  CockpitTextSearch *search;
+  const gchar *haystack = "abcNEEDLE";
+
+  /* Nothing past the given length is looked at */
+  search = cockpit_text_search_new ("needle", COCKPIT_TEXT_SEARCH_IGNORE_CASE);
+  g_assert (cockpit_text_search_match (search, haystack, 9));
+  g_assert (!cockpit_text_search_match (search, haystack, 8));
+  g_assert (!cockpit_text_search_match (search, haystack + 4, 5));
+  cockpit_text_search_free (search);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  gchar *name;
+  gint i;
+
+  cockpit_test_init (&argc, &argv);
+
+  for (i = 0; i < G_N_ELEMENTS (fixtures); i++)
+    {
+      name = g_strdup_printf ("/text-search/match/%d", i);
+      g_test_add_data_func (name, fixtures + i, test_match);
+      g_free (name);
+    }
+
+  g_test_add_func ("/text-search/length", test_length);
+
+  return g_test_run ();
+}
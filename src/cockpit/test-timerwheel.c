@@ -0,0 +1,247 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpittimerwheel.h"
+
+#include "cockpit/cockpittest.h"
+
+#include <glib.h>
+
+typedef struct {
+  GSource *wheel;
+} TestCase;
+
+typedef struct {
+  TestCase *tc;
+  gint64 started;
+  gint64 fired;
+  guint count;
+  guint repeat;
+  GString *order;
+  const gchar *name;
+  CockpitTimer *timer;
+  CockpitTimer *other;
+} TestTimer;
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  tc->wheel = cockpit_timer_wheel_new (GPOINTER_TO_UINT (data));
+  g_source_attach (tc->wheel, NULL);
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  g_assert_cmpuint (cockpit_timer_wheel_count (tc->wheel), ==, 0);
+  g_source_destroy (tc->wheel);
+  g_source_unref (tc->wheel);
+}
+
+static gboolean
+on_timer (gpointer user_data)
+{
+  TestTimer *tt = user_data;
+
+  tt->fired = g_get_monotonic_time ();
+  tt->count++;
+  if (tt->order)
+    g_string_append (tt->order, tt->name);
+  if (tt->other)
+    {
+      cockpit_timer_remove (tt->other);
+      tt->other = NULL;
+    }
+
+  return tt->count < tt->repeat;
+}
+
+static void
+wait_for_count (TestCase *tc,
+                TestTimer *tt,
+                guint count)
+{
+  while (tt->count < count)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+test_fire (TestCase *tc,
+           gconstpointer data)
+{
+  TestTimer tt = { tc, };
+
+  tt.started = g_get_monotonic_time ();
+  tt.timer = cockpit_timer_wheel_add (tc->wheel, 50, on_timer, &tt);
+  g_assert_cmpuint (cockpit_timer_wheel_count (tc->wheel), ==, 1);
+
+  wait_for_count (tc, &tt, 1);
+
+  /* Never earlier than requested */
+  g_assert_cmpint (tt.fired - tt.started, >=, 50 * 1000);
+  g_assert_cmpuint (tt.count, ==, 1);
+}
+
+static void
+test_cascade (TestCase *tc,
+              gconstpointer data)
+{
+  TestTimer tt = { tc, };
+
+  /* Further than the first level of the wheel reaches */
+  tt.started = g_get_monotonic_time ();
+  tt.timer = cockpit_timer_wheel_add (tc->wheel, 150, on_timer, &tt);
+
+  wait_for_count (tc, &tt, 1);
+
+  g_assert_cmpint (tt.fired - tt.started, >=, 150 * 1000);
+}
+
+static void
+test_order (TestCase *tc,
+            gconstpointer data)
+{
+  GString *order = g_string_new ("");
+  TestTimer one = { tc, .order = order, .name = "1" };
+  TestTimer two = { tc, .order = order, .name = "2" };
+  TestTimer three = { tc, .order = order, .name = "3" };
+
+  three.timer = cockpit_timer_wheel_add (tc->wheel, 90, on_timer, &three);
+  one.timer = cockpit_timer_wheel_add (tc->wheel, 10, on_timer, &one);
+  two.timer = cockpit_timer_wheel_add (tc->wheel, 40, on_timer, &two);
+
+  wait_for_count (tc, &three, 1);
+
+  g_assert_cmpstr (order->str, ==, "123");
+  g_string_free (order, TRUE);
+}
+
+static void
+test_repeat (TestCase *tc,
+             gconstpointer data)
+{
+  TestTimer tt = { tc, .repeat = 3 };
+
+  tt.started = g_get_monotonic_time ();
+  tt.timer = cockpit_timer_wheel_add (tc->wheel, 20, on_timer, &tt);
+
+  wait_for_count (tc, &tt, 3);
+
+  g_assert_cmpint (tt.fired - tt.started, >=, 3 * 20 * 1000);
+
+  /* Returned FALSE the third time */
+  g_assert_cmpuint (cockpit_timer_wheel_count (tc->wheel), ==, 0);
+}
+
+static void
+test_remove (TestCase *tc,
+             gconstpointer data)
+{
+  TestTimer removed = { tc, };
+  TestTimer tt = { tc, };
+
+  removed.timer = cockpit_timer_wheel_add (tc->wheel, 20, on_timer, &removed);
+  tt.timer = cockpit_timer_wheel_add (tc->wheel, 60, on_timer, &tt);
+  g_assert_cmpuint (cockpit_timer_wheel_count (tc->wheel), ==, 2);
+
+  cockpit_timer_remove (removed.timer);
+  g_assert_cmpuint (cockpit_timer_wheel_count (tc->wheel), ==, 1);
+
+  wait_for_count (tc, &tt, 1);
+
+  g_assert_cmpuint (removed.count, ==, 0);
+}
+
+static gboolean
+on_timer_remove_self (gpointer user_data)
+{
+  TestTimer *tt = user_data;
+  tt->count++;
+  cockpit_timer_remove (tt->timer);
+  return TRUE;
+}
+
+static void
+test_remove_in_callback (TestCase *tc,
+                         gconstpointer data)
+{
+  TestTimer self = { tc, };
+  TestTimer first = { tc, };
+  TestTimer second = { tc, };
+  TestTimer last = { tc, };
+
+  self.timer = cockpit_timer_wheel_add (tc->wheel, 20, on_timer_remove_self, &self);
+
+  /* Expire on the same tick, whichever runs first removes the other */
+  first.timer = cockpit_timer_wheel_add (tc->wheel, 40, on_timer, &first);
+  second.timer = cockpit_timer_wheel_add (tc->wheel, 40, on_timer, &second);
+  first.other = second.timer;
+  second.other = first.timer;
+
+  last.timer = cockpit_timer_wheel_add (tc->wheel, 80, on_timer, &last);
+
+  wait_for_count (tc, &last, 1);
+
+  g_assert_cmpuint (self.count, ==, 1);
+  g_assert_cmpuint (first.count + second.count, ==, 1);
+}
+
+static void
+test_for_context (void)
+{
+  GMainContext *context;
+  GSource *wheel;
+
+  context = g_main_context_new ();
+
+  wheel = cockpit_timer_wheel_for_context (context);
+  g_assert (wheel != NULL);
+  g_assert (cockpit_timer_wheel_for_context (context) == wheel);
+  g_assert (cockpit_timer_wheel_for_context (NULL) != wheel);
+  g_assert (g_source_get_context (wheel) == context);
+
+  g_main_context_unref (context);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/timer-wheel/fire", TestCase, GUINT_TO_POINTER (10),
+              setup, test_fire, teardown);
+  g_test_add ("/timer-wheel/cascade", TestCase, GUINT_TO_POINTER (1),
+              setup, test_cascade, teardown);
+  g_test_add ("/timer-wheel/order", TestCase, GUINT_TO_POINTER (10),
+              setup, test_order, teardown);
+  g_test_add ("/timer-wheel/repeat", TestCase, GUINT_TO_POINTER (5),
+              setup, test_repeat, teardown);
+  g_test_add ("/timer-wheel/remove", TestCase, GUINT_TO_POINTER (10),
+              setup, test_remove, teardown);
+  g_test_add ("/timer-wheel/remove-in-callback", TestCase, GUINT_TO_POINTER (10),
+              setup, test_remove_in_callback, teardown);
+  g_test_add_func ("/timer-wheel/for-context", test_for_context);
+
+  return g_test_run ();
+}
@@ -0,0 +1,523 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2013 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "batchmonitor.h"
+#include "cgroupmonitor.h"
+#include "subscriptions.h"
+#include "timeseries.h"
+
+/**
+ * SECTION:batchmonitor
+ * @title: BatchMonitor
+ * @short_description: Implementation of #CockpitBatchMonitor
+ *
+ * This type provides an implementation of the #CockpitBatchMonitor
+ * interface.
+ *
+ * Each NewSample signal of a resource monitor is broadcast, and the
+ * agent turns it into its own message on every D-Bus channel. With a
+ * page showing four plots that is four messages per second and
+ * channel. Clients of this object instead get one Samples signal per
+ * tick, sent to them directly and with only the monitors they asked
+ * for. The monitors don't broadcast anything while they only sample
+ * on behalf of this object.
+ */
+
+/* A resource monitor that somebody wants samples of */
+typedef struct {
+  BatchMonitor *batch;
+  gchar *path;
+  GDBusInterface *monitor;
+  /* Of the resource monitor, held while there are clients */
+  Subscriptions *subscriptions;
+  /* The clients of this object that want samples of the monitor */
+  Subscriptions *clients;
+  /* NULL for a #CGroupMonitor */
+  TimeSeries *series;
+  gint64 last_timestamp;
+} Watched;
+
+typedef struct _BatchMonitorClass BatchMonitorClass;
+
+/**
+ * BatchMonitor:
+ *
+ * The #BatchMonitor structure contains only private data and should
+ * only be accessed using the provided API.
+ */
+struct _BatchMonitor
+{
+  CockpitBatchMonitorSkeleton parent_instance;
+
+  GObject *tick_source;
+  GDBusObjectManagerServer *object_manager;
+
+  /* object path -> Watched */
+  GHashTable *watched;
+};
+
+struct _BatchMonitorClass
+{
+  CockpitBatchMonitorSkeletonClass parent_class;
+};
+
+enum
+{
+  PROP_0,
+  PROP_TICK_SOURCE,
+  PROP_OBJECT_MANAGER
+};
+
+static void batch_monitor_iface_init (CockpitBatchMonitorIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (BatchMonitor, batch_monitor, COCKPIT_TYPE_BATCH_MONITOR_SKELETON,
+                         G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_BATCH_MONITOR, batch_monitor_iface_init));
+
+static void on_tick (GObject *tick_source,
+                     guint64 delta_usec,
+                     gpointer user_data);
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+static void
+watched_free (gpointer data)
+{
+  Watched *watched = data;
+
+  if (subscriptions_is_active (watched->clients))
+    subscriptions_release (watched->subscriptions);
+  subscriptions_free (watched->clients);
+  g_object_unref (watched->monitor);
+  g_free (watched->path);
+  g_slice_free (Watched, watched);
+}
+
+static void
+batch_monitor_init (BatchMonitor *monitor)
+{
+  monitor->watched = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, watched_free);
+}
+
+static void
+batch_monitor_finalize (GObject *object)
+{
+  BatchMonitor *monitor = BATCH_MONITOR (object);
+
+  if (monitor->tick_source)
+    {
+      g_signal_handlers_disconnect_by_func (monitor->tick_source, G_CALLBACK (on_tick), monitor);
+      g_object_remove_weak_pointer (monitor->tick_source, (gpointer *)&monitor->tick_source);
+    }
+
+  g_hash_table_destroy (monitor->watched);
+
+  G_OBJECT_CLASS (batch_monitor_parent_class)->finalize (object);
+}
+
+static void
+batch_monitor_set_property (GObject *object,
+                            guint prop_id,
+                            const GValue *value,
+                            GParamSpec *pspec)
+{
+  BatchMonitor *monitor = BATCH_MONITOR (object);
+
+  switch (prop_id)
+    {
+    case PROP_TICK_SOURCE:
+      g_assert (monitor->tick_source == NULL);
+      /* we don't take a reference to the tick source */
+      monitor->tick_source = g_value_get_object (value);
+      break;
+    case PROP_OBJECT_MANAGER:
+      g_assert (monitor->object_manager == NULL);
+      /* we don't take a reference to the object manager */
+      monitor->object_manager = g_value_get_object (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
+static void
+batch_monitor_constructed (GObject *object)
+{
+  BatchMonitor *monitor = BATCH_MONITOR (object);
+
+  /* After the resource monitors have collected their samples */
+  if (monitor->tick_source)
+    {
+      g_object_add_weak_pointer (monitor->tick_source, (gpointer *)&monitor->tick_source);
+      g_signal_connect_after (monitor->tick_source, "tick", G_CALLBACK (on_tick), monitor);
+    }
+
+  if (G_OBJECT_CLASS (batch_monitor_parent_class)->constructed != NULL)
+    G_OBJECT_CLASS (batch_monitor_parent_class)->constructed (object);
+}
+
+static void
+batch_monitor_class_init (BatchMonitorClass *klass)
+{
+  GObjectClass *gobject_class;
+
+  gobject_class = G_OBJECT_CLASS (klass);
+  gobject_class->finalize = batch_monitor_finalize;
+  gobject_class->constructed = batch_monitor_constructed;
+  gobject_class->set_property = batch_monitor_set_property;
+
+  /**
+   * BatchMonitor:tick-source:
+   *
+   * An object which emits a tick signal, like a #Daemon
+   */
+  g_object_class_install_property (gobject_class,
+                                   PROP_TICK_SOURCE,
+                                   g_param_spec_object ("tick-source",
+                                                        NULL,
+                                                        NULL,
+                                                        G_TYPE_OBJECT,
+                                                        G_PARAM_WRITABLE |
+                                                        G_PARAM_CONSTRUCT_ONLY |
+                                                        G_PARAM_STATIC_STRINGS));
+
+  /**
+   * BatchMonitor:object-manager:
+   *
+   * Object Manager to find the resource monitors in
+   */
+  g_object_class_install_property (gobject_class,
+                                   PROP_OBJECT_MANAGER,
+                                   g_param_spec_object ("object-manager",
+                                                        NULL,
+                                                        NULL,
+                                                        G_TYPE_DBUS_OBJECT_MANAGER_SERVER,
+                                                        G_PARAM_WRITABLE |
+                                                        G_PARAM_CONSTRUCT_ONLY |
+                                                        G_PARAM_STATIC_STRINGS));
+}
+
+/**
+ * batch_monitor_new:
+ * @tick_source: An object which emits a signal like a tick source
+ * @object_manager: object manager with the resource monitors
+ *
+ * Creates a new #BatchMonitor instance.
+ *
+ * Returns: A new #BatchMonitor. Free with g_object_unref().
+ */
+CockpitBatchMonitor *
+batch_monitor_new (GObject *tick_source,
+                   GDBusObjectManagerServer *object_manager)
+{
+  g_return_val_if_fail (G_IS_DBUS_OBJECT_MANAGER_SERVER (object_manager), NULL);
+  return COCKPIT_BATCH_MONITOR (g_object_new (TYPE_BATCH_MONITOR,
+                                              "tick-source", tick_source,
+                                              "object-manager", object_manager,
+                                              NULL));
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+/* Returns a reference to the resource monitor at @path, or NULL */
+static GDBusInterface *
+lookup_monitor (BatchMonitor *monitor,
+                const gchar *path)
+{
+  GDBusObjectManager *object_manager;
+  Subscriptions *subscriptions;
+  GDBusInterface *iface;
+
+  object_manager = G_DBUS_OBJECT_MANAGER (monitor->object_manager);
+  iface = g_dbus_object_manager_get_interface (object_manager, path, "com.redhat.Cockpit.ResourceMonitor");
+  if (iface == NULL)
+    iface = g_dbus_object_manager_get_interface (object_manager, path, "com.redhat.Cockpit.MultiResourceMonitor");
+  if (iface == NULL)
+    return NULL;
+
+  subscriptions = subscriptions_get_for_monitor (iface);
+  if (subscriptions == NULL ||
+      (subscriptions_get_series (subscriptions) == NULL && !IS_CGROUP_MONITOR (iface)))
+    {
+      g_object_unref (iface);
+      return NULL;
+    }
+
+  return iface;
+}
+
+static void
+on_clients_changed (gboolean active,
+                    gpointer user_data)
+{
+  Watched *watched = user_data;
+
+  if (active)
+    {
+      subscriptions_hold (watched->subscriptions);
+    }
+  else
+    {
+      subscriptions_release (watched->subscriptions);
+      g_hash_table_remove (watched->batch->watched, watched->path);
+    }
+}
+
+static Watched *
+lookup_watched (BatchMonitor *monitor,
+                const gchar *path)
+{
+  GDBusInterface *iface;
+  Watched *watched;
+
+  watched = g_hash_table_lookup (monitor->watched, path);
+  if (watched)
+    return watched;
+
+  iface = lookup_monitor (monitor, path);
+  if (iface == NULL)
+    return NULL;
+
+  watched = g_slice_new0 (Watched);
+  watched->batch = monitor;
+  watched->path = g_strdup (path);
+  watched->monitor = iface;
+  watched->subscriptions = subscriptions_get_for_monitor (iface);
+  watched->series = subscriptions_get_series (watched->subscriptions);
+
+  /* The resource monitor lingers by itself once our clients are gone */
+  watched->clients = subscriptions_new (on_clients_changed, watched);
+  subscriptions_set_linger (watched->clients, 0);
+
+  /* Only samples collected from now on */
+  watched->last_timestamp = g_get_real_time ();
+
+  g_hash_table_insert (monitor->watched, watched->path, watched);
+  return watched;
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+typedef struct {
+  guint n_series;
+  gint64 timestamp;
+  GVariant *values;
+} Latest;
+
+static void
+on_latest_sample (gint64 timestamp,
+                  const gdouble *values,
+                  gpointer user_data)
+{
+  Latest *latest = user_data;
+  latest->timestamp = timestamp;
+  latest->values = g_variant_new_fixed_array (G_VARIANT_TYPE_DOUBLE, values,
+                                              latest->n_series, sizeof (gdouble));
+}
+
+/* Returns a floating (xv) variant, or NULL if there's nothing new */
+static GVariant *
+read_new_sample (Watched *watched)
+{
+  Latest latest = { 0, 0, NULL };
+
+  if (watched->series)
+    {
+      latest.n_series = cockpit_resource_monitor_get_num_series (COCKPIT_RESOURCE_MONITOR (watched->monitor));
+      time_series_foreach (watched->series, 0, TIME_SERIES_AVERAGE, watched->last_timestamp + 1, 0, 1,
+                           on_latest_sample, &latest);
+    }
+  else
+    {
+      latest.values = cgroup_monitor_get_latest_sample (CGROUP_MONITOR (watched->monitor), &latest.timestamp);
+      if (latest.values && latest.timestamp <= watched->last_timestamp)
+        {
+          g_variant_unref (g_variant_ref_sink (latest.values));
+          latest.values = NULL;
+        }
+    }
+
+  if (latest.values == NULL)
+    return NULL;
+
+  watched->last_timestamp = latest.timestamp;
+  return g_variant_new ("(xv)", latest.timestamp, latest.values);
+}
+
+typedef struct {
+  GDBusConnection *connection;
+  gchar *sender;
+  GVariantBuilder builder;
+} Batch;
+
+static void
+batch_free (gpointer data)
+{
+  Batch *batch = data;
+  g_variant_builder_clear (&batch->builder);
+  g_object_unref (batch->connection);
+  g_free (batch->sender);
+  g_slice_free (Batch, batch);
+}
+
+typedef struct {
+  /* sender -> Batch */
+  GHashTable *batches;
+  const gchar *path;
+  GVariant *sample;
+} Batching;
+
+static void
+add_to_batch (GDBusConnection *connection,
+              const gchar *sender,
+              gpointer user_data)
+{
+  Batching *batching = user_data;
+  Batch *batch;
+
+  batch = g_hash_table_lookup (batching->batches, sender);
+  if (!batch)
+    {
+      batch = g_slice_new0 (Batch);
+      batch->connection = g_object_ref (connection);
+      batch->sender = g_strdup (sender);
+      g_variant_builder_init (&batch->builder, G_VARIANT_TYPE ("a{o(xv)}"));
+      g_hash_table_insert (batching->batches, batch->sender, batch);
+    }
+
+  g_variant_builder_add (&batch->builder, "{o@(xv)}", batching->path, batching->sample);
+}
+
+static void
+on_tick (GObject *tick_source,
+         guint64 delta_usec,
+         gpointer user_data)
+{
+  BatchMonitor *monitor = BATCH_MONITOR (user_data);
+  const gchar *object_path;
+  GError *error = NULL;
+  Batching batching;
+  GHashTableIter iter;
+  Watched *watched;
+  Batch *batch;
+
+  object_path = g_dbus_interface_skeleton_get_object_path (G_DBUS_INTERFACE_SKELETON (monitor));
+  if (object_path == NULL || g_hash_table_size (monitor->watched) == 0)
+    return;
+
+  /* Read every watched monitor once, and add it for whoever wants it */
+  batching.batches = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, batch_free);
+  g_hash_table_iter_init (&iter, monitor->watched);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&watched))
+    {
+      batching.sample = read_new_sample (watched);
+      if (!batching.sample)
+        continue;
+      batching.path = watched->path;
+      g_variant_ref_sink (batching.sample);
+      subscriptions_foreach (watched->clients, add_to_batch, &batching);
+      g_variant_unref (batching.sample);
+    }
+
+  g_hash_table_iter_init (&iter, batching.batches);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&batch))
+    {
+      /* Only to this client, rather than broadcast */
+      if (!g_dbus_connection_emit_signal (batch->connection, batch->sender, object_path,
+                                          "com.redhat.Cockpit.BatchMonitor", "Samples",
+                                          g_variant_new ("(@a{o(xv)})", g_variant_builder_end (&batch->builder)),
+                                          &error))
+        {
+          g_debug ("couldn't send samples to %s: %s", batch->sender, error->message);
+          g_clear_error (&error);
+        }
+    }
+
+  g_hash_table_destroy (batching.batches);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+static gboolean
+handle_subscribe (CockpitBatchMonitor *object,
+                  GDBusMethodInvocation *invocation,
+                  const gchar *const *arg_monitors)
+{
+  BatchMonitor *monitor = BATCH_MONITOR (object);
+  GDBusInterface *iface;
+  Watched *watched;
+  gint i;
+
+  /* Check them all first, so that nothing needs to be undone */
+  for (i = 0; arg_monitors[i] != NULL; i++)
+    {
+      if (g_hash_table_lookup (monitor->watched, arg_monitors[i]))
+        continue;
+      iface = lookup_monitor (monitor, arg_monitors[i]);
+      if (iface == NULL)
+        {
+          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                                 "No resource monitor at %s", arg_monitors[i]);
+          return TRUE;
+        }
+      g_object_unref (iface);
+    }
+
+  for (i = 0; arg_monitors[i] != NULL; i++)
+    {
+      watched = lookup_watched (monitor, arg_monitors[i]);
+      g_assert (watched != NULL);
+      subscriptions_add (watched->clients, invocation);
+    }
+
+  cockpit_batch_monitor_complete_subscribe (object, invocation);
+  return TRUE;
+}
+
+static gboolean
+handle_unsubscribe (CockpitBatchMonitor *object,
+                    GDBusMethodInvocation *invocation,
+                    const gchar *const *arg_monitors)
+{
+  BatchMonitor *monitor = BATCH_MONITOR (object);
+  Watched *watched;
+  gint i;
+
+  for (i = 0; arg_monitors[i] != NULL; i++)
+    {
+      watched = g_hash_table_lookup (monitor->watched, arg_monitors[i]);
+      if (watched)
+        subscriptions_remove (watched->clients, invocation);
+    }
+
+  cockpit_batch_monitor_complete_unsubscribe (object, invocation);
+  return TRUE;
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+static void
+batch_monitor_iface_init (CockpitBatchMonitorIface *iface)
+{
+  iface->handle_subscribe = handle_subscribe;
+  iface->handle_unsubscribe = handle_unsubscribe;
+}
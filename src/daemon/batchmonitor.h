@@ -0,0 +1,38 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2013 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COCKPIT_BATCH_MONITOR_H__
+#define COCKPIT_BATCH_MONITOR_H__
+
+#include "types.h"
+
+G_BEGIN_DECLS
+
+#define TYPE_BATCH_MONITOR  (batch_monitor_get_type ())
+#define BATCH_MONITOR(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), TYPE_BATCH_MONITOR, BatchMonitor))
+#define IS_BATCH_MONITOR(o) (G_TYPE_CHECK_INSTANCE_TYPE ((o), TYPE_BATCH_MONITOR))
+
+GType                     batch_monitor_get_type    (void) G_GNUC_CONST;
+
+CockpitBatchMonitor *     batch_monitor_new         (GObject *tick_source,
+                                                     GDBusObjectManagerServer *object_manager);
+
+G_END_DECLS
+
+#endif /* COCKPIT_BATCH_MONITOR_H__ */
@@ -26,6 +26,7 @@
 
 #include "daemon.h"
 #include "cgroupmonitor.h"
+#include "subscriptions.h"
 
 #include <gsystem-local-alloc.h>
 
@@ -69,6 +70,10 @@ struct _CGroupMonitor
 {
   CockpitMultiResourceMonitorSkeleton parent_instance;
 
+  /* Only used while constructing, usually the #Daemon */
+  GObject *tick_source;
+  Subscriptions *subscriptions;
+
   gchar *basedir;
 
   gchar *memory_root;
@@ -103,10 +108,6 @@ static void resource_monitor_iface_init (CockpitMultiResourceMonitorIface *iface
 G_DEFINE_TYPE_WITH_CODE (CGroupMonitor, cgroup_monitor, COCKPIT_TYPE_MULTI_RESOURCE_MONITOR_SKELETON,
                          G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_MULTI_RESOURCE_MONITOR, resource_monitor_iface_init));
 
-static void on_tick (GObject    *unused_source,
-                     guint64     delta_usec,
-                     gpointer    user_data);
-
 /* ---------------------------------------------------------------------------------------------------- */
 
 static void
@@ -122,6 +123,8 @@ cgroup_monitor_finalize (GObject *object)
 {
   CGroupMonitor *monitor = CGROUP_MONITOR (object);
 
+  subscriptions_free (monitor->subscriptions);
+
   g_free (monitor->basedir);
   g_free (monitor->memory_root);
   g_free (monitor->cpuacct_root);
@@ -142,9 +145,7 @@ cgroup_monitor_set_property (GObject *object,
   switch (prop_id)
     {
     case PROP_TICK_SOURCE:
-      g_signal_connect_object (g_value_get_object (value),
-                               "tick", G_CALLBACK (on_tick),
-                               monitor, 0);
+      monitor->tick_source = g_value_get_object (value);
       break;
     case PROP_BASEDIR:
       monitor->basedir = g_value_dup_string (value);
@@ -157,15 +158,6 @@ cgroup_monitor_set_property (GObject *object,
 
 static void collect (CGroupMonitor *monitor);
 
-static void
-on_tick (GObject *unused_source,
-         guint64 delta_usec,
-         gpointer user_data)
-{
-  CGroupMonitor *monitor = CGROUP_MONITOR (user_data);
-  collect (monitor);
-}
-
 static void
 cgroup_monitor_constructed (GObject *object)
 {
@@ -188,6 +180,9 @@ cgroup_monitor_constructed (GObject *object)
   monitor->memory_root = g_build_filename (monitor->basedir, "memory", NULL);
   monitor->cpuacct_root = g_build_filename (monitor->basedir, "cpuacct", NULL);
 
+  /* Walking the cgroup hierarchy is expensive, only do it while someone is subscribed */
+  monitor->subscriptions = subscriptions_new_sampling (monitor, monitor->tick_source, NULL,
+                                                      (SubscriptionsSampleFunc)collect);
   collect (monitor);
 
   G_OBJECT_CLASS (cgroup_monitor_parent_class)->constructed (object);
@@ -499,9 +494,13 @@ collect (CGroupMonitor *monitor)
   notice_cgroups_in_hierarchy (&data, monitor->cpuacct_root);
   g_hash_table_foreach (monitor->consumers, collect_cgroup, &data);
 
-  cockpit_multi_resource_monitor_emit_new_sample (COCKPIT_MULTI_RESOURCE_MONITOR (monitor),
-                                                  data.now,
-                                                  build_sample_variant (monitor, monitor->samples_next));
+  /* Those who only want batched samples use cgroup_monitor_get_latest_sample() */
+  if (subscriptions_has_subscribers (monitor->subscriptions))
+    {
+      cockpit_multi_resource_monitor_emit_new_sample (COCKPIT_MULTI_RESOURCE_MONITOR (monitor),
+                                                      data.now,
+                                                      build_sample_variant (monitor, monitor->samples_next));
+    }
 
   monitor->samples_prev = monitor->samples_next;
   monitor->samples_next += 1;
@@ -513,6 +512,30 @@ collect (CGroupMonitor *monitor)
     update_consumers_property (monitor);
 }
 
+/**
+ * cgroup_monitor_get_latest_sample:
+ * @monitor: A #CGroupMonitor.
+ * @timestamp: (out): location for the timestamp of the sample
+ *
+ * Gets the sample collected last, in the same form as the
+ * #CockpitMultiResourceMonitor::new-sample signal.
+ *
+ * Returns: (transfer floating): a a{sad} variant, or %NULL if
+ *          @monitor hasn't collected anything yet
+ */
+GVariant *
+cgroup_monitor_get_latest_sample (CGroupMonitor *monitor,
+                                  gint64 *timestamp)
+{
+  g_return_val_if_fail (IS_CGROUP_MONITOR (monitor), NULL);
+
+  if (monitor->samples_prev < 0)
+    return NULL;
+
+  *timestamp = monitor->timestamps[monitor->samples_prev];
+  return build_sample_variant (monitor, monitor->samples_prev);
+}
+
 /* ---------------------------------------------------------------------------------------------------- */
 
 static gboolean
@@ -548,8 +571,24 @@ handle_get_samples (CockpitMultiResourceMonitor *_monitor,
   return TRUE;
 }
 
+static gboolean
+handle_subscribe (CockpitMultiResourceMonitor *_monitor,
+                  GDBusMethodInvocation *invocation)
+{
+  return subscriptions_handle_subscribe (CGROUP_MONITOR (_monitor)->subscriptions, invocation);
+}
+
+static gboolean
+handle_unsubscribe (CockpitMultiResourceMonitor *_monitor,
+                    GDBusMethodInvocation *invocation)
+{
+  return subscriptions_handle_unsubscribe (CGROUP_MONITOR (_monitor)->subscriptions, invocation);
+}
+
 static void
 resource_monitor_iface_init (CockpitMultiResourceMonitorIface *iface)
 {
   iface->handle_get_samples = handle_get_samples;
+  iface->handle_subscribe = handle_subscribe;
+  iface->handle_unsubscribe = handle_unsubscribe;
 }
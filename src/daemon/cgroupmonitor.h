@@ -28,9 +28,12 @@ G_BEGIN_DECLS
 #define CGROUP_MONITOR(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), TYPE_CGROUP_MONITOR, CGroupMonitor))
 #define IS_CGROUP_MONITOR(o) (G_TYPE_CHECK_INSTANCE_TYPE ((o), TYPE_CGROUP_MONITOR))
 
-GType                         cgroup_monitor_get_type    (void) G_GNUC_CONST;
+GType                         cgroup_monitor_get_type          (void) G_GNUC_CONST;
 
-CockpitMultiResourceMonitor * cgroup_monitor_new         (GObject *tick_source);
+CockpitMultiResourceMonitor * cgroup_monitor_new               (GObject *tick_source);
+
+GVariant *                    cgroup_monitor_get_latest_sample (CGroupMonitor *monitor,
+                                                                gint64 *timestamp);
 
 G_END_DECLS
 
@@ -19,11 +19,13 @@
 
 #include "config.h"
 
-#include <stdio.h>
 #include <unistd.h>
 
 #include "daemon.h"
 #include "cpumonitor.h"
+#include "procfile.h"
+#include "subscriptions.h"
+#include "timeseries.h"
 
 /**
  * SECTION:cpumonitor
@@ -59,15 +61,19 @@ struct _CpuMonitor
   CockpitResourceMonitorSkeleton parent_instance;
 
   Daemon *daemon;
+  Subscriptions *subscriptions;
 
   guint user_hz;
+  ProcFile *stat;
 
+  /* Number of samples returned by GetSamples() without options */
   guint samples_max;
-  gint samples_prev;
-  guint samples_next;
 
-  /* Arrays of samples_max Sample instances (nice, user, system, iowait) */
-  Sample *samples;
+  /* The previous sample, timestamp is zero if there is none */
+  Sample last;
+
+  /* History of (nice, user, system, iowait) */
+  TimeSeries *series;
 };
 
 struct _CpuMonitorClass
@@ -86,10 +92,6 @@ static void resource_monitor_iface_init (CockpitResourceMonitorIface *iface);
 G_DEFINE_TYPE_WITH_CODE (CpuMonitor, cpu_monitor, COCKPIT_TYPE_RESOURCE_MONITOR_SKELETON,
                          G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_RESOURCE_MONITOR, resource_monitor_iface_init));
 
-static void on_tick (Daemon  *daemon,
-                     guint64     delta_usec,
-                     gpointer    user_data);
-
 /* ---------------------------------------------------------------------------------------------------- */
 
 static void
@@ -107,9 +109,11 @@ cpu_monitor_init (CpuMonitor *monitor)
   /* Assign legends */
   cockpit_resource_monitor_set_legends (COCKPIT_RESOURCE_MONITOR (monitor), legends);
 
-  monitor->samples_prev = -1;
+  monitor->stat = proc_file_new ("/proc/stat");
+
   monitor->samples_max = 300;
-  monitor->samples = g_new0 (Sample, monitor->samples_max);
+  monitor->series = time_series_new_archived (PACKAGE_LOCALSTATE_DIR "/lib/cockpit/samples/cpu",
+                                              4, NULL, 0);
 }
 
 static void
@@ -117,9 +121,9 @@ cpu_monitor_finalize (GObject *object)
 {
   CpuMonitor *monitor = CPU_MONITOR (object);
 
-  g_free (monitor->samples);
-
-  g_signal_handlers_disconnect_by_func (monitor->daemon, G_CALLBACK (on_tick), monitor);
+  subscriptions_free (monitor->subscriptions);
+  time_series_free (monitor->series);
+  proc_file_free (monitor->stat);
 
   G_OBJECT_CLASS (cpu_monitor_parent_class)->finalize (object);
 }
@@ -168,15 +172,6 @@ cpu_monitor_set_property (GObject *object,
 
 static void collect (CpuMonitor *monitor);
 
-static void
-on_tick (Daemon *daemon,
-         guint64 delta_usec,
-         gpointer user_data)
-{
-  CpuMonitor *monitor = CPU_MONITOR (user_data);
-  collect (monitor);
-}
-
 static void
 cpu_monitor_constructed (GObject *object)
 {
@@ -185,7 +180,8 @@ cpu_monitor_constructed (GObject *object)
   cockpit_resource_monitor_set_num_samples (COCKPIT_RESOURCE_MONITOR (monitor), monitor->samples_max);
   cockpit_resource_monitor_set_num_series (COCKPIT_RESOURCE_MONITOR (monitor), 4);
 
-  g_signal_connect (monitor->daemon, "tick", G_CALLBACK (on_tick), monitor);
+  monitor->subscriptions = subscriptions_new_sampling (monitor, G_OBJECT (monitor->daemon), monitor->series,
+                                                      (SubscriptionsSampleFunc)collect);
   collect (monitor);
 
   if (G_OBJECT_CLASS (cpu_monitor_parent_class)->constructed != NULL)
@@ -275,24 +271,21 @@ calc_percentage (CpuMonitor *monitor,
   return ret;
 }
 
-/* TODO: this should be optimized so we don't allocate memory and call open()/close() all the time */
 static void
 collect (CpuMonitor *monitor)
 {
-  gchar *contents = NULL;
-  gsize len;
+  const gchar *line;
+  const gchar *pos;
   GError *error;
-  gchar **lines = NULL;
   guint n;
   gint64 now;
-  GVariantBuilder builder;
-  Sample *sample = NULL;
+  gdouble values[4];
+  Sample sample;
+  gboolean have_sample = FALSE;
 
   error = NULL;
-  if (!g_file_get_contents ("/proc/stat",
-                            &contents,
-                            &len,
-                            &error))
+  line = proc_file_read (monitor->stat, &error);
+  if (line == NULL)
     {
       g_warning ("Error loading contents /proc/stat: %s (%s, %d)",
                  error->message, g_quark_to_string (error->domain), error->code);
@@ -304,10 +297,8 @@ collect (CpuMonitor *monitor)
 
   /* see 'man proc' for the format of /proc/stat */
 
-  lines = g_strsplit (contents, "\n", -1);
-  for (n = 0; lines != NULL && lines[n] != NULL; n++)
+  for (n = 0; line != NULL; line = proc_next_line (line), n++)
     {
-      const gchar *line = lines[n];
       guint64 user;
       guint64 nice;
       guint64 system;
@@ -319,58 +310,61 @@ collect (CpuMonitor *monitor)
         continue;
 
       last = NULL;
-      if (monitor->samples_prev != -1)
-        last = &(monitor->samples[monitor->samples_prev]);
-      sample = &(monitor->samples[monitor->samples_next]);
-
-#define FMT64 "%" G_GUINT64_FORMAT " "
-      if (sscanf (line + sizeof ("cpu ") - 1, FMT64 FMT64 FMT64 FMT64 FMT64,
-                  &user,
-                  &nice,
-                  &system,
-                  &idle,
-                  &iowait) != 5)
+      if (monitor->last.timestamp != 0)
+        last = &monitor->last;
+
+      pos = line + sizeof ("cpu ") - 1;
+      if (!proc_parse_u64 (&pos, &user) ||
+          !proc_parse_u64 (&pos, &nice) ||
+          !proc_parse_u64 (&pos, &system) ||
+          !proc_parse_u64 (&pos, &idle) ||
+          !proc_parse_u64 (&pos, &iowait))
         {
-          g_warning ("Error parsing line %d of /proc/stat with content `%s'", n, line);
+          g_warning ("Error parsing line %d of /proc/stat", n);
           continue;
         }
 
-      sample->timestamp    = now;
-      sample->nice_value   = nice;
-      sample->user_value   = user;
-      sample->system_value = system;
-      sample->iowait_value = iowait;
+      sample.timestamp         = now;
+      sample.nice_value        = nice;
+      sample.user_value        = user;
+      sample.system_value      = system;
+      sample.iowait_value      = iowait;
+      sample.nice_percentage   = 0.0;
+      sample.user_percentage   = 0.0;
+      sample.system_percentage = 0.0;
+      sample.iowait_percentage = 0.0;
 
       if (last != NULL)
         {
-          sample->nice_percentage   = calc_percentage (monitor, sample, last, sample->nice_value,   last->nice_value);
-          sample->user_percentage   = calc_percentage (monitor, sample, last, sample->user_value,   last->user_value);
-          sample->system_percentage = calc_percentage (monitor, sample, last, sample->system_value, last->system_value);
-          sample->iowait_percentage = calc_percentage (monitor, sample, last, sample->iowait_value, last->iowait_value);
+          sample.nice_percentage   = calc_percentage (monitor, &sample, last, sample.nice_value,   last->nice_value);
+          sample.user_percentage   = calc_percentage (monitor, &sample, last, sample.user_value,   last->user_value);
+          sample.system_percentage = calc_percentage (monitor, &sample, last, sample.system_value, last->system_value);
+          sample.iowait_percentage = calc_percentage (monitor, &sample, last, sample.iowait_value, last->iowait_value);
         }
 
+      have_sample = TRUE;
       break;
     }
 
 out:
-  g_strfreev (lines);
-  g_free (contents);
-
-  if (sample != NULL)
+  if (have_sample)
     {
-      g_variant_builder_init (&builder, G_VARIANT_TYPE ("ad"));
-      g_variant_builder_add (&builder, "d", sample->nice_percentage);
-      g_variant_builder_add (&builder, "d", sample->user_percentage);
-      g_variant_builder_add (&builder, "d", sample->system_percentage);
-      g_variant_builder_add (&builder, "d", sample->iowait_percentage);
-      cockpit_resource_monitor_emit_new_sample (COCKPIT_RESOURCE_MONITOR (monitor),
-                                                now, g_variant_builder_end (&builder));
+      values[0] = sample.nice_percentage;
+      values[1] = sample.user_percentage;
+      values[2] = sample.system_percentage;
+      values[3] = sample.iowait_percentage;
+      time_series_add (monitor->series, now, values);
+
+      /* Those who only want batched samples read them from the series */
+      if (subscriptions_has_subscribers (monitor->subscriptions))
+        {
+          cockpit_resource_monitor_emit_new_sample (COCKPIT_RESOURCE_MONITOR (monitor), now,
+                                                    g_variant_new_fixed_array (G_VARIANT_TYPE_DOUBLE, values,
+                                                                               G_N_ELEMENTS (values),
+                                                                               sizeof (gdouble)));
+        }
+      monitor->last = sample;
     }
-
-  monitor->samples_prev = monitor->samples_next;
-  monitor->samples_next += 1;
-  if (monitor->samples_next == monitor->samples_max)
-    monitor->samples_next = 0;
 }
 
 /* ---------------------------------------------------------------------------------------------------- */
@@ -381,36 +375,32 @@ handle_get_samples (CockpitResourceMonitor *_monitor,
                     GVariant *arg_options)
 {
   CpuMonitor *monitor = CPU_MONITOR (_monitor);
-  GVariantBuilder builder;
-  gint n;
-
-  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(xad)"));
-  for (n = 0; n < monitor->samples_max; n++)
-    {
-      gint pos;
-      GVariantBuilder sample_builder;
-
-      pos = monitor->samples_next + n;
-      if (pos >= monitor->samples_max)
-        pos -= monitor->samples_max;
-
-      if (monitor->samples[pos].timestamp == 0)
-        continue;
+  return time_series_handle_get_samples (monitor->series, invocation, arg_options, monitor->samples_max);
+}
 
-      g_variant_builder_init (&sample_builder, G_VARIANT_TYPE ("ad"));
-      g_variant_builder_add (&sample_builder, "d", monitor->samples[pos].nice_percentage);
-      g_variant_builder_add (&sample_builder, "d", monitor->samples[pos].user_percentage);
-      g_variant_builder_add (&sample_builder, "d", monitor->samples[pos].system_percentage);
-      g_variant_builder_add (&sample_builder, "d", monitor->samples[pos].iowait_percentage);
+static gboolean
+handle_get_samples_since (CockpitResourceMonitor *_monitor,
+                          GDBusMethodInvocation *invocation,
+                          gint64 arg_since,
+                          GVariant *arg_options)
+{
+  CpuMonitor *monitor = CPU_MONITOR (_monitor);
+  return time_series_handle_get_samples_since (monitor->series, invocation, arg_since,
+                                               arg_options, monitor->samples_max);
+}
 
-      g_variant_builder_add (&builder, "(x@ad)",
-                             monitor->samples[pos].timestamp,
-                             g_variant_builder_end (&sample_builder));
-    }
-  cockpit_resource_monitor_complete_get_samples (_monitor, invocation,
-                                                 g_variant_builder_end (&builder));
+static gboolean
+handle_subscribe (CockpitResourceMonitor *_monitor,
+                  GDBusMethodInvocation *invocation)
+{
+  return subscriptions_handle_subscribe (CPU_MONITOR (_monitor)->subscriptions, invocation);
+}
 
-  return TRUE;
+static gboolean
+handle_unsubscribe (CockpitResourceMonitor *_monitor,
+                    GDBusMethodInvocation *invocation)
+{
+  return subscriptions_handle_unsubscribe (CPU_MONITOR (_monitor)->subscriptions, invocation);
 }
 
 /* ---------------------------------------------------------------------------------------------------- */
@@ -419,4 +409,7 @@ static void
 resource_monitor_iface_init (CockpitResourceMonitorIface *iface)
 {
   iface->handle_get_samples = handle_get_samples;
+  iface->handle_get_samples_since = handle_get_samples_since;
+  iface->handle_subscribe = handle_subscribe;
+  iface->handle_unsubscribe = handle_unsubscribe;
 }
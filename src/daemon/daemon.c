@@ -32,6 +32,7 @@
 #include "networkmonitor.h"
 #include "diskiomonitor.h"
 #include "cgroupmonitor.h"
+#include "batchmonitor.h"
 #include "storageprovider.h"
 #include "storagemanager.h"
 #include "realms.h"
@@ -67,6 +68,7 @@ struct _Daemon
   Machines *machines;
   StorageProvider *storage_provider;
 
+  guint tick_holds;
   guint tick_timeout_id;
   gint64 last_tick;
 };
@@ -190,6 +192,7 @@ daemon_constructed (GObject *_object)
   CockpitMachines *machines;
   CockpitResourceMonitor *monitor;
   CockpitMultiResourceMonitor *multi_monitor;
+  CockpitBatchMonitor *batch_monitor;
   CockpitRealms *realms;
   CockpitServices *services;
   CockpitJournal *journal;
@@ -265,6 +268,14 @@ daemon_constructed (GObject *_object)
   g_object_unref (multi_monitor);
   g_object_unref (object);
 
+  /* /com/redhat/Cockpit/BatchMonitor */
+  batch_monitor = batch_monitor_new (G_OBJECT (daemon), daemon->object_manager);
+  object = cockpit_object_skeleton_new ("/com/redhat/Cockpit/BatchMonitor");
+  cockpit_object_skeleton_set_batch_monitor (object, batch_monitor);
+  g_dbus_object_manager_server_export (daemon->object_manager, G_DBUS_OBJECT_SKELETON (object));
+  g_object_unref (batch_monitor);
+  g_object_unref (object);
+
   /* /com/redhat/Cockpit/Realms */
   realms = realms_new (daemon);
   object = cockpit_object_skeleton_new ("/com/redhat/Cockpit/Realms");
@@ -310,8 +321,6 @@ daemon_constructed (GObject *_object)
   /* Export the ObjectManager */
   g_dbus_object_manager_server_set_connection (daemon->object_manager, daemon->connection);
 
-  daemon->tick_timeout_id = g_timeout_add_seconds (1, on_timeout, daemon);
-
   if (G_OBJECT_CLASS (daemon_parent_class)->constructed != NULL)
     G_OBJECT_CLASS (daemon_parent_class)->constructed (_object);
 }
@@ -365,6 +374,9 @@ daemon_class_init (DaemonClass *klass)
    * Emitted every second - subsystems should use this signal instead
    * of setting up their own timeout.
    *
+   * This is only emitted while someone holds the tick with
+   * daemon_hold_tick(), so that an idle daemon doesn't wake up.
+   *
    * This signal is emitted in the
    * <link linkend="g-main-context-push-thread-default">thread-default main loop</link>
    * that @daemon was created in.
@@ -440,6 +452,47 @@ daemon_get_object_manager (Daemon *daemon)
   return daemon->object_manager;
 }
 
+/**
+ * daemon_hold_tick:
+ * @daemon: A #Daemon.
+ *
+ * Start emitting the #Daemon::tick signal every second, if it isn't
+ * already. Every call must be paired with daemon_release_tick().
+ */
+void
+daemon_hold_tick (Daemon *daemon)
+{
+  g_return_if_fail (IS_DAEMON (daemon));
+
+  if (daemon->tick_holds++ == 0)
+    {
+      g_debug ("starting to tick");
+      daemon->last_tick = 0;
+      daemon->tick_timeout_id = g_timeout_add_seconds (1, on_timeout, daemon);
+    }
+}
+
+/**
+ * daemon_release_tick:
+ * @daemon: A #Daemon.
+ *
+ * Release a hold taken by daemon_hold_tick(). The #Daemon::tick
+ * signal stops when no holds are left.
+ */
+void
+daemon_release_tick (Daemon *daemon)
+{
+  g_return_if_fail (IS_DAEMON (daemon));
+  g_return_if_fail (daemon->tick_holds > 0);
+
+  if (--daemon->tick_holds == 0)
+    {
+      g_debug ("stopping to tick");
+      g_source_remove (daemon->tick_timeout_id);
+      daemon->tick_timeout_id = 0;
+    }
+}
+
 static gboolean
 authorize_method (Daemon *daemon,
                   GDBusMethodInvocation *invocation,
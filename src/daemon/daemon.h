@@ -38,6 +38,10 @@ GDBusConnection *          daemon_get_connection       (Daemon *daemon);
 
 GDBusObjectManagerServer * daemon_get_object_manager   (Daemon *daemon);
 
+void                       daemon_hold_tick            (Daemon *daemon);
+
+void                       daemon_release_tick         (Daemon *daemon);
+
 gboolean                   daemon_authorize_method     (Daemon *daemon,
                                                         GDBusMethodInvocation *invocation);
 
@@ -19,12 +19,14 @@
 
 #include "config.h"
 
-#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "daemon.h"
 #include "diskiomonitor.h"
+#include "procfile.h"
+#include "subscriptions.h"
+#include "timeseries.h"
 
 /**
  * SECTION:diskiomonitor
@@ -58,15 +60,19 @@ struct _DiskIOMonitor
   CockpitResourceMonitorSkeleton parent_instance;
 
   Daemon *daemon;
+  Subscriptions *subscriptions;
+  ProcFile *diskstats;
 
   guint user_hz;
 
+  /* Number of samples returned by GetSamples() without options */
   guint samples_max;
-  gint samples_prev;
-  guint samples_next;
 
-  /* Arrays of samples_max Sample instances */
-  Sample *samples;
+  /* The previous sample, timestamp is zero if there is none */
+  Sample last;
+
+  /* History of (read, written, operations) */
+  TimeSeries *series;
 };
 
 struct _DiskIOMonitorClass
@@ -85,10 +91,6 @@ static void resource_monitor_iface_init (CockpitResourceMonitorIface *iface);
 G_DEFINE_TYPE_WITH_CODE (DiskIOMonitor, disk_io_monitor, COCKPIT_TYPE_RESOURCE_MONITOR_SKELETON,
                          G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_RESOURCE_MONITOR, resource_monitor_iface_init));
 
-static void on_tick (Daemon  *daemon,
-                     guint64     delta_usec,
-                     gpointer    user_data);
-
 /* ---------------------------------------------------------------------------------------------------- */
 
 static void
@@ -99,9 +101,10 @@ disk_io_monitor_init (DiskIOMonitor *monitor)
   /* Assign legends */
   cockpit_resource_monitor_set_legends (COCKPIT_RESOURCE_MONITOR (monitor), legends);
 
-  monitor->samples_prev = -1;
   monitor->samples_max = 300;
-  monitor->samples = g_new0 (Sample, monitor->samples_max);
+  monitor->series = time_series_new_archived (PACKAGE_LOCALSTATE_DIR "/lib/cockpit/samples/disk-io",
+                                              3, NULL, 0);
+  monitor->diskstats = proc_file_new ("/proc/diskstats");
 }
 
 static void
@@ -109,9 +112,9 @@ disk_io_monitor_finalize (GObject *object)
 {
   DiskIOMonitor *monitor = DISK_IO_MONITOR (object);
 
-  g_free (monitor->samples);
-
-  g_signal_handlers_disconnect_by_func (monitor->daemon, G_CALLBACK (on_tick), monitor);
+  subscriptions_free (monitor->subscriptions);
+  time_series_free (monitor->series);
+  proc_file_free (monitor->diskstats);
 
   G_OBJECT_CLASS (disk_io_monitor_parent_class)->finalize (object);
 }
@@ -160,15 +163,6 @@ disk_io_monitor_set_property (GObject *object,
 
 static void collect (DiskIOMonitor *monitor);
 
-static void
-on_tick (Daemon *daemon,
-         guint64 delta_usec,
-         gpointer user_data)
-{
-  DiskIOMonitor *monitor = DISK_IO_MONITOR (user_data);
-  collect (monitor);
-}
-
 static void
 disk_io_monitor_constructed (GObject *object)
 {
@@ -177,7 +171,8 @@ disk_io_monitor_constructed (GObject *object)
   cockpit_resource_monitor_set_num_samples (COCKPIT_RESOURCE_MONITOR (monitor), monitor->samples_max);
   cockpit_resource_monitor_set_num_series (COCKPIT_RESOURCE_MONITOR (monitor), 3);
 
-  g_signal_connect (monitor->daemon, "tick", G_CALLBACK (on_tick), monitor);
+  monitor->subscriptions = subscriptions_new_sampling (monitor, G_OBJECT (monitor->daemon), monitor->series,
+                                                      (SubscriptionsSampleFunc)collect);
   collect (monitor);
 
   if (G_OBJECT_CLASS (disk_io_monitor_parent_class)->constructed != NULL)
@@ -263,27 +258,24 @@ calc_bandwidth (DiskIOMonitor *monitor,
   return ret;
 }
 
-/* TODO: this should be optimized so we don't allocate network and call open()/close() all the time */
 static void
 collect (DiskIOMonitor *monitor)
 {
-  gchar *contents = NULL;
-  gsize len;
+  const gchar *line;
+  const gchar *pos;
   GError *error;
-  gchar **lines = NULL;
   guint n;
   gint64 now;
+  gdouble values[3];
+  Sample current = { 0, };
   Sample *sample = NULL;
   Sample *last = NULL;
-  GVariantBuilder builder;
 
   error = NULL;
-  if (!g_file_get_contents ("/proc/diskstats",
-                            &contents,
-                            &len,
-                            &error))
+  line = proc_file_read (monitor->diskstats, &error);
+  if (line == NULL)
     {
-      g_warning ("Error loading contents /proc/vmstat: %s (%s, %d)",
+      g_warning ("Error loading contents /proc/diskstats: %s (%s, %d)",
                  error->message, g_quark_to_string (error->domain), error->code);
       g_error_free (error);
       goto out;
@@ -291,27 +283,24 @@ collect (DiskIOMonitor *monitor)
 
   now = g_get_real_time ();
 
-  sample = &(monitor->samples[monitor->samples_next]);
+  sample = &current;
   sample->timestamp = now;
   sample->bytes_read = 0;
   sample->bytes_written = 0;
   sample->num_ops = 0;
 
-  if (monitor->samples_prev != -1)
-    last = &(monitor->samples[monitor->samples_prev]);
+  if (monitor->last.timestamp != 0)
+    last = &monitor->last;
 
-  lines = g_strsplit (contents, "\n", -1);
-  for (n = 0; lines != NULL && lines[n] != NULL; n++)
+  for (n = 0; line != NULL; line = proc_next_line (line), n++)
     {
-      const gchar *line = lines[n];
       guint num_parsed;
-      gint dev_major, dev_minor;
-      gchar dev_name[64]; /* TODO: big enough? */
-      guint64 num_reads,  num_reads_merged,  num_sectors_read,    num_msec_reading;
-      guint64 num_writes, num_writes_merged, num_sectors_written, num_msec_writing;
-      guint64 num_io_in_progress, num_msec_doing_io, weighted_num_msec_doing_io;
+      guint64 dev_major, dev_minor;
+      const gchar *dev_name;
+      gsize dev_len;
+      guint64 values[11];
 
-      if (strlen (line) == 0)
+      if (line[0] == '\n' || line[0] == '\0')
         continue;
 
       /* From http://www.kernel.org/doc/Documentation/iostats.txt
@@ -348,18 +337,21 @@ collect (DiskIOMonitor *monitor)
        *     I/O completion time and the backlog that may be accumulating.
        */
 
-      num_parsed = sscanf (line,
-                           "%d %d %s"
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
-                           &dev_major, &dev_minor, dev_name,
-                           &num_reads,  &num_reads_merged, &num_sectors_read, &num_msec_reading,
-                           &num_writes, &num_writes_merged, &num_sectors_written, &num_msec_writing,
-                           &num_io_in_progress, &num_msec_doing_io, &weighted_num_msec_doing_io);
+      pos = line;
+      num_parsed = 0;
+      if (proc_parse_u64 (&pos, &dev_major) &&
+          proc_parse_u64 (&pos, &dev_minor) &&
+          (dev_name = proc_parse_word (&pos, &dev_len)) != NULL)
+        {
+          for (num_parsed = 3; num_parsed < 14; num_parsed++)
+            {
+              if (!proc_parse_u64 (&pos, &values[num_parsed - 3]))
+                break;
+            }
+        }
       if (num_parsed != 14)
         {
-          g_warning ("Error parsing line %d of file /proc/diskstats (num_parsed=%d): `%s'", n, num_parsed, line);
+          g_warning ("Error parsing line %d of file /proc/diskstats (num_parsed=%d)", n, num_parsed);
           continue;
         }
 
@@ -373,12 +365,13 @@ collect (DiskIOMonitor *monitor)
       if (dev_major == 253)
         continue;
 
-      if (g_str_has_prefix (dev_name, "sd") && g_ascii_isdigit (dev_name[strlen (dev_name) - 1]))
+      if (dev_len > 2 && strncmp (dev_name, "sd", 2) == 0 && g_ascii_isdigit (dev_name[dev_len - 1]))
         continue;
 
-      sample->bytes_read += num_sectors_read * 512;
-      sample->bytes_written += num_sectors_written * 512;
-      sample->num_ops += num_reads_merged + num_writes_merged;
+      /* Fields 3 and 7 are sectors read and written, 2 and 6 merges */
+      sample->bytes_read += values[2] * 512;
+      sample->bytes_written += values[6] * 512;
+      sample->num_ops += values[1] + values[5];
     }
 
   if (last != NULL)
@@ -389,22 +382,23 @@ collect (DiskIOMonitor *monitor)
     }
 
 out:
-  g_strfreev (lines);
-  g_free (contents);
   if (sample != NULL)
     {
-      g_variant_builder_init (&builder, G_VARIANT_TYPE ("ad"));
-      g_variant_builder_add (&builder, "d", sample->bytes_read_per_sec);
-      g_variant_builder_add (&builder, "d", sample->bytes_written_per_sec);
-      g_variant_builder_add (&builder, "d", sample->io_operations_per_sec);
-      cockpit_resource_monitor_emit_new_sample (COCKPIT_RESOURCE_MONITOR(monitor),
-                                                now, g_variant_builder_end (&builder));
-    }
+      values[0] = sample->bytes_read_per_sec;
+      values[1] = sample->bytes_written_per_sec;
+      values[2] = sample->io_operations_per_sec;
+      time_series_add (monitor->series, now, values);
 
-  monitor->samples_prev = monitor->samples_next;
-  monitor->samples_next += 1;
-  if (monitor->samples_next == monitor->samples_max)
-    monitor->samples_next = 0;
+      /* Those who only want batched samples read them from the series */
+      if (subscriptions_has_subscribers (monitor->subscriptions))
+        {
+          cockpit_resource_monitor_emit_new_sample (COCKPIT_RESOURCE_MONITOR (monitor), now,
+                                                    g_variant_new_fixed_array (G_VARIANT_TYPE_DOUBLE, values,
+                                                                               G_N_ELEMENTS (values),
+                                                                               sizeof (gdouble)));
+        }
+      monitor->last = *sample;
+    }
 }
 
 /* ---------------------------------------------------------------------------------------------------- */
@@ -415,35 +409,32 @@ handle_get_samples (CockpitResourceMonitor *_monitor,
                     GVariant *arg_options)
 {
   DiskIOMonitor *monitor = DISK_IO_MONITOR (_monitor);
-  GVariantBuilder builder;
-  gint n;
-
-  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(xad)"));
-  for (n = 0; n < monitor->samples_max; n++)
-    {
-      gint pos;
-      GVariantBuilder sample_builder;
-
-      pos = monitor->samples_next + n;
-      if (pos >= monitor->samples_max)
-        pos -= monitor->samples_max;
-
-      if (monitor->samples[pos].timestamp == 0)
-        continue;
+  return time_series_handle_get_samples (monitor->series, invocation, arg_options, monitor->samples_max);
+}
 
-      g_variant_builder_init (&sample_builder, G_VARIANT_TYPE ("ad"));
-      g_variant_builder_add (&sample_builder, "d", monitor->samples[pos].bytes_read_per_sec);
-      g_variant_builder_add (&sample_builder, "d", monitor->samples[pos].bytes_written_per_sec);
-      g_variant_builder_add (&sample_builder, "d", monitor->samples[pos].io_operations_per_sec);
+static gboolean
+handle_get_samples_since (CockpitResourceMonitor *_monitor,
+                          GDBusMethodInvocation *invocation,
+                          gint64 arg_since,
+                          GVariant *arg_options)
+{
+  DiskIOMonitor *monitor = DISK_IO_MONITOR (_monitor);
+  return time_series_handle_get_samples_since (monitor->series, invocation, arg_since,
+                                               arg_options, monitor->samples_max);
+}
 
-      g_variant_builder_add (&builder, "(x@ad)",
-                             monitor->samples[pos].timestamp,
-                             g_variant_builder_end (&sample_builder));
-    }
-  cockpit_resource_monitor_complete_get_samples (_monitor, invocation,
-                                                 g_variant_builder_end (&builder));
+static gboolean
+handle_subscribe (CockpitResourceMonitor *_monitor,
+                  GDBusMethodInvocation *invocation)
+{
+  return subscriptions_handle_subscribe (DISK_IO_MONITOR (_monitor)->subscriptions, invocation);
+}
 
-  return TRUE;
+static gboolean
+handle_unsubscribe (CockpitResourceMonitor *_monitor,
+                    GDBusMethodInvocation *invocation)
+{
+  return subscriptions_handle_unsubscribe (DISK_IO_MONITOR (_monitor)->subscriptions, invocation);
 }
 
 /* ---------------------------------------------------------------------------------------------------- */
@@ -452,4 +443,7 @@ static void
 resource_monitor_iface_init (CockpitResourceMonitorIface *iface)
 {
   iface->handle_get_samples = handle_get_samples;
+  iface->handle_get_samples_since = handle_get_samples_since;
+  iface->handle_subscribe = handle_subscribe;
+  iface->handle_unsubscribe = handle_unsubscribe;
 }
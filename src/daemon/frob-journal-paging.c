@@ -0,0 +1,183 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures paging through the journal the way the journal page does,
+ * with one small query per page that seeks to the cursor the previous
+ * page ended at. Runs the pages once opening the journal for every
+ * query, and once with the journal cache that cockpitd uses.
+ *
+ * Use --directory to point it at a large test journal.
+ */
+
+#include "config.h"
+
+#include "journalcache.h"
+
+#include <glib.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+static gint opt_pages = 100;
+static gint opt_count = 50;
+
+static gint
+page_through (GVariant *match,
+              gboolean cached)
+{
+  JournalHandle *handle;
+  const gchar *previous;
+  const void *data;
+  sd_journal *j;
+  gchar *cursor = NULL;
+  gint entries = 0;
+  size_t len;
+  int skip;
+  int ret;
+  int i;
+  int n;
+
+  for (i = 0; i < opt_pages; i++)
+    {
+      handle = journal_cache_acquire (NULL, "frob", match, &ret);
+      if (!handle)
+        g_error ("couldn't open journal: %s", g_strerror (-ret));
+
+      j = journal_handle_get_journal (handle);
+      previous = journal_handle_get_cursor (handle);
+
+      /* Pages start at the entry after the previous page */
+      if (!cursor)
+        {
+          ret = sd_journal_seek_head (j);
+          skip = 1;
+        }
+      else if (previous && g_str_equal (previous, cursor))
+        {
+          /* Still at the last entry of the previous page */
+          ret = 0;
+          skip = 1;
+        }
+      else
+        {
+          ret = sd_journal_seek_cursor (j, cursor);
+          skip = 2;
+        }
+      if (ret < 0)
+        g_error ("couldn't seek: %s", g_strerror (-ret));
+
+      if (sd_journal_next_skip (j, skip) < skip)
+        {
+          journal_cache_release (handle, NULL);
+          break;
+        }
+
+      for (n = 0; n < opt_count; n++)
+        {
+          if (sd_journal_get_data (j, "MESSAGE", &data, &len) >= 0)
+            entries++;
+          if (n + 1 < opt_count && sd_journal_next (j) != 1)
+            break;
+        }
+
+      free (cursor);
+      if (sd_journal_get_cursor (j, &cursor) < 0)
+        g_error ("couldn't get cursor");
+
+      journal_cache_release (handle, cached ? cursor : NULL);
+    }
+
+  free (cursor);
+  journal_cache_forget_sender ("frob");
+  return entries;
+}
+
+static void
+measure (GVariant *match,
+         gboolean cached)
+{
+  gint64 start;
+  gint64 elapsed;
+  gint entries;
+
+  start = g_get_monotonic_time ();
+  entries = page_through (match, cached);
+  elapsed = g_get_monotonic_time () - start;
+
+  g_print ("%-8s %d entries, %.1f ms total, %.2f ms per page\n",
+           cached ? "cached" : "open", entries,
+           elapsed / 1000.0, elapsed / 1000.0 / opt_pages);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *options;
+  GError *error = NULL;
+  GVariantBuilder builder;
+  GVariant *match;
+  gint i;
+
+  gchar *opt_directory = NULL;
+  gchar **opt_matches = NULL;
+
+  GOptionEntry entries[] = {
+    { "directory", 'D', 0, G_OPTION_ARG_FILENAME, &opt_directory, "Journal directory to use", "path" },
+    { "pages", 'n', 0, G_OPTION_ARG_INT, &opt_pages, "Number of pages (100)", "count" },
+    { "count", 'c', 0, G_OPTION_ARG_INT, &opt_count, "Entries per page (50)", "count" },
+    { "match", 'm', 0, G_OPTION_ARG_STRING_ARRAY, &opt_matches, "Match entries", "FIELD=value" },
+    { NULL }
+  };
+
+  options = g_option_context_new (NULL);
+  g_option_context_add_main_entries (options, entries, NULL);
+  if (!g_option_context_parse (options, &argc, &argv, &error))
+    {
+      g_printerr ("frob-journal-paging: %s\n", error->message);
+      return 2;
+    }
+
+  if (opt_pages <= 0 || opt_count <= 0)
+    {
+      g_printerr ("frob-journal-paging: invalid number of pages or entries\n");
+      return 2;
+    }
+
+  journal_cache_set_directory (opt_directory);
+
+  /* All matches in one clause */
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("aas"));
+  g_variant_builder_open (&builder, G_VARIANT_TYPE ("as"));
+  for (i = 0; opt_matches && opt_matches[i]; i++)
+    g_variant_builder_add (&builder, "s", opt_matches[i]);
+  g_variant_builder_close (&builder);
+  match = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  g_print ("%d pages of %d entries\n", opt_pages, opt_count);
+  measure (match, FALSE);
+  measure (match, TRUE);
+
+  g_variant_unref (match);
+  g_strfreev (opt_matches);
+  g_free (opt_directory);
+  g_option_context_free (options);
+  return 0;
+}
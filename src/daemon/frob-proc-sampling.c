@@ -0,0 +1,178 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures the CPU time that collecting one round of samples from
+ * /proc/stat, /proc/meminfo, /proc/net/dev and /proc/diskstats takes,
+ * as the resource monitors do every second. Compares reading the files
+ * with g_file_get_contents(), g_strsplit() and sscanf(), as they used
+ * to, with the ProcFile readers and parsers they use now.
+ */
+
+#include "config.h"
+
+#include "procfile.h"
+
+#include <glib.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+static const gchar *paths[] = {
+  "/proc/stat",
+  "/proc/meminfo",
+  "/proc/net/dev",
+  "/proc/diskstats",
+};
+
+/* Keeps the compiler from optimizing away the parsing */
+static guint64 total = 0;
+
+static gint64
+cpu_time (void)
+{
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts) < 0)
+    g_error ("couldn't get cpu time: %s", g_strerror (errno));
+
+  return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static void
+tick_sscanf (void)
+{
+  GError *error = NULL;
+  gchar *contents;
+  gchar **lines;
+  gchar word[64];
+  guint64 values[4];
+  gint i;
+  gint n;
+
+  for (i = 0; i < G_N_ELEMENTS (paths); i++)
+    {
+      if (!g_file_get_contents (paths[i], &contents, NULL, &error))
+        g_error ("couldn't read %s: %s", paths[i], error->message);
+
+      lines = g_strsplit (contents, "\n", -1);
+      for (n = 0; lines[n] != NULL; n++)
+        {
+          if (sscanf (lines[n], "%63s %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+                      " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
+                      word, values + 0, values + 1, values + 2, values + 3) == 5)
+            total += values[0] + values[3];
+        }
+
+      g_strfreev (lines);
+      g_free (contents);
+    }
+}
+
+static void
+tick_proc_file (ProcFile **files)
+{
+  GError *error = NULL;
+  const gchar *line;
+  const gchar *pos;
+  guint64 values[4];
+  gsize length;
+  gint i;
+  gint n;
+
+  for (i = 0; i < G_N_ELEMENTS (paths); i++)
+    {
+      line = proc_file_read (files[i], &error);
+      if (!line)
+        g_error ("couldn't read %s: %s", paths[i], error->message);
+
+      for (; line != NULL; line = proc_next_line (line))
+        {
+          pos = line;
+          if (!proc_parse_word (&pos, &length))
+            continue;
+          for (n = 0; n < G_N_ELEMENTS (values); n++)
+            {
+              if (!proc_parse_u64 (&pos, values + n))
+                break;
+            }
+          if (n == G_N_ELEMENTS (values))
+            total += values[0] + values[3];
+        }
+    }
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *options;
+  GError *error = NULL;
+  ProcFile *files[G_N_ELEMENTS (paths)];
+  gint64 start;
+  gint64 sscanf_usec;
+  gint64 proc_file_usec;
+  gint i;
+
+  gint opt_ticks = 10000;
+
+  GOptionEntry entries[] = {
+    { "ticks", 'n', 0, G_OPTION_ARG_INT, &opt_ticks, "Number of ticks (10000)", "count" },
+    { NULL }
+  };
+
+  options = g_option_context_new (NULL);
+  g_option_context_add_main_entries (options, entries, NULL);
+  if (!g_option_context_parse (options, &argc, &argv, &error))
+    {
+      g_printerr ("frob-proc-sampling: %s\n", error->message);
+      return 2;
+    }
+
+  if (opt_ticks <= 0)
+    {
+      g_printerr ("frob-proc-sampling: invalid number of ticks\n");
+      return 2;
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (paths); i++)
+    files[i] = proc_file_new (paths[i]);
+
+  start = cpu_time ();
+  for (i = 0; i < opt_ticks; i++)
+    tick_sscanf ();
+  sscanf_usec = cpu_time () - start;
+
+  start = cpu_time ();
+  for (i = 0; i < opt_ticks; i++)
+    tick_proc_file (files);
+  proc_file_usec = cpu_time () - start;
+
+  g_print ("%d ticks\n", opt_ticks);
+  g_print ("sscanf    %8.1f us cpu per tick\n", (gdouble)sscanf_usec / opt_ticks);
+  g_print ("proc-file %8.1f us cpu per tick\n", (gdouble)proc_file_usec / opt_ticks);
+  g_debug ("checksum %" G_GUINT64_FORMAT, total);
+
+  for (i = 0; i < G_N_ELEMENTS (paths); i++)
+    proc_file_free (files[i]);
+  g_option_context_free (options);
+
+  return 0;
+}
@@ -28,12 +28,19 @@
 #include "daemon.h"
 #include "journal.h"
 #include "auth.h"
+#include "journalcache.h"
+
+#include "cockpit/cockpittextsearch.h"
+#include "cockpit/cockpitunixfd.h"
 
 typedef struct _JournalClass JournalClass;
 
 struct _Journal
 {
   CockpitJournalSkeleton parent_instance;
+
+  gchar *role;
+  guint wait_timeout;
 };
 
 struct _JournalClass
@@ -41,6 +48,16 @@ struct _JournalClass
   CockpitJournalSkeletonClass parent_class;
 };
 
+enum
+{
+  PROP_0,
+  PROP_ROLE,
+  PROP_WAIT_TIMEOUT
+};
+
+/* How long a waiting query waits for new entries */
+#define QUERY_WAIT_SECONDS 10
+
 static void journal_iface_init (CockpitJournalIface *iface);
 
 G_DEFINE_TYPE_WITH_CODE (Journal, journal, COCKPIT_TYPE_JOURNAL_SKELETON,
@@ -51,9 +68,36 @@ G_DEFINE_TYPE_WITH_CODE (Journal, journal, COCKPIT_TYPE_JOURNAL_SKELETON,
 static void
 journal_finalize (GObject *object)
 {
+  Journal *self = JOURNAL (object);
+
+  g_free (self->role);
+
   G_OBJECT_CLASS (journal_parent_class)->finalize (object);
 }
 
+static void
+journal_set_property (GObject *object,
+                      guint prop_id,
+                      const GValue *value,
+                      GParamSpec *pspec)
+{
+  Journal *self = JOURNAL (object);
+
+  switch (prop_id)
+    {
+    case PROP_ROLE:
+      self->role = g_value_dup_string (value);
+      break;
+    case PROP_WAIT_TIMEOUT:
+      self->wait_timeout = g_value_get_uint (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
+}
+
 static void
 journal_init (Journal *self)
 {
@@ -66,6 +110,26 @@ journal_class_init (JournalClass *klass)
 {
   GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
   gobject_class->finalize = journal_finalize;
+  gobject_class->set_property = journal_set_property;
+
+  /**
+   * Journal:role:
+   *
+   * The role a caller needs to query the journal, or %NULL to
+   * let anyone query it.
+   */
+  g_object_class_install_property (gobject_class, PROP_ROLE,
+            g_param_spec_string ("role", NULL, NULL, COCKPIT_ROLE_ADMIN,
+                                 G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * Journal:wait-timeout:
+   *
+   * Seconds that a waiting query waits for new entries
+   */
+  g_object_class_install_property (gobject_class, PROP_WAIT_TIMEOUT,
+            g_param_spec_uint ("wait-timeout", NULL, NULL, 1, G_MAXUINT, QUERY_WAIT_SECONDS,
+                               G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
 }
 
 CockpitJournal *
@@ -85,6 +149,14 @@ fail_with_errno (GDBusMethodInvocation *invocation,
   return TRUE;
 }
 
+static gboolean
+check_role (CockpitJournal *object,
+            GDBusMethodInvocation *invocation)
+{
+  Journal *self = JOURNAL (object);
+  return self->role == NULL || auth_check_sender_role (invocation, self->role);
+}
+
 static void
 cleanup_journal (sd_journal **ptr)
 {
@@ -155,62 +227,98 @@ add_field (GVariantBuilder *fields,
     g_variant_builder_add (fields, "s", "<binary>");
 }
 
-static gboolean
-handle_query (CockpitJournal *object,
-              GDBusMethodInvocation *invocation,
-              GVariant *arg_match,
-              const gchar *arg_filter_text,
-              const gchar *arg_seek,
-              gint arg_skip,
-              gint arg_count,
-              const gchar *const *arg_fields,
-              gint arg_max_field_size,
-              gboolean arg_wait)
+/*
+ * Queries can take a long time, so they run on their own thread pool,
+ * rather than the shared one that method invocations are handled in.
+ * Follow mode doesn't block a thread at all: the main loop watches the
+ * journal fd and the query goes back to the pool when something changes.
+ */
+
+#define QUERY_THREADS 4
+
+/* Entries looked at by one filtered query before it returns what it has */
+#define QUERY_MAX_SCAN 20000
+
+static void query_thread (gpointer data,
+                          gpointer user_data);
+
+static GThreadPool *
+query_pool (void)
 {
-  __attribute__ ((cleanup (cleanup_journal))) sd_journal *j = NULL;
-  int ret;
-  gboolean eof = FALSE;
-  gboolean backwards = FALSE;
-  gboolean empty = FALSE;
-  int extra_skip = 1;
-  int n = 0;
+  static gsize pool = 0;
 
-  if (!auth_check_sender_role (invocation, COCKPIT_ROLE_ADMIN))
-    return TRUE;
+  if (g_once_init_enter (&pool))
+    g_once_init_leave (&pool, (gsize)g_thread_pool_new (query_thread, NULL, QUERY_THREADS, FALSE, NULL));
 
-  ret = sd_journal_open (&j, 0);
-  if (ret < 0)
-    return fail_with_errno (invocation, "Can't open journal", -ret);
+  return (GThreadPool *)pool;
+}
 
-  GVariantIter match_iter;
-  GVariantIter *clause_iter;
-  gboolean need_disjunction = FALSE;
-  g_variant_iter_init (&match_iter, arg_match);
-  while (g_variant_iter_next (&match_iter, "as", &clause_iter))
-    {
-      if (need_disjunction)
-        {
-          ret = sd_journal_add_disjunction (j);
-          if (ret < 0)
-            return fail_with_errno (invocation, "Can't add disjunction", -ret);
-        }
+typedef struct {
+  CockpitJournal *object;
+  GDBusMethodInvocation *invocation;
+  GMainContext *context;
+
+  GVariant *match;
+  CockpitTextSearch *filter;
+  gchar **filter_fields;
+  gchar *seek;
+  gint skip;
+  gint count;
+  gchar **fields;
+  gint max_field_size;
+  gboolean wait;
+
+  /* Kept across runs while following */
+  JournalHandle *handle;
+  gchar *cursor;
+  gboolean backwards;
+  gboolean eof;
+  gboolean empty;
+  gboolean timed_out;
+  GSource *fd_source;
+  GSource *timeout_source;
+} QueryJob;
 
-      const gchar *clause;
-      while (g_variant_iter_next (clause_iter, "&s", &clause))
-        {
-          ret = sd_journal_add_match (j, clause, strlen (clause));
-          if (ret < 0)
-            {
-              g_variant_iter_free (clause_iter);
-              return fail_with_errno (invocation, "Can't add match", -ret);
-            }
-        }
+static void
+query_job_free (QueryJob *job)
+{
+  g_assert (job->fd_source == NULL);
+  g_assert (job->timeout_source == NULL);
+
+  g_object_unref (job->object);
+  g_object_unref (job->invocation);
+  g_main_context_unref (job->context);
+  g_variant_unref (job->match);
+  cockpit_text_search_free (job->filter);
+  g_strfreev (job->filter_fields);
+  g_free (job->seek);
+  g_strfreev (job->fields);
+  if (job->handle)
+    journal_cache_release (job->handle, job->cursor);
+  g_free (job->cursor);
+  g_slice_free (QueryJob, job);
+}
 
-      need_disjunction = TRUE;
-      g_variant_iter_free (clause_iter);
-    }
+static gboolean
+query_start (QueryJob *job)
+{
+  GDBusMethodInvocation *invocation = job->invocation;
+  const gchar *arg_seek = job->seek;
+  const gchar *cursor;
+  sd_journal *j;
+  int extra_skip = 1;
+  int ret = 0;
+
+  job->handle = journal_cache_acquire (g_dbus_method_invocation_get_connection (invocation),
+                                       g_dbus_method_invocation_get_sender (invocation),
+                                       job->match, &ret);
+  if (!job->handle)
+    return fail_with_errno (invocation, "Can't open journal", -ret);
 
-  ret = sd_journal_set_data_threshold (j, arg_max_field_size);
+  j = journal_handle_get_journal (job->handle);
+  cursor = journal_handle_get_cursor (job->handle);
+
+  ret = sd_journal_set_data_threshold (j, job->max_field_size);
   if (ret < 0)
     return fail_with_errno (invocation, "Can't set data limit", -ret);
 
@@ -220,6 +328,13 @@ handle_query (CockpitJournal *object,
     {
       ret = sd_journal_seek_head (j);
     }
+  else if (cursor && job->skip >= 0 && strcmp (arg_seek, cursor) == 0)
+    {
+      /* Paging on from where the last query left this journal, which
+         is already at the entry rather than just before it */
+      ret = 0;
+      extra_skip = 0;
+    }
   else if (strcmp (arg_seek, "tail") == 0)
     {
       ret = sd_journal_seek_tail (j);
@@ -263,52 +378,153 @@ handle_query (CockpitJournal *object,
      because of the way the journal API works.  We will also wait if
      necessary.
   */
-  if (arg_skip < 0)
+  if (job->skip < 0)
     {
-      backwards = TRUE;
-      arg_skip = -arg_skip;
+      job->backwards = TRUE;
+      job->skip = -job->skip;
 
-      ret = sd_journal_previous_skip (j, arg_skip);
+      ret = sd_journal_previous_skip (j, job->skip);
       if (ret < 0)
         return fail_with_errno (invocation, "Can't skip", -ret);
 
-      empty = (ret == 0);
+      job->empty = (ret == 0);
 
-      if (ret < arg_skip)
+      if (ret < job->skip)
         {
-          eof = TRUE;
-          if (arg_count > arg_skip)
-            arg_count = arg_skip;
-          arg_count -= arg_skip - ret;
+          job->eof = TRUE;
+          if (job->count > job->skip)
+            job->count = job->skip;
+          job->count -= job->skip - ret;
         }
+
+      job->skip = 0;
     }
   else
     {
-      arg_skip += extra_skip;
-again:
-      ret = sd_journal_next_skip (j, arg_skip);
-      if (ret < 0)
-        return fail_with_errno (invocation, "Can't skip", -ret);
+      job->skip += extra_skip;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+is_field_name (const gchar *name)
+{
+  const gchar *p;
 
-      arg_skip -= ret;
-      if (arg_skip > 0)
+  if (!name[0] || g_ascii_isdigit (name[0]))
+    return FALSE;
+  for (p = name; *p; p++)
+    {
+      if (!g_ascii_isupper (*p) && !g_ascii_isdigit (*p) && *p != '_')
+        return FALSE;
+    }
+  return TRUE;
+}
+
+/*
+ * A filter text of the form "FIELD=text" or "FIELD,FIELD=text" only
+ * looks at those fields, which saves decompressing all the others.
+ * Case is ignored unless the text has upper case letters.
+ */
+static void
+query_parse_filter (QueryJob *job,
+                    const gchar *filter_text)
+{
+  const gchar *text = filter_text;
+  const gchar *equals;
+  gchar **fields;
+  gchar *names;
+  gint i;
+
+  if (!filter_text || !filter_text[0])
+    return;
+
+  equals = strchr (filter_text, '=');
+  if (equals)
+    {
+      names = g_strndup (filter_text, equals - filter_text);
+      fields = g_strsplit (names, ",", -1);
+      g_free (names);
+
+      for (i = 0; fields[i]; i++)
         {
-          if (arg_wait)
-            {
-              ret = sd_journal_wait (j, 10 * 1000 * 1000);
-              if (ret < 0)
-                return fail_with_errno (invocation, "Can't wait", -ret);
-              if (ret != SD_JOURNAL_NOP)
-                goto again;
-            }
-          eof = TRUE;
-          arg_count = 0;
-          empty = TRUE;
+          if (!is_field_name (fields[i]))
+            break;
+        }
+
+      if (i > 0 && fields[i] == NULL)
+        {
+          job->filter_fields = fields;
+          text = equals + 1;
+        }
+      else
+        {
+          g_strfreev (fields);
         }
     }
 
+  job->filter = cockpit_text_search_new (text, COCKPIT_TEXT_SEARCH_SMART_CASE);
+}
+
+static gboolean
+query_entry_matches (QueryJob *job,
+                     sd_journal *j)
+{
+  const void *data;
+  const gchar *value;
+  size_t prefix;
+  size_t len;
+  gint i;
+
+  if (!job->filter)
+    return TRUE;
+
+  if (job->filter_fields)
+    {
+      for (i = 0; job->filter_fields[i]; i++)
+        {
+          if (sd_journal_get_data (j, job->filter_fields[i], &data, &len) < 0)
+            continue;
+          prefix = strlen (job->filter_fields[i]) + 1;
+          if (len >= prefix &&
+              cockpit_text_search_match (job->filter, (const gchar *)data + prefix, len - prefix))
+            return TRUE;
+        }
+      return FALSE;
+    }
+
+  sd_journal_restart_data (j);
+  while (sd_journal_enumerate_data (j, &data, &len) > 0)
+    {
+      /* Only look at the value, not the field name */
+      value = memchr (data, '=', len);
+      if (value)
+        {
+          value++;
+          len -= value - (const gchar *)data;
+          data = value;
+        }
+      if (cockpit_text_search_match (job->filter, data, len))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+query_entries (QueryJob *job)
+{
+  GDBusMethodInvocation *invocation = job->invocation;
+  gint arg_max_field_size = job->max_field_size;
+  gchar **arg_fields = job->fields;
+  sd_journal *j = journal_handle_get_journal (job->handle);
+  int scanned = 0;
+  int n = 0;
+  int ret;
+
   gs_free char *first_cursor = NULL;
-  if (!empty)
+  if (!job->empty)
     {
       ret = sd_journal_get_cursor (j, &first_cursor);
       if (ret < 0)
@@ -320,24 +536,12 @@ again:
   GVariantBuilder entries;
   g_variant_builder_init (&entries, G_VARIANT_TYPE ("aas"));
 
-  while (n < arg_count)
+  while (n < job->count)
     {
       gboolean include;
 
-      if (arg_filter_text && *arg_filter_text)
-        {
-          const void *data;
-          size_t len;
-          size_t text_len = strlen (arg_filter_text);
-
-          // Skip this entry if none of the fields contain the text.
-          include = FALSE;
-          while (sd_journal_enumerate_data (j, &data, &len) > 0 && !include)
-            if (memmem (data, len, arg_filter_text, text_len))
-              include = TRUE;
-        }
-      else
-        include = TRUE;
+      scanned += 1;
+      include = query_entry_matches (job, j);
 
       if (include)
         {
@@ -406,60 +610,237 @@ again:
           g_variant_builder_add (&entries, "as", &fields);
         }
 
-      n += 1;
+      /* Entries that are filtered out don't count, except when going
+         backwards, where 'count' is the window that was asked for */
+      if (include || job->backwards)
+        n += 1;
 
-      if (n >= arg_count)
+      if (n >= job->count || (job->filter && scanned >= QUERY_MAX_SCAN))
         break;
 
       if (sd_journal_next (j) != 1)
         {
-          if (!backwards)
-            eof = TRUE;
+          if (!job->backwards)
+            job->eof = TRUE;
           break;
         }
     }
 
   gs_free char *last_cursor = NULL;
-  if (!empty)
+  if (!job->empty)
     {
       ret = sd_journal_get_cursor (j, &last_cursor);
       if (ret < 0)
-        return fail_with_errno (invocation, "Can't get last cursor", -ret);
+        {
+          g_variant_builder_clear (&entries);
+          return fail_with_errno (invocation, "Can't get last cursor", -ret);
+        }
     }
   else
     last_cursor = g_strdup ("");
 
-  cockpit_journal_complete_query (object, invocation,
+  /* Lets the next page continue from here */
+  if (!job->empty)
+    job->cursor = g_strdup (last_cursor);
+  else if (sd_journal_get_cursor (j, &job->cursor) < 0)
+    job->cursor = NULL;
+
+  cockpit_journal_complete_query (job->object, invocation,
                                   g_variant_builder_end (&entries),
                                   first_cursor,
                                   last_cursor,
-                                  eof);
+                                  job->eof,
+                                  scanned);
+  return TRUE;
+}
+
+/*
+ * Returns TRUE when the invocation has been completed, and FALSE
+ * when the query should wait for the journal to change.
+ */
+static gboolean
+query_run (QueryJob *job)
+{
+  int ret;
+
+  if (!job->handle)
+    {
+      if (query_start (job))
+        return TRUE;
+    }
+
+  if (job->skip > 0)
+    {
+      ret = sd_journal_next_skip (journal_handle_get_journal (job->handle), job->skip);
+      if (ret < 0)
+        return fail_with_errno (job->invocation, "Can't skip", -ret);
+
+      job->skip -= ret;
+      if (job->skip > 0)
+        {
+          if (job->wait && !job->timed_out)
+            return FALSE;
+          job->eof = TRUE;
+          job->count = 0;
+          job->empty = TRUE;
+        }
+    }
+
+  return query_entries (job);
+}
+
+static void
+query_stop_waiting (QueryJob *job)
+{
+  g_source_destroy (job->fd_source);
+  g_source_unref (job->fd_source);
+  job->fd_source = NULL;
+  g_source_destroy (job->timeout_source);
+  g_source_unref (job->timeout_source);
+  job->timeout_source = NULL;
+}
+
+static gboolean
+on_query_journal_changed (gint fd,
+                          GIOCondition cond,
+                          gpointer user_data)
+{
+  QueryJob *job = user_data;
+
+  /* The query isn't running, so it's fine to touch the journal here */
+  if (sd_journal_process (journal_handle_get_journal (job->handle)) == SD_JOURNAL_NOP)
+    return TRUE;
+
+  query_stop_waiting (job);
+  g_thread_pool_push (query_pool (), job, NULL);
+  return FALSE;
+}
+
+static gboolean
+on_query_timeout (gpointer user_data)
+{
+  QueryJob *job = user_data;
+
+  job->timed_out = TRUE;
+  query_stop_waiting (job);
+  g_thread_pool_push (query_pool (), job, NULL);
+  return FALSE;
+}
+
+static gboolean
+on_query_wait (gpointer user_data)
+{
+  QueryJob *job = user_data;
+
+  job->fd_source = cockpit_unix_fd_source_new (sd_journal_get_fd (journal_handle_get_journal (job->handle)), G_IO_IN);
+  g_source_set_callback (job->fd_source, (GSourceFunc)on_query_journal_changed, job, NULL);
+  g_source_attach (job->fd_source, job->context);
+
+  job->timeout_source = g_timeout_source_new_seconds (JOURNAL (job->object)->wait_timeout);
+  g_source_set_callback (job->timeout_source, on_query_timeout, job, NULL);
+  g_source_attach (job->timeout_source, job->context);
+
+  return FALSE;
+}
+
+static void
+query_thread (gpointer data,
+              gpointer user_data)
+{
+  QueryJob *job = data;
+
+  if (query_run (job))
+    query_job_free (job);
+  else
+    g_main_context_invoke (job->context, on_query_wait, job);
+}
+
+static gboolean
+handle_query (CockpitJournal *object,
+              GDBusMethodInvocation *invocation,
+              GVariant *arg_match,
+              const gchar *arg_filter_text,
+              const gchar *arg_seek,
+              gint arg_skip,
+              gint arg_count,
+              const gchar *const *arg_fields,
+              gint arg_max_field_size,
+              gboolean arg_wait)
+{
+  QueryJob *job;
+
+  if (!check_role (object, invocation))
+    return TRUE;
+
+  job = g_slice_new0 (QueryJob);
+  job->object = g_object_ref (object);
+  job->invocation = g_object_ref (invocation);
+  job->context = g_main_context_ref (g_main_context_default ());
+  job->match = g_variant_ref (arg_match);
+  query_parse_filter (job, arg_filter_text);
+  job->seek = g_strdup (arg_seek);
+  job->skip = arg_skip;
+  job->count = arg_count;
+  job->fields = g_strdupv ((gchar **)arg_fields);
+  job->max_field_size = arg_max_field_size;
+  job->wait = arg_wait;
+
+  g_thread_pool_push (query_pool (), job, NULL);
   return TRUE;
 }
 
+static void
+release_unique_journal (JournalHandle *handle)
+{
+  sd_journal *j = journal_handle_get_journal (handle);
+  gs_free char *cursor = NULL;
+
+  /* The cache keeps journals that are at an entry, a new one isn't yet */
+  if (sd_journal_get_cursor (j, &cursor) < 0 &&
+      sd_journal_next (j) > 0)
+    sd_journal_get_cursor (j, &cursor);
+
+  journal_cache_release (handle, cursor);
+}
+
 static gboolean
 handle_query_unique (CockpitJournal *object,
                      GDBusMethodInvocation *invocation,
                      const gchar *arg_field,
                      int arg_max_len)
 {
-  __attribute__ ((cleanup (cleanup_journal))) sd_journal *j = NULL;
-  int ret;
+  JournalHandle *handle;
+  GVariant *match;
+  sd_journal *j;
+  int ret = 0;
 
-  if (!auth_check_sender_role (invocation, COCKPIT_ROLE_ADMIN))
+  if (!check_role (object, invocation))
     return TRUE;
 
-  ret = sd_journal_open (&j, 0);
-  if (ret < 0)
+  /* The same journal as unfiltered queries of this client use */
+  match = g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE ("as"), NULL, 0));
+  handle = journal_cache_acquire (g_dbus_method_invocation_get_connection (invocation),
+                                  g_dbus_method_invocation_get_sender (invocation),
+                                  match, &ret);
+  g_variant_unref (match);
+  if (!handle)
     return fail_with_errno (invocation, "Can't open journal", -ret);
 
+  j = journal_handle_get_journal (handle);
+
   ret = sd_journal_set_data_threshold (j, arg_max_len);
   if (ret < 0)
-    return fail_with_errno (invocation, "Can't set data limit", -ret);
+    {
+      journal_cache_release (handle, NULL);
+      return fail_with_errno (invocation, "Can't set data limit", -ret);
+    }
 
   ret = sd_journal_query_unique (j, arg_field);
   if (ret < 0)
-    return fail_with_errno (invocation, "Can't query unique values", -ret);
+    {
+      journal_cache_release (handle, NULL);
+      return fail_with_errno (invocation, "Can't query unique values", -ret);
+    }
 
   GVariantBuilder values;
   g_variant_builder_init (&values, G_VARIANT_TYPE ("as"));
@@ -481,6 +862,9 @@ handle_query_unique (CockpitJournal *object,
         }
     }
 
+  sd_journal_restart_unique (j);
+  release_unique_journal (handle);
+
   cockpit_journal_complete_query_unique (object, invocation, g_variant_builder_end (&values));
   return TRUE;
 }
@@ -0,0 +1,458 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "journalcache.h"
+
+#include <string.h>
+
+/*
+ * Opening the journal maps every journal file, which is far more
+ * expensive than the small queries the journal page pages with. So
+ * handles are kept open per D-Bus sender and match set, along with the
+ * cursor where the last query left off. They are closed when unused for
+ * a while, or when the sender goes away.
+ */
+
+#define HANDLES_PER_SENDER 4
+#define MAX_IDLE_SECONDS 60
+#define EXPIRE_SECONDS 30
+
+struct _JournalHandle {
+  gchar *sender;
+  gchar *key;
+  sd_journal *journal;
+  gchar *cursor;
+  gint64 last_used;
+};
+
+G_LOCK_DEFINE_STATIC (cache);
+
+/* sender -> GQueue of idle JournalHandle, most recently used first */
+static GHashTable *senders = NULL;
+static guint name_subscription = 0;
+static guint expire_timeout = 0;
+static gchar *cache_directory = NULL;
+
+static void
+journal_handle_free (gpointer data)
+{
+  JournalHandle *handle = data;
+  if (handle->journal)
+    sd_journal_close (handle->journal);
+  g_free (handle->sender);
+  g_free (handle->key);
+  g_free (handle->cursor);
+  g_slice_free (JournalHandle, handle);
+}
+
+static gint
+compare_strings (gconstpointer a,
+                 gconstpointer b)
+{
+  return strcmp (*(const gchar **)a, *(const gchar **)b);
+}
+
+/*
+ * Matches within a clause and the clauses themselves are unordered,
+ * so sort both. Each string is prefixed with its length to keep the
+ * key unambiguous.
+ */
+static gchar *
+canonical_match_key (GVariant *match)
+{
+  GPtrArray *clauses;
+  GPtrArray *matches;
+  GVariantIter match_iter;
+  GVariantIter *clause_iter;
+  const gchar *clause;
+  GString *string;
+  guint i;
+
+  clauses = g_ptr_array_new_with_free_func (g_free);
+
+  g_variant_iter_init (&match_iter, match);
+  while (g_variant_iter_next (&match_iter, "as", &clause_iter))
+    {
+      matches = g_ptr_array_new ();
+      while (g_variant_iter_next (clause_iter, "&s", &clause))
+        g_ptr_array_add (matches, (gpointer)clause);
+      g_ptr_array_sort (matches, compare_strings);
+
+      string = g_string_new ("(");
+      for (i = 0; i < matches->len; i++)
+        {
+          clause = matches->pdata[i];
+          g_string_append_printf (string, "%u:%s", (guint)strlen (clause), clause);
+        }
+      g_string_append_c (string, ')');
+      g_ptr_array_add (clauses, g_string_free (string, FALSE));
+
+      g_ptr_array_free (matches, TRUE);
+      g_variant_iter_free (clause_iter);
+    }
+
+  g_ptr_array_sort (clauses, compare_strings);
+
+  string = g_string_new ("");
+  for (i = 0; i < clauses->len; i++)
+    g_string_append (string, clauses->pdata[i]);
+
+  g_ptr_array_free (clauses, TRUE);
+  return g_string_free (string, FALSE);
+}
+
+static int
+open_journal (GVariant *match,
+              sd_journal **journal)
+{
+  GVariantIter match_iter;
+  GVariantIter *clause_iter;
+  gboolean need_disjunction = FALSE;
+  const gchar *clause;
+  sd_journal *j = NULL;
+  int ret;
+
+  if (cache_directory)
+    ret = sd_journal_open_directory (&j, cache_directory, 0);
+  else
+    ret = sd_journal_open (&j, 0);
+  if (ret < 0)
+    return ret;
+
+  /*
+   * Without the inotify watches a journal never notices new files, and
+   * a handle that lives a while would miss entries after a rotation.
+   */
+  ret = sd_journal_get_fd (j);
+  if (ret < 0)
+    goto out;
+
+  g_variant_iter_init (&match_iter, match);
+  while (g_variant_iter_next (&match_iter, "as", &clause_iter))
+    {
+      if (need_disjunction)
+        ret = sd_journal_add_disjunction (j);
+
+      while (ret >= 0 && g_variant_iter_next (clause_iter, "&s", &clause))
+        ret = sd_journal_add_match (j, clause, strlen (clause));
+
+      need_disjunction = TRUE;
+      g_variant_iter_free (clause_iter);
+      if (ret < 0)
+        goto out;
+    }
+
+  ret = 0;
+
+out:
+  if (ret < 0)
+    sd_journal_close (j);
+  else
+    *journal = j;
+  return ret;
+}
+
+static void
+on_name_owner_changed (GDBusConnection *connection,
+                       const gchar *sender_name,
+                       const gchar *object_path,
+                       const gchar *interface_name,
+                       const gchar *signal_name,
+                       GVariant *parameters,
+                       gpointer user_data)
+{
+  const gchar *name;
+  const gchar *new_owner;
+
+  g_variant_get (parameters, "(&s&s&s)", &name, NULL, &new_owner);
+  if (name[0] == ':' && new_owner[0] == '\0')
+    journal_cache_forget_sender (name);
+}
+
+static gboolean
+on_expire_timeout (gpointer user_data)
+{
+  gboolean ret;
+
+  journal_cache_expire (MAX_IDLE_SECONDS * G_USEC_PER_SEC);
+
+  G_LOCK (cache);
+  ret = (senders != NULL && g_hash_table_size (senders) > 0);
+  if (!ret)
+    expire_timeout = 0;
+  G_UNLOCK (cache);
+
+  return ret;
+}
+
+/**
+ * journal_cache_acquire:
+ * @connection: (allow-none): connection the sender is on
+ * @sender: (allow-none): unique bus name of the client
+ * @match: the matches as an 'aas' variant, clauses of conjunctions
+ * @error: location to place a negative errno
+ *
+ * Get a journal with the given matches for exclusive use, either one
+ * that the same sender used before, or a newly opened one. Without a
+ * @sender the journal is not cached.
+ *
+ * Returns: (transfer full): the handle or %NULL
+ */
+JournalHandle *
+journal_cache_acquire (GDBusConnection *connection,
+                       const gchar *sender,
+                       GVariant *match,
+                       int *error)
+{
+  JournalHandle *handle = NULL;
+  GQueue *queue;
+  gchar *key;
+  GList *l;
+  int ret;
+
+  key = canonical_match_key (match);
+
+  G_LOCK (cache);
+
+  if (sender && senders)
+    {
+      queue = g_hash_table_lookup (senders, sender);
+      for (l = queue ? queue->head : NULL; l != NULL; l = g_list_next (l))
+        {
+          handle = l->data;
+          if (g_str_equal (handle->key, key))
+            {
+              g_queue_delete_link (queue, l);
+              break;
+            }
+          handle = NULL;
+        }
+    }
+
+  if (sender && connection && !name_subscription)
+    {
+      name_subscription = g_dbus_connection_signal_subscribe (connection, "org.freedesktop.DBus",
+                                                              "org.freedesktop.DBus", "NameOwnerChanged",
+                                                              "/org/freedesktop/DBus", NULL,
+                                                              G_DBUS_SIGNAL_FLAGS_NONE,
+                                                              on_name_owner_changed, NULL, NULL);
+    }
+
+  G_UNLOCK (cache);
+
+  if (handle)
+    {
+      g_free (key);
+
+      /* Pick up new and rotated files, the position may not survive that */
+      if (sd_journal_process (handle->journal) == SD_JOURNAL_INVALIDATE)
+        {
+          g_free (handle->cursor);
+          handle->cursor = NULL;
+        }
+
+      return handle;
+    }
+
+  handle = g_slice_new0 (JournalHandle);
+  handle->sender = g_strdup (sender);
+  handle->key = key;
+
+  ret = open_journal (match, &handle->journal);
+  if (ret < 0)
+    {
+      journal_handle_free (handle);
+      if (error)
+        *error = ret;
+      return NULL;
+    }
+
+  return handle;
+}
+
+/**
+ * journal_handle_get_journal:
+ * @handle: an acquired handle
+ *
+ * Returns: (transfer none): the journal, with the matches added
+ */
+sd_journal *
+journal_handle_get_journal (JournalHandle *handle)
+{
+  g_return_val_if_fail (handle != NULL, NULL);
+  return handle->journal;
+}
+
+/**
+ * journal_handle_get_cursor:
+ * @handle: an acquired handle
+ *
+ * Returns: the cursor of the entry the journal was left at when
+ *          it was released, or %NULL for a new journal
+ */
+const gchar *
+journal_handle_get_cursor (JournalHandle *handle)
+{
+  g_return_val_if_fail (handle != NULL, NULL);
+  return handle->cursor;
+}
+
+/**
+ * journal_cache_release:
+ * @handle: (transfer full): an acquired handle
+ * @cursor: (allow-none): cursor of the current entry
+ *
+ * Give back a handle once done with it. The journal must be at the
+ * entry @cursor points to. Without a @cursor the journal is closed,
+ * which is what to do when a query failed half way.
+ */
+void
+journal_cache_release (JournalHandle *handle,
+                       const gchar *cursor)
+{
+  JournalHandle *evicted = NULL;
+  GQueue *queue;
+
+  g_return_if_fail (handle != NULL);
+
+  if (!handle->sender || !cursor)
+    {
+      journal_handle_free (handle);
+      return;
+    }
+
+  g_free (handle->cursor);
+  handle->cursor = g_strdup (cursor);
+  handle->last_used = g_get_monotonic_time ();
+
+  G_LOCK (cache);
+
+  if (!senders)
+    {
+      senders = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                       (GDestroyNotify)g_queue_free);
+    }
+
+  queue = g_hash_table_lookup (senders, handle->sender);
+  if (!queue)
+    {
+      queue = g_queue_new ();
+      g_hash_table_insert (senders, g_strdup (handle->sender), queue);
+    }
+
+  g_queue_push_head (queue, handle);
+  if (g_queue_get_length (queue) > HANDLES_PER_SENDER)
+    evicted = g_queue_pop_tail (queue);
+
+  if (!expire_timeout)
+    expire_timeout = g_timeout_add_seconds (EXPIRE_SECONDS, on_expire_timeout, NULL);
+
+  G_UNLOCK (cache);
+
+  if (evicted)
+    journal_handle_free (evicted);
+}
+
+/**
+ * journal_cache_forget_sender:
+ * @sender: unique bus name
+ *
+ * Close all the idle journals of a sender that has gone away.
+ */
+void
+journal_cache_forget_sender (const gchar *sender)
+{
+  GQueue *queue = NULL;
+  gpointer key;
+
+  G_LOCK (cache);
+  if (senders && g_hash_table_lookup_extended (senders, sender, &key, (gpointer *)&queue))
+    {
+      g_hash_table_steal (senders, sender);
+      g_free (key);
+    }
+  G_UNLOCK (cache);
+
+  if (queue)
+    {
+      g_debug ("%s: closing %u cached journals", sender, g_queue_get_length (queue));
+      g_queue_free_full (queue, journal_handle_free);
+    }
+}
+
+/**
+ * journal_cache_expire:
+ * @max_idle: microseconds
+ *
+ * Close the journals that haven't been used for @max_idle.
+ *
+ * Returns: the number of journals closed
+ */
+guint
+journal_cache_expire (gint64 max_idle)
+{
+  GHashTableIter iter;
+  GSList *expired = NULL;
+  JournalHandle *handle;
+  GQueue *queue;
+  gint64 now;
+  guint count;
+
+  now = g_get_monotonic_time ();
+
+  G_LOCK (cache);
+  if (senders)
+    {
+      g_hash_table_iter_init (&iter, senders);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&queue))
+        {
+          /* Least recently used are at the tail */
+          while ((handle = g_queue_peek_tail (queue)) != NULL &&
+                 now - handle->last_used >= max_idle)
+            {
+              expired = g_slist_prepend (expired, g_queue_pop_tail (queue));
+            }
+          if (g_queue_is_empty (queue))
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+  G_UNLOCK (cache);
+
+  count = g_slist_length (expired);
+  g_slist_free_full (expired, journal_handle_free);
+  return count;
+}
+
+/**
+ * journal_cache_set_directory:
+ * @directory: (allow-none): a directory with journal files
+ *
+ * Open journals from @directory rather than the system journal.
+ * Used for testing.
+ */
+void
+journal_cache_set_directory (const gchar *directory)
+{
+  G_LOCK (cache);
+  g_free (cache_directory);
+  cache_directory = g_strdup (directory);
+  G_UNLOCK (cache);
+}
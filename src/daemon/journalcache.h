@@ -0,0 +1,52 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COCKPIT_JOURNAL_CACHE_H__
+#define COCKPIT_JOURNAL_CACHE_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <systemd/sd-journal.h>
+
+G_BEGIN_DECLS
+
+typedef struct _JournalHandle JournalHandle;
+
+JournalHandle *   journal_cache_acquire        (GDBusConnection *connection,
+                                                const gchar *sender,
+                                                GVariant *match,
+                                                int *error);
+
+sd_journal *      journal_handle_get_journal   (JournalHandle *handle);
+
+const gchar *     journal_handle_get_cursor    (JournalHandle *handle);
+
+void              journal_cache_release        (JournalHandle *handle,
+                                                const gchar *cursor);
+
+void              journal_cache_forget_sender  (const gchar *sender);
+
+guint             journal_cache_expire         (gint64 max_idle);
+
+void              journal_cache_set_directory  (const gchar *directory);
+
+G_END_DECLS
+
+#endif /* COCKPIT_JOURNAL_CACHE_H__ */
@@ -34,6 +34,7 @@
 #include "auth.h"
 #include "manager.h"
 #include "utils.h"
+#include "subscriptions.h"
 
 /**
  * SECTION:manager
@@ -648,6 +649,86 @@ out:
 
 /* ---------------------------------------------------------------------------------------------------- */
 
+/* RESOURCE MONITORS
+ */
+
+static TimeSeries *
+lookup_resource_series (Manager *manager,
+                        const gchar *path,
+                        guint *num_samples)
+{
+  GDBusObjectManager *object_manager;
+  Subscriptions *subscriptions;
+  GDBusInterface *iface;
+  TimeSeries *series = NULL;
+
+  object_manager = G_DBUS_OBJECT_MANAGER (daemon_get_object_manager (manager->daemon));
+  iface = g_dbus_object_manager_get_interface (object_manager, path, "com.redhat.Cockpit.ResourceMonitor");
+  if (iface == NULL)
+    return NULL;
+
+  subscriptions = subscriptions_get_for_monitor (iface);
+  if (subscriptions)
+    series = subscriptions_get_series (subscriptions);
+
+  *num_samples = cockpit_resource_monitor_get_num_samples (COCKPIT_RESOURCE_MONITOR (iface));
+  g_object_unref (iface);
+  return series;
+}
+
+static gboolean
+handle_get_resource_samples_since (CockpitManager *object,
+                                   GDBusMethodInvocation *invocation,
+                                   GVariant *arg_requests)
+{
+  Manager *manager = MANAGER (object);
+  GVariantBuilder builder;
+  GVariantIter iter;
+  GError *error = NULL;
+  TimeSeries *series;
+  const gchar *path;
+  GVariant *options;
+  GVariant *samples;
+  guint num_samples;
+  gint64 since;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{o(axad)}"));
+
+  g_variant_iter_init (&iter, arg_requests);
+  while (error == NULL &&
+         g_variant_iter_next (&iter, "{&o(x@a{sv})}", &path, &since, &options))
+    {
+      series = lookup_resource_series (manager, path, &num_samples);
+      if (series == NULL)
+        {
+          g_set_error (&error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                       "No resource monitor at %s", path);
+        }
+      else
+        {
+          samples = time_series_build_samples_since (series, since, options, num_samples, &error);
+          if (samples)
+            g_variant_builder_add (&builder, "{o@(axad)}", path, samples);
+        }
+      g_variant_unref (options);
+    }
+
+  if (error)
+    {
+      g_variant_builder_clear (&builder);
+      g_dbus_method_invocation_take_error (invocation, error);
+    }
+  else
+    {
+      cockpit_manager_complete_get_resource_samples_since (object, invocation,
+                                                           g_variant_builder_end (&builder));
+    }
+
+  return TRUE;
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
 /* SHUTDOWN & RESTART
  */
 
@@ -836,6 +917,7 @@ manager_iface_init (CockpitManagerIface *iface)
   iface->handle_set_avatar_data_url = handle_set_avatar_data_url;
 
   iface->handle_get_server_time = handle_get_server_time;
+  iface->handle_get_resource_samples_since = handle_get_resource_samples_since;
   iface->handle_shutdown = handle_shutdown;
   iface->handle_cancel_shutdown = handle_cancel_shutdown;
 }
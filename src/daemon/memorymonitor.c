@@ -19,11 +19,13 @@
 
 #include "config.h"
 
-#include <stdio.h>
 #include <unistd.h>
 
 #include "daemon.h"
 #include "memorymonitor.h"
+#include "procfile.h"
+#include "subscriptions.h"
+#include "timeseries.h"
 
 /**
  * SECTION:memorymonitor
@@ -55,13 +57,14 @@ struct _MemoryMonitor
   CockpitResourceMonitorSkeleton parent_instance;
 
   Daemon *daemon;
+  Subscriptions *subscriptions;
+  ProcFile *meminfo;
 
+  /* Number of samples returned by GetSamples() without options */
   guint samples_max;
-  gint samples_prev;
-  guint samples_next;
 
-  /* Arrays of samples_max Sample instances */
-  Sample *samples;
+  /* History of (free, used, cached, swap used) */
+  TimeSeries *series;
 };
 
 struct _MemoryMonitorClass
@@ -80,10 +83,6 @@ static void resource_monitor_iface_init (CockpitResourceMonitorIface *iface);
 G_DEFINE_TYPE_WITH_CODE (MemoryMonitor, memory_monitor, COCKPIT_TYPE_RESOURCE_MONITOR_SKELETON,
                          G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_RESOURCE_MONITOR, resource_monitor_iface_init));
 
-static void on_tick (Daemon  *daemon,
-                     guint64     delta_usec,
-                     gpointer    user_data);
-
 /* ---------------------------------------------------------------------------------------------------- */
 
 static void
@@ -94,9 +93,10 @@ memory_monitor_init (MemoryMonitor *monitor)
   /* Assign legends */
   cockpit_resource_monitor_set_legends (COCKPIT_RESOURCE_MONITOR (monitor), legends);
 
-  monitor->samples_prev = -1;
   monitor->samples_max = 300;
-  monitor->samples = g_new0 (Sample, monitor->samples_max);
+  monitor->series = time_series_new_archived (PACKAGE_LOCALSTATE_DIR "/lib/cockpit/samples/memory",
+                                              4, NULL, 0);
+  monitor->meminfo = proc_file_new ("/proc/meminfo");
 }
 
 static void
@@ -104,9 +104,9 @@ memory_monitor_finalize (GObject *object)
 {
   MemoryMonitor *monitor = MEMORY_MONITOR (object);
 
-  g_free (monitor->samples);
-
-  g_signal_handlers_disconnect_by_func (monitor->daemon, G_CALLBACK (on_tick), monitor);
+  subscriptions_free (monitor->subscriptions);
+  time_series_free (monitor->series);
+  proc_file_free (monitor->meminfo);
 
   G_OBJECT_CLASS (memory_monitor_parent_class)->finalize (object);
 }
@@ -155,15 +155,6 @@ memory_monitor_set_property (GObject *object,
 
 static void collect (MemoryMonitor *monitor);
 
-static void
-on_tick (Daemon *daemon,
-         guint64 delta_usec,
-         gpointer user_data)
-{
-  MemoryMonitor *monitor = MEMORY_MONITOR (user_data);
-  collect (monitor);
-}
-
 static void
 memory_monitor_constructed (GObject *object)
 {
@@ -172,7 +163,8 @@ memory_monitor_constructed (GObject *object)
   cockpit_resource_monitor_set_num_samples (COCKPIT_RESOURCE_MONITOR (monitor), monitor->samples_max);
   cockpit_resource_monitor_set_num_series (COCKPIT_RESOURCE_MONITOR (monitor), 4);
 
-  g_signal_connect (monitor->daemon, "tick", G_CALLBACK (on_tick), monitor);
+  monitor->subscriptions = subscriptions_new_sampling (monitor, G_OBJECT (monitor->daemon), monitor->series,
+                                                      (SubscriptionsSampleFunc)collect);
   collect (monitor);
 
   if (G_OBJECT_CLASS (memory_monitor_parent_class)->constructed != NULL)
@@ -241,18 +233,16 @@ memory_monitor_get_daemon (MemoryMonitor *monitor)
 
 /* ---------------------------------------------------------------------------------------------------- */
 
-/* TODO: this should be optimized so we don't allocate memory and call open()/close() all the time */
 static void
 collect (MemoryMonitor *monitor)
 {
-  gchar *contents = NULL;
-  gsize len;
+  const gchar *line;
+  const gchar *pos;
   GError *error;
-  gchar **lines = NULL;
-  guint n;
   gint64 now;
+  gdouble values[4];
+  Sample current = { 0, };
   Sample *sample = NULL;
-  GVariantBuilder builder;
   guint64 free_kb = 0;
   guint64 total_kb = 0;
   guint64 buffers_kb = 0;
@@ -261,10 +251,8 @@ collect (MemoryMonitor *monitor)
   guint64 swap_free_kb = 0;
 
   error = NULL;
-  if (!g_file_get_contents ("/proc/meminfo",
-                            &contents,
-                            &len,
-                            &error))
+  line = proc_file_read (monitor->meminfo, &error);
+  if (line == NULL)
     {
       g_warning ("Error loading contents /proc/meminfo: %s (%s, %d)",
                  error->message, g_quark_to_string (error->domain), error->code);
@@ -274,26 +262,42 @@ collect (MemoryMonitor *monitor)
 
   now = g_get_real_time ();
 
-  sample = &(monitor->samples[monitor->samples_next]);
+  sample = &current;
 
   /* see 'man proc' for the format of /proc/stat */
 
-  lines = g_strsplit (contents, "\n", -1);
-  for (n = 0; lines != NULL && lines[n] != NULL; n++)
+  for (; line != NULL; line = proc_next_line (line))
     {
-      const gchar *line = lines[n];
       if (g_str_has_prefix (line, "MemTotal:"))
-        g_warn_if_fail (sscanf (line + sizeof ("MemTotal:") - 1, "%" G_GUINT64_FORMAT, &total_kb) == 1);
+        {
+          pos = line + sizeof ("MemTotal:") - 1;
+          g_warn_if_fail (proc_parse_u64 (&pos, &total_kb));
+        }
       else if (g_str_has_prefix (line, "MemFree:"))
-        g_warn_if_fail (sscanf (line + sizeof ("MemFree:") - 1, "%" G_GUINT64_FORMAT, &free_kb) == 1);
+        {
+          pos = line + sizeof ("MemFree:") - 1;
+          g_warn_if_fail (proc_parse_u64 (&pos, &free_kb));
+        }
       else if (g_str_has_prefix (line, "SwapTotal:"))
-        g_warn_if_fail (sscanf (line + sizeof ("SwapTotal:") - 1, "%" G_GUINT64_FORMAT, &swap_total_kb) == 1);
+        {
+          pos = line + sizeof ("SwapTotal:") - 1;
+          g_warn_if_fail (proc_parse_u64 (&pos, &swap_total_kb));
+        }
       else if (g_str_has_prefix (line, "SwapFree:"))
-        g_warn_if_fail (sscanf (line + sizeof ("SwapFree:") - 1, "%" G_GUINT64_FORMAT, &swap_free_kb) == 1);
+        {
+          pos = line + sizeof ("SwapFree:") - 1;
+          g_warn_if_fail (proc_parse_u64 (&pos, &swap_free_kb));
+        }
       else if (g_str_has_prefix (line, "Buffers:"))
-        g_warn_if_fail (sscanf (line + sizeof ("Buffers:") - 1, "%" G_GUINT64_FORMAT, &buffers_kb) == 1);
+        {
+          pos = line + sizeof ("Buffers:") - 1;
+          g_warn_if_fail (proc_parse_u64 (&pos, &buffers_kb));
+        }
       else if (g_str_has_prefix (line, "Cached:"))
-        g_warn_if_fail (sscanf (line + sizeof ("Cached:") - 1, "%" G_GUINT64_FORMAT, &cached_kb) == 1);
+        {
+          pos = line + sizeof ("Cached:") - 1;
+          g_warn_if_fail (proc_parse_u64 (&pos, &cached_kb));
+        }
     }
 
   sample->timestamp = now;
@@ -303,23 +307,23 @@ collect (MemoryMonitor *monitor)
   sample->swap_used = (swap_total_kb - swap_free_kb) * 1024;
 
 out:
-  g_strfreev (lines);
-  g_free (contents);
   if (sample != NULL)
     {
-      g_variant_builder_init (&builder, G_VARIANT_TYPE ("ad"));
-      g_variant_builder_add (&builder, "d", (gdouble)sample->free);
-      g_variant_builder_add (&builder, "d", (gdouble)sample->used);
-      g_variant_builder_add (&builder, "d", (gdouble)sample->cached);
-      g_variant_builder_add (&builder, "d", (gdouble)sample->swap_used);
-      cockpit_resource_monitor_emit_new_sample (COCKPIT_RESOURCE_MONITOR (monitor), now,
-                                                g_variant_builder_end (&builder));
+      values[0] = (gdouble)sample->free;
+      values[1] = (gdouble)sample->used;
+      values[2] = (gdouble)sample->cached;
+      values[3] = (gdouble)sample->swap_used;
+      time_series_add (monitor->series, now, values);
+
+      /* Those who only want batched samples read them from the series */
+      if (subscriptions_has_subscribers (monitor->subscriptions))
+        {
+          cockpit_resource_monitor_emit_new_sample (COCKPIT_RESOURCE_MONITOR (monitor), now,
+                                                    g_variant_new_fixed_array (G_VARIANT_TYPE_DOUBLE, values,
+                                                                               G_N_ELEMENTS (values),
+                                                                               sizeof (gdouble)));
+        }
     }
-
-  monitor->samples_prev = monitor->samples_next;
-  monitor->samples_next += 1;
-  if (monitor->samples_next == monitor->samples_max)
-    monitor->samples_next = 0;
 }
 
 /* ---------------------------------------------------------------------------------------------------- */
@@ -330,36 +334,32 @@ handle_get_samples (CockpitResourceMonitor *_monitor,
                     GVariant *arg_options)
 {
   MemoryMonitor *monitor = MEMORY_MONITOR (_monitor);
-  GVariantBuilder builder;
-  gint n;
-
-  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(xad)"));
-  for (n = 0; n < monitor->samples_max; n++)
-    {
-      gint pos;
-      GVariantBuilder sample_builder;
-
-      pos = monitor->samples_next + n;
-      if (pos >= monitor->samples_max)
-        pos -= monitor->samples_max;
-
-      if (monitor->samples[pos].timestamp == 0)
-        continue;
+  return time_series_handle_get_samples (monitor->series, invocation, arg_options, monitor->samples_max);
+}
 
-      g_variant_builder_init (&sample_builder, G_VARIANT_TYPE ("ad"));
-      g_variant_builder_add (&sample_builder, "d", (gdouble)monitor->samples[pos].free);
-      g_variant_builder_add (&sample_builder, "d", (gdouble)monitor->samples[pos].used);
-      g_variant_builder_add (&sample_builder, "d", (gdouble)monitor->samples[pos].cached);
-      g_variant_builder_add (&sample_builder, "d", (gdouble)monitor->samples[pos].swap_used);
+static gboolean
+handle_get_samples_since (CockpitResourceMonitor *_monitor,
+                          GDBusMethodInvocation *invocation,
+                          gint64 arg_since,
+                          GVariant *arg_options)
+{
+  MemoryMonitor *monitor = MEMORY_MONITOR (_monitor);
+  return time_series_handle_get_samples_since (monitor->series, invocation, arg_since,
+                                               arg_options, monitor->samples_max);
+}
 
-      g_variant_builder_add (&builder, "(x@ad)",
-                             monitor->samples[pos].timestamp,
-                             g_variant_builder_end (&sample_builder));
-    }
-  cockpit_resource_monitor_complete_get_samples (_monitor, invocation,
-                                                 g_variant_builder_end (&builder));
+static gboolean
+handle_subscribe (CockpitResourceMonitor *_monitor,
+                  GDBusMethodInvocation *invocation)
+{
+  return subscriptions_handle_subscribe (MEMORY_MONITOR (_monitor)->subscriptions, invocation);
+}
 
-  return TRUE;
+static gboolean
+handle_unsubscribe (CockpitResourceMonitor *_monitor,
+                    GDBusMethodInvocation *invocation)
+{
+  return subscriptions_handle_unsubscribe (MEMORY_MONITOR (_monitor)->subscriptions, invocation);
 }
 
 /* ---------------------------------------------------------------------------------------------------- */
@@ -368,4 +368,7 @@ static void
 resource_monitor_iface_init (CockpitResourceMonitorIface *iface)
 {
   iface->handle_get_samples = handle_get_samples;
+  iface->handle_get_samples_since = handle_get_samples_since;
+  iface->handle_subscribe = handle_subscribe;
+  iface->handle_unsubscribe = handle_unsubscribe;
 }
@@ -19,12 +19,14 @@
 
 #include "config.h"
 
-#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "daemon.h"
 #include "networkmonitor.h"
+#include "procfile.h"
+#include "subscriptions.h"
+#include "timeseries.h"
 
 /**
  * SECTION:networkmonitor
@@ -56,15 +58,19 @@ struct _NetworkMonitor
   CockpitResourceMonitorSkeleton parent_instance;
 
   Daemon *daemon;
+  Subscriptions *subscriptions;
+  ProcFile *net_dev;
 
   guint user_hz;
 
+  /* Number of samples returned by GetSamples() without options */
   guint samples_max;
-  gint samples_prev;
-  guint samples_next;
 
-  /* Arrays of samples_max Sample instances */
-  Sample *samples;
+  /* The previous sample, timestamp is zero if there is none */
+  Sample last;
+
+  /* History of (incoming, outgoing) */
+  TimeSeries *series;
 };
 
 struct _NetworkMonitorClass
@@ -83,10 +89,6 @@ static void resource_monitor_iface_init (CockpitResourceMonitorIface *iface);
 G_DEFINE_TYPE_WITH_CODE (NetworkMonitor, network_monitor, COCKPIT_TYPE_RESOURCE_MONITOR_SKELETON,
                          G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_RESOURCE_MONITOR, resource_monitor_iface_init));
 
-static void on_tick (Daemon  *daemon,
-                     guint64     delta_usec,
-                     gpointer    user_data);
-
 /* ---------------------------------------------------------------------------------------------------- */
 
 static void
@@ -97,9 +99,10 @@ network_monitor_init (NetworkMonitor *monitor)
   /* Assign legends */
   cockpit_resource_monitor_set_legends (COCKPIT_RESOURCE_MONITOR (monitor), legends);
 
-  monitor->samples_prev = -1;
   monitor->samples_max = 300;
-  monitor->samples = g_new0 (Sample, monitor->samples_max);
+  monitor->series = time_series_new_archived (PACKAGE_LOCALSTATE_DIR "/lib/cockpit/samples/network",
+                                              2, NULL, 0);
+  monitor->net_dev = proc_file_new ("/proc/net/dev");
 }
 
 static void
@@ -107,9 +110,9 @@ network_monitor_finalize (GObject *object)
 {
   NetworkMonitor *monitor = NETWORK_MONITOR (object);
 
-  g_free (monitor->samples);
-
-  g_signal_handlers_disconnect_by_func (monitor->daemon, G_CALLBACK (on_tick), monitor);
+  subscriptions_free (monitor->subscriptions);
+  time_series_free (monitor->series);
+  proc_file_free (monitor->net_dev);
 
   G_OBJECT_CLASS (network_monitor_parent_class)->finalize (object);
 }
@@ -158,15 +161,6 @@ network_monitor_set_property (GObject *object,
 
 static void collect (NetworkMonitor *monitor);
 
-static void
-on_tick (Daemon *daemon,
-         guint64 delta_usec,
-         gpointer user_data)
-{
-  NetworkMonitor *monitor = NETWORK_MONITOR (user_data);
-  collect (monitor);
-}
-
 static void
 network_monitor_constructed (GObject *object)
 {
@@ -175,7 +169,8 @@ network_monitor_constructed (GObject *object)
   cockpit_resource_monitor_set_num_samples (COCKPIT_RESOURCE_MONITOR (monitor), monitor->samples_max);
   cockpit_resource_monitor_set_num_series (COCKPIT_RESOURCE_MONITOR (monitor), 2);
 
-  g_signal_connect (monitor->daemon, "tick", G_CALLBACK (on_tick), monitor);
+  monitor->subscriptions = subscriptions_new_sampling (monitor, G_OBJECT (monitor->daemon), monitor->series,
+                                                      (SubscriptionsSampleFunc)collect);
   collect (monitor);
 
   if (G_OBJECT_CLASS (network_monitor_parent_class)->constructed != NULL)
@@ -261,25 +256,22 @@ calc_bandwidth (NetworkMonitor *monitor,
   return ret;
 }
 
-/* TODO: this should be optimized so we don't allocate network and call open()/close() all the time */
 static void
 collect (NetworkMonitor *monitor)
 {
-  gchar *contents = NULL;
-  gsize len;
+  const gchar *line;
+  const gchar *pos;
   GError *error;
-  gchar **lines = NULL;
   guint n;
   gint64 now;
+  gdouble values[2];
+  Sample current = { 0, };
   Sample *sample = NULL;
   Sample *last = NULL;
-  GVariantBuilder builder;
 
   error = NULL;
-  if (!g_file_get_contents ("/proc/net/dev",
-                            &contents,
-                            &len,
-                            &error))
+  line = proc_file_read (monitor->net_dev, &error);
+  if (line == NULL)
     {
       g_warning ("Error loading contents /proc/net/dev: %s (%s, %d)",
                  error->message, g_quark_to_string (error->domain), error->code);
@@ -289,21 +281,19 @@ collect (NetworkMonitor *monitor)
 
   now = g_get_real_time ();
 
-  sample = &(monitor->samples[monitor->samples_next]);
+  sample = &current;
   sample->timestamp = now;
   sample->bytes_rx = 0;
   sample->bytes_tx = 0;
 
-  if (monitor->samples_prev != -1)
-    last = &(monitor->samples[monitor->samples_prev]);
+  if (monitor->last.timestamp != 0)
+    last = &monitor->last;
 
-  lines = g_strsplit (contents, "\n", -1);
-  for (n = 0; lines != NULL && lines[n] != NULL; n++)
+  for (n = 0; line != NULL; line = proc_next_line (line), n++)
     {
-      const gchar *line = lines[n];
-      gchar iface_name[64]; /* guaranteed to be max 16 chars */
-      guint64 bytes_rx, packets_rx, errors_rx, dropped_rx, fifo_rx, frame_rx, compressed_rx, multicast_rx;
-      guint64 bytes_tx, packets_tx, errors_tx, dropped_tx, fifo_tx, frame_tx, compressed_tx, multicast_tx;
+      const gchar *iface_name;
+      gsize iface_len;
+      guint64 values[16];
       gint num_parsed;
 
       /* Format is
@@ -316,31 +306,40 @@ collect (NetworkMonitor *monitor)
        * tap0:    7714      81    0    0    0     0          0         0     7714      81    0    0    0     0       0          0
        */
 
-      if (n < 2 || strlen (line) == 0)
+      if (n < 2 || line[0] == '\n')
         continue;
 
-      num_parsed = sscanf (line,
-                           "%s %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
-                           iface_name,
-                           &bytes_rx, &packets_rx, &errors_rx, &dropped_rx,
-                           &fifo_rx, &frame_rx, &compressed_rx, &multicast_rx,
-                           &bytes_tx, &packets_tx, &errors_tx, &dropped_tx,
-                           &fifo_tx, &frame_tx, &compressed_tx, &multicast_tx);
-      if (num_parsed != 17)
+      /* The counters may follow the colon without a blank */
+      iface_name = line;
+      while (*iface_name == ' ')
+        iface_name++;
+      for (pos = iface_name; *pos && *pos != ':' && *pos != '\n'; pos++);
+      if (*pos != ':')
         {
-          g_warning ("Error parsing line %d of file /proc/net/dev (num_parsed=%d): `%s'", n, num_parsed, line);
+          g_warning ("Error parsing line %d of file /proc/net/dev (no interface name)", n);
+          continue;
+        }
+      iface_len = pos - iface_name;
+      pos++;
+
+      for (num_parsed = 0; num_parsed < G_N_ELEMENTS (values); num_parsed++)
+        {
+          if (!proc_parse_u64 (&pos, &values[num_parsed]))
+            break;
+        }
+      if (num_parsed != G_N_ELEMENTS (values))
+        {
+          g_warning ("Error parsing line %d of file /proc/net/dev (num_parsed=%d)", n, num_parsed);
           continue;
         }
 
       /* skip loopback */
-      if (g_strcmp0 (iface_name, "lo:") == 0)
+      if (iface_len == 2 && strncmp (iface_name, "lo", 2) == 0)
         continue;
 
-      sample->bytes_rx += bytes_rx;
-      sample->bytes_tx += bytes_tx;
+      /* received bytes, then transmitted bytes after eight counters */
+      sample->bytes_rx += values[0];
+      sample->bytes_tx += values[8];
     }
 
   if (last != NULL)
@@ -350,21 +349,22 @@ collect (NetworkMonitor *monitor)
     }
 
 out:
-  g_strfreev (lines);
-  g_free (contents);
   if (sample != NULL)
     {
-      g_variant_builder_init (&builder, G_VARIANT_TYPE ("ad"));
-      g_variant_builder_add (&builder, "d", sample->bytes_rx_per_sec);
-      g_variant_builder_add (&builder, "d", sample->bytes_tx_per_sec);
-      cockpit_resource_monitor_emit_new_sample (COCKPIT_RESOURCE_MONITOR(monitor), now,
-                                                g_variant_builder_end (&builder));
-    }
+      values[0] = sample->bytes_rx_per_sec;
+      values[1] = sample->bytes_tx_per_sec;
+      time_series_add (monitor->series, now, values);
 
-  monitor->samples_prev = monitor->samples_next;
-  monitor->samples_next += 1;
-  if (monitor->samples_next == monitor->samples_max)
-    monitor->samples_next = 0;
+      /* Those who only want batched samples read them from the series */
+      if (subscriptions_has_subscribers (monitor->subscriptions))
+        {
+          cockpit_resource_monitor_emit_new_sample (COCKPIT_RESOURCE_MONITOR (monitor), now,
+                                                    g_variant_new_fixed_array (G_VARIANT_TYPE_DOUBLE, values,
+                                                                               G_N_ELEMENTS (values),
+                                                                               sizeof (gdouble)));
+        }
+      monitor->last = *sample;
+    }
 }
 
 /* ---------------------------------------------------------------------------------------------------- */
@@ -375,35 +375,32 @@ handle_get_samples (CockpitResourceMonitor *_monitor,
                     GVariant *arg_options)
 {
   NetworkMonitor *monitor = NETWORK_MONITOR (_monitor);
-  GVariantBuilder builder;
-  gint n;
-
-  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(xad)"));
-  for (n = 0; n < monitor->samples_max; n++)
-    {
-      gint pos;
-      GVariantBuilder sample_builder;
-
-      pos = monitor->samples_next + n;
-      if (pos >= monitor->samples_max)
-        pos -= monitor->samples_max;
-
-      if (monitor->samples[pos].timestamp == 0)
-        continue;
+  return time_series_handle_get_samples (monitor->series, invocation, arg_options, monitor->samples_max);
+}
 
-      g_variant_builder_init (&sample_builder, G_VARIANT_TYPE("ad"));
-      g_variant_builder_add (&sample_builder, "d", monitor->samples[pos].bytes_rx_per_sec);
-      g_variant_builder_add (&sample_builder, "d", monitor->samples[pos].bytes_tx_per_sec);
+static gboolean
+handle_get_samples_since (CockpitResourceMonitor *_monitor,
+                          GDBusMethodInvocation *invocation,
+                          gint64 arg_since,
+                          GVariant *arg_options)
+{
+  NetworkMonitor *monitor = NETWORK_MONITOR (_monitor);
+  return time_series_handle_get_samples_since (monitor->series, invocation, arg_since,
+                                               arg_options, monitor->samples_max);
+}
 
-      g_variant_builder_add (&builder, "(x@ad)",
-                             monitor->samples[pos].timestamp,
-                             g_variant_builder_end (&sample_builder));
-    }
-  cockpit_resource_monitor_complete_get_samples (_monitor,
-                                                 invocation,
-                                                 g_variant_builder_end (&builder));
+static gboolean
+handle_subscribe (CockpitResourceMonitor *_monitor,
+                  GDBusMethodInvocation *invocation)
+{
+  return subscriptions_handle_subscribe (NETWORK_MONITOR (_monitor)->subscriptions, invocation);
+}
 
-  return TRUE;
+static gboolean
+handle_unsubscribe (CockpitResourceMonitor *_monitor,
+                    GDBusMethodInvocation *invocation)
+{
+  return subscriptions_handle_unsubscribe (NETWORK_MONITOR (_monitor)->subscriptions, invocation);
 }
 
 /* ---------------------------------------------------------------------------------------------------- */
@@ -412,4 +409,7 @@ static void
 resource_monitor_iface_init (CockpitResourceMonitorIface *iface)
 {
   iface->handle_get_samples = handle_get_samples;
+  iface->handle_get_samples_since = handle_get_samples_since;
+  iface->handle_subscribe = handle_subscribe;
+  iface->handle_unsubscribe = handle_unsubscribe;
 }
@@ -0,0 +1,237 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "procfile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * The resource monitors read their /proc file every second. Rather
+ * than opening it and allocating its contents and lines every time, a
+ * ProcFile keeps the file open and reads it again from the start into
+ * the same buffer. The parsers below work in place on that buffer.
+ */
+
+#define INITIAL_SIZE 4096
+
+struct _ProcFile {
+  gchar *path;
+  int fd;
+  gchar *buffer;
+  gsize size;
+};
+
+/**
+ * proc_file_new:
+ * @path: the file to read
+ *
+ * Create a reader for @path. The file is opened on the first read.
+ *
+ * Returns: (transfer full): the new reader
+ */
+ProcFile *
+proc_file_new (const gchar *path)
+{
+  ProcFile *file;
+
+  g_return_val_if_fail (path != NULL, NULL);
+
+  file = g_slice_new0 (ProcFile);
+  file->path = g_strdup (path);
+  file->fd = -1;
+  file->size = INITIAL_SIZE;
+  file->buffer = g_malloc (file->size);
+  return file;
+}
+
+static void
+set_error_from_errno (ProcFile *file,
+                      const gchar *action,
+                      int errn,
+                      GError **error)
+{
+  g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errn),
+               "Couldn't %s %s: %s", action, file->path, g_strerror (errn));
+}
+
+/**
+ * proc_file_read:
+ * @file: the reader
+ * @error: location to place an error
+ *
+ * Read the whole file again. The buffer is reused from one read to
+ * the next, and only grows when the file no longer fits.
+ *
+ * Returns: the null terminated contents, valid until the next read,
+ *          or %NULL with @error set
+ */
+const gchar *
+proc_file_read (ProcFile *file,
+                GError **error)
+{
+  gsize length = 0;
+  gssize ret;
+
+  g_return_val_if_fail (file != NULL, NULL);
+
+  if (file->fd < 0)
+    {
+      file->fd = open (file->path, O_RDONLY | O_CLOEXEC);
+      if (file->fd < 0)
+        {
+          set_error_from_errno (file, "open", errno, error);
+          return NULL;
+        }
+    }
+
+  for (;;)
+    {
+      ret = pread (file->fd, file->buffer + length, file->size - 1 - length, length);
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          set_error_from_errno (file, "read", errno, error);
+
+          /* Try opening it again next time */
+          close (file->fd);
+          file->fd = -1;
+          return NULL;
+        }
+      else if (ret == 0)
+        {
+          break;
+        }
+
+      length += ret;
+      if (length == file->size - 1)
+        {
+          file->size *= 2;
+          file->buffer = g_realloc (file->buffer, file->size);
+        }
+    }
+
+  file->buffer[length] = '\0';
+  return file->buffer;
+}
+
+/**
+ * proc_file_free:
+ * @file: the reader
+ *
+ * Close the file and free the reader.
+ */
+void
+proc_file_free (ProcFile *file)
+{
+  if (!file)
+    return;
+
+  if (file->fd >= 0)
+    close (file->fd);
+  g_free (file->buffer);
+  g_free (file->path);
+  g_slice_free (ProcFile, file);
+}
+
+/**
+ * proc_next_line:
+ * @line: a line in the contents of a file
+ *
+ * Returns: the start of the line after @line, or %NULL if there
+ *          are no more lines
+ */
+const gchar *
+proc_next_line (const gchar *line)
+{
+  line = strchr (line, '\n');
+  if (line == NULL || line[1] == '\0')
+    return NULL;
+  return line + 1;
+}
+
+static const gchar *
+skip_blank (const gchar *pos)
+{
+  while (*pos == ' ' || *pos == '\t')
+    pos++;
+  return pos;
+}
+
+/**
+ * proc_parse_u64:
+ * @pos: the position to parse at, moved past the number
+ * @value: location to place the number
+ *
+ * Parse a decimal number after any blanks. The number doesn't end
+ * the line, and doesn't need to be followed by a blank.
+ *
+ * Returns: whether there was a number
+ */
+gboolean
+proc_parse_u64 (const gchar **pos,
+                guint64 *value)
+{
+  const gchar *p;
+  guint64 result = 0;
+
+  p = skip_blank (*pos);
+  if (*p < '0' || *p > '9')
+    return FALSE;
+
+  for (; *p >= '0' && *p <= '9'; p++)
+    result = result * 10 + (*p - '0');
+
+  *pos = p;
+  *value = result;
+  return TRUE;
+}
+
+/**
+ * proc_parse_word:
+ * @pos: the position to parse at, moved past the word
+ * @length: location to place the length of the word
+ *
+ * Find the next run of non-blank characters on the line.
+ *
+ * Returns: the start of the word, which is not null terminated, or
+ *          %NULL if the line has no more words
+ */
+const gchar *
+proc_parse_word (const gchar **pos,
+                 gsize *length)
+{
+  const gchar *start;
+  const gchar *p;
+
+  start = skip_blank (*pos);
+  for (p = start; *p && *p != ' ' && *p != '\t' && *p != '\n'; p++);
+
+  if (p == start)
+    return NULL;
+
+  *pos = p;
+  *length = p - start;
+  return start;
+}
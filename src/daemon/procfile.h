@@ -0,0 +1,46 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COCKPIT_PROC_FILE_H__
+#define COCKPIT_PROC_FILE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _ProcFile ProcFile;
+
+ProcFile *        proc_file_new                (const gchar *path);
+
+const gchar *     proc_file_read               (ProcFile *file,
+                                                GError **error);
+
+void              proc_file_free               (ProcFile *file);
+
+const gchar *     proc_next_line               (const gchar *line);
+
+gboolean          proc_parse_u64               (const gchar **pos,
+                                                guint64 *value);
+
+const gchar *     proc_parse_word              (const gchar **pos,
+                                                gsize *length);
+
+G_END_DECLS
+
+#endif /* COCKPIT_PROC_FILE_H__ */
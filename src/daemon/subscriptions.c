@@ -0,0 +1,544 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "subscriptions.h"
+
+#include "daemon.h"
+
+/*
+ * The resource monitors only need to sample while someone is looking
+ * at them. Clients say so with Subscribe() and Unsubscribe(), and a
+ * client going away from the bus drops all its subscriptions.
+ *
+ * Subscriptions are active from the first Subscribe() until a while
+ * after the last subscription is gone, so that reloading a page
+ * doesn't leave a gap in the samples.
+ *
+ * Parts of the daemon can also hold the subscriptions active, without
+ * being a subscriber that wants signals from the object itself.
+ *
+ * The resource monitors use subscriptions_new_sampling(), which takes
+ * care of sampling on every tick while the subscriptions are active.
+ * Nothing is sampled otherwise, not even for the history, so that an
+ * idle daemon doesn't wake up at all.
+ * Other parts of the daemon find the subscriptions and sample history
+ * of a monitor with subscriptions_get_for_monitor().
+ */
+
+#define LINGER_SECONDS 30
+
+typedef struct {
+  Subscriptions *subscriptions;
+  GDBusConnection *connection;
+  gchar *sender;
+  guint count;
+  guint name_watch;
+} Subscriber;
+
+struct _Subscriptions {
+  SubscriptionsFunc callback;
+  gpointer user_data;
+
+  /* sender -> Subscriber */
+  GHashTable *subscribers;
+  guint holds;
+  guint linger;
+  guint linger_timeout;
+  gboolean active;
+
+  /* Only for subscriptions_new_sampling() */
+  gpointer monitor;
+  GObject *tick_source;
+  TimeSeries *series;
+  SubscriptionsSampleFunc sample;
+  gulong tick_sig;
+};
+
+static GQuark
+subscriptions_quark (void)
+{
+  return g_quark_from_static_string ("cockpit-subscriptions");
+}
+
+static void
+subscriber_free (gpointer data)
+{
+  Subscriber *subscriber = data;
+
+  g_dbus_connection_signal_unsubscribe (subscriber->connection, subscriber->name_watch);
+  g_object_unref (subscriber->connection);
+  g_free (subscriber->sender);
+  g_slice_free (Subscriber, subscriber);
+}
+
+/**
+ * subscriptions_new:
+ * @callback: called when the subscriptions become active or inactive
+ * @user_data: passed to @callback
+ *
+ * Track which D-Bus clients are subscribed to an object. When
+ * @callback is called because the subscriptions became inactive,
+ * it may free them.
+ *
+ * Returns: (transfer full): the subscriptions
+ */
+Subscriptions *
+subscriptions_new (SubscriptionsFunc callback,
+                   gpointer user_data)
+{
+  Subscriptions *subscriptions;
+
+  g_return_val_if_fail (callback != NULL, NULL);
+
+  subscriptions = g_slice_new0 (Subscriptions);
+  subscriptions->callback = callback;
+  subscriptions->user_data = user_data;
+  subscriptions->subscribers = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                      NULL, subscriber_free);
+  subscriptions->linger = LINGER_SECONDS;
+  return subscriptions;
+}
+
+static void
+on_tick (GObject *source,
+         guint64 delta_usec,
+         gpointer user_data)
+{
+  Subscriptions *subscriptions = user_data;
+  (subscriptions->sample) (subscriptions->monitor);
+}
+
+static void
+stop_ticking (Subscriptions *subscriptions)
+{
+  if (!subscriptions->tick_sig)
+    return;
+
+  /* The tick source may be gone already */
+  if (subscriptions->tick_source)
+    {
+      g_signal_handler_disconnect (subscriptions->tick_source, subscriptions->tick_sig);
+      if (IS_DAEMON (subscriptions->tick_source))
+        daemon_release_tick (DAEMON (subscriptions->tick_source));
+    }
+  subscriptions->tick_sig = 0;
+}
+
+/* Only sample on every tick while someone is subscribed */
+static void
+on_sampling_changed (gboolean active,
+                     gpointer user_data)
+{
+  Subscriptions *subscriptions = user_data;
+
+  if (active)
+    {
+      if (subscriptions->tick_source)
+        {
+          subscriptions->tick_sig = g_signal_connect (subscriptions->tick_source, "tick",
+                                                      G_CALLBACK (on_tick), subscriptions);
+          if (IS_DAEMON (subscriptions->tick_source))
+            daemon_hold_tick (DAEMON (subscriptions->tick_source));
+        }
+      (subscriptions->sample) (subscriptions->monitor);
+    }
+  else
+    {
+      stop_ticking (subscriptions);
+    }
+}
+
+/**
+ * subscriptions_new_sampling:
+ * @monitor: the resource monitor object
+ * @tick_source: (allow-none): an object with a tick signal, like a #Daemon
+ * @series: (allow-none): the sample history of @monitor
+ * @sample: called with @monitor to take a sample
+ *
+ * Track the subscriptions of a resource monitor, and call @sample on
+ * every tick of @tick_source while they are active. When @tick_source
+ * is a #Daemon, the tick is held for as long as that.
+ *
+ * The subscriptions can be found again with
+ * subscriptions_get_for_monitor(). Free them before @series.
+ *
+ * Returns: (transfer full): the subscriptions
+ */
+Subscriptions *
+subscriptions_new_sampling (gpointer monitor,
+                            GObject *tick_source,
+                            TimeSeries *series,
+                            SubscriptionsSampleFunc sample)
+{
+  Subscriptions *subscriptions;
+
+  g_return_val_if_fail (G_IS_OBJECT (monitor), NULL);
+  g_return_val_if_fail (tick_source == NULL || G_IS_OBJECT (tick_source), NULL);
+  g_return_val_if_fail (sample != NULL, NULL);
+
+  subscriptions = g_slice_new0 (Subscriptions);
+  subscriptions->callback = on_sampling_changed;
+  subscriptions->user_data = subscriptions;
+  subscriptions->subscribers = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                      NULL, subscriber_free);
+  subscriptions->linger = LINGER_SECONDS;
+  subscriptions->monitor = monitor;
+  subscriptions->series = series;
+  subscriptions->sample = sample;
+
+  if (tick_source)
+    {
+      subscriptions->tick_source = tick_source;
+      g_object_add_weak_pointer (tick_source, (gpointer *)&subscriptions->tick_source);
+    }
+
+  g_object_set_qdata (monitor, subscriptions_quark (), subscriptions);
+  return subscriptions;
+}
+
+/**
+ * subscriptions_get_for_monitor:
+ * @monitor: a resource monitor object
+ *
+ * Returns: (transfer none): the subscriptions created for @monitor
+ *          with subscriptions_new_sampling(), or %NULL
+ */
+Subscriptions *
+subscriptions_get_for_monitor (gpointer monitor)
+{
+  g_return_val_if_fail (G_IS_OBJECT (monitor), NULL);
+  return g_object_get_qdata (monitor, subscriptions_quark ());
+}
+
+/**
+ * subscriptions_get_series:
+ * @subscriptions: the subscriptions
+ *
+ * Returns: (transfer none): the sample history of the monitor, or
+ *          %NULL if it doesn't keep one
+ */
+TimeSeries *
+subscriptions_get_series (Subscriptions *subscriptions)
+{
+  g_return_val_if_fail (subscriptions != NULL, NULL);
+  return subscriptions->series;
+}
+
+static gboolean
+on_linger_timeout (gpointer user_data)
+{
+  Subscriptions *subscriptions = user_data;
+
+  subscriptions->linger_timeout = 0;
+  subscriptions->active = FALSE;
+
+  /* May free the subscriptions */
+  (subscriptions->callback) (FALSE, subscriptions->user_data);
+
+  return FALSE;
+}
+
+static void
+maybe_linger (Subscriptions *subscriptions)
+{
+  if (g_hash_table_size (subscriptions->subscribers) == 0 && subscriptions->holds == 0 &&
+      subscriptions->active && !subscriptions->linger_timeout)
+    {
+      g_debug ("no more subscribers, stopping in %u seconds", subscriptions->linger);
+      if (subscriptions->linger == 0)
+        subscriptions->linger_timeout = g_idle_add (on_linger_timeout, subscriptions);
+      else
+        subscriptions->linger_timeout = g_timeout_add_seconds (subscriptions->linger, on_linger_timeout,
+                                                               subscriptions);
+    }
+}
+
+static void
+activate (Subscriptions *subscriptions)
+{
+  if (subscriptions->linger_timeout)
+    {
+      g_source_remove (subscriptions->linger_timeout);
+      subscriptions->linger_timeout = 0;
+    }
+
+  if (!subscriptions->active)
+    {
+      subscriptions->active = TRUE;
+      (subscriptions->callback) (TRUE, subscriptions->user_data);
+    }
+}
+
+static void
+on_name_owner_changed (GDBusConnection *connection,
+                       const gchar *sender_name,
+                       const gchar *object_path,
+                       const gchar *interface_name,
+                       const gchar *signal_name,
+                       GVariant *parameters,
+                       gpointer user_data)
+{
+  Subscriber *subscriber = user_data;
+  Subscriptions *subscriptions = subscriber->subscriptions;
+  const gchar *new_owner;
+
+  g_variant_get (parameters, "(&s&s&s)", NULL, NULL, &new_owner);
+  if (new_owner[0] == '\0')
+    {
+      g_debug ("%s went away, dropping its subscriptions", subscriber->sender);
+      g_hash_table_remove (subscriptions->subscribers, subscriber->sender);
+      maybe_linger (subscriptions);
+    }
+}
+
+/**
+ * subscriptions_add:
+ * @subscriptions: the subscriptions
+ * @invocation: the Subscribe() call
+ *
+ * Add a subscription for the caller of @invocation. A caller can
+ * subscribe more than once, and then needs to unsubscribe as often.
+ */
+void
+subscriptions_add (Subscriptions *subscriptions,
+                   GDBusMethodInvocation *invocation)
+{
+  Subscriber *subscriber;
+  const gchar *sender;
+
+  g_return_if_fail (subscriptions != NULL);
+
+  sender = g_dbus_method_invocation_get_sender (invocation);
+  subscriber = g_hash_table_lookup (subscriptions->subscribers, sender);
+  if (!subscriber)
+    {
+      subscriber = g_slice_new0 (Subscriber);
+      subscriber->subscriptions = subscriptions;
+      subscriber->connection = g_object_ref (g_dbus_method_invocation_get_connection (invocation));
+      subscriber->sender = g_strdup (sender);
+      subscriber->name_watch = g_dbus_connection_signal_subscribe (subscriber->connection,
+                                                                   "org.freedesktop.DBus",
+                                                                   "org.freedesktop.DBus",
+                                                                   "NameOwnerChanged",
+                                                                   "/org/freedesktop/DBus",
+                                                                   sender,
+                                                                   G_DBUS_SIGNAL_FLAGS_NONE,
+                                                                   on_name_owner_changed,
+                                                                   subscriber, NULL);
+      g_hash_table_insert (subscriptions->subscribers, subscriber->sender, subscriber);
+    }
+
+  subscriber->count++;
+  activate (subscriptions);
+}
+
+/**
+ * subscriptions_remove:
+ * @subscriptions: the subscriptions
+ * @invocation: the Unsubscribe() call
+ *
+ * Remove one subscription of the caller of @invocation, if it has any.
+ */
+void
+subscriptions_remove (Subscriptions *subscriptions,
+                      GDBusMethodInvocation *invocation)
+{
+  Subscriber *subscriber;
+  const gchar *sender;
+
+  g_return_if_fail (subscriptions != NULL);
+
+  sender = g_dbus_method_invocation_get_sender (invocation);
+  subscriber = g_hash_table_lookup (subscriptions->subscribers, sender);
+  if (!subscriber)
+    return;
+
+  subscriber->count--;
+  if (subscriber->count == 0)
+    g_hash_table_remove (subscriptions->subscribers, sender);
+
+  maybe_linger (subscriptions);
+}
+
+/**
+ * subscriptions_handle_subscribe:
+ * @subscriptions: the subscriptions
+ * @invocation: the Subscribe() call
+ *
+ * Add a subscription for the caller of @invocation, and reply to it.
+ * For the Subscribe() method of the resource monitors.
+ *
+ * Returns: %TRUE, as the method handler should
+ */
+gboolean
+subscriptions_handle_subscribe (Subscriptions *subscriptions,
+                                GDBusMethodInvocation *invocation)
+{
+  subscriptions_add (subscriptions, invocation);
+  g_dbus_method_invocation_return_value (invocation, NULL);
+  return TRUE;
+}
+
+/**
+ * subscriptions_handle_unsubscribe:
+ * @subscriptions: the subscriptions
+ * @invocation: the Unsubscribe() call
+ *
+ * Like subscriptions_handle_subscribe() for the Unsubscribe() method.
+ *
+ * Returns: %TRUE, as the method handler should
+ */
+gboolean
+subscriptions_handle_unsubscribe (Subscriptions *subscriptions,
+                                  GDBusMethodInvocation *invocation)
+{
+  subscriptions_remove (subscriptions, invocation);
+  g_dbus_method_invocation_return_value (invocation, NULL);
+  return TRUE;
+}
+
+/**
+ * subscriptions_hold:
+ * @subscriptions: the subscriptions
+ *
+ * Keep the subscriptions active on behalf of another part of the
+ * daemon, until subscriptions_release() is called.
+ */
+void
+subscriptions_hold (Subscriptions *subscriptions)
+{
+  g_return_if_fail (subscriptions != NULL);
+
+  subscriptions->holds++;
+  activate (subscriptions);
+}
+
+/**
+ * subscriptions_release:
+ * @subscriptions: the subscriptions
+ *
+ * Drop a hold taken with subscriptions_hold().
+ */
+void
+subscriptions_release (Subscriptions *subscriptions)
+{
+  g_return_if_fail (subscriptions != NULL);
+  g_return_if_fail (subscriptions->holds > 0);
+
+  subscriptions->holds--;
+  maybe_linger (subscriptions);
+}
+
+/**
+ * subscriptions_set_linger:
+ * @subscriptions: the subscriptions
+ * @seconds: how long to stay active
+ *
+ * Set how long the subscriptions stay active after the last
+ * subscription or hold is gone. With zero they become inactive
+ * on the next main loop iteration.
+ */
+void
+subscriptions_set_linger (Subscriptions *subscriptions,
+                          guint seconds)
+{
+  g_return_if_fail (subscriptions != NULL);
+  subscriptions->linger = seconds;
+}
+
+/**
+ * subscriptions_foreach:
+ * @subscriptions: the subscriptions
+ * @func: called for every subscribed D-Bus client
+ * @user_data: passed to @func
+ *
+ * Call @func with the connection and unique name of every client
+ * that is subscribed right now. @func must not change the
+ * subscriptions.
+ */
+void
+subscriptions_foreach (Subscriptions *subscriptions,
+                       SubscriptionsForeachFunc func,
+                       gpointer user_data)
+{
+  GHashTableIter iter;
+  Subscriber *subscriber;
+
+  g_return_if_fail (subscriptions != NULL);
+  g_return_if_fail (func != NULL);
+
+  g_hash_table_iter_init (&iter, subscriptions->subscribers);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&subscriber))
+    (func) (subscriber->connection, subscriber->sender, user_data);
+}
+
+/**
+ * subscriptions_has_subscribers:
+ * @subscriptions: the subscriptions
+ *
+ * Returns: whether any D-Bus client is subscribed right now
+ */
+gboolean
+subscriptions_has_subscribers (Subscriptions *subscriptions)
+{
+  g_return_val_if_fail (subscriptions != NULL, FALSE);
+  return g_hash_table_size (subscriptions->subscribers) > 0;
+}
+
+/**
+ * subscriptions_is_active:
+ * @subscriptions: the subscriptions
+ *
+ * Returns: whether anyone is subscribed, or was until recently
+ */
+gboolean
+subscriptions_is_active (Subscriptions *subscriptions)
+{
+  g_return_val_if_fail (subscriptions != NULL, FALSE);
+  return subscriptions->active;
+}
+
+/**
+ * subscriptions_free:
+ * @subscriptions: the subscriptions
+ *
+ * Drop all subscriptions. The callback is not called, but sampling
+ * stops.
+ */
+void
+subscriptions_free (Subscriptions *subscriptions)
+{
+  if (!subscriptions)
+    return;
+
+  if (subscriptions->monitor)
+    {
+      stop_ticking (subscriptions);
+      if (subscriptions->tick_source)
+        g_object_remove_weak_pointer (subscriptions->tick_source, (gpointer *)&subscriptions->tick_source);
+      g_object_set_qdata (subscriptions->monitor, subscriptions_quark (), NULL);
+    }
+
+  if (subscriptions->linger_timeout)
+    g_source_remove (subscriptions->linger_timeout);
+  g_hash_table_destroy (subscriptions->subscribers);
+  g_slice_free (Subscriptions, subscriptions);
+}
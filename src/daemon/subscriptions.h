@@ -0,0 +1,83 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COCKPIT_SUBSCRIPTIONS_H__
+#define COCKPIT_SUBSCRIPTIONS_H__
+
+#include <gio/gio.h>
+
+#include "timeseries.h"
+
+G_BEGIN_DECLS
+
+typedef struct _Subscriptions Subscriptions;
+
+typedef void   (* SubscriptionsFunc)             (gboolean active,
+                                                  gpointer user_data);
+
+typedef void   (* SubscriptionsSampleFunc)       (gpointer monitor);
+
+typedef void   (* SubscriptionsForeachFunc)      (GDBusConnection *connection,
+                                                  const gchar *sender,
+                                                  gpointer user_data);
+
+Subscriptions *   subscriptions_new              (SubscriptionsFunc callback,
+                                                  gpointer user_data);
+
+Subscriptions *   subscriptions_new_sampling     (gpointer monitor,
+                                                  GObject *tick_source,
+                                                  TimeSeries *series,
+                                                  SubscriptionsSampleFunc sample);
+
+Subscriptions *   subscriptions_get_for_monitor  (gpointer monitor);
+
+TimeSeries *      subscriptions_get_series       (Subscriptions *subscriptions);
+
+void              subscriptions_add              (Subscriptions *subscriptions,
+                                                  GDBusMethodInvocation *invocation);
+
+void              subscriptions_remove           (Subscriptions *subscriptions,
+                                                  GDBusMethodInvocation *invocation);
+
+gboolean          subscriptions_handle_subscribe (Subscriptions *subscriptions,
+                                                  GDBusMethodInvocation *invocation);
+
+gboolean          subscriptions_handle_unsubscribe (Subscriptions *subscriptions,
+                                                    GDBusMethodInvocation *invocation);
+
+void              subscriptions_hold             (Subscriptions *subscriptions);
+
+void              subscriptions_release          (Subscriptions *subscriptions);
+
+void              subscriptions_set_linger       (Subscriptions *subscriptions,
+                                                  guint seconds);
+
+void              subscriptions_foreach          (Subscriptions *subscriptions,
+                                                  SubscriptionsForeachFunc func,
+                                                  gpointer user_data);
+
+gboolean          subscriptions_has_subscribers  (Subscriptions *subscriptions);
+
+gboolean          subscriptions_is_active        (Subscriptions *subscriptions);
+
+void              subscriptions_free             (Subscriptions *subscriptions);
+
+G_END_DECLS
+
+#endif /* COCKPIT_SUBSCRIPTIONS_H__ */
@@ -0,0 +1,546 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "batchmonitor.h"
+#include "cgroupmonitor.h"
+#include "subscriptions.h"
+#include "timeseries.h"
+
+#include "cockpit/cockpittest.h"
+
+#include <glib/gstdio.h>
+
+#include <string.h>
+
+/* -----------------------------------------------------------------------------
+ * Mock
+ */
+
+static GType mock_ticker_get_type (void) G_GNUC_CONST;
+
+typedef struct {
+  GObject parent;
+  guint tick_id;
+  guint64 last_tick;
+} MockTicker;
+
+typedef GObjectClass MockTickerClass;
+
+G_DEFINE_TYPE (MockTicker, mock_ticker, G_TYPE_OBJECT);
+
+static guint signal_tick;
+
+static void
+mock_ticker_init (MockTicker *self)
+{
+
+}
+
+static void
+mock_ticker_finalize (GObject *object)
+{
+  MockTicker *self = (MockTicker *)object;
+  g_source_remove (self->tick_id);
+  G_OBJECT_CLASS (mock_ticker_parent_class)->finalize (object);
+}
+
+static void
+mock_ticker_class_init (MockTickerClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  object_class->finalize = mock_ticker_finalize;
+  signal_tick = g_signal_new ("tick",
+                              G_OBJECT_CLASS_TYPE (klass),
+                              G_SIGNAL_RUN_LAST, 0, NULL, NULL,
+                              g_cclosure_marshal_generic,
+                              G_TYPE_NONE, 1, G_TYPE_UINT64);
+}
+
+static gboolean
+on_timeout_emit_tick (gpointer user_data)
+{
+  MockTicker *self = user_data;
+  guint64 delta_usec = 0;
+  gint64 now = g_get_monotonic_time ();
+  if (self->last_tick != 0)
+    delta_usec = now - self->last_tick;
+  self->last_tick = now;
+  g_signal_emit (self, signal_tick, 0, delta_usec);
+  return TRUE; /* keep source around */
+}
+
+static MockTicker *
+mock_ticker_new (gint frequency_ms)
+{
+  MockTicker *ticker = g_object_new (mock_ticker_get_type (), NULL);
+  ticker->tick_id = g_timeout_add (frequency_ms, on_timeout_emit_tick, ticker);
+  return ticker;
+}
+
+/* A resource monitor with a history, like the CPU monitor */
+static void
+mock_monitor_sample (gpointer monitor)
+{
+  TimeSeries *series;
+  gdouble values[2] = { 1.0, 2.0 };
+
+  series = subscriptions_get_series (subscriptions_get_for_monitor (monitor));
+  time_series_add (series, g_get_real_time (), values);
+}
+
+/* -----------------------------------------------------------------------------
+ * Test
+ */
+
+#define MOCK_PATH "/test/mock"
+#define CGROUP_PATH "/test/cgroup"
+
+static const TimeSeriesLevel mock_levels[] = {
+  { 0, 100 },
+};
+
+typedef struct {
+  GQueue *samples;
+  CockpitBatchMonitor *proxy;
+  GDBusConnection *connection;
+} Client;
+
+typedef struct {
+  MockTicker *ticker;
+  GDBusObjectManagerServer *object_manager;
+  GTestDBus *bus;
+  gchar *testdir;
+
+  CockpitResourceMonitor *mock;
+  Subscriptions *mock_subscriptions;
+  TimeSeries *mock_series;
+  CockpitMultiResourceMonitor *cgroup;
+  CockpitBatchMonitor *batch;
+
+  Client one;
+  Client two;
+} TestCase;
+
+static void
+on_ready_get_result (GObject *source_object,
+                     GAsyncResult *result,
+                     gpointer user_data)
+{
+  GAsyncResult **ret = user_data;
+  g_assert (ret && !*ret);
+  *ret = g_object_ref (result);
+}
+
+static gboolean
+on_timeout_set_flag (gpointer user_data)
+{
+  gboolean *flag = user_data;
+  *flag = TRUE;
+  return FALSE;
+}
+
+static void
+wait_a_while (guint msec)
+{
+  gboolean timed_out = FALSE;
+
+  g_timeout_add (msec, on_timeout_set_flag, &timed_out);
+  while (!timed_out)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+set_file_contents (const gchar *directory,
+                   const gchar *file,
+                   const gchar *contents)
+{
+  GError *error = NULL;
+  gchar *path = g_build_filename (directory, file, NULL);
+  g_file_set_contents (path, contents, -1, &error);
+  g_assert_no_error (error);
+  g_free (path);
+}
+
+static void
+on_samples_stash (CockpitBatchMonitor *proxy,
+                  GVariant *samples,
+                  gpointer user_data)
+{
+  Client *client = user_data;
+  g_queue_push_tail (client->samples, g_variant_ref (samples));
+}
+
+static void
+client_setup (Client *client,
+              TestCase *tc,
+              const gchar *name)
+{
+  GAsyncResult *result = NULL;
+  GError *error = NULL;
+  gchar *address;
+
+  /* Every client has its own connection, and so its own unique name */
+  address = g_dbus_address_get_for_bus_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  g_assert_no_error (error);
+  client->connection = g_dbus_connection_new_for_address_sync (address,
+                                                               G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                               G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                               NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_free (address);
+
+  cockpit_batch_monitor_proxy_new (client->connection, G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
+                                   name, "/test/batch", NULL, on_ready_get_result, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  client->proxy = cockpit_batch_monitor_proxy_new_finish (result, &error);
+  g_assert_no_error (error);
+  g_object_unref (result);
+
+  client->samples = g_queue_new ();
+  g_signal_connect (client->proxy, "samples", G_CALLBACK (on_samples_stash), client);
+}
+
+static void
+client_teardown (Client *client)
+{
+  g_object_unref (client->proxy);
+  if (!g_dbus_connection_is_closed (client->connection))
+    g_dbus_connection_close_sync (client->connection, NULL, NULL);
+  g_object_unref (client->connection);
+  g_queue_free_full (client->samples, (GDestroyNotify)g_variant_unref);
+}
+
+static void
+export_interface (TestCase *tc,
+                  const gchar *path,
+                  gpointer iface)
+{
+  CockpitObjectSkeleton *object;
+
+  object = cockpit_object_skeleton_new (path);
+  if (COCKPIT_IS_RESOURCE_MONITOR (iface))
+    cockpit_object_skeleton_set_resource_monitor (object, iface);
+  else if (COCKPIT_IS_MULTI_RESOURCE_MONITOR (iface))
+    cockpit_object_skeleton_set_multi_resource_monitor (object, iface);
+  else
+    cockpit_object_skeleton_set_batch_monitor (object, iface);
+  g_dbus_object_manager_server_export (tc->object_manager, G_DBUS_OBJECT_SKELETON (object));
+  g_object_unref (object);
+}
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  GDBusConnection *connection;
+  GError *error = NULL;
+  gchar *dir;
+
+  tc->bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (tc->bus);
+
+  tc->object_manager = g_dbus_object_manager_server_new ("/test");
+  tc->ticker = mock_ticker_new (10);
+
+  tc->mock = cockpit_resource_monitor_skeleton_new ();
+  cockpit_resource_monitor_set_num_series (tc->mock, 2);
+  tc->mock_series = time_series_new (2, mock_levels, G_N_ELEMENTS (mock_levels));
+  tc->mock_subscriptions = subscriptions_new_sampling (tc->mock, G_OBJECT (tc->ticker), tc->mock_series,
+                                                       mock_monitor_sample);
+  subscriptions_set_linger (tc->mock_subscriptions, 0);
+  export_interface (tc, MOCK_PATH, tc->mock);
+
+  tc->testdir = g_strdup ("/tmp/cockpit-test-XXXXXX");
+  g_assert (g_mkdtemp (tc->testdir) != NULL);
+  dir = g_build_filename (tc->testdir, "memory", NULL);
+  g_assert_cmpint (g_mkdir (dir, 0700), ==, 0);
+  set_file_contents (dir, "memory.usage_in_bytes", "4042923");
+  g_free (dir);
+  dir = g_build_filename (tc->testdir, "cpuacct", NULL);
+  g_assert_cmpint (g_mkdir (dir, 0700), ==, 0);
+  set_file_contents (dir, "cpuacct.usage", "1000");
+  g_free (dir);
+
+  tc->cgroup = g_object_new (TYPE_CGROUP_MONITOR,
+                             "base-directory", tc->testdir,
+                             "tick-source", tc->ticker,
+                             NULL);
+  export_interface (tc, CGROUP_PATH, tc->cgroup);
+
+  tc->batch = batch_monitor_new (G_OBJECT (tc->ticker), tc->object_manager);
+  export_interface (tc, "/test/batch", tc->batch);
+
+  connection = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  g_assert_no_error (error);
+  g_dbus_object_manager_server_set_connection (tc->object_manager, connection);
+
+  client_setup (&tc->one, tc, g_dbus_connection_get_unique_name (connection));
+  client_setup (&tc->two, tc, g_dbus_connection_get_unique_name (connection));
+  g_object_unref (connection);
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  gchar *cmd;
+
+  client_teardown (&tc->one);
+  client_teardown (&tc->two);
+
+  g_object_unref (tc->object_manager);
+
+  g_object_add_weak_pointer (G_OBJECT (tc->batch), (gpointer *)&tc->batch);
+  g_object_unref (tc->batch);
+  g_assert (tc->batch == NULL);
+
+  g_object_add_weak_pointer (G_OBJECT (tc->cgroup), (gpointer *)&tc->cgroup);
+  g_object_unref (tc->cgroup);
+  g_assert (tc->cgroup == NULL);
+
+  subscriptions_free (tc->mock_subscriptions);
+  time_series_free (tc->mock_series);
+  g_object_add_weak_pointer (G_OBJECT (tc->mock), (gpointer *)&tc->mock);
+  g_object_unref (tc->mock);
+  g_assert (tc->mock == NULL);
+
+  g_object_unref (tc->ticker);
+
+  g_assert_cmpstr (strstr (tc->testdir, "/tmp"), ==, tc->testdir);
+  g_assert_cmpint (system (cmd = g_strdup_printf ("rm -r '%s'", tc->testdir)), ==, 0);
+  g_free (tc->testdir);
+  g_free (cmd);
+
+  g_test_dbus_down (tc->bus);
+  g_object_add_weak_pointer (G_OBJECT (tc->bus), (gpointer *)&tc->bus);
+  g_object_unref (tc->bus);
+  g_assert (tc->bus == NULL);
+
+  /* Wait for all updates to arrive asynchronously */
+  while (g_main_context_iteration (NULL, FALSE));
+}
+
+static void
+client_subscribe (Client *client,
+                  const gchar **monitors,
+                  GError **error)
+{
+  GAsyncResult *result = NULL;
+
+  cockpit_batch_monitor_call_subscribe (client->proxy, monitors, NULL, on_ready_get_result, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  cockpit_batch_monitor_call_subscribe_finish (client->proxy, result, error);
+  g_object_unref (result);
+}
+
+static void
+client_unsubscribe (Client *client,
+                    const gchar **monitors)
+{
+  GAsyncResult *result = NULL;
+  GError *error = NULL;
+
+  cockpit_batch_monitor_call_unsubscribe (client->proxy, monitors, NULL, on_ready_get_result, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  cockpit_batch_monitor_call_unsubscribe_finish (client->proxy, result, &error);
+  g_assert_no_error (error);
+  g_object_unref (result);
+}
+
+/* Count the samples of @path the client got, and check there is nothing else */
+static guint
+count_samples (Client *client,
+               const gchar *path,
+               const gchar *other)
+{
+  GVariantIter iter;
+  const gchar *object_path;
+  guint count = 0;
+  GList *l;
+
+  for (l = client->samples->head; l != NULL; l = g_list_next (l))
+    {
+      g_variant_iter_init (&iter, l->data);
+      while (g_variant_iter_next (&iter, "{&o(x@v)}", &object_path, NULL, NULL))
+        {
+          if (g_str_equal (object_path, path))
+            count++;
+          else if (other && g_str_equal (object_path, other))
+            ;
+          else
+            g_assert_not_reached ();
+        }
+    }
+
+  return count;
+}
+
+static void
+test_samples (TestCase *tc,
+              gconstpointer unused)
+{
+  const gchar *monitors[] = { MOCK_PATH, CGROUP_PATH, NULL };
+  GError *error = NULL;
+
+  client_subscribe (&tc->one, monitors, &error);
+  g_assert_no_error (error);
+
+  /* Held on behalf of the client, but it isn't subscribed itself */
+  g_assert (subscriptions_is_active (tc->mock_subscriptions));
+  g_assert (!subscriptions_has_subscribers (tc->mock_subscriptions));
+
+  while (count_samples (&tc->one, MOCK_PATH, CGROUP_PATH) < 3 ||
+         count_samples (&tc->one, CGROUP_PATH, MOCK_PATH) < 3)
+    g_main_context_iteration (NULL, TRUE);
+
+  client_unsubscribe (&tc->one, monitors);
+  while (subscriptions_is_active (tc->mock_subscriptions))
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+test_invalid_path (TestCase *tc,
+                   gconstpointer unused)
+{
+  const gchar *monitors[] = { MOCK_PATH, "/test/nothing", NULL };
+  GError *error = NULL;
+
+  client_subscribe (&tc->one, monitors, &error);
+  g_assert_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS);
+  g_error_free (error);
+
+  /* Nothing stays subscribed from the valid path before it */
+  wait_a_while (100);
+  g_assert (!subscriptions_is_active (tc->mock_subscriptions));
+  g_assert_cmpuint (g_queue_get_length (tc->one.samples), ==, 0);
+}
+
+static void
+test_per_client (TestCase *tc,
+                 gconstpointer unused)
+{
+  const gchar *mock[] = { MOCK_PATH, NULL };
+  const gchar *cgroup[] = { CGROUP_PATH, NULL };
+  GError *error = NULL;
+
+  client_subscribe (&tc->one, mock, &error);
+  g_assert_no_error (error);
+  client_subscribe (&tc->two, cgroup, &error);
+  g_assert_no_error (error);
+
+  /* Each client only gets what it asked for */
+  while (count_samples (&tc->one, MOCK_PATH, NULL) < 3 ||
+         count_samples (&tc->two, CGROUP_PATH, NULL) < 3)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* Subscribing twice still gives one sample per signal */
+  client_subscribe (&tc->two, mock, &error);
+  g_assert_no_error (error);
+  client_subscribe (&tc->two, mock, &error);
+  g_assert_no_error (error);
+  g_queue_foreach (tc->two.samples, (GFunc)g_variant_unref, NULL);
+  g_queue_clear (tc->two.samples);
+  while (count_samples (&tc->two, MOCK_PATH, CGROUP_PATH) < 3)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpuint (count_samples (&tc->two, MOCK_PATH, CGROUP_PATH), <=,
+                    g_queue_get_length (tc->two.samples));
+
+  client_unsubscribe (&tc->one, mock);
+  client_unsubscribe (&tc->two, mock);
+  client_unsubscribe (&tc->two, mock);
+  client_unsubscribe (&tc->two, cgroup);
+}
+
+static void
+test_client_vanishes (TestCase *tc,
+                      gconstpointer unused)
+{
+  const gchar *monitors[] = { MOCK_PATH, NULL };
+  GError *error = NULL;
+
+  client_subscribe (&tc->two, monitors, &error);
+  g_assert_no_error (error);
+  while (count_samples (&tc->two, MOCK_PATH, NULL) < 1)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert (subscriptions_is_active (tc->mock_subscriptions));
+
+  /* Without ever calling Unsubscribe */
+  g_dbus_connection_close_sync (tc->two.connection, NULL, &error);
+  g_assert_no_error (error);
+
+  while (subscriptions_is_active (tc->mock_subscriptions))
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+test_cgroup_timestamps (TestCase *tc,
+                        gconstpointer unused)
+{
+  const gchar *monitors[] = { CGROUP_PATH, NULL };
+  GError *error = NULL;
+  gint64 before;
+  gint64 last;
+  gint64 timestamp;
+  GVariant *sample;
+  GList *l;
+
+  before = g_get_real_time ();
+  client_subscribe (&tc->one, monitors, &error);
+  g_assert_no_error (error);
+
+  while (g_queue_get_length (tc->one.samples) < 5)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* Only samples collected after subscribing, and every one of them once */
+  last = before;
+  for (l = tc->one.samples->head; l != NULL; l = g_list_next (l))
+    {
+      g_assert (g_variant_lookup (l->data, CGROUP_PATH, "(x@v)", &timestamp, &sample));
+      g_assert_cmpint (timestamp, >, last);
+      last = timestamp;
+      g_variant_unref (sample);
+    }
+
+  client_unsubscribe (&tc->one, monitors);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/batch-monitor/samples", TestCase, NULL,
+              setup, test_samples, teardown);
+  g_test_add ("/batch-monitor/invalid-path", TestCase, NULL,
+              setup, test_invalid_path, teardown);
+  g_test_add ("/batch-monitor/per-client", TestCase, NULL,
+              setup, test_per_client, teardown);
+  g_test_add ("/batch-monitor/client-vanishes", TestCase, NULL,
+              setup, test_client_vanishes, teardown);
+  g_test_add ("/batch-monitor/cgroup-timestamps", TestCase, NULL,
+              setup, test_cgroup_timestamps, teardown);
+
+  return g_test_run ();
+}
@@ -20,6 +20,7 @@
 #include "config.h"
 
 #include "cgroupmonitor.h"
+#include "subscriptions.h"
 
 #include "cockpit/cockpittest.h"
 
@@ -223,6 +224,15 @@ setup (TestCase *tc,
   g_assert_no_error (error);
   g_object_unref (connection);
 
+  /* The monitor only samples while someone is subscribed */
+  result = NULL;
+  cockpit_multi_resource_monitor_call_subscribe (tc->proxy, NULL, on_ready_get_result, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  cockpit_multi_resource_monitor_call_subscribe_finish (tc->proxy, result, &error);
+  g_assert_no_error (error);
+  g_object_unref (result);
+
   g_signal_connect (tc->proxy, "new-sample", G_CALLBACK (on_new_sample_stash), tc);
   tc->samples_received = g_queue_new ();
 
@@ -281,6 +291,90 @@ test_new (void)
   g_assert (monitor == NULL);
 }
 
+static void
+on_new_sample_count (CockpitMultiResourceMonitor *monitor,
+                     gint64 timestamp,
+                     GVariant *data,
+                     gpointer user_data)
+{
+  gint *count = user_data;
+  (*count)++;
+}
+
+static gboolean
+on_timeout_set_flag (gpointer user_data)
+{
+  gboolean *flag = user_data;
+  *flag = TRUE;
+  return FALSE;
+}
+
+static void
+test_not_subscribed (void)
+{
+  CockpitMultiResourceMonitor *monitor;
+  MockTicker *ticker = mock_ticker_new (10);
+  gboolean timed_out = FALSE;
+  gint count = 0;
+
+  monitor = cgroup_monitor_new (G_OBJECT (ticker));
+  g_signal_connect (monitor, "new-sample", G_CALLBACK (on_new_sample_count), &count);
+
+  /* Ticks keep coming, but nobody has called Subscribe */
+  g_timeout_add (100, on_timeout_set_flag, &timed_out);
+  while (!timed_out)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpint (count, ==, 0);
+
+  g_object_add_weak_pointer (G_OBJECT (monitor), (gpointer *)&monitor);
+  g_object_unref (monitor);
+  g_assert (monitor == NULL);
+  g_object_unref (ticker);
+}
+
+static void
+test_held (void)
+{
+  CockpitMultiResourceMonitor *monitor;
+  MockTicker *ticker = mock_ticker_new (10);
+  Subscriptions *subscriptions;
+  gboolean timed_out = FALSE;
+  gint64 first = 0;
+  gint64 latest = 0;
+  GVariant *sample;
+  gint count = 0;
+
+  monitor = cgroup_monitor_new (G_OBJECT (ticker));
+  g_signal_connect (monitor, "new-sample", G_CALLBACK (on_new_sample_count), &count);
+
+  sample = cgroup_monitor_get_latest_sample (CGROUP_MONITOR (monitor), &first);
+  g_assert (sample != NULL);
+  g_variant_unref (g_variant_ref_sink (sample));
+
+  /* Held from within the daemon, samples are collected but not emitted */
+  subscriptions = subscriptions_get_for_monitor (monitor);
+  subscriptions_hold (subscriptions);
+  g_assert (subscriptions_is_active (subscriptions));
+  g_assert (!subscriptions_has_subscribers (subscriptions));
+
+  g_timeout_add (100, on_timeout_set_flag, &timed_out);
+  while (!timed_out)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpint (count, ==, 0);
+
+  sample = cgroup_monitor_get_latest_sample (CGROUP_MONITOR (monitor), &latest);
+  g_assert (sample != NULL);
+  g_assert_cmpint (latest, >, first);
+  g_variant_unref (g_variant_ref_sink (sample));
+
+  subscriptions_release (subscriptions);
+
+  g_object_add_weak_pointer (G_OBJECT (monitor), (gpointer *)&monitor);
+  g_object_unref (monitor);
+  g_assert (monitor == NULL);
+  g_object_unref (ticker);
+}
+
 static const TestFixture fixture_samples = {
   .data = {
     { "memory.usage_in_bytes", 4042923.0 },
@@ -452,6 +546,8 @@ main (int argc,
   cockpit_test_init (&argc, &argv);
 
   g_test_add_func ("/cgroup-monitor/new", test_new);
+  g_test_add_func ("/cgroup-monitor/not-subscribed", test_not_subscribed);
+  g_test_add_func ("/cgroup-monitor/held", test_held);
   g_test_add ("/cgroup-monitor/get-samples", TestCase, &fixture_samples,
               setup, test_get_samples, teardown);
   g_test_add ("/cgroup-monitor/new-sample", TestCase, &fixture_samples,
@@ -0,0 +1,415 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "journal.h"
+#include "journalcache.h"
+
+#include "cockpit/cockpittest.h"
+
+#include <glib/gstdio.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* More than the query pool has threads */
+#define N_QUERIES 8
+
+typedef struct {
+  GTestDBus *bus;
+  gchar *directory;
+  gboolean have_journal;
+  CockpitJournal *journal;
+  CockpitJournal *proxy;
+} TestCase;
+
+static const gchar *ten_entries[] = {
+  "MESSAGE=one", NULL,
+  "MESSAGE=two", NULL,
+  "MESSAGE=three", NULL,
+  "MESSAGE=four", NULL,
+  "MESSAGE=five", NULL,
+  "MESSAGE=six", NULL,
+  "MESSAGE=seven", NULL,
+  "MESSAGE=eight", NULL,
+  "MESSAGE=nine", NULL,
+  "MESSAGE=ten", NULL,
+  NULL
+};
+
+static const gchar *more_entries[] = {
+  "MESSAGE=eleven", NULL,
+  NULL
+};
+
+static void
+on_ready_get_result (GObject *source_object,
+                     GAsyncResult *result,
+                     gpointer user_data)
+{
+  GAsyncResult **ret = user_data;
+  g_assert (ret && !*ret);
+  *ret = g_object_ref (result);
+}
+
+static gboolean
+on_timeout_set_flag (gpointer user_data)
+{
+  gboolean *flag = user_data;
+  *flag = TRUE;
+  return FALSE;
+}
+
+static void
+wait_a_while (guint msec)
+{
+  gboolean timed_out = FALSE;
+
+  g_timeout_add (msec, on_timeout_set_flag, &timed_out);
+  while (!timed_out)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  GDBusConnection *connection;
+  GAsyncResult *result = NULL;
+  GError *error = NULL;
+
+  tc->bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (tc->bus);
+
+  tc->directory = g_strdup ("/tmp/cockpit-test-XXXXXX");
+  g_assert (g_mkdtemp (tc->directory) != NULL);
+  tc->have_journal = cockpit_test_write_journal (tc->directory, ten_entries);
+  journal_cache_set_directory (tc->directory);
+
+  /* Anyone may query, and waiting doesn't take long */
+  tc->journal = g_object_new (TYPE_JOURNAL,
+                              "role", NULL,
+                              "wait-timeout", 1,
+                              NULL);
+
+  connection = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  g_assert_no_error (error);
+  g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (tc->journal), connection,
+                                    "/test/journal", &error);
+  g_assert_no_error (error);
+
+  cockpit_journal_proxy_new (connection, G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
+                             g_dbus_connection_get_unique_name (connection),
+                             "/test/journal", NULL, on_ready_get_result, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  tc->proxy = cockpit_journal_proxy_new_finish (result, &error);
+  g_assert_no_error (error);
+  g_object_unref (result);
+
+  g_object_unref (connection);
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  gchar *cmd;
+
+  g_object_unref (tc->proxy);
+
+  g_dbus_interface_skeleton_unexport (G_DBUS_INTERFACE_SKELETON (tc->journal));
+  g_object_add_weak_pointer (G_OBJECT (tc->journal), (gpointer *)&tc->journal);
+  g_object_unref (tc->journal);
+  g_assert (tc->journal == NULL);
+
+  /* Close the cached journals before their files go away */
+  journal_cache_expire (0);
+  journal_cache_set_directory (NULL);
+
+  g_assert_cmpstr (strstr (tc->directory, "/tmp"), ==, tc->directory);
+  g_assert_cmpint (system (cmd = g_strdup_printf ("rm -r '%s'", tc->directory)), ==, 0);
+  g_free (tc->directory);
+  g_free (cmd);
+
+  g_test_dbus_down (tc->bus);
+  g_object_add_weak_pointer (G_OBJECT (tc->bus), (gpointer *)&tc->bus);
+  g_object_unref (tc->bus);
+  g_assert (tc->bus == NULL);
+
+  /* Wait for all updates to arrive asynchronously */
+  while (g_main_context_iteration (NULL, FALSE));
+}
+
+static gboolean
+skip_without_journal (TestCase *tc)
+{
+  if (tc->have_journal)
+    return FALSE;
+
+  cockpit_test_skip ("systemd-journal-remote not available");
+  return TRUE;
+}
+
+static void
+start_query (TestCase *tc,
+             const gchar *seek,
+             gint skip,
+             gint count,
+             gboolean wait,
+             GAsyncResult **result)
+{
+  const gchar *fields[] = { "MESSAGE", "__CURSOR", NULL };
+  GVariant *match;
+
+  match = g_variant_new_array (G_VARIANT_TYPE ("as"), NULL, 0);
+  cockpit_journal_call_query (tc->proxy, match, "", seek, skip, count, fields, 1000, wait,
+                              NULL, on_ready_get_result, result);
+}
+
+static GVariant *
+finish_query (TestCase *tc,
+              GAsyncResult *result,
+              gchar **last,
+              gboolean *eof)
+{
+  GError *error = NULL;
+  GVariant *entries;
+  gchar *first;
+  gint scanned;
+
+  cockpit_journal_call_query_finish (tc->proxy, &entries, &first, last, eof, &scanned,
+                                     result, &error);
+  g_assert_no_error (error);
+  g_free (first);
+  return entries;
+}
+
+static void
+assert_message (GVariant *entries,
+                gsize index,
+                const gchar *expected)
+{
+  GVariant *fields;
+  gchar *message;
+
+  fields = g_variant_get_child_value (entries, index);
+  g_variant_get_child (fields, 0, "s", &message);
+  g_assert_cmpstr (message, ==, expected);
+  g_variant_unref (fields);
+  g_free (message);
+}
+
+static void
+test_concurrent (TestCase *tc,
+                 gconstpointer unused)
+{
+  GAsyncResult *results[N_QUERIES] = { NULL, };
+  GVariant *entries;
+  gboolean eof;
+  gchar *last;
+  gint i;
+
+  if (skip_without_journal (tc))
+    return;
+
+  for (i = 0; i < N_QUERIES; i++)
+    start_query (tc, "head", 0, 20, FALSE, &results[i]);
+
+  /* All of them complete, though only some run at a time */
+  for (i = 0; i < N_QUERIES; i++)
+    {
+      while (results[i] == NULL)
+        g_main_context_iteration (NULL, TRUE);
+      entries = finish_query (tc, results[i], &last, &eof);
+      g_object_unref (results[i]);
+
+      g_assert_cmpuint (g_variant_n_children (entries), ==, 10);
+      assert_message (entries, 0, "one");
+      assert_message (entries, 9, "ten");
+      g_assert (eof);
+
+      g_variant_unref (entries);
+      g_free (last);
+    }
+}
+
+static gchar *
+query_last_cursor (TestCase *tc)
+{
+  GAsyncResult *result = NULL;
+  GVariant *entries;
+  gboolean eof;
+  gchar *last;
+
+  start_query (tc, "tail", -1, 1, FALSE, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  entries = finish_query (tc, result, &last, &eof);
+  g_object_unref (result);
+
+  g_assert_cmpuint (g_variant_n_children (entries), ==, 1);
+  assert_message (entries, 0, "ten");
+  g_variant_unref (entries);
+
+  return last;
+}
+
+static void
+test_wait (TestCase *tc,
+           gconstpointer unused)
+{
+  GAsyncResult *waiting[N_QUERIES] = { NULL, };
+  GAsyncResult *result = NULL;
+  GVariant *entries;
+  gboolean eof;
+  gchar *cursor;
+  gchar *last;
+  gint i;
+
+  if (skip_without_journal (tc))
+    return;
+
+  cursor = query_last_cursor (tc);
+
+  /* More waiting queries than the pool has threads */
+  for (i = 0; i < N_QUERIES; i++)
+    start_query (tc, cursor, 1, 10, TRUE, &waiting[i]);
+  wait_a_while (200);
+  for (i = 0; i < N_QUERIES; i++)
+    g_assert (waiting[i] == NULL);
+
+  /* Waiting doesn't take up a thread, other queries still run */
+  start_query (tc, "head", 0, 1, FALSE, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  entries = finish_query (tc, result, &last, &eof);
+  g_object_unref (result);
+  g_assert_cmpuint (g_variant_n_children (entries), ==, 1);
+  g_variant_unref (entries);
+  g_free (last);
+
+  for (i = 0; i < N_QUERIES; i++)
+    g_assert (waiting[i] == NULL);
+
+  /* A new entry wakes up every one of them */
+  g_assert (cockpit_test_write_journal (tc->directory, more_entries));
+  for (i = 0; i < N_QUERIES; i++)
+    {
+      while (waiting[i] == NULL)
+        g_main_context_iteration (NULL, TRUE);
+      entries = finish_query (tc, waiting[i], &last, &eof);
+      g_object_unref (waiting[i]);
+
+      g_assert_cmpuint (g_variant_n_children (entries), ==, 1);
+      assert_message (entries, 0, "eleven");
+
+      g_variant_unref (entries);
+      g_free (last);
+    }
+
+  g_free (cursor);
+}
+
+static void
+test_wait_timeout (TestCase *tc,
+                   gconstpointer unused)
+{
+  GAsyncResult *result = NULL;
+  GVariant *entries;
+  gint64 start;
+  gboolean eof;
+  gchar *cursor;
+  gchar *last;
+
+  if (skip_without_journal (tc))
+    return;
+
+  cursor = query_last_cursor (tc);
+
+  start = g_get_monotonic_time ();
+  start_query (tc, cursor, 1, 10, TRUE, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* Nothing new after the "wait-timeout", so it returns empty handed */
+  g_assert_cmpint (g_get_monotonic_time () - start, >=, G_USEC_PER_SEC / 2);
+  g_assert_cmpint (g_get_monotonic_time () - start, <, 5 * G_USEC_PER_SEC);
+
+  entries = finish_query (tc, result, &last, &eof);
+  g_object_unref (result);
+  g_assert_cmpuint (g_variant_n_children (entries), ==, 0);
+  g_assert (eof);
+
+  g_variant_unref (entries);
+  g_free (cursor);
+  g_free (last);
+}
+
+static void
+test_query_unique (TestCase *tc,
+                   gconstpointer unused)
+{
+  GAsyncResult *result = NULL;
+  GError *error = NULL;
+  GVariant *values;
+  const gchar **strv;
+  gint i;
+
+  if (skip_without_journal (tc))
+    return;
+
+  for (i = 0; i < 2; i++)
+    {
+      cockpit_journal_call_query_unique (tc->proxy, "MESSAGE", 100, NULL, on_ready_get_result, &result);
+      while (result == NULL)
+        g_main_context_iteration (NULL, TRUE);
+      cockpit_journal_call_query_unique_finish (tc->proxy, &values, result, &error);
+      g_assert_no_error (error);
+      g_object_unref (result);
+      result = NULL;
+
+      strv = g_variant_get_strv (values, NULL);
+      g_assert_cmpuint (g_strv_length ((gchar **)strv), ==, 10);
+      g_free (strv);
+      g_variant_unref (values);
+    }
+
+  /* Both used the same cached journal */
+  g_assert_cmpuint (journal_cache_expire (0), ==, 1);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/journal/query/concurrent", TestCase, NULL,
+              setup, test_concurrent, teardown);
+  g_test_add ("/journal/query/wait", TestCase, NULL,
+              setup, test_wait, teardown);
+  g_test_add ("/journal/query/wait-timeout", TestCase, NULL,
+              setup, test_wait_timeout, teardown);
+  g_test_add ("/journal/query-unique", TestCase, NULL,
+              setup, test_query_unique, teardown);
+
+  return g_test_run ();
+}
@@ -0,0 +1,318 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "journalcache.h"
+
+#include "cockpit/cockpittest.h"
+
+#include <glib/gstdio.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  gchar *directory;
+  gboolean have_journal;
+} TestCase;
+
+static const gchar *entries[] = {
+  "MESSAGE=one", "PRIORITY=6", NULL,
+  "MESSAGE=two", "PRIORITY=4", NULL,
+  "MESSAGE=three", "PRIORITY=6", NULL,
+  NULL
+};
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  tc->directory = g_strdup ("/tmp/cockpit-test-XXXXXX");
+  g_assert (g_mkdtemp (tc->directory) != NULL);
+  tc->have_journal = cockpit_test_write_journal (tc->directory, entries);
+  journal_cache_set_directory (tc->directory);
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  gchar *cmd;
+
+  journal_cache_expire (0);
+  journal_cache_set_directory (NULL);
+
+  g_assert_cmpstr (strstr (tc->directory, "/tmp"), ==, tc->directory);
+  g_assert_cmpint (system (cmd = g_strdup_printf ("rm -r '%s'", tc->directory)), ==, 0);
+  g_free (tc->directory);
+  g_free (cmd);
+}
+
+static gboolean
+skip_without_journal (TestCase *tc)
+{
+  if (tc->have_journal)
+    return FALSE;
+
+  cockpit_test_skip ("systemd-journal-remote not available");
+  return TRUE;
+}
+
+static JournalHandle *
+acquire (GDBusConnection *connection,
+         const gchar *sender,
+         const gchar *match)
+{
+  JournalHandle *handle;
+  GError *error = NULL;
+  GVariant *variant;
+  int ret = 0;
+
+  variant = g_variant_parse (G_VARIANT_TYPE ("aas"), match, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  handle = journal_cache_acquire (connection, sender, variant, &ret);
+  g_assert_cmpint (ret, ==, 0);
+  g_assert (handle != NULL);
+
+  g_variant_unref (variant);
+  return handle;
+}
+
+/* Moves the journal on by one entry, and gives it back */
+static gchar *
+release_next (JournalHandle *handle)
+{
+  sd_journal *j = journal_handle_get_journal (handle);
+  gchar *cursor = NULL;
+  char *str;
+
+  g_assert_cmpint (sd_journal_next (j), ==, 1);
+  g_assert_cmpint (sd_journal_get_cursor (j, &str), >=, 0);
+  cursor = g_strdup (str);
+  free (str);
+
+  journal_cache_release (handle, cursor);
+  return cursor;
+}
+
+static void
+test_reuse (TestCase *tc,
+            gconstpointer unused)
+{
+  JournalHandle *handle;
+  JournalHandle *again;
+  gchar *cursor;
+
+  if (skip_without_journal (tc))
+    return;
+
+  handle = acquire (NULL, ":1.1", "[['PRIORITY=6', 'MESSAGE=one'], ['PRIORITY=4']]");
+  g_assert (journal_handle_get_cursor (handle) == NULL);
+  cursor = release_next (handle);
+
+  /* The same matches in another order are the same journal */
+  again = acquire (NULL, ":1.1", "[['PRIORITY=4'], ['MESSAGE=one', 'PRIORITY=6']]");
+  g_assert (again == handle);
+  g_assert_cmpstr (journal_handle_get_cursor (again), ==, cursor);
+
+  /* And it is still where it was left */
+  g_assert_cmpint (sd_journal_test_cursor (journal_handle_get_journal (again), cursor), >, 0);
+  g_free (cursor);
+
+  /* While it's in use, the same sender gets another one */
+  handle = acquire (NULL, ":1.1", "[['PRIORITY=4'], ['MESSAGE=one', 'PRIORITY=6']]");
+  g_assert (handle != again);
+  journal_cache_release (handle, NULL);
+
+  /* Other senders and other matches get their own */
+  g_free (release_next (again));
+  handle = acquire (NULL, ":1.2", "[['PRIORITY=4'], ['MESSAGE=one', 'PRIORITY=6']]");
+  g_assert (handle != again);
+  g_assert (journal_handle_get_cursor (handle) == NULL);
+  journal_cache_release (handle, NULL);
+  handle = acquire (NULL, ":1.1", "[['PRIORITY=4']]");
+  g_assert (handle != again);
+  g_assert (journal_handle_get_cursor (handle) == NULL);
+  journal_cache_release (handle, NULL);
+
+  /* Released without a cursor means closed */
+  g_assert_cmpuint (journal_cache_expire (0), ==, 1);
+}
+
+static void
+test_no_sender (TestCase *tc,
+                gconstpointer unused)
+{
+  JournalHandle *handle;
+
+  if (skip_without_journal (tc))
+    return;
+
+  handle = acquire (NULL, NULL, "[]");
+  g_free (release_next (handle));
+
+  /* Not cached at all */
+  g_assert_cmpuint (journal_cache_expire (0), ==, 0);
+}
+
+static void
+test_expire (TestCase *tc,
+             gconstpointer unused)
+{
+  JournalHandle *handle;
+
+  if (skip_without_journal (tc))
+    return;
+
+  g_free (release_next (acquire (NULL, ":1.1", "[]")));
+  g_free (release_next (acquire (NULL, ":1.2", "[]")));
+
+  /* The cache closes journals once idle for 60 seconds */
+  g_assert_cmpuint (journal_cache_expire (60 * G_USEC_PER_SEC), ==, 0);
+
+  g_usleep (G_USEC_PER_SEC / 10);
+
+  /* Using a journal makes it fresh again */
+  handle = acquire (NULL, ":1.2", "[]");
+  g_free (release_next (handle));
+
+  g_assert_cmpuint (journal_cache_expire (G_USEC_PER_SEC / 20), ==, 1);
+  g_assert_cmpuint (journal_cache_expire (0), ==, 1);
+  g_assert_cmpuint (journal_cache_expire (0), ==, 0);
+}
+
+static void
+test_evict (TestCase *tc,
+            gconstpointer unused)
+{
+  const gchar *matches[] = { "[]", "[['PRIORITY=6']]", "[['PRIORITY=4']]",
+                             "[['MESSAGE=one']]", "[['MESSAGE=two']]", "[['MESSAGE=three']]" };
+  JournalHandle *handles[G_N_ELEMENTS (matches)];
+  gint i;
+
+  if (skip_without_journal (tc))
+    return;
+
+  for (i = 0; i < G_N_ELEMENTS (matches); i++)
+    handles[i] = acquire (NULL, ":1.1", matches[i]);
+  for (i = 0; i < G_N_ELEMENTS (matches); i++)
+    g_free (release_next (handles[i]));
+
+  /* Only a few per sender are kept open */
+  g_assert_cmpuint (journal_cache_expire (0), ==, 4);
+}
+
+static void
+on_name_owner_changed (GDBusConnection *connection,
+                       const gchar *sender_name,
+                       const gchar *object_path,
+                       const gchar *interface_name,
+                       const gchar *signal_name,
+                       GVariant *parameters,
+                       gpointer user_data)
+{
+  gboolean *gone = user_data;
+  const gchar *new_owner;
+
+  g_variant_get (parameters, "(&s&s&s)", NULL, NULL, &new_owner);
+  if (new_owner[0] == '\0')
+    *gone = TRUE;
+}
+
+static void
+test_forget_sender (TestCase *tc,
+                    gconstpointer unused)
+{
+  GDBusConnection *connection;
+  GDBusConnection *client;
+  GError *error = NULL;
+  gboolean gone = FALSE;
+  GTestDBus *bus;
+  gchar *address;
+  gchar *sender;
+  guint sig;
+
+  if (skip_without_journal (tc))
+    return;
+
+  bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (bus);
+
+  connection = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  g_assert_no_error (error);
+
+  address = g_dbus_address_get_for_bus_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  g_assert_no_error (error);
+  client = g_dbus_connection_new_for_address_sync (address,
+                                                   G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                   G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                   NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_free (address);
+  sender = g_strdup (g_dbus_connection_get_unique_name (client));
+
+  g_free (release_next (acquire (connection, sender, "[]")));
+  g_free (release_next (acquire (connection, sender, "[['PRIORITY=6']]")));
+  g_free (release_next (acquire (connection, ":1.9999", "[]")));
+
+  /* After the cache itself starts watching */
+  sig = g_dbus_connection_signal_subscribe (connection, "org.freedesktop.DBus",
+                                            "org.freedesktop.DBus", "NameOwnerChanged",
+                                            "/org/freedesktop/DBus", sender,
+                                            G_DBUS_SIGNAL_FLAGS_NONE,
+                                            on_name_owner_changed, &gone, NULL);
+
+  g_dbus_connection_close_sync (client, NULL, &error);
+  g_assert_no_error (error);
+  while (!gone)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* Only the journal of the other sender is left */
+  g_assert_cmpuint (journal_cache_expire (0), ==, 1);
+
+  g_dbus_connection_signal_unsubscribe (connection, sig);
+  g_object_unref (client);
+  g_object_unref (connection);
+  g_free (sender);
+
+  g_test_dbus_down (bus);
+  g_object_unref (bus);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/journal-cache/reuse", TestCase, NULL,
+              setup, test_reuse, teardown);
+  g_test_add ("/journal-cache/no-sender", TestCase, NULL,
+              setup, test_no_sender, teardown);
+  g_test_add ("/journal-cache/expire", TestCase, NULL,
+              setup, test_expire, teardown);
+  g_test_add ("/journal-cache/evict", TestCase, NULL,
+              setup, test_evict, teardown);
+  g_test_add ("/journal-cache/forget-sender", TestCase, NULL,
+              setup, test_forget_sender, teardown);
+
+  return g_test_run ();
+}
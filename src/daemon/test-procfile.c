@@ -0,0 +1,201 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "procfile.h"
+
+#include "cockpit/cockpittest.h"
+
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+  gchar *path;
+  ProcFile *file;
+} TestCase;
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  int fd;
+
+  tc->path = g_build_filename (g_get_tmp_dir (), "test-procfile.XXXXXX", NULL);
+  fd = g_mkstemp (tc->path);
+  g_assert (fd >= 0);
+  close (fd);
+
+  tc->file = proc_file_new (tc->path);
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  proc_file_free (tc->file);
+  g_unlink (tc->path);
+  g_free (tc->path);
+}
+
+/* Like /proc files, rewrite the same inode rather than replacing it */
+static void
+overwrite (TestCase *tc,
+           const gchar *contents)
+{
+  gsize length = strlen (contents);
+  int fd;
+
+  fd = open (tc->path, O_WRONLY | O_TRUNC);
+  g_assert (fd >= 0);
+  g_assert_cmpint (write (fd, contents, length), ==, length);
+  close (fd);
+}
+
+static void
+test_read_again (TestCase *tc,
+                 gconstpointer unused)
+{
+  GError *error = NULL;
+
+  overwrite (tc, "one\n");
+  g_assert_cmpstr (proc_file_read (tc->file, &error), ==, "one\n");
+  g_assert_no_error (error);
+
+  overwrite (tc, "two\nthree\n");
+  g_assert_cmpstr (proc_file_read (tc->file, &error), ==, "two\nthree\n");
+  g_assert_no_error (error);
+
+  overwrite (tc, "");
+  g_assert_cmpstr (proc_file_read (tc->file, &error), ==, "");
+  g_assert_no_error (error);
+}
+
+static void
+test_read_large (TestCase *tc,
+                 gconstpointer unused)
+{
+  GError *error = NULL;
+  GString *contents;
+  gint i;
+
+  contents = g_string_new ("");
+  for (i = 0; i < 10000; i++)
+    g_string_append_printf (contents, "line %d\n", i);
+
+  overwrite (tc, contents->str);
+  g_assert_cmpstr (proc_file_read (tc->file, &error), ==, contents->str);
+  g_assert_no_error (error);
+
+  g_string_free (contents, TRUE);
+}
+
+static void
+test_read_missing (void)
+{
+  GError *error = NULL;
+  ProcFile *file;
+
+  file = proc_file_new ("/non-existent");
+  g_assert (proc_file_read (file, &error) == NULL);
+  g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_NOENT);
+  g_error_free (error);
+  proc_file_free (file);
+}
+
+static void
+test_lines (void)
+{
+  const gchar *line;
+
+  line = "one\n\nthree\n";
+  g_assert (g_str_has_prefix (line, "one\n"));
+  line = proc_next_line (line);
+  g_assert (g_str_has_prefix (line, "\nthree"));
+  line = proc_next_line (line);
+  g_assert_cmpstr (line, ==, "three\n");
+  g_assert (proc_next_line (line) == NULL);
+
+  /* Last line without a newline */
+  line = proc_next_line ("one\ntwo");
+  g_assert_cmpstr (line, ==, "two");
+  g_assert (proc_next_line (line) == NULL);
+}
+
+static void
+test_parse (void)
+{
+  const gchar *pos;
+  const gchar *word;
+  guint64 value;
+  gsize length;
+
+  pos = "cpu  4705 356\t584 18446744073709551615\n9";
+  word = proc_parse_word (&pos, &length);
+  g_assert (word != NULL);
+  g_assert_cmpuint (length, ==, 3);
+  g_assert (strncmp (word, "cpu", 3) == 0);
+
+  g_assert (proc_parse_u64 (&pos, &value));
+  g_assert_cmpuint (value, ==, 4705);
+  g_assert (proc_parse_u64 (&pos, &value));
+  g_assert_cmpuint (value, ==, 356);
+  g_assert (proc_parse_u64 (&pos, &value));
+  g_assert_cmpuint (value, ==, 584);
+  g_assert (proc_parse_u64 (&pos, &value));
+  g_assert_cmpuint (value, ==, G_MAXUINT64);
+
+  /* Neither goes past the end of the line */
+  g_assert (!proc_parse_u64 (&pos, &value));
+  g_assert (proc_parse_word (&pos, &length) == NULL);
+  g_assert_cmpstr (pos, ==, "\n9");
+
+  /* A number directly after other text */
+  pos = "eth0:1215645 2751";
+  word = proc_parse_word (&pos, &length);
+  g_assert_cmpuint (length, ==, 12);
+  pos = word + 5;
+  g_assert (proc_parse_u64 (&pos, &value));
+  g_assert_cmpuint (value, ==, 1215645);
+
+  pos = "kB";
+  g_assert (!proc_parse_u64 (&pos, &value));
+  g_assert_cmpstr (pos, ==, "kB");
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/proc-file/read-again", TestCase, NULL,
+              setup, test_read_again, teardown);
+  g_test_add ("/proc-file/read-large", TestCase, NULL,
+              setup, test_read_large, teardown);
+  g_test_add_func ("/proc-file/read-missing", test_read_missing);
+  g_test_add_func ("/proc-file/lines", test_lines);
+  g_test_add_func ("/proc-file/parse", test_parse);
+
+  return g_test_run ();
+}
@@ -0,0 +1,704 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "timeseries.h"
+
+#include "cockpit/cockpittest.h"
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A multiple of ten seconds, so intervals line up with the samples */
+#define BASE ((gint64)1400000000 * G_USEC_PER_SEC)
+
+static const TimeSeriesLevel test_levels[] = {
+  { 0, 5 },
+  { 10, 3 },
+};
+
+typedef struct {
+  TimeSeries *series;
+} TestCase;
+
+typedef struct {
+  guint count;
+  gint64 timestamps[16];
+  gdouble values[16][2];
+} Collected;
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  gdouble values[2];
+  gint i;
+
+  tc->series = time_series_new (2, test_levels, G_N_ELEMENTS (test_levels));
+
+  /* 35 samples, half a millisecond after each second */
+  for (i = 0; i < 35; i++)
+    {
+      values[0] = i;
+      values[1] = -i;
+      time_series_add (tc->series, BASE + i * G_USEC_PER_SEC + 500, values);
+    }
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  time_series_free (tc->series);
+}
+
+static void
+on_sample_collect (gint64 timestamp,
+                   const gdouble *values,
+                   gpointer user_data)
+{
+  Collected *collected = user_data;
+
+  g_assert_cmpuint (collected->count, <, G_N_ELEMENTS (collected->timestamps));
+  collected->timestamps[collected->count] = timestamp;
+  collected->values[collected->count][0] = values[0];
+  collected->values[collected->count][1] = values[1];
+  collected->count++;
+}
+
+static void
+test_every_sample (TestCase *tc,
+                   gconstpointer data)
+{
+  Collected collected = { 0, };
+  gint i;
+
+  /* Only the newest five samples fit */
+  g_assert_cmpuint (time_series_foreach (tc->series, 0, TIME_SERIES_AVERAGE, 0, 0, 0,
+                                         on_sample_collect, &collected), ==, 5);
+  for (i = 0; i < 5; i++)
+    {
+      g_assert_cmpint (collected.timestamps[i], ==, BASE + (30 + i) * G_USEC_PER_SEC + 500);
+      g_assert_cmpfloat (collected.values[i][0], ==, 30 + i);
+      g_assert_cmpfloat (collected.values[i][1], ==, -30 - i);
+    }
+}
+
+static void
+test_out_of_order (TestCase *tc,
+                   gconstpointer data)
+{
+  Collected collected = { 0, };
+  gdouble values[2] = { 100, -100 };
+
+  /* As if the wall clock was set back, or repeated */
+  time_series_add (tc->series, BASE + 10 * G_USEC_PER_SEC, values);
+  time_series_add (tc->series, BASE + 34 * G_USEC_PER_SEC + 500, values);
+
+  g_assert_cmpuint (time_series_foreach (tc->series, 0, TIME_SERIES_AVERAGE, 0, 0, 0,
+                                         on_sample_collect, &collected), ==, 5);
+  g_assert_cmpint (collected.timestamps[4], ==, BASE + 34 * G_USEC_PER_SEC + 500);
+  g_assert_cmpfloat (collected.values[4][0], ==, 34);
+
+  /* Newer samples go in as usual */
+  time_series_add (tc->series, BASE + 35 * G_USEC_PER_SEC + 500, values);
+  memset (&collected, 0, sizeof (collected));
+  g_assert_cmpuint (time_series_foreach (tc->series, 0, TIME_SERIES_AVERAGE, 0, 0, 0,
+                                         on_sample_collect, &collected), ==, 5);
+  g_assert_cmpfloat (collected.values[4][0], ==, 100);
+}
+
+static void
+test_clock_step (TestCase *tc,
+                 gconstpointer data)
+{
+  Collected collected = { 0, };
+  gdouble values[2] = { 100, -100 };
+
+  /* As if the wall clock was set back by an hour */
+  cockpit_expect_message ("Clock went back by 3600 seconds, discarding sample history");
+  time_series_add (tc->series, BASE + (34 - 3600) * G_USEC_PER_SEC + 500, values);
+  cockpit_assert_expected ();
+
+  /* The history starts over, instead of waiting for the clock to catch up */
+  g_assert_cmpuint (time_series_foreach (tc->series, 0, TIME_SERIES_AVERAGE, 0, 0, 0,
+                                         on_sample_collect, &collected), ==, 1);
+  g_assert_cmpint (collected.timestamps[0], ==, BASE + (34 - 3600) * G_USEC_PER_SEC + 500);
+  g_assert_cmpfloat (collected.values[0][0], ==, 100);
+  g_assert_cmpuint (time_series_foreach (tc->series, 1, TIME_SERIES_AVERAGE, 0, 0, 0,
+                                         on_sample_collect, &collected), ==, 0);
+
+  values[0] = 200;
+  time_series_add (tc->series, BASE + (44 - 3600) * G_USEC_PER_SEC + 500, values);
+  memset (&collected, 0, sizeof (collected));
+  g_assert_cmpuint (time_series_foreach (tc->series, 1, TIME_SERIES_AVERAGE, 0, 0, 0,
+                                         on_sample_collect, &collected), ==, 1);
+  g_assert_cmpint (collected.timestamps[0], ==, BASE - 3570 * G_USEC_PER_SEC);
+  g_assert_cmpfloat (collected.values[0][0], ==, 100);
+}
+
+static void
+test_aggregates (TestCase *tc,
+                 gconstpointer data)
+{
+  Collected collected = { 0, };
+  gint i;
+
+  /* The interval from 30 to 39 is still being filled */
+  g_assert_cmpuint (time_series_foreach (tc->series, 1, TIME_SERIES_AVERAGE, 0, 0, 0,
+                                         on_sample_collect, &collected), ==, 3);
+  for (i = 0; i < 3; i++)
+    {
+      g_assert_cmpint (collected.timestamps[i], ==, BASE + i * 10 * G_USEC_PER_SEC);
+      g_assert_cmpfloat (collected.values[i][0], ==, i * 10 + 4.5);
+      g_assert_cmpfloat (collected.values[i][1], ==, -(i * 10 + 4.5));
+    }
+
+  memset (&collected, 0, sizeof (collected));
+  time_series_foreach (tc->series, 1, TIME_SERIES_MINIMUM, 0, 0, 0, on_sample_collect, &collected);
+  g_assert_cmpfloat (collected.values[2][0], ==, 20);
+  g_assert_cmpfloat (collected.values[2][1], ==, -29);
+
+  memset (&collected, 0, sizeof (collected));
+  time_series_foreach (tc->series, 1, TIME_SERIES_MAXIMUM, 0, 0, 0, on_sample_collect, &collected);
+  g_assert_cmpfloat (collected.values[2][0], ==, 29);
+  g_assert_cmpfloat (collected.values[2][1], ==, -20);
+}
+
+static void
+test_range (TestCase *tc,
+            gconstpointer data)
+{
+  Collected collected = { 0, };
+
+  g_assert_cmpuint (time_series_foreach (tc->series, 0, TIME_SERIES_AVERAGE,
+                                         BASE + 31 * G_USEC_PER_SEC,
+                                         BASE + 33 * G_USEC_PER_SEC + 500, 0,
+                                         on_sample_collect, &collected), ==, 3);
+  g_assert_cmpfloat (collected.values[0][0], ==, 31);
+  g_assert_cmpfloat (collected.values[2][0], ==, 33);
+
+  /* Both ends are included */
+  memset (&collected, 0, sizeof (collected));
+  g_assert_cmpuint (time_series_foreach (tc->series, 0, TIME_SERIES_AVERAGE,
+                                         BASE + 30 * G_USEC_PER_SEC + 500,
+                                         BASE + 34 * G_USEC_PER_SEC + 500, 0,
+                                         on_sample_collect, &collected), ==, 5);
+  g_assert_cmpfloat (collected.values[0][0], ==, 30);
+  g_assert_cmpfloat (collected.values[4][0], ==, 34);
+
+  /* Ranges outside of what's kept */
+  g_assert_cmpuint (time_series_foreach (tc->series, 0, TIME_SERIES_AVERAGE,
+                                         BASE + 35 * G_USEC_PER_SEC, 0, 0,
+                                         on_sample_collect, &collected), ==, 0);
+  g_assert_cmpuint (time_series_foreach (tc->series, 0, TIME_SERIES_AVERAGE,
+                                         0, BASE + 30 * G_USEC_PER_SEC, 0,
+                                         on_sample_collect, &collected), ==, 0);
+  g_assert_cmpuint (time_series_foreach (tc->series, 0, TIME_SERIES_AVERAGE,
+                                         BASE + 32 * G_USEC_PER_SEC,
+                                         BASE + 32 * G_USEC_PER_SEC + 100, 0,
+                                         on_sample_collect, &collected), ==, 0);
+
+  /* The newest ones are kept */
+  memset (&collected, 0, sizeof (collected));
+  g_assert_cmpuint (time_series_foreach (tc->series, 0, TIME_SERIES_AVERAGE, 0, 0, 2,
+                                         on_sample_collect, &collected), ==, 2);
+  g_assert_cmpfloat (collected.values[0][0], ==, 33);
+  g_assert_cmpfloat (collected.values[1][0], ==, 34);
+}
+
+static void
+test_find_level (TestCase *tc,
+                 gconstpointer data)
+{
+  g_assert_cmpuint (time_series_find_level (tc->series, 0, 0), ==, 0);
+  g_assert_cmpuint (time_series_find_level (tc->series, 1, 0), ==, 0);
+  g_assert_cmpuint (time_series_find_level (tc->series, 5, 0), ==, 1);
+  g_assert_cmpuint (time_series_find_level (tc->series, 3600, 0), ==, 1);
+
+  g_assert_cmpuint (time_series_find_level (tc->series, 0, BASE + 31 * G_USEC_PER_SEC), ==, 0);
+  g_assert_cmpuint (time_series_find_level (tc->series, 0, BASE + 10 * G_USEC_PER_SEC), ==, 1);
+
+  /* Nothing reaches back that far, so the one with the most history */
+  g_assert_cmpuint (time_series_find_level (tc->series, 0, 1), ==, 1);
+}
+
+static void
+test_build_samples (TestCase *tc,
+                    gconstpointer data)
+{
+  GError *error = NULL;
+  GVariant *options;
+  GVariant *samples;
+  gint64 timestamp;
+  GVariant *values;
+  const gdouble *array;
+  gsize len;
+
+  /* Without options the newest samples, up to the maximum */
+  samples = time_series_build_samples (tc->series, NULL, 4, &error);
+  g_assert_no_error (error);
+  g_variant_ref_sink (samples);
+  g_assert_cmpstr (g_variant_get_type_string (samples), ==, "a(xad)");
+  g_assert_cmpuint (g_variant_n_children (samples), ==, 4);
+  g_variant_get_child (samples, 0, "(x@ad)", &timestamp, &values);
+  g_assert_cmpint (timestamp, ==, BASE + 31 * G_USEC_PER_SEC + 500);
+  array = g_variant_get_fixed_array (values, &len, sizeof (gdouble));
+  g_assert_cmpuint (len, ==, 2);
+  g_assert_cmpfloat (array[0], ==, 31);
+  g_assert_cmpfloat (array[1], ==, -31);
+  g_variant_unref (values);
+  g_variant_unref (samples);
+
+  options = g_variant_ref_sink (g_variant_new_parsed ("{'resolution': <@u 10>, 'aggregate': <'maximum'>}"));
+  samples = time_series_build_samples (tc->series, options, 4, &error);
+  g_assert_no_error (error);
+  g_variant_ref_sink (samples);
+  g_assert_cmpuint (g_variant_n_children (samples), ==, 3);
+  g_variant_get_child (samples, 0, "(x@ad)", &timestamp, &values);
+  g_assert_cmpint (timestamp, ==, BASE);
+  array = g_variant_get_fixed_array (values, &len, sizeof (gdouble));
+  g_assert_cmpfloat (array[0], ==, 9);
+  g_assert_cmpfloat (array[1], ==, 0);
+  g_variant_unref (values);
+  g_variant_unref (samples);
+  g_variant_unref (options);
+}
+
+static void
+test_build_invalid (TestCase *tc,
+                    gconstpointer data)
+{
+  GError *error = NULL;
+  GVariant *options;
+
+  options = g_variant_ref_sink (g_variant_new_parsed ("{'since': <'yesterday'>}"));
+  g_assert (time_series_build_samples (tc->series, options, 4, &error) == NULL);
+  g_assert_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS);
+  g_clear_error (&error);
+  g_variant_unref (options);
+
+  options = g_variant_ref_sink (g_variant_new_parsed ("{'aggregate': <'median'>}"));
+  g_assert (time_series_build_samples (tc->series, options, 4, &error) == NULL);
+  g_assert_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS);
+  g_clear_error (&error);
+  g_variant_unref (options);
+}
+
+static void
+test_build_since (TestCase *tc,
+                  gconstpointer data)
+{
+  GError *error = NULL;
+  GVariant *options;
+  GVariant *samples;
+  GVariant *timestamps;
+  GVariant *values;
+  const gint64 *ts;
+  const gdouble *array;
+  gsize len;
+
+  /* Without a start, the newest samples up to the maximum */
+  samples = time_series_build_samples_since (tc->series, 0, NULL, 2, &error);
+  g_assert_no_error (error);
+  g_variant_ref_sink (samples);
+  g_assert_cmpstr (g_variant_get_type_string (samples), ==, "(axad)");
+  g_variant_get (samples, "(@ax@ad)", &timestamps, &values);
+  ts = g_variant_get_fixed_array (timestamps, &len, sizeof (gint64));
+  g_assert_cmpuint (len, ==, 2);
+  g_assert_cmpint (ts[0], ==, BASE + 33 * G_USEC_PER_SEC + 500);
+  g_assert_cmpint (ts[1], ==, BASE + 34 * G_USEC_PER_SEC + 500);
+  array = g_variant_get_fixed_array (values, &len, sizeof (gdouble));
+  g_assert_cmpuint (len, ==, 4);
+  g_assert_cmpfloat (array[0], ==, 33);
+  g_assert_cmpfloat (array[1], ==, -33);
+  g_assert_cmpfloat (array[2], ==, 34);
+  g_assert_cmpfloat (array[3], ==, -34);
+  g_variant_unref (timestamps);
+  g_variant_unref (values);
+  g_variant_unref (samples);
+
+  /* Only samples newer than the start, without a maximum */
+  samples = time_series_build_samples_since (tc->series, BASE + 31 * G_USEC_PER_SEC + 500, NULL, 1, &error);
+  g_assert_no_error (error);
+  g_variant_ref_sink (samples);
+  g_variant_get (samples, "(@ax@ad)", &timestamps, &values);
+  ts = g_variant_get_fixed_array (timestamps, &len, sizeof (gint64));
+  g_assert_cmpuint (len, ==, 3);
+  g_assert_cmpint (ts[0], ==, BASE + 32 * G_USEC_PER_SEC + 500);
+  g_variant_unref (timestamps);
+  g_variant_unref (values);
+  g_variant_unref (samples);
+
+  /* Nothing new */
+  samples = time_series_build_samples_since (tc->series, BASE + 34 * G_USEC_PER_SEC + 500, NULL, 1, &error);
+  g_assert_no_error (error);
+  g_variant_ref_sink (samples);
+  g_variant_get (samples, "(@ax@ad)", &timestamps, &values);
+  g_assert_cmpuint (g_variant_n_children (timestamps), ==, 0);
+  g_assert_cmpuint (g_variant_n_children (values), ==, 0);
+  g_variant_unref (timestamps);
+  g_variant_unref (values);
+  g_variant_unref (samples);
+
+  /* Quantized and delta encoded */
+  options = g_variant_ref_sink (g_variant_new_parsed ("{'quantum': <2.0>, 'delta': <true>}"));
+  samples = time_series_build_samples_since (tc->series, BASE + 31 * G_USEC_PER_SEC + 500, options, 1, &error);
+  g_assert_no_error (error);
+  g_variant_ref_sink (samples);
+  g_variant_get (samples, "(@ax@ad)", &timestamps, &values);
+  ts = g_variant_get_fixed_array (timestamps, &len, sizeof (gint64));
+  g_assert_cmpuint (len, ==, 3);
+  g_assert_cmpint (ts[0], ==, BASE + 32 * G_USEC_PER_SEC + 500);
+  g_assert_cmpint (ts[1], ==, G_USEC_PER_SEC);
+  g_assert_cmpint (ts[2], ==, G_USEC_PER_SEC);
+  array = g_variant_get_fixed_array (values, &len, sizeof (gdouble));
+  g_assert_cmpuint (len, ==, 6);
+  g_assert_cmpfloat (array[0], ==, 16);
+  g_assert_cmpfloat (array[1], ==, -16);
+  g_assert_cmpfloat (array[2], ==, 1);
+  g_assert_cmpfloat (array[3], ==, -1);
+  g_assert_cmpfloat (array[4], ==, 0);
+  g_assert_cmpfloat (array[5], ==, 0);
+  g_variant_unref (timestamps);
+  g_variant_unref (values);
+  g_variant_unref (samples);
+  g_variant_unref (options);
+}
+
+static void
+test_build_since_invalid (TestCase *tc,
+                          gconstpointer data)
+{
+  GError *error = NULL;
+  GVariant *options;
+
+  options = g_variant_ref_sink (g_variant_new_parsed ("{'delta': <true>}"));
+  g_assert (time_series_build_samples_since (tc->series, 0, options, 4, &error) == NULL);
+  g_assert_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS);
+  g_clear_error (&error);
+  g_variant_unref (options);
+
+  options = g_variant_ref_sink (g_variant_new_parsed ("{'quantum': <0.0>}"));
+  g_assert (time_series_build_samples_since (tc->series, 0, options, 4, &error) == NULL);
+  g_assert_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS);
+  g_clear_error (&error);
+  g_variant_unref (options);
+
+  options = g_variant_ref_sink (g_variant_new_parsed ("{'quantum': <@u 1>}"));
+  g_assert (time_series_build_samples_since (tc->series, 0, options, 4, &error) == NULL);
+  g_assert_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS);
+  g_clear_error (&error);
+  g_variant_unref (options);
+}
+
+typedef struct {
+  gchar *directory;
+  gchar *path;
+} TestArchive;
+
+static void
+setup_archive (TestArchive *tc,
+               gconstpointer data)
+{
+  tc->directory = g_strdup ("/tmp/cockpit-test-XXXXXX");
+  g_assert (g_mkdtemp (tc->directory) != NULL);
+
+  /* The directory of the archive is created as needed */
+  tc->path = g_build_filename (tc->directory, "samples", "test", NULL);
+}
+
+static void
+teardown_archive (TestArchive *tc,
+                  gconstpointer data)
+{
+  gchar *cmd;
+
+  g_assert (g_str_has_prefix (tc->directory, "/tmp/"));
+  g_assert_cmpint (system (cmd = g_strdup_printf ("rm -r '%s'", tc->directory)), ==, 0);
+  g_free (cmd);
+
+  g_free (tc->directory);
+  g_free (tc->path);
+}
+
+static void
+add_samples (TimeSeries *series,
+             gint from,
+             gint to)
+{
+  gdouble values[2];
+  gint i;
+
+  for (i = from; i < to; i++)
+    {
+      values[0] = i;
+      values[1] = -i;
+      time_series_add (series, BASE + i * G_USEC_PER_SEC, values);
+    }
+}
+
+static void
+test_archive_reopen (TestArchive *tc,
+                     gconstpointer data)
+{
+  Collected collected = { 0, };
+  TimeSeries *series;
+
+  series = time_series_new_archived (tc->path, 2, test_levels, G_N_ELEMENTS (test_levels));
+  add_samples (series, 0, 25);
+  time_series_free (series);
+
+  series = time_series_new_archived (tc->path, 2, test_levels, G_N_ELEMENTS (test_levels));
+  g_assert_cmpuint (time_series_foreach (series, 0, TIME_SERIES_AVERAGE, 0, 0, 0,
+                                         on_sample_collect, &collected), ==, 5);
+  g_assert_cmpfloat (collected.values[4][0], ==, 24);
+
+  /* The interval that was being filled carries on */
+  add_samples (series, 25, 31);
+  memset (&collected, 0, sizeof (collected));
+  g_assert_cmpuint (time_series_foreach (series, 1, TIME_SERIES_AVERAGE, 0, 0, 0,
+                                         on_sample_collect, &collected), ==, 3);
+  g_assert_cmpfloat (collected.values[2][0], ==, 24.5);
+  time_series_free (series);
+}
+
+static void
+test_archive_clock_step (TestArchive *tc,
+                         gconstpointer data)
+{
+  Collected collected = { 0, };
+  TimeSeries *series;
+
+  /* Written while the clock was a day ahead */
+  series = time_series_new_archived (tc->path, 2, test_levels, G_N_ELEMENTS (test_levels));
+  add_samples (series, 86400, 86425);
+  time_series_free (series);
+
+  series = time_series_new_archived (tc->path, 2, test_levels, G_N_ELEMENTS (test_levels));
+  cockpit_expect_message ("Clock went back by 86424 seconds, discarding sample history");
+  add_samples (series, 0, 3);
+  cockpit_assert_expected ();
+
+  g_assert_cmpuint (time_series_foreach (series, 0, TIME_SERIES_AVERAGE, 0, 0, 0,
+                                         on_sample_collect, &collected), ==, 3);
+  g_assert_cmpfloat (collected.values[0][0], ==, 0);
+  g_assert_cmpfloat (collected.values[2][0], ==, 2);
+  time_series_free (series);
+
+  /* And the fresh start is what's kept */
+  series = time_series_new_archived (tc->path, 2, test_levels, G_N_ELEMENTS (test_levels));
+  memset (&collected, 0, sizeof (collected));
+  g_assert_cmpuint (time_series_foreach (series, 0, TIME_SERIES_AVERAGE, 0, 0, 0,
+                                         on_sample_collect, &collected), ==, 3);
+  g_assert_cmpfloat (collected.values[2][0], ==, 2);
+  time_series_free (series);
+}
+
+static void
+test_archive_allocated (TestArchive *tc,
+                        gconstpointer data)
+{
+  TimeSeries *series;
+  struct stat st;
+
+  /* No holes that could fault the mapping when the disk fills up */
+  series = time_series_new_archived (tc->path, 2, test_levels, G_N_ELEMENTS (test_levels));
+  g_assert_cmpint (g_stat (tc->path, &st), ==, 0);
+  g_assert_cmpint (st.st_size, >, 0);
+  g_assert_cmpuint ((guint64)st.st_blocks * 512, >=, st.st_size);
+  time_series_free (series);
+}
+
+static void
+test_archive_layout (TestArchive *tc,
+                     gconstpointer data)
+{
+  static const TimeSeriesLevel other_levels[] = {
+    { 0, 6 },
+    { 10, 3 },
+  };
+
+  Collected collected = { 0, };
+  TimeSeries *series;
+
+  series = time_series_new_archived (tc->path, 2, test_levels, G_N_ELEMENTS (test_levels));
+  add_samples (series, 0, 25);
+  time_series_free (series);
+
+  /* Different levels, so the archive starts over */
+  series = time_series_new_archived (tc->path, 2, other_levels, G_N_ELEMENTS (other_levels));
+  g_assert_cmpuint (time_series_foreach (series, 0, TIME_SERIES_AVERAGE, 0, 0, 0,
+                                         on_sample_collect, &collected), ==, 0);
+  time_series_free (series);
+}
+
+static void
+test_archive_damaged (TestArchive *tc,
+                      gconstpointer data)
+{
+  Collected collected = { 0, };
+  TimeSeries *series;
+  gint64 bogus = G_MAXINT64 / 2;
+  FILE *file;
+
+  series = time_series_new_archived (tc->path, 2, test_levels, G_N_ELEMENTS (test_levels));
+  add_samples (series, 0, 31);
+  time_series_free (series);
+
+  /*
+   * Samples 26 to 30 are in slots 1, 2, 3, 4, 0. Make the timestamp of
+   * sample 27 newer than the ones after it. The timestamps of the
+   * first level start after the 16 byte header and two 40 byte level
+   * headers.
+   */
+  file = fopen (tc->path, "r+b");
+  g_assert (file != NULL);
+  g_assert_cmpint (fseek (file, 16 + 2 * 40 + 2 * sizeof (gint64), SEEK_SET), ==, 0);
+  g_assert_cmpuint (fwrite (&bogus, sizeof (bogus), 1, file), ==, 1);
+  fclose (file);
+
+  cockpit_expect_message ("Discarding 2 damaged samples in archive");
+  series = time_series_new_archived (tc->path, 2, test_levels, G_N_ELEMENTS (test_levels));
+  g_assert_cmpuint (time_series_foreach (series, 0, TIME_SERIES_AVERAGE, 0, 0, 0,
+                                         on_sample_collect, &collected), ==, 3);
+  g_assert_cmpfloat (collected.values[0][0], ==, 28);
+  time_series_free (series);
+
+  cockpit_assert_expected ();
+}
+
+static void
+test_archive_position (TestArchive *tc,
+                       gconstpointer data)
+{
+  Collected collected = { 0, };
+  TimeSeries *series;
+  guint32 position[2] = { 4, 2 };
+  FILE *file;
+
+  series = time_series_new_archived (tc->path, 2, test_levels, G_N_ELEMENTS (test_levels));
+  add_samples (series, 0, 31);
+  time_series_free (series);
+
+  /*
+   * The position of the first level didn't reach the disk, and is
+   * from three samples ago. It's after the 16 byte header, and the
+   * interval, length and planes of the level.
+   */
+  file = fopen (tc->path, "r+b");
+  g_assert (file != NULL);
+  g_assert_cmpint (fseek (file, 16 + 16, SEEK_SET), ==, 0);
+  g_assert_cmpuint (fwrite (position, sizeof (position), 1, file), ==, 1);
+  fclose (file);
+
+  /* All samples are found anyway */
+  series = time_series_new_archived (tc->path, 2, test_levels, G_N_ELEMENTS (test_levels));
+  g_assert_cmpuint (time_series_foreach (series, 0, TIME_SERIES_AVERAGE, 0, 0, 0,
+                                         on_sample_collect, &collected), ==, 5);
+  g_assert_cmpfloat (collected.values[0][0], ==, 26);
+  g_assert_cmpfloat (collected.values[4][0], ==, 30);
+
+  /* And new ones go after them */
+  add_samples (series, 31, 32);
+  memset (&collected, 0, sizeof (collected));
+  g_assert_cmpuint (time_series_foreach (series, 0, TIME_SERIES_AVERAGE, 0, 0, 0,
+                                         on_sample_collect, &collected), ==, 5);
+  g_assert_cmpfloat (collected.values[4][0], ==, 31);
+  time_series_free (series);
+}
+
+static void
+test_archive_unusable (void)
+{
+  TimeSeries *series;
+
+  /* Falls back to memory */
+  cockpit_expect_message ("Couldn't create directory /dev/null:*");
+  series = time_series_new_archived ("/dev/null/samples", 2, test_levels, G_N_ELEMENTS (test_levels));
+  g_assert (series != NULL);
+  add_samples (series, 0, 3);
+  time_series_free (series);
+
+  cockpit_assert_expected ();
+}
+
+static void
+test_default_size (void)
+{
+  TimeSeries *series;
+
+  /* The numbers documented for the default levels */
+  series = time_series_new (4, NULL, 0);
+  g_assert_cmpuint (time_series_get_n_levels (series), ==, 3);
+  g_assert_cmpuint (time_series_get_size (series), <, 1300 * 1024);
+  time_series_free (series);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/time-series/every-sample", TestCase, NULL,
+              setup, test_every_sample, teardown);
+  g_test_add ("/time-series/out-of-order", TestCase, NULL,
+              setup, test_out_of_order, teardown);
+  g_test_add ("/time-series/clock-step", TestCase, NULL,
+              setup, test_clock_step, teardown);
+  g_test_add ("/time-series/aggregates", TestCase, NULL,
+              setup, test_aggregates, teardown);
+  g_test_add ("/time-series/range", TestCase, NULL,
+              setup, test_range, teardown);
+  g_test_add ("/time-series/find-level", TestCase, NULL,
+              setup, test_find_level, teardown);
+  g_test_add ("/time-series/build-samples", TestCase, NULL,
+              setup, test_build_samples, teardown);
+  g_test_add ("/time-series/build-invalid", TestCase, NULL,
+              setup, test_build_invalid, teardown);
+  g_test_add ("/time-series/build-since", TestCase, NULL,
+              setup, test_build_since, teardown);
+  g_test_add ("/time-series/build-since-invalid", TestCase, NULL,
+              setup, test_build_since_invalid, teardown);
+  g_test_add_func ("/time-series/default-size", test_default_size);
+
+  g_test_add ("/time-series/archive/reopen", TestArchive, NULL,
+              setup_archive, test_archive_reopen, teardown_archive);
+  g_test_add ("/time-series/archive/clock-step", TestArchive, NULL,
+              setup_archive, test_archive_clock_step, teardown_archive);
+  g_test_add ("/time-series/archive/allocated", TestArchive, NULL,
+              setup_archive, test_archive_allocated, teardown_archive);
+  g_test_add ("/time-series/archive/layout", TestArchive, NULL,
+              setup_archive, test_archive_layout, teardown_archive);
+  g_test_add ("/time-series/archive/damaged", TestArchive, NULL,
+              setup_archive, test_archive_damaged, teardown_archive);
+  g_test_add ("/time-series/archive/position", TestArchive, NULL,
+              setup_archive, test_archive_position, teardown_archive);
+  g_test_add_func ("/time-series/archive/unusable", test_archive_unusable);
+
+  return g_test_run ();
+}
@@ -0,0 +1,1212 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "timeseries.h"
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * TimeSeries:
+ *
+ * Sample history of a resource monitor, kept at several resolutions.
+ * The first level usually stores every sample as it arrives, and each
+ * further level stores the minimum, average and maximum of all samples
+ * that fell into one of its intervals. All levels are fed directly from
+ * the incoming samples, so aggregates are exact and cost a constant
+ * amount of work per sample. The interval that is currently being
+ * filled isn't visible until it is complete.
+ *
+ * Each level is a ring of fixed length, so the memory used never
+ * grows. Values are stored one array per series and aggregate, which
+ * keeps each ring compact and lets a range of one series be read
+ * without touching the others.
+ *
+ * A level of length L costs 8 * L bytes for the timestamps, plus
+ * 8 * L bytes per series if it stores every sample, or 24 * L bytes
+ * per series if it stores aggregates. With the default levels that is
+ * about 100 KiB plus 292 KiB per series, so 1.2 MiB for the four
+ * series of the CPU monitor. Memory that was never written to isn't
+ * backed by pages, so a young series is much cheaper than that.
+ *
+ * A store can also live in a file, see time_series_new_archived().
+ * The file is the same block of memory that an unarchived store
+ * allocates, mapped shared. Adding a sample costs the same as in
+ * memory, and the kernel writes the dirty pages back on its own. The
+ * file is allocated in full when it's opened, so that running out of
+ * disk space later can't fault the mapping. Long
+ * ranges are read straight from the mapping, so pages of old history
+ * are only read from disk when somebody asks for them.
+ */
+
+/*
+ * With the one second tick of the daemon: every sample for ten minutes,
+ * ten second aggregates for six hours, and one minute aggregates for a
+ * week. The monitors only sample while somebody is subscribed, so all
+ * levels have gaps for the time nobody was looking.
+ */
+static const TimeSeriesLevel default_levels[] = {
+  { 0, 600 },
+  { 10, 2160 },
+  { 60, 10080 },
+};
+
+/* Further back than this, the wall clock was set rather than slewed */
+#define MAX_CLOCK_STEP (60 * G_USEC_PER_SEC)
+
+/* Planes of an aggregating level, the order matches TimeSeriesAggregate */
+#define N_PLANES 3
+
+/*
+ * All of a store lives in one block, which is the archive file when
+ * archived: a Header, n_levels LevelHeaders, and then the timestamps,
+ * values and bucket of each level in turn. Everything is a multiple
+ * of eight bytes, in host byte order.
+ */
+
+#define ARCHIVE_MAGIC "CKPTTS01"
+
+typedef struct {
+  gchar magic[8];
+  guint32 n_series;
+  guint32 n_levels;
+} Header;
+
+typedef struct {
+  /* The layout, written once */
+  gint64 interval;              /* in microseconds, zero for every sample */
+  guint32 length;
+  guint32 n_planes;
+
+  /* Position in the ring, updated after the data for each sample */
+  guint32 next;
+  guint32 filled;
+
+  /* The interval being filled */
+  gint64 bucket;
+  guint32 bucket_count;
+  guint32 reserved;
+} LevelHeader;
+
+typedef struct {
+  /* Copied from the LevelHeader, so a damaged archive can't change them */
+  gint64 interval;
+  guint length;
+  guint n_planes;
+
+  LevelHeader *state;
+  gint64 *timestamps;
+
+  /* One plane for every sample, N_PLANES for aggregates. Plane p of
+   * series s is the run at values[(p * n_series + s) * length] */
+  gdouble *values;
+
+  /* Sum, minimum and maximum per series of the interval being filled */
+  gdouble *bucket_values;
+} Level;
+
+struct _TimeSeries {
+  guint n_series;
+  guint n_levels;
+  Level *levels;
+
+  /* Values of one sample are gathered here for TimeSeriesFunc */
+  gdouble *scratch;
+
+  /* Timestamp of the newest sample added */
+  gint64 last;
+
+  /* The block everything lives in, either allocated or mapped */
+  gpointer block;
+  gsize size;
+  gboolean mapped;
+};
+
+static gsize
+level_size (guint n_series,
+            const TimeSeriesLevel *level)
+{
+  guint n_planes = level->interval == 0 ? 1 : N_PLANES;
+  gsize size;
+
+  size = (gsize)level->length * sizeof (gint64);
+  size += (gsize)n_planes * n_series * level->length * sizeof (gdouble);
+  if (level->interval != 0)
+    size += N_PLANES * n_series * sizeof (gdouble);
+  return size;
+}
+
+static gsize
+block_size (guint n_series,
+            const TimeSeriesLevel *levels,
+            guint n_levels)
+{
+  gsize size;
+  guint i;
+
+  size = sizeof (Header) + n_levels * sizeof (LevelHeader);
+  for (i = 0; i < n_levels; i++)
+    size += level_size (n_series, levels + i);
+  return size;
+}
+
+static void
+block_init (gpointer block,
+            guint n_series,
+            const TimeSeriesLevel *levels,
+            guint n_levels)
+{
+  Header *header = block;
+  LevelHeader *level = (LevelHeader *)(header + 1);
+  guint i;
+
+  for (i = 0; i < n_levels; i++)
+    {
+      level[i].interval = (gint64)levels[i].interval * G_USEC_PER_SEC;
+      level[i].length = levels[i].length;
+      level[i].n_planes = levels[i].interval == 0 ? 1 : N_PLANES;
+    }
+
+  header->n_series = n_series;
+  header->n_levels = n_levels;
+
+  /* Last, so that a half written archive isn't recognized */
+  memcpy (header->magic, ARCHIVE_MAGIC, sizeof (header->magic));
+}
+
+static gboolean
+block_check (gconstpointer block,
+             guint n_series,
+             const TimeSeriesLevel *levels,
+             guint n_levels)
+{
+  const Header *header = block;
+  const LevelHeader *level = (const LevelHeader *)(header + 1);
+  guint i;
+
+  if (memcmp (header->magic, ARCHIVE_MAGIC, sizeof (header->magic)) != 0 ||
+      header->n_series != n_series ||
+      header->n_levels != n_levels)
+    return FALSE;
+
+  for (i = 0; i < n_levels; i++)
+    {
+      if (level[i].interval != (gint64)levels[i].interval * G_USEC_PER_SEC ||
+          level[i].length != levels[i].length ||
+          level[i].n_planes != (levels[i].interval == 0 ? 1 : N_PLANES))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+ * The position of a ring is updated after its data, but after a crash
+ * of the machine the pages may have reached the disk in any order. So
+ * the position isn't trusted. Instead the ring is searched for its
+ * longest run of timestamps that go forward in time, and only those
+ * samples are kept. The newest run wins a tie. A single damaged
+ * timestamp can look like the newest sample, but it can't make a
+ * long run.
+ */
+static void
+level_repair (Level *level)
+{
+  LevelHeader *state = level->state;
+  guint best = 0;
+  guint best_slot = 0;
+  guint run = 0;
+  guint slot;
+  guint i;
+
+  /* Twice around, so that the run across the end of the ring is seen */
+  for (i = 0; i < 2 * level->length; i++)
+    {
+      slot = i % level->length;
+      if (level->timestamps[slot] <= 0)
+        run = 0;
+      else if (run > 0 && run < level->length &&
+               level->timestamps[slot] > level->timestamps[(slot + level->length - 1) % level->length])
+        run++;
+      else
+        run = 1;
+
+      if (run > best || (run == best && run > 0 &&
+                         level->timestamps[slot] > level->timestamps[best_slot]))
+        {
+          best = run;
+          best_slot = slot;
+        }
+    }
+
+  if (state->next >= level->length || state->filled > level->length)
+    g_message ("Discarding damaged position in archive");
+  else if (best < state->filled)
+    g_message ("Discarding %u damaged samples in archive", state->filled - best);
+
+  state->filled = best;
+  state->next = best > 0 ? (best_slot + 1) % level->length : 0;
+
+  /* The interval being filled comes after the newest one that's complete */
+  if (level->bucket_values == NULL || state->bucket <= 0 ||
+      (best > 0 && state->bucket <= level->timestamps[best_slot]))
+    state->bucket_count = 0;
+}
+
+/* Time of the newest sample in the level, or zero */
+static gint64
+level_newest (Level *level)
+{
+  if (level->state->bucket_count > 0)
+    return level->state->bucket;
+  if (level->state->filled == 0)
+    return 0;
+  return level->timestamps[(level->state->next + level->length - 1) % level->length];
+}
+
+static TimeSeries *
+series_new_for_block (gpointer block,
+                      gsize size,
+                      gboolean mapped)
+{
+  TimeSeries *series;
+  Header *header = block;
+  LevelHeader *state;
+  guchar *data;
+  Level *level;
+  guint i;
+
+  series = g_new0 (TimeSeries, 1);
+  series->block = block;
+  series->size = size;
+  series->mapped = mapped;
+  series->n_series = header->n_series;
+  series->n_levels = header->n_levels;
+  series->levels = g_new0 (Level, series->n_levels);
+  series->scratch = g_new0 (gdouble, series->n_series);
+
+  state = (LevelHeader *)(header + 1);
+  data = (guchar *)(state + series->n_levels);
+  for (i = 0; i < series->n_levels; i++)
+    {
+      level = series->levels + i;
+      level->state = state + i;
+      level->interval = level->state->interval;
+      level->length = level->state->length;
+      level->n_planes = level->state->n_planes;
+
+      level->timestamps = (gint64 *)data;
+      data += (gsize)level->length * sizeof (gint64);
+      level->values = (gdouble *)data;
+      data += (gsize)level->n_planes * series->n_series * level->length * sizeof (gdouble);
+      if (level->interval != 0)
+        {
+          level->bucket_values = (gdouble *)data;
+          data += N_PLANES * series->n_series * sizeof (gdouble);
+        }
+    }
+
+  g_assert (data == (guchar *)block + size);
+  return series;
+}
+
+/**
+ * time_series_new:
+ * @n_series: number of values in each sample
+ * @levels: (allow-none): resolutions to keep, finest first, or %NULL
+ *          for the defaults
+ * @n_levels: number of @levels
+ *
+ * Create a new store for samples of @n_series values each.
+ *
+ * Returns: (transfer full): the store, free with time_series_free()
+ */
+TimeSeries *
+time_series_new (guint n_series,
+                 const TimeSeriesLevel *levels,
+                 guint n_levels)
+{
+  gpointer block;
+  gsize size;
+  guint i;
+
+  g_return_val_if_fail (n_series > 0, NULL);
+
+  if (levels == NULL)
+    {
+      levels = default_levels;
+      n_levels = G_N_ELEMENTS (default_levels);
+    }
+
+  g_return_val_if_fail (n_levels > 0, NULL);
+  for (i = 0; i < n_levels; i++)
+    g_return_val_if_fail (levels[i].length > 0, NULL);
+
+  size = block_size (n_series, levels, n_levels);
+  block = g_malloc0 (size);
+  block_init (block, n_series, levels, n_levels);
+
+  return series_new_for_block (block, size, FALSE);
+}
+
+static gpointer
+map_archive (const gchar *path,
+             gsize size,
+             guint n_series,
+             const TimeSeriesLevel *levels,
+             guint n_levels,
+             GError **error)
+{
+  gpointer block = NULL;
+  gchar *directory;
+  struct stat st;
+  gboolean fresh;
+  int errn;
+  int fd = -1;
+
+  directory = g_path_get_dirname (path);
+  if (g_mkdir_with_parents (directory, 0700) < 0)
+    {
+      errn = errno;
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errn),
+                   "Couldn't create directory %s: %s", directory, g_strerror (errn));
+      g_free (directory);
+      return NULL;
+    }
+  g_free (directory);
+
+  fd = g_open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0)
+    goto failed;
+
+  if (fstat (fd, &st) < 0)
+    goto failed;
+
+  /* Anything of the wrong size is started over */
+  fresh = ((gsize)st.st_size != size);
+  if (fresh && ftruncate (fd, 0) < 0)
+    goto failed;
+
+  /*
+   * Writing to a hole in the mapping when the disk is full would kill
+   * the daemon with SIGBUS, so have all of the file allocated up front.
+   */
+  errn = posix_fallocate (fd, 0, size);
+  if (errn != 0)
+    {
+      errno = errn;
+      goto failed;
+    }
+
+  block = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (block == MAP_FAILED)
+    {
+      block = NULL;
+      goto failed;
+    }
+
+  if (!fresh && !block_check (block, n_series, levels, n_levels))
+    {
+      g_message ("Starting over with sample archive %s, it has a different layout", path);
+      memset (block, 0, size);
+      fresh = TRUE;
+    }
+
+  if (fresh)
+    block_init (block, n_series, levels, n_levels);
+
+  close (fd);
+  return block;
+
+failed:
+  errn = errno;
+  g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errn),
+               "Couldn't open sample archive %s: %s", path, g_strerror (errn));
+  if (fd >= 0)
+    close (fd);
+  return NULL;
+}
+
+/**
+ * time_series_new_archived:
+ * @path: the archive file
+ * @n_series: number of values in each sample
+ * @levels: (allow-none): resolutions to keep, finest first, or %NULL
+ *          for the defaults
+ * @n_levels: number of @levels
+ *
+ * Create a new store that lives in the file at @path, and so survives
+ * restarts. Samples already in the file are kept if it was written
+ * with the same @n_series and @levels, otherwise the file is started
+ * over.
+ *
+ * Nothing is ever synced to disk explicitly. If the file can't be
+ * used, or there isn't enough space for all of it, a message is logged
+ * and the store only lives in memory.
+ *
+ * Returns: (transfer full): the store, free with time_series_free()
+ */
+TimeSeries *
+time_series_new_archived (const gchar *path,
+                          guint n_series,
+                          const TimeSeriesLevel *levels,
+                          guint n_levels)
+{
+  TimeSeries *series;
+  GError *error = NULL;
+  gpointer block;
+  gsize size;
+  guint i;
+
+  g_return_val_if_fail (path != NULL, NULL);
+  g_return_val_if_fail (n_series > 0, NULL);
+
+  if (levels == NULL)
+    {
+      levels = default_levels;
+      n_levels = G_N_ELEMENTS (default_levels);
+    }
+
+  g_return_val_if_fail (n_levels > 0, NULL);
+  for (i = 0; i < n_levels; i++)
+    g_return_val_if_fail (levels[i].length > 0, NULL);
+
+  size = block_size (n_series, levels, n_levels);
+  block = map_archive (path, size, n_series, levels, n_levels, &error);
+  if (block == NULL)
+    {
+      g_message ("%s", error->message);
+      g_error_free (error);
+      return time_series_new (n_series, levels, n_levels);
+    }
+
+  series = series_new_for_block (block, size, TRUE);
+  for (i = 0; i < series->n_levels; i++)
+    {
+      level_repair (series->levels + i);
+      series->last = MAX (series->last, level_newest (series->levels + i));
+    }
+
+  return series;
+}
+
+static inline gdouble *
+level_value (TimeSeries *series,
+             Level *level,
+             guint plane,
+             guint index,
+             guint slot)
+{
+  return level->values + ((gsize)plane * series->n_series + index) * level->length + slot;
+}
+
+static void
+level_push (Level *level)
+{
+  level->state->next++;
+  if (level->state->next == level->length)
+    level->state->next = 0;
+  if (level->state->filled < level->length)
+    level->state->filled++;
+}
+
+static void
+level_flush_bucket (TimeSeries *series,
+                    Level *level)
+{
+  gdouble *bucket = level->bucket_values;
+  guint n = series->n_series;
+  guint i;
+
+  level->timestamps[level->state->next] = level->state->bucket;
+  for (i = 0; i < n; i++)
+    {
+      *level_value (series, level, TIME_SERIES_AVERAGE, i, level->state->next) = bucket[i] / level->state->bucket_count;
+      *level_value (series, level, TIME_SERIES_MINIMUM, i, level->state->next) = bucket[n + i];
+      *level_value (series, level, TIME_SERIES_MAXIMUM, i, level->state->next) = bucket[2 * n + i];
+    }
+
+  level_push (level);
+  level->state->bucket_count = 0;
+}
+
+static void
+level_add_to_bucket (TimeSeries *series,
+                     Level *level,
+                     gint64 timestamp,
+                     const gdouble *values)
+{
+  gdouble *bucket = level->bucket_values;
+  guint n = series->n_series;
+  gint64 start;
+  guint i;
+
+  start = timestamp - (timestamp % level->interval);
+  if (level->state->bucket_count > 0 && start != level->state->bucket)
+    level_flush_bucket (series, level);
+
+  if (level->state->bucket_count == 0)
+    {
+      level->state->bucket = start;
+      for (i = 0; i < n; i++)
+        {
+          bucket[i] = values[i];
+          bucket[n + i] = values[i];
+          bucket[2 * n + i] = values[i];
+        }
+    }
+  else
+    {
+      for (i = 0; i < n; i++)
+        {
+          bucket[i] += values[i];
+          if (values[i] < bucket[n + i])
+            bucket[n + i] = values[i];
+          if (values[i] > bucket[2 * n + i])
+            bucket[2 * n + i] = values[i];
+        }
+    }
+
+  level->state->bucket_count++;
+}
+
+/* Timestamps are cleared too, level_repair() goes by them alone */
+static void
+level_reset (Level *level)
+{
+  memset (level->timestamps, 0, (gsize)level->length * sizeof (gint64));
+  level->state->next = 0;
+  level->state->filled = 0;
+  level->state->bucket = 0;
+  level->state->bucket_count = 0;
+}
+
+/**
+ * time_series_add:
+ * @series: the store
+ * @timestamp: time of the sample in microseconds since the epoch
+ * @values: the n_series values of the sample
+ *
+ * Add a sample to all levels of the store. Samples must come in order,
+ * a sample that isn't newer than the last one, for example when the
+ * wall clock was slewed back a little, is skipped. When the clock
+ * jumped back further than MAX_CLOCK_STEP, the history is thrown away
+ * and starts over, rather than skipping samples until the clock has
+ * caught up with it. That also covers an archive written while the
+ * clock was wrong.
+ */
+void
+time_series_add (TimeSeries *series,
+                 gint64 timestamp,
+                 const gdouble *values)
+{
+  Level *level;
+  guint i, j;
+
+  g_return_if_fail (series != NULL);
+  g_return_if_fail (values != NULL);
+  g_return_if_fail (timestamp > 0);
+
+  if (series->last - timestamp > MAX_CLOCK_STEP)
+    {
+      g_message ("Clock went back by %" G_GINT64_FORMAT " seconds, discarding sample history",
+                 (series->last - timestamp) / G_USEC_PER_SEC);
+      for (i = 0; i < series->n_levels; i++)
+        level_reset (series->levels + i);
+    }
+  else if (timestamp <= series->last)
+    {
+      g_debug ("skipping sample that isn't newer than the last one");
+      return;
+    }
+  series->last = timestamp;
+
+  for (i = 0; i < series->n_levels; i++)
+    {
+      level = series->levels + i;
+      if (level->interval == 0)
+        {
+          level->timestamps[level->state->next] = timestamp;
+          for (j = 0; j < series->n_series; j++)
+            *level_value (series, level, 0, j, level->state->next) = values[j];
+          level_push (level);
+        }
+      else
+        {
+          level_add_to_bucket (series, level, timestamp, values);
+        }
+    }
+}
+
+/**
+ * time_series_get_n_levels:
+ * @series: the store
+ *
+ * Returns: the number of resolutions kept
+ */
+guint
+time_series_get_n_levels (TimeSeries *series)
+{
+  g_return_val_if_fail (series != NULL, 0);
+  return series->n_levels;
+}
+
+static guint
+level_oldest (Level *level)
+{
+  return (level->state->next + level->length - level->state->filled) % level->length;
+}
+
+/**
+ * time_series_find_level:
+ * @series: the store
+ * @resolution: wanted seconds between samples, or zero
+ * @since: wanted start of the history, or zero
+ *
+ * Pick the level for a query. If @resolution is set this is the
+ * finest level that is at least that coarse. Otherwise if @since is
+ * set it's the finest level that still reaches back that far, or the
+ * one that reaches back furthest. Otherwise it's the finest level.
+ *
+ * Returns: the index of the level
+ */
+guint
+time_series_find_level (TimeSeries *series,
+                        guint resolution,
+                        gint64 since)
+{
+  gint64 oldest;
+  gint64 best_oldest = G_MAXINT64;
+  guint best = 0;
+  Level *level;
+  guint i;
+
+  g_return_val_if_fail (series != NULL, 0);
+
+  if (resolution > 0)
+    {
+      for (i = 0; i < series->n_levels; i++)
+        {
+          /* Storing every sample counts as one second */
+          if (MAX (series->levels[i].interval, G_USEC_PER_SEC) >= (gint64)resolution * G_USEC_PER_SEC)
+            return i;
+        }
+      return series->n_levels - 1;
+    }
+
+  if (since > 0)
+    {
+      for (i = 0; i < series->n_levels; i++)
+        {
+          level = series->levels + i;
+          if (level->state->filled == 0)
+            continue;
+          oldest = level->timestamps[level_oldest (level)];
+          if (oldest <= since)
+            return i;
+          if (oldest < best_oldest)
+            {
+              best_oldest = oldest;
+              best = i;
+            }
+        }
+    }
+
+  return best;
+}
+
+/*
+ * Binary search of the samples between @first and @last, counted from
+ * the oldest slot @oldest. Returns the position of the first sample
+ * newer than @timestamp, or if @after is FALSE the first one that
+ * isn't older than it.
+ */
+static guint
+level_search (Level *level,
+              guint oldest,
+              guint first,
+              guint last,
+              gint64 timestamp,
+              gboolean after)
+{
+  gint64 value;
+  guint middle;
+
+  while (first < last)
+    {
+      middle = first + (last - first) / 2;
+      value = level->timestamps[(oldest + middle) % level->length];
+      if (value < timestamp || (after && value == timestamp))
+        first = middle + 1;
+      else
+        last = middle;
+    }
+
+  return first;
+}
+
+/**
+ * time_series_foreach:
+ * @series: the store
+ * @level_index: index of the level to read
+ * @aggregate: which aggregate to read, ignored for a level that
+ *             stores every sample
+ * @since: skip samples older than this, or zero
+ * @until: skip samples newer than this, or zero
+ * @max: only the newest this many of the remaining samples, or zero
+ * @func: called for every sample, oldest first
+ * @user_data: passed to @func
+ *
+ * Read samples from one level of the store. The values passed to @func
+ * are only valid during the call.
+ *
+ * Returns: the number of samples passed to @func
+ */
+guint
+time_series_foreach (TimeSeries *series,
+                     guint level_index,
+                     TimeSeriesAggregate aggregate,
+                     gint64 since,
+                     gint64 until,
+                     guint max,
+                     TimeSeriesFunc func,
+                     gpointer user_data)
+{
+  Level *level;
+  guint oldest;
+  guint plane;
+  guint first;
+  guint last;
+  guint slot;
+  guint i, j;
+
+  g_return_val_if_fail (series != NULL, 0);
+  g_return_val_if_fail (level_index < series->n_levels, 0);
+  g_return_val_if_fail (func != NULL, 0);
+
+  level = series->levels + level_index;
+  plane = level->n_planes == 1 ? 0 : aggregate;
+
+  if (until <= 0)
+    until = G_MAXINT64;
+
+  /* Timestamps grow along the ring, so narrow down the range first */
+  oldest = level_oldest (level);
+  first = level_search (level, oldest, 0, level->state->filled, since, FALSE);
+  last = level_search (level, oldest, first, level->state->filled, until, TRUE);
+  if (max > 0 && last - first > max)
+    first = last - max;
+
+  for (i = first; i < last; i++)
+    {
+      slot = (oldest + i) % level->length;
+      for (j = 0; j < series->n_series; j++)
+        series->scratch[j] = *level_value (series, level, plane, j, slot);
+      (func) (level->timestamps[slot], series->scratch, user_data);
+    }
+
+  return last - first;
+}
+
+typedef struct {
+  GVariantBuilder builder;
+  guint n_series;
+} BuildData;
+
+static void
+add_sample_variant (gint64 timestamp,
+                    const gdouble *values,
+                    gpointer user_data)
+{
+  BuildData *data = user_data;
+  g_variant_builder_add (&data->builder, "(x@ad)", timestamp,
+                         g_variant_new_fixed_array (G_VARIANT_TYPE_DOUBLE, values,
+                                                    data->n_series, sizeof (gdouble)));
+}
+
+static gboolean
+lookup_option (GVariant *options,
+               const gchar *name,
+               const GVariantType *type,
+               GVariant **value,
+               GError **error)
+{
+  *value = g_variant_lookup_value (options, name, NULL);
+  if (*value && !g_variant_is_of_type (*value, type))
+    {
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                   "Invalid type for the '%s' option", name);
+      g_variant_unref (*value);
+      *value = NULL;
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+parse_aggregate (GVariant *value,
+                 TimeSeriesAggregate *aggregate,
+                 GError **error)
+{
+  const gchar *str = g_variant_get_string (value, NULL);
+
+  if (g_str_equal (str, "average"))
+    *aggregate = TIME_SERIES_AVERAGE;
+  else if (g_str_equal (str, "minimum"))
+    *aggregate = TIME_SERIES_MINIMUM;
+  else if (g_str_equal (str, "maximum"))
+    *aggregate = TIME_SERIES_MAXIMUM;
+  else
+    {
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                   "Invalid aggregate '%s'", str);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * time_series_build_samples:
+ * @series: the store
+ * @options: (allow-none): the a{sv} options of GetSamples()
+ * @max: number of samples to return without any options
+ * @error: location to place an error
+ *
+ * Build the reply of the GetSamples() method of a resource monitor.
+ * The options "resolution", "since", "until" and "aggregate" are
+ * described with that method. Without any of "resolution" and "since"
+ * the newest @max samples of the finest level are returned.
+ *
+ * Returns: (transfer floating): a a(xad) variant, or %NULL if the
+ *          options are invalid
+ */
+GVariant *
+time_series_build_samples (TimeSeries *series,
+                           GVariant *options,
+                           guint max,
+                           GError **error)
+{
+  TimeSeriesAggregate aggregate = TIME_SERIES_AVERAGE;
+  GVariant *resolution = NULL;
+  GVariant *since = NULL;
+  GVariant *until = NULL;
+  GVariant *agg = NULL;
+  GVariant *result = NULL;
+  BuildData data;
+  guint level;
+
+  g_return_val_if_fail (series != NULL, NULL);
+
+  if (options)
+    {
+      if (!lookup_option (options, "resolution", G_VARIANT_TYPE_UINT32, &resolution, error) ||
+          !lookup_option (options, "since", G_VARIANT_TYPE_INT64, &since, error) ||
+          !lookup_option (options, "until", G_VARIANT_TYPE_INT64, &until, error) ||
+          !lookup_option (options, "aggregate", G_VARIANT_TYPE_STRING, &agg, error))
+        goto out;
+    }
+
+  if (agg && !parse_aggregate (agg, &aggregate, error))
+    goto out;
+
+  level = time_series_find_level (series,
+                                  resolution ? g_variant_get_uint32 (resolution) : 0,
+                                  since ? g_variant_get_int64 (since) : 0);
+  if (resolution || since)
+    max = 0;
+
+  g_variant_builder_init (&data.builder, G_VARIANT_TYPE ("a(xad)"));
+  data.n_series = series->n_series;
+  time_series_foreach (series, level, aggregate,
+                       since ? g_variant_get_int64 (since) : 0,
+                       until ? g_variant_get_int64 (until) : 0,
+                       max, add_sample_variant, &data);
+  result = g_variant_builder_end (&data.builder);
+
+out:
+  if (resolution)
+    g_variant_unref (resolution);
+  if (since)
+    g_variant_unref (since);
+  if (until)
+    g_variant_unref (until);
+  if (agg)
+    g_variant_unref (agg);
+  return result;
+}
+
+typedef struct {
+  GArray *timestamps;
+  GArray *values;
+  guint n_series;
+  gdouble quantum;
+} SinceData;
+
+static void
+add_sample_arrays (gint64 timestamp,
+                   const gdouble *values,
+                   gpointer user_data)
+{
+  SinceData *data = user_data;
+  gdouble value;
+  guint i;
+
+  g_array_append_val (data->timestamps, timestamp);
+  for (i = 0; i < data->n_series; i++)
+    {
+      value = values[i];
+      if (data->quantum > 0)
+        value = round (value / data->quantum);
+      g_array_append_val (data->values, value);
+    }
+}
+
+/**
+ * time_series_build_samples_since:
+ * @series: the store
+ * @since: only return samples newer than this, or zero
+ * @options: (allow-none): the a{sv} options of GetSamplesSince()
+ * @max: number of samples to return when @since is zero
+ * @error: location to place an error
+ *
+ * Build the reply of the GetSamplesSince() method of a resource
+ * monitor: the timestamps and the values of the samples, each in one
+ * flat array. The options "resolution", "aggregate", "quantum" and
+ * "delta" are described with that method.
+ *
+ * A client that passes the newest timestamp it has as @since only
+ * gets what it is missing, which is usually very little.
+ *
+ * Returns: (transfer floating): a (axad) variant, or %NULL if the
+ *          options are invalid
+ */
+GVariant *
+time_series_build_samples_since (TimeSeries *series,
+                                 gint64 since,
+                                 GVariant *options,
+                                 guint max,
+                                 GError **error)
+{
+  TimeSeriesAggregate aggregate = TIME_SERIES_AVERAGE;
+  GVariant *resolution = NULL;
+  GVariant *agg = NULL;
+  GVariant *quantum = NULL;
+  GVariant *delta = NULL;
+  GVariant *result = NULL;
+  gint64 *timestamps;
+  gdouble *values;
+  SinceData data;
+  guint level;
+  guint count;
+  guint i, j;
+
+  g_return_val_if_fail (series != NULL, NULL);
+
+  if (options)
+    {
+      if (!lookup_option (options, "resolution", G_VARIANT_TYPE_UINT32, &resolution, error) ||
+          !lookup_option (options, "aggregate", G_VARIANT_TYPE_STRING, &agg, error) ||
+          !lookup_option (options, "quantum", G_VARIANT_TYPE_DOUBLE, &quantum, error) ||
+          !lookup_option (options, "delta", G_VARIANT_TYPE_BOOLEAN, &delta, error))
+        goto out;
+    }
+
+  if (agg && !parse_aggregate (agg, &aggregate, error))
+    goto out;
+
+  data.quantum = 0;
+  if (quantum)
+    {
+      data.quantum = g_variant_get_double (quantum);
+      if (!(data.quantum > 0) || isinf (data.quantum))
+        {
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                       "Invalid quantum %g", data.quantum);
+          goto out;
+        }
+    }
+
+  /* Differences of unrounded values would not add up exactly again */
+  if (delta && g_variant_get_boolean (delta) && !quantum)
+    {
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                   "The 'delta' option needs a 'quantum'");
+      goto out;
+    }
+
+  /* The same level every time, so that the client can simply append */
+  level = time_series_find_level (series, resolution ? g_variant_get_uint32 (resolution) : 0, 0);
+
+  data.n_series = series->n_series;
+  data.timestamps = g_array_new (FALSE, FALSE, sizeof (gint64));
+  data.values = g_array_new (FALSE, FALSE, sizeof (gdouble));
+  count = time_series_foreach (series, level, aggregate,
+                               since > 0 ? since + 1 : 0, 0,
+                               since > 0 ? 0 : max,
+                               add_sample_arrays, &data);
+
+  if (delta && g_variant_get_boolean (delta))
+    {
+      /* Backwards, so that each difference is taken from the absolute value */
+      timestamps = (gint64 *)data.timestamps->data;
+      values = (gdouble *)data.values->data;
+      for (i = count; i > 1; i--)
+        {
+          timestamps[i - 1] -= timestamps[i - 2];
+          for (j = 0; j < data.n_series; j++)
+            values[(i - 1) * data.n_series + j] -= values[(i - 2) * data.n_series + j];
+        }
+    }
+
+  result = g_variant_new ("(@ax@ad)",
+                          g_variant_new_fixed_array (G_VARIANT_TYPE_INT64, data.timestamps->data,
+                                                     data.timestamps->len, sizeof (gint64)),
+                          g_variant_new_fixed_array (G_VARIANT_TYPE_DOUBLE, data.values->data,
+                                                     data.values->len, sizeof (gdouble)));
+  g_array_free (data.timestamps, TRUE);
+  g_array_free (data.values, TRUE);
+
+out:
+  if (resolution)
+    g_variant_unref (resolution);
+  if (agg)
+    g_variant_unref (agg);
+  if (quantum)
+    g_variant_unref (quantum);
+  if (delta)
+    g_variant_unref (delta);
+  return result;
+}
+
+/**
+ * time_series_handle_get_samples:
+ * @series: the store
+ * @invocation: the GetSamples() call
+ * @options: its options
+ * @max: number of samples without a "resolution" or "since" option
+ *
+ * Reply to the GetSamples() method of a resource monitor with
+ * time_series_build_samples().
+ *
+ * Returns: %TRUE, as the method handler should
+ */
+gboolean
+time_series_handle_get_samples (TimeSeries *series,
+                                GDBusMethodInvocation *invocation,
+                                GVariant *options,
+                                guint max)
+{
+  GError *error = NULL;
+  GVariant *samples;
+
+  samples = time_series_build_samples (series, options, max, &error);
+  if (samples == NULL)
+    g_dbus_method_invocation_take_error (invocation, error);
+  else
+    g_dbus_method_invocation_return_value (invocation, g_variant_new_tuple (&samples, 1));
+
+  return TRUE;
+}
+
+/**
+ * time_series_handle_get_samples_since:
+ * @series: the store
+ * @invocation: the GetSamplesSince() call
+ * @since: its since argument
+ * @options: its options
+ * @max: number of samples when @since is zero
+ *
+ * Reply to the GetSamplesSince() method of a resource monitor with
+ * time_series_build_samples_since().
+ *
+ * Returns: %TRUE, as the method handler should
+ */
+gboolean
+time_series_handle_get_samples_since (TimeSeries *series,
+                                      GDBusMethodInvocation *invocation,
+                                      gint64 since,
+                                      GVariant *options,
+                                      guint max)
+{
+  GError *error = NULL;
+  GVariant *samples;
+
+  samples = time_series_build_samples_since (series, since, options, max, &error);
+  if (samples == NULL)
+    g_dbus_method_invocation_take_error (invocation, error);
+  else
+    g_dbus_method_invocation_return_value (invocation, samples);
+
+  return TRUE;
+}
+
+/**
+ * time_series_get_size:
+ * @series: the store
+ *
+ * Returns: the number of bytes allocated for the store
+ */
+gsize
+time_series_get_size (TimeSeries *series)
+{
+  g_return_val_if_fail (series != NULL, 0);
+
+  return sizeof (TimeSeries) + series->n_levels * sizeof (Level) +
+         series->n_series * sizeof (gdouble) + series->size;
+}
+
+/**
+ * time_series_free:
+ * @series: the store
+ *
+ * Free the store and all samples in it.
+ */
+void
+time_series_free (TimeSeries *series)
+{
+  if (!series)
+    return;
+
+  if (series->mapped)
+    {
+      /* Not waiting for the data to reach the disk, just starting it */
+      msync (series->block, series->size, MS_ASYNC);
+      munmap (series->block, series->size);
+    }
+  else
+    {
+      g_free (series->block);
+    }
+
+  g_free (series->levels);
+  g_free (series->scratch);
+  g_free (series);
+}
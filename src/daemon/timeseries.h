@@ -0,0 +1,102 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COCKPIT_TIME_SERIES_H__
+#define COCKPIT_TIME_SERIES_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct {
+  /* Seconds per stored sample, or zero to store every sample as is */
+  guint interval;
+  /* Number of samples kept */
+  guint length;
+} TimeSeriesLevel;
+
+typedef enum {
+  TIME_SERIES_AVERAGE,
+  TIME_SERIES_MINIMUM,
+  TIME_SERIES_MAXIMUM
+} TimeSeriesAggregate;
+
+typedef struct _TimeSeries TimeSeries;
+
+typedef void   (* TimeSeriesFunc)              (gint64 timestamp,
+                                                const gdouble *values,
+                                                gpointer user_data);
+
+TimeSeries *      time_series_new              (guint n_series,
+                                                const TimeSeriesLevel *levels,
+                                                guint n_levels);
+
+TimeSeries *      time_series_new_archived     (const gchar *path,
+                                                guint n_series,
+                                                const TimeSeriesLevel *levels,
+                                                guint n_levels);
+
+void              time_series_add              (TimeSeries *series,
+                                                gint64 timestamp,
+                                                const gdouble *values);
+
+guint             time_series_get_n_levels     (TimeSeries *series);
+
+guint             time_series_find_level       (TimeSeries *series,
+                                                guint resolution,
+                                                gint64 since);
+
+guint             time_series_foreach          (TimeSeries *series,
+                                                guint level_index,
+                                                TimeSeriesAggregate aggregate,
+                                                gint64 since,
+                                                gint64 until,
+                                                guint max,
+                                                TimeSeriesFunc func,
+                                                gpointer user_data);
+
+GVariant *        time_series_build_samples    (TimeSeries *series,
+                                                GVariant *options,
+                                                guint max,
+                                                GError **error);
+
+GVariant *        time_series_build_samples_since (TimeSeries *series,
+                                                   gint64 since,
+                                                   GVariant *options,
+                                                   guint max,
+                                                   GError **error);
+
+gboolean          time_series_handle_get_samples (TimeSeries *series,
+                                                  GDBusMethodInvocation *invocation,
+                                                  GVariant *options,
+                                                  guint max);
+
+gboolean          time_series_handle_get_samples_since (TimeSeries *series,
+                                                        GDBusMethodInvocation *invocation,
+                                                        gint64 since,
+                                                        GVariant *options,
+                                                        guint max);
+
+gsize             time_series_get_size         (TimeSeries *series);
+
+void              time_series_free             (TimeSeries *series);
+
+G_END_DECLS
+
+#endif /* COCKPIT_TIME_SERIES_H__ */
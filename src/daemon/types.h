@@ -62,6 +62,9 @@ typedef struct _DiskIOMonitor DiskIOMonitor;
 struct _CGroupMonitor;
 typedef struct _CGroupMonitor CGroupMonitor;
 
+struct _BatchMonitor;
+typedef struct _BatchMonitor BatchMonitor;
+
 struct _StorageManager;
 typedef struct _StorageManager StorageManager;
 
@@ -1260,6 +1260,10 @@ function DockerClient(machine) {
     }
 
     $(monitor).on('NewSample', handle_new_samples);
+    monitor.call("Subscribe", function (error) {
+        if (error)
+            console.warn(error);
+    });
 
     function trigger_id(id) {
         if (id in me.containers)
@@ -1539,6 +1543,7 @@ function DockerClient(machine) {
 
     this.close = function close() {
         $(monitor).off('NewSample', handle_new_samples);
+        monitor.call("Unsubscribe", function (error) { });
         monitor = null;
         dbus_client.release();
         dbus_client = null;
@@ -154,6 +154,7 @@ function cockpit_journal_filler (journal, box, start, match, match_text, header,
 
     var bottom_scroll;
     var running = true;
+    var searched = 0;
 
     var renderer = cockpit_journal_renderer (cockpit_output_funcs_for_box (box));
 
@@ -169,18 +170,28 @@ function cockpit_journal_filler (journal, box, start, match, match_text, header,
                      seek, skip, count,
                      query_fields, query_max_length,
                      wait,
-                     function (error, result, first, last, eof) {
+                     function (error, result, first, last, eof, scanned) {
                          if (running) {
                              if (error) {
                                  query_error (error);
                              } else {
                                  // console.log("R %s", result.length);
-                                 callback (result, first, last, eof);
+                                 callback (result, first, last, eof, scanned);
                              }
                          }
                      });
     }
 
+    /* Filtered queries return after looking at a limited number of
+     * entries, so show how far the search has come.
+     */
+    function show_progress (box, scanned) {
+        if (!match_text)
+            return;
+        searched += scanned;
+        box.text(F(_("Searching, %{count} entries looked at..."), { count: searched }));
+    }
+
     function query_error (error) {
         if (error.name == "org.freedesktop.DBus.Error.AccessDenied")
             end_box.text(_("You are not authorized."));
@@ -207,7 +218,7 @@ function cockpit_journal_filler (journal, box, start, match, match_text, header,
 
         var increment = Math.min(count, query_increment);
         query (seek, skip, increment, false,
-               function (result, first, last, eof)
+               function (result, first, last, eof, scanned)
                {
                    prepend_entries (result);
 
@@ -222,6 +233,7 @@ function cockpit_journal_filler (journal, box, start, match, match_text, header,
                        /* 'last' is always valid here since 'eof ==
                         * FALSE' implies valid cursors.
                         */
+                       show_progress (end_box, scanned);
                        get_entries_fwd (last, 1, count - result.length);
                    }
                });
@@ -284,7 +296,7 @@ function cockpit_journal_filler (journal, box, start, match, match_text, header,
 
         var increment = Math.min(count, query_increment);
         query (seek, -skip-increment, increment, false,
-               function (result, first, last, eof)
+               function (result, first, last, eof, scanned)
                {
                    append_entries (result);
 
@@ -310,6 +322,8 @@ function cockpit_journal_filler (journal, box, start, match, match_text, header,
                        didnt_reach_start (first);
                    }
 
+                   if (!eof && count != increment)
+                       show_progress (start_box, scanned);
                    if (!eof)
                        get_entries_bwd (first, 1 , count - result.length);
                });
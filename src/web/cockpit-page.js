@@ -119,10 +119,100 @@ function cockpit_content_update_loc_trail ()
     document.title = doc_title;
 }
 
+/*
+ * The cockpit_manifest is written into index.html by cockpit-ws when
+ * pages are split into bundles. It's not present in debug builds,
+ * where all the pages are loaded up front.
+ */
+var cockpit_bundles = { };
+var cockpit_loading_trail = null;
+
+function bundle_debug() {
+    if (cockpit.debugging == "all" || cockpit.debugging == "bundle")
+        console.debug.apply(console, arguments);
+}
+
+function cockpit_load_bundle (name)
+{
+    var promise = cockpit_bundles[name];
+    if (promise)
+        return promise;
+
+    var info = cockpit_manifest.bundles[name];
+    var dfd = new $.Deferred();
+    cockpit_bundles[name] = promise = dfd.promise();
+
+    /* Bundles we depend on have to be evaluated first */
+    var requires = $.map(info.requires, cockpit_load_bundle);
+
+    $.when.apply($, requires).
+        fail(function() {
+            dfd.reject();
+        }).
+        done(function() {
+            var script = document.createElement("script");
+            var started = window.performance ? window.performance.now() : 0;
+            script.src = "/static/bundles/" + info.file;
+            script.onload = function() {
+                if (window.performance) {
+                    var loaded = window.performance.now();
+                    var entries = window.performance.getEntriesByName ?
+                        window.performance.getEntriesByName(script.src) : [ ];
+                    var fetched = entries.length ? entries[0].responseEnd : started;
+                    bundle_debug("bundle " + name + ": loaded in " + (loaded - started).toFixed(1) +
+                                 "ms, evaluated in " + (loaded - fetched).toFixed(1) + "ms");
+                }
+                dfd.resolve();
+            };
+            script.onerror = function() {
+                console.warn("couldn't load bundle: " + info.file);
+                delete cockpit_bundles[name];
+                dfd.reject();
+            };
+            document.head.appendChild(script);
+        });
+
+    return promise;
+}
+
+/* Returns a promise if pages in the trail still need to be loaded */
+function cockpit_load_pages (trail)
+{
+    if (!window.cockpit_manifest)
+        return null;
+
+    var needed = [ ];
+    for (var i = 0; i < trail.length; i++) {
+        var name = cockpit_manifest.pages[trail[i].page];
+        if (name && !cockpit_page_from_id(trail[i].page))
+            needed.push(cockpit_load_bundle(name));
+    }
+
+    if (needed.length === 0)
+        return null;
+    return $.when.apply($, needed);
+}
+
 function cockpit_go (trail)
 {
     var new_loc = trail[trail.length-1];
 
+    /* Navigating elsewhere while loading cancels this navigation */
+    var loading = cockpit_load_pages (trail);
+    cockpit_loading_trail = trail;
+    if (loading) {
+        loading.
+            done(function() {
+                if (cockpit_loading_trail === trail)
+                    cockpit_go (trail);
+            }).
+            fail(function() {
+                if (cockpit_loading_trail === trail && trail.length > 1)
+                    cockpit_go (trail.slice(0, trail.length-1));
+            });
+        return;
+    }
+
     function leave_breadcrumb(trail) {
         for (var i = 0; i < trail.length; i++)
             cockpit_page_leave_breadcrumb(trail[i].page);
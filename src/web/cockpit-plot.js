@@ -50,6 +50,8 @@ function cockpit_setup_plot (graph_id, resmon, data, user_options,
     var plot;
     var running = false;
     var ready = false;
+    var batch = null;
+    var path = null;
 
     $.extend(true, options, user_options);
 
@@ -75,16 +77,31 @@ function cockpit_setup_plot (graph_id, resmon, data, user_options,
                 data[n].data = series;
             }
 
-            $(resmon).on("NewSample", new_sample_handler);
+            // The samples of all plots come in one signal per second
+            // when the daemon can batch them, otherwise each monitor
+            // only samples while someone is subscribed to it.
+            if (resmon._client)
+                batch = resmon._client.lookup("/com/redhat/Cockpit/BatchMonitor",
+                                              "com.redhat.Cockpit.BatchMonitor");
+            if (batch) {
+                path = resmon.getObject().objectPath;
+                $(batch).on("Samples", batch_samples_handler);
+                batch.call("Subscribe", [ path ], function (error) {
+                    if (error)
+                        console.warn(error);
+                });
+            } else {
+                $(resmon).on("NewSample", new_sample_handler);
+                resmon.call("Subscribe", function (error) {
+                    if (error)
+                        console.warn(error);
+                });
+            }
 
-            resmon.call("GetSamples", {},
-                        function(error, result) {
-                            if (!error) {
-                                got_historical_samples (result);
-                                got_historical_data = true;
-                                refresh ();
-                            }
-                        });
+            if (resmon._iface_name == "com.redhat.Cockpit.ResourceMonitor")
+                fetch_recent_samples ();
+            else
+                fetch_all_samples ();
 
             $(window).on('resize', resize);
 
@@ -165,16 +182,105 @@ function cockpit_setup_plot (graph_id, resmon, data, user_options,
         }
     }
 
+    // The samples of a monitor are kept with it when the plot goes
+    // away, so showing the plot again only fetches the ones that are
+    // new since then.
+
+    function remember_sample (timestamp, samples)
+    {
+        var history = resmon.plot_history;
+        var n = history.timestamps.length;
+
+        // Like the daemon, start over when the clock was set back
+        if (n > 0 && history.timestamps[n-1] - timestamp > 60 * 1000000) {
+            history.timestamps = [ ];
+            history.samples = [ ];
+            n = 0;
+        }
+        if (n > 0 && history.timestamps[n-1] >= timestamp)
+            return;
+        history.timestamps.push(timestamp);
+        history.samples.push(samples);
+        if (n + 1 > num_points) {
+            history.timestamps.shift();
+            history.samples.shift();
+        }
+    }
+
+    function fetch_all_samples ()
+    {
+        resmon.call("GetSamples", {},
+                    function(error, result) {
+                        var i;
+                        if (error) {
+                            console.warn(error);
+                        } else {
+                            if (resmon.plot_history) {
+                                for (i = 0; i < result.length; i++)
+                                    remember_sample (result[i][0], result[i][1]);
+                            }
+                            got_historical_samples (result);
+                        }
+                        // Live samples are shown even without a history
+                        got_historical_data = true;
+                        refresh ();
+                    });
+    }
+
+    function fetch_recent_samples ()
+    {
+        var history, since, n;
+
+        if (!resmon.plot_history)
+            resmon.plot_history = { timestamps: [ ], samples: [ ] };
+        history = resmon.plot_history;
+        n = history.timestamps.length;
+        since = n > 0 ? history.timestamps[n-1] : 0;
+
+        resmon.call("GetSamplesSince", since, {},
+                    function(error, timestamps, values) {
+                        var i, width;
+                        // Older versions of cockpitd only have GetSamples
+                        if (error) {
+                            fetch_all_samples ();
+                            return;
+                        }
+                        width = resmon.NumSeries;
+                        for (i = 0; i < timestamps.length; i++)
+                            remember_sample (timestamps[i], values.slice(i * width, (i + 1) * width));
+                        got_historical_samples (history.samples.map(function (samples, i) {
+                            return [ history.timestamps[i], samples ];
+                        }));
+                        got_historical_data = true;
+                        refresh ();
+                    });
+    }
+
     function new_sample_handler (event, timestampUsec, samples) {
         if (got_historical_data) {
+            if (resmon.plot_history)
+                remember_sample (timestampUsec, samples);
             new_samples (samples);
             refresh ();
         }
     }
 
+    function batch_samples_handler (event, samples) {
+        var sample = samples[path];
+        if (sample)
+            new_sample_handler (event, sample[0], sample[1]);
+    }
+
     function destroy () {
         $(resmon).off('notify:NumSamples', init);
-        $(resmon).off("NewSample", new_sample_handler);
+        if (batch) {
+            $(batch).off("Samples", batch_samples_handler);
+            batch.call("Unsubscribe", [ path ], function (error) { });
+        } else {
+            $(resmon).off("NewSample", new_sample_handler);
+            if (ready)
+                resmon.call("Unsubscribe", function (error) { });
+        }
         $(window).off('resize', resize);
         $(outer_div).empty();
         plot = null;
@@ -0,0 +1,132 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmark for HTTP request parsing. Compares the allocating
+ * parsers with the slice parsers on a typical browser request.
+ */
+
+#include "config.h"
+
+#include "websocket.h"
+
+#include <string.h>
+
+static const gchar request[] =
+  "GET /cockpit/static/cockpit.js HTTP/1.1\r\n"
+  "Host: localhost:1001\r\n"
+  "Connection: keep-alive\r\n"
+  "Cache-Control: max-age=0\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/33.0 Safari/537.36\r\n"
+  "Referer: https://localhost:1001/\r\n"
+  "Accept-Encoding: gzip,deflate,sdch\r\n"
+  "Accept-Language: en-US,en;q=0.8\r\n"
+  "Cookie: CockpitAuth=v=2;k=0123456789abcdef0123456789abcdef\r\n"
+  "\r\n";
+
+static gdouble
+measure_table (guint iterations)
+{
+  GHashTable *headers;
+  gchar *method;
+  gchar *path;
+  gint64 start;
+  gsize off1;
+  gssize off2;
+  guint i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++)
+    {
+      off1 = web_socket_util_parse_req_line (request, sizeof (request) - 1, &method, &path);
+      off2 = web_socket_util_parse_headers (request + off1, sizeof (request) - 1 - off1, &headers);
+      g_assert (off2 > 0);
+      g_assert (g_hash_table_lookup (headers, "Content-Length") == NULL);
+      g_hash_table_unref (headers);
+      g_free (method);
+      g_free (path);
+    }
+
+  return (g_get_monotonic_time () - start) * 1000.0 / iterations;
+}
+
+static gdouble
+measure_slices (guint iterations)
+{
+  WebSocketHeaders headers;
+  WebSocketSlice method;
+  WebSocketSlice path;
+  gint64 start;
+  gssize off1;
+  gssize off2;
+  guint i;
+
+  web_socket_headers_init (&headers);
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < iterations; i++)
+    {
+      off1 = web_socket_util_parse_req_line_slices (request, sizeof (request) - 1, &method, &path);
+      off2 = web_socket_util_parse_header_slices (request + off1, sizeof (request) - 1 - off1, &headers);
+      g_assert (off2 > 0);
+      g_assert (web_socket_headers_lookup (&headers, "Content-Length") == NULL);
+    }
+
+  web_socket_headers_clear (&headers);
+  return (g_get_monotonic_time () - start) * 1000.0 / iterations;
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *options;
+  GError *error = NULL;
+  gint iterations = 1000000;
+
+  GOptionEntry entries[] = {
+    { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Number of requests to parse", "count" },
+    { NULL }
+  };
+
+  options = g_option_context_new (NULL);
+  g_option_context_add_main_entries (options, entries, NULL);
+  if (!g_option_context_parse (options, &argc, &argv, &error))
+    {
+      g_printerr ("frob-parse-headers: %s\n", error->message);
+      return 2;
+    }
+
+  if (iterations <= 0)
+    {
+      g_printerr ("frob-parse-headers: invalid number of iterations\n");
+      return 2;
+    }
+
+  /* Warm up */
+  measure_table (iterations / 10 + 1);
+  measure_slices (iterations / 10 + 1);
+
+  g_print ("hash table: %8.1f ns/request\n", measure_table (iterations));
+  g_print ("slices:     %8.1f ns/request\n", measure_slices (iterations));
+
+  g_option_context_free (options);
+  return 0;
+}
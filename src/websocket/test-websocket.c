@@ -346,6 +346,93 @@ test_parse_headers_bad (void)
     }
 }
 
+static void
+test_parse_header_slices (void)
+{
+  const gchar *input =
+      "Header1: value3\r\n"
+      "Header2:  field\r\n"
+      "header1: again \r\n"
+      "\r\n"
+      "BODY  ";
+
+  WebSocketHeaders headers;
+  const WebSocketSlice *value;
+  gssize ret;
+
+  web_socket_headers_init (&headers);
+
+  ret = web_socket_util_parse_header_slices (input, strlen (input), &headers);
+  g_assert_cmpint (ret, ==, strlen (input) - 6);
+  g_assert_cmpuint (headers.count, ==, 3);
+
+  /* Nothing allocated, slices point into the input */
+  g_assert (headers.headers == headers.inlined);
+  value = web_socket_headers_lookup (&headers, "HEADER2");
+  g_assert (value != NULL);
+  g_assert (value->data > input && value->data < input + strlen (input));
+  g_assert (web_socket_slice_equal (value, "field"));
+
+  /* The last one wins, as in the hash table */
+  value = web_socket_headers_lookup (&headers, "Header1");
+  g_assert (web_socket_slice_equal (value, "again"));
+  g_assert (web_socket_headers_lookup (&headers, "Something else") == NULL);
+
+  web_socket_headers_clear (&headers);
+}
+
+static void
+test_parse_header_slices_many (void)
+{
+  WebSocketHeaders headers;
+  GHashTable *table;
+  GString *input;
+  gchar *name;
+  gssize ret;
+  gint i;
+
+  input = g_string_new ("");
+  for (i = 0; i < WEB_SOCKET_INLINE_HEADERS * 3; i++)
+    g_string_append_printf (input, "Header%d: value%d\r\n", i, i);
+  g_string_append (input, "\r\n");
+
+  web_socket_headers_init (&headers);
+  ret = web_socket_util_parse_header_slices (input->str, input->len, &headers);
+  g_assert_cmpint (ret, ==, input->len);
+  g_assert_cmpuint (headers.count, ==, WEB_SOCKET_INLINE_HEADERS * 3);
+  g_assert (headers.headers != headers.inlined);
+
+  table = web_socket_headers_to_table (&headers);
+  for (i = 0; i < WEB_SOCKET_INLINE_HEADERS * 3; i++)
+    {
+      name = g_strdup_printf ("header%d", i);
+      g_assert (web_socket_headers_lookup (&headers, name) != NULL);
+      g_assert (g_hash_table_lookup (table, name) != NULL);
+      g_free (name);
+    }
+
+  g_hash_table_unref (table);
+  web_socket_headers_clear (&headers);
+  g_assert (headers.headers == headers.inlined);
+  g_string_free (input, TRUE);
+}
+
+static void
+test_parse_req_slices (void)
+{
+  const gchar *req = "POST  /path/part HTTP/1.1\r\n";
+  WebSocketSlice method;
+  WebSocketSlice resource;
+  gssize ret;
+
+  ret = web_socket_util_parse_req_line_slices (req, strlen (req), &method, &resource);
+  g_assert_cmpint (ret, ==, strlen (req));
+  g_assert (web_socket_slice_equal (&method, "POST"));
+  g_assert (web_socket_slice_equal (&resource, "/path/part"));
+  g_assert (web_socket_slice_has_prefix (&resource, "/path"));
+  g_assert (!web_socket_slice_has_prefix (&resource, "/path/part/more"));
+}
+
 static void
 test_header_equals (void)
 {
@@ -1412,6 +1499,9 @@ main (int argc,
   g_test_add_func ("/web-socket/parse-headers-no-out", test_parse_headers_no_out);
   g_test_add_func ("/web-socket/parse-headers-bad", test_parse_headers_bad);
   g_test_add_func ("/web-socket/parse-headers-not-enough", test_parse_headers_not_enough);
+  g_test_add_func ("/web-socket/parse-header-slices", test_parse_header_slices);
+  g_test_add_func ("/web-socket/parse-header-slices-many", test_parse_header_slices_many);
+  g_test_add_func ("/web-socket/parse-req-slices", test_parse_req_slices);
   g_test_add_func ("/web-socket/header-equals", test_header_equals);
   g_test_add_func ("/web-socket/header-contains", test_header_contains);
   g_test_add_func ("/web-socket/header-empty", test_header_empty);
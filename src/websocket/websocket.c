@@ -141,32 +141,25 @@ _web_socket_util_parse_url (const gchar *url,
 }
 
 /**
- * web_socket_util_parse_req_line:
+ * web_socket_util_parse_req_line_slices:
  * @data: (array length=length): the input data
  * @length: length of data
- * @method: (out): location to place HTTP method, or %NULL
- * @resource: (out): location to place HTTP resource path, or %NULL
+ * @method: (out): location to place HTTP method slice, or %NULL
+ * @resource: (out): location to place HTTP resource path slice, or %NULL
  *
- * Parse an HTTP request line.
- *
- * The number of bytes parsed will be returned if parsing succeeds, including
- * the new line at the end of the request line. A negative value will be
- * returned if parsing fails.
- *
- * If the HTTP request line was truncated (ie: not all of it was present
- * within @length) then zero will be returned.
+ * Parse an HTTP request line without allocating.
  *
- * The @method and @resource should point to string pointers. The values
- * returned should be freed by the caller using g_free().
+ * The same as web_socket_util_parse_req_line() except that @method
+ * and @resource point into @data, and are not null terminated.
  *
  * Return value: zero if truncated, negative if fails, or number of
  *               characters parsed
  */
-gsize
-web_socket_util_parse_req_line (const gchar *data,
-                                gsize length,
-                                gchar **method,
-                                gchar **resource)
+gssize
+web_socket_util_parse_req_line_slices (const gchar *data,
+                                       gsize length,
+                                       WebSocketSlice *method,
+                                       WebSocketSlice *resource)
 {
   const gchar *end;
   const gchar *method_end;
@@ -220,12 +213,61 @@ web_socket_util_parse_req_line (const gchar *data,
     }
 
   if (method)
-    *method = g_strndup (data, (method_end - data));
+    {
+      method->data = data;
+      method->length = method_end - data;
+    }
   if (resource)
-    *resource = g_strndup (path_beg, (path_end - path_beg));
+    {
+      resource->data = path_beg;
+      resource->length = path_end - path_beg;
+    }
   return (end - data) + 1;
 }
 
+/**
+ * web_socket_util_parse_req_line:
+ * @data: (array length=length): the input data
+ * @length: length of data
+ * @method: (out): location to place HTTP method, or %NULL
+ * @resource: (out): location to place HTTP resource path, or %NULL
+ *
+ * Parse an HTTP request line.
+ *
+ * The number of bytes parsed will be returned if parsing succeeds, including
+ * the new line at the end of the request line. A negative value will be
+ * returned if parsing fails.
+ *
+ * If the HTTP request line was truncated (ie: not all of it was present
+ * within @length) then zero will be returned.
+ *
+ * The @method and @resource should point to string pointers. The values
+ * returned should be freed by the caller using g_free().
+ *
+ * Return value: zero if truncated, negative if fails, or number of
+ *               characters parsed
+ */
+gsize
+web_socket_util_parse_req_line (const gchar *data,
+                                gsize length,
+                                gchar **method,
+                                gchar **resource)
+{
+  WebSocketSlice method_slice;
+  WebSocketSlice resource_slice;
+  gssize ret;
+
+  ret = web_socket_util_parse_req_line_slices (data, length, &method_slice, &resource_slice);
+  if (ret > 0)
+    {
+      if (method)
+        *method = web_socket_slice_dup (&method_slice);
+      if (resource)
+        *resource = web_socket_slice_dup (&resource_slice);
+    }
+  return ret;
+}
+
 static guint
 str_case_hash (gconstpointer v)
 {
@@ -265,41 +307,196 @@ web_socket_util_new_headers (void)
 }
 
 /**
- * web_socket_util_parse_headers:
- * @data: (array length=length): the input data
- * @length: length of data
- * @headers: (out): location to place HTTP header hash table
+ * web_socket_slice_equal:
+ * @slice: the slice
+ * @str: null terminated string to compare against
  *
- * Parse HTTP headers.
+ * Return value: whether the slice has exactly the contents of @str
+ */
+gboolean
+web_socket_slice_equal (const WebSocketSlice *slice,
+                        const gchar *str)
+{
+  gsize len = strlen (str);
+  return slice->length == len && memcmp (slice->data, str, len) == 0;
+}
+
+/**
+ * web_socket_slice_has_prefix:
+ * @slice: the slice
+ * @prefix: null terminated prefix
  *
- * The number of bytes parsed will be returned if parsing succeeds, including
- * the new line at the end of the request line. A negative value will be
- * returned if parsing fails.
+ * Return value: whether the slice starts with @prefix
+ */
+gboolean
+web_socket_slice_has_prefix (const WebSocketSlice *slice,
+                             const gchar *prefix)
+{
+  gsize len = strlen (prefix);
+  return slice->length >= len && memcmp (slice->data, prefix, len) == 0;
+}
+
+/**
+ * web_socket_slice_dup:
+ * @slice: the slice
  *
- * If the HTTP request line was truncated (ie: not all of it was present
- * within @length) then zero will be returned.
+ * Return value: (transfer full): a null terminated copy of the slice
+ */
+gchar *
+web_socket_slice_dup (const WebSocketSlice *slice)
+{
+  return g_strndup (slice->data, slice->length);
+}
+
+/**
+ * web_socket_headers_init:
+ * @headers: headers to initialize
  *
- * The @headers returned will be allocated using web_socket_util_new_headers(),
- * and should be freed by the caller using g_free().
+ * Initialize a #WebSocketHeaders, usually allocated on the stack.
+ * Clear it with web_socket_headers_clear() when done.
+ */
+void
+web_socket_headers_init (WebSocketHeaders *headers)
+{
+  headers->count = 0;
+  headers->allocated = WEB_SOCKET_INLINE_HEADERS;
+  headers->headers = headers->inlined;
+}
+
+/**
+ * web_socket_headers_clear:
+ * @headers: headers to clear
+ *
+ * Free memory used by a #WebSocketHeaders, if any. It can be
+ * used again afterwards.
+ */
+void
+web_socket_headers_clear (WebSocketHeaders *headers)
+{
+  if (headers->headers != headers->inlined)
+    g_free (headers->headers);
+  web_socket_headers_init (headers);
+}
+
+static WebSocketHeader *
+headers_append (WebSocketHeaders *headers)
+{
+  if (headers->count == headers->allocated)
+    {
+      /* Only requests with unusually many headers get here */
+      headers->allocated *= 2;
+      if (headers->headers == headers->inlined)
+        {
+          headers->headers = g_new (WebSocketHeader, headers->allocated);
+          memcpy (headers->headers, headers->inlined, sizeof (headers->inlined));
+        }
+      else
+        {
+          headers->headers = g_renew (WebSocketHeader, headers->headers, headers->allocated);
+        }
+    }
+
+  return headers->headers + headers->count++;
+}
+
+/**
+ * web_socket_headers_lookup:
+ * @headers: parsed headers
+ * @name: the header name
+ *
+ * Lookup a header by its name, in a case insensitive way. If a header
+ * is present more than once the last one is returned, the same as
+ * web_socket_util_parse_headers().
+ *
+ * Return value: (transfer none): the value, or %NULL if not present
+ */
+const WebSocketSlice *
+web_socket_headers_lookup (const WebSocketHeaders *headers,
+                           const gchar *name)
+{
+  const WebSocketHeader *header;
+  gsize len = strlen (name);
+  guint i;
+
+  for (i = headers->count; i > 0; i--)
+    {
+      header = headers->headers + (i - 1);
+      if (header->name.length == len &&
+          g_ascii_strncasecmp (header->name.data, name, len) == 0)
+        return &header->value;
+    }
+
+  return NULL;
+}
+
+/**
+ * web_socket_headers_to_table:
+ * @headers: parsed headers
+ *
+ * Build a header hashtable, as returned by web_socket_util_new_headers(),
+ * for callers that need to hold onto the headers.
+ *
+ * Return value: (transfer full): a new header hashtable
+ */
+GHashTable *
+web_socket_headers_to_table (const WebSocketHeaders *headers)
+{
+  GHashTable *table;
+  guint i;
+
+  table = web_socket_util_new_headers ();
+  for (i = 0; i < headers->count; i++)
+    {
+      g_hash_table_insert (table,
+                           web_socket_slice_dup (&headers->headers[i].name),
+                           web_socket_slice_dup (&headers->headers[i].value));
+    }
+
+  return table;
+}
+
+static void
+slice_strip (WebSocketSlice *slice,
+             const gchar *beg,
+             const gchar *end)
+{
+  while (beg != end && g_ascii_isspace (beg[0]))
+    beg++;
+  while (end != beg && g_ascii_isspace (end[-1]))
+    end--;
+  slice->data = beg;
+  slice->length = end - beg;
+}
+
+/**
+ * web_socket_util_parse_header_slices:
+ * @data: (array length=length): the input data
+ * @length: length of data
+ * @headers: initialized headers to fill in
+ *
+ * Parse HTTP headers without allocating.
+ *
+ * The same as web_socket_util_parse_headers() except that the headers
+ * are placed in @headers as slices pointing into @data. Any previous
+ * contents of @headers are replaced. Nothing is allocated unless there
+ * are more than %WEB_SOCKET_INLINE_HEADERS headers.
  *
  * Return value: zero if truncated, negative if fails, or number of
  *               characters parsed
  */
 gssize
-web_socket_util_parse_headers (const gchar *data,
-                               gsize length,
-                               GHashTable **headers)
+web_socket_util_parse_header_slices (const gchar *data,
+                                     gsize length,
+                                     WebSocketHeaders *headers)
 {
-  GHashTable *parsed_headers;
+  WebSocketHeader *header;
   const gchar *line;
   const gchar *colon;
-  gsize consumed = 0;
+  gssize consumed = 0;
   gboolean end = FALSE;
   gsize line_len;
-  gchar *name;
-  gchar *value;
 
-  parsed_headers = web_socket_util_new_headers ();
+  headers->count = 0;
 
   while (!end)
     {
@@ -324,19 +521,17 @@ web_socket_util_parse_headers (const gchar *data,
       /* A header line */
       else
         {
-          colon = memchr (data, ':', length);
-          if (!colon || colon >= line)
+          colon = memchr (data, ':', line_len);
+          if (!colon)
             {
               g_message ("received invalid header line: %.*s", (gint)line_len, data);
               consumed = -1;
               break;
             }
 
-          name = g_strndup (data, colon - data);
-          g_strstrip (name);
-          value = g_strndup (colon + 1, line - (colon + 1));
-          g_strstrip (value);
-          g_hash_table_insert (parsed_headers, name, value);
+          header = headers_append (headers);
+          slice_strip (&header->name, data, colon);
+          slice_strip (&header->value, colon + 1, line);
         }
 
       consumed += line_len;
@@ -344,14 +539,51 @@ web_socket_util_parse_headers (const gchar *data,
       length -= line_len;
     }
 
-  if (consumed > 0)
-    {
-      if (headers)
-          *headers = g_hash_table_ref (parsed_headers);
-    }
+  if (consumed <= 0)
+    headers->count = 0;
+
+  return consumed;
+}
+
+/**
+ * web_socket_util_parse_headers:
+ * @data: (array length=length): the input data
+ * @length: length of data
+ * @headers: (out): location to place HTTP header hash table
+ *
+ * Parse HTTP headers.
+ *
+ * The number of bytes parsed will be returned if parsing succeeds, including
+ * the new line at the end of the request line. A negative value will be
+ * returned if parsing fails.
+ *
+ * If the HTTP request line was truncated (ie: not all of it was present
+ * within @length) then zero will be returned.
+ *
+ * The @headers returned will be allocated using web_socket_util_new_headers(),
+ * and should be freed by the caller using g_free().
+ *
+ * Use web_socket_util_parse_header_slices() in hot paths that don't need
+ * to hold onto the headers.
+ *
+ * Return value: zero if truncated, negative if fails, or number of
+ *               characters parsed
+ */
+gssize
+web_socket_util_parse_headers (const gchar *data,
+                               gsize length,
+                               GHashTable **headers)
+{
+  WebSocketHeaders parsed;
+  gssize consumed;
+
+  web_socket_headers_init (&parsed);
 
-  g_hash_table_unref (parsed_headers);
+  consumed = web_socket_util_parse_header_slices (data, length, &parsed);
+  if (consumed > 0 && headers)
+    *headers = web_socket_headers_to_table (&parsed);
 
+  web_socket_headers_clear (&parsed);
   return consumed;
 }
 
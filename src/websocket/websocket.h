@@ -28,8 +28,61 @@ G_BEGIN_DECLS
 
 GQuark          web_socket_error_get_quark     (void) G_GNUC_CONST;
 
+/*
+ * A slice of an input buffer, not null terminated. Only valid as
+ * long as the buffer it points into.
+ */
+typedef struct {
+  const gchar *data;
+  gsize length;
+} WebSocketSlice;
+
+typedef struct {
+  WebSocketSlice name;
+  WebSocketSlice value;
+} WebSocketHeader;
+
+#define WEB_SOCKET_INLINE_HEADERS 24
+
+/*
+ * Parsed HTTP headers as slices into the input buffer. Typical requests
+ * fit in the inline array, and parsing them allocates nothing.
+ */
+typedef struct {
+  guint count;
+  guint allocated;
+  WebSocketHeader *headers;
+  WebSocketHeader inlined[WEB_SOCKET_INLINE_HEADERS];
+} WebSocketHeaders;
+
+gboolean        web_socket_slice_equal         (const WebSocketSlice *slice,
+                                                const gchar *str);
+
+gboolean        web_socket_slice_has_prefix    (const WebSocketSlice *slice,
+                                                const gchar *prefix);
+
+gchar *         web_socket_slice_dup           (const WebSocketSlice *slice);
+
+void            web_socket_headers_init        (WebSocketHeaders *headers);
+
+void            web_socket_headers_clear       (WebSocketHeaders *headers);
+
+const WebSocketSlice * web_socket_headers_lookup (const WebSocketHeaders *headers,
+                                                  const gchar *name);
+
+GHashTable *    web_socket_headers_to_table    (const WebSocketHeaders *headers);
+
 GHashTable *    web_socket_util_new_headers    (void);
 
+gssize          web_socket_util_parse_header_slices (const gchar *data,
+                                                     gsize length,
+                                                     WebSocketHeaders *headers);
+
+gssize          web_socket_util_parse_req_line_slices (const gchar *data,
+                                                       gsize length,
+                                                       WebSocketSlice *method,
+                                                       WebSocketSlice *resource);
+
 gssize          web_socket_util_parse_headers  (const gchar *data,
                                                 gsize length,
                                                 GHashTable **headers);
@@ -0,0 +1,448 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitadmission.h"
+#include "cockpitws.h"
+
+#include <string.h>
+
+/*
+ * Admission control for cockpit-ws. Work beyond these limits is turned
+ * away straight away with a 503 and a Retry-After, rather than queued
+ * up while it eats the memory that the logged in users need.
+ *
+ * This state is process wide, and shared by all the web server workers.
+ * A limit of zero means no limit.
+ */
+
+/* Connections that haven't been handed off to a handler yet */
+guint cockpit_ws_max_connections = 250;
+
+/* Logins in flight, each of which spawns a cockpit-session */
+guint cockpit_ws_max_logins = 20;
+
+/* Web sockets open for any one user */
+guint cockpit_ws_max_user_sessions = 100;
+
+/* Web sockets open in total */
+guint cockpit_ws_max_web_sockets = 1000;
+
+/* Token bucket for new connections from each remote address */
+guint cockpit_ws_address_rate = 20;
+guint cockpit_ws_address_burst = 200;
+
+/* Suggested to clients when a limit is reached */
+guint cockpit_ws_retry_after = 5;
+
+/*
+ * Don't track more than this many addresses with partially empty
+ * buckets. When the table is full, full buckets are pruned at most
+ * once a second, and addresses that still don't fit aren't limited.
+ */
+#define MAX_ADDRESSES 4096
+
+typedef struct {
+  guint current;
+  guint peak;
+  guint64 rejected;
+} Counter;
+
+typedef struct {
+  gdouble tokens;
+  gint64 updated;
+} Bucket;
+
+G_LOCK_DEFINE_STATIC (admission);
+static Counter counters[COCKPIT_ADMISSION_WEB_SOCKETS + 1];
+static Counter user_counter;
+static GHashTable *users = NULL;
+static GHashTable *addresses = NULL;
+static guint64 addresses_rejected = 0;
+static guint64 addresses_untracked = 0;
+static gint64 addresses_pruned = 0;
+
+static guint *
+limit_for_kind (CockpitAdmissionKind kind)
+{
+  switch (kind)
+    {
+    case COCKPIT_ADMISSION_CONNECTIONS:
+      return &cockpit_ws_max_connections;
+    case COCKPIT_ADMISSION_LOGINS:
+      return &cockpit_ws_max_logins;
+    case COCKPIT_ADMISSION_WEB_SOCKETS:
+      return &cockpit_ws_max_web_sockets;
+    default:
+      g_return_val_if_reached (NULL);
+    }
+}
+
+static const gchar *
+name_for_kind (CockpitAdmissionKind kind)
+{
+  switch (kind)
+    {
+    case COCKPIT_ADMISSION_CONNECTIONS:
+      return "connections";
+    case COCKPIT_ADMISSION_LOGINS:
+      return "logins";
+    case COCKPIT_ADMISSION_WEB_SOCKETS:
+      return "web-sockets";
+    default:
+      g_return_val_if_reached (NULL);
+    }
+}
+
+static gboolean
+counter_acquire (Counter *counter,
+                 guint limit)
+{
+  if (limit > 0 && counter->current >= limit)
+    {
+      counter->rejected++;
+      return FALSE;
+    }
+
+  counter->current++;
+  counter->peak = MAX (counter->peak, counter->current);
+  return TRUE;
+}
+
+/**
+ * cockpit_admission_acquire:
+ * @kind: the kind of work
+ * @retry_after: location to place suggested Retry-After seconds
+ *
+ * Try to admit some work. If this returns TRUE, then call
+ * cockpit_admission_release() once the work is done.
+ *
+ * Returns: whether the work should go ahead
+ */
+gboolean
+cockpit_admission_acquire (CockpitAdmissionKind kind,
+                           guint *retry_after)
+{
+  const gchar *name;
+  gboolean ret;
+  guint *limit;
+
+  limit = limit_for_kind (kind);
+  g_return_val_if_fail (limit != NULL, FALSE);
+
+  G_LOCK (admission);
+  ret = counter_acquire (counters + kind, *limit);
+  G_UNLOCK (admission);
+
+  if (!ret)
+    {
+      name = name_for_kind (kind);
+      g_debug ("turning away work, too many %s: %u", name, *limit);
+      if (retry_after)
+        *retry_after = cockpit_ws_retry_after;
+    }
+
+  return ret;
+}
+
+/**
+ * cockpit_admission_release:
+ * @kind: the kind of work
+ *
+ * Release work that was admitted by cockpit_admission_acquire().
+ */
+void
+cockpit_admission_release (CockpitAdmissionKind kind)
+{
+  Counter *counter;
+
+  g_return_if_fail (limit_for_kind (kind) != NULL);
+
+  G_LOCK (admission);
+  counter = counters + kind;
+  g_warn_if_fail (counter->current > 0);
+  if (counter->current > 0)
+    counter->current--;
+  G_UNLOCK (admission);
+}
+
+/**
+ * cockpit_admission_acquire_user:
+ * @user: the user opening a session
+ * @retry_after: location to place suggested Retry-After seconds
+ *
+ * Try to admit another session for @user. If this returns TRUE,
+ * then call cockpit_admission_release_user() once the session is done.
+ *
+ * Returns: whether the session should go ahead
+ */
+gboolean
+cockpit_admission_acquire_user (const gchar *user,
+                                guint *retry_after)
+{
+  guint count;
+  gboolean ret;
+
+  g_return_val_if_fail (user != NULL, FALSE);
+
+  G_LOCK (admission);
+
+  if (!users)
+    users = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (users, user));
+  ret = (cockpit_ws_max_user_sessions == 0 || count < cockpit_ws_max_user_sessions);
+  if (ret)
+    {
+      g_hash_table_replace (users, g_strdup (user), GUINT_TO_POINTER (count + 1));
+      user_counter.current++;
+      user_counter.peak = MAX (user_counter.peak, user_counter.current);
+    }
+  else
+    {
+      user_counter.rejected++;
+    }
+
+  G_UNLOCK (admission);
+
+  if (!ret)
+    {
+      g_message ("%s: too many sessions for user: %u", user, cockpit_ws_max_user_sessions);
+      if (retry_after)
+        *retry_after = cockpit_ws_retry_after;
+    }
+
+  return ret;
+}
+
+/**
+ * cockpit_admission_release_user:
+ * @user: the user
+ *
+ * Release a session admitted by cockpit_admission_acquire_user().
+ */
+void
+cockpit_admission_release_user (const gchar *user)
+{
+  guint count;
+
+  g_return_if_fail (user != NULL);
+
+  G_LOCK (admission);
+
+  count = users ? GPOINTER_TO_UINT (g_hash_table_lookup (users, user)) : 0;
+  g_warn_if_fail (count > 0);
+  if (count > 1)
+    g_hash_table_replace (users, g_strdup (user), GUINT_TO_POINTER (count - 1));
+  else if (count == 1)
+    g_hash_table_remove (users, user);
+  if (count > 0)
+    user_counter.current--;
+
+  G_UNLOCK (admission);
+}
+
+static void
+bucket_refill (Bucket *bucket,
+               gint64 now)
+{
+  gdouble burst = cockpit_ws_address_burst;
+
+  if (now > bucket->updated)
+    {
+      bucket->tokens += (now - bucket->updated) * (gdouble)cockpit_ws_address_rate / G_USEC_PER_SEC;
+      bucket->updated = now;
+    }
+  if (bucket->tokens > burst)
+    bucket->tokens = burst;
+}
+
+static void
+prune_addresses (gint64 now)
+{
+  GHashTableIter iter;
+  Bucket *bucket;
+
+  if (addresses_pruned > 0 && now - addresses_pruned < G_USEC_PER_SEC)
+    return;
+  addresses_pruned = now;
+
+  /* Full buckets are the same as no bucket */
+  g_hash_table_iter_init (&iter, addresses);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&bucket))
+    {
+      bucket_refill (bucket, now);
+      if (bucket->tokens >= cockpit_ws_address_burst)
+        g_hash_table_iter_remove (&iter);
+    }
+}
+
+/**
+ * cockpit_admission_check_address:
+ * @address: the remote address
+ * @retry_after: location to place suggested Retry-After seconds
+ *
+ * Take a token from the bucket for @address. Each bucket holds up to
+ * cockpit_ws_address_burst tokens and refills at
+ * cockpit_ws_address_rate tokens per second.
+ *
+ * Returns: whether a new connection from @address should go ahead
+ */
+gboolean
+cockpit_admission_check_address (const gchar *address,
+                                 guint *retry_after)
+{
+  Bucket *bucket;
+  gboolean ret;
+  gint64 now;
+  gint64 usec;
+  guint wait = 0;
+
+  g_return_val_if_fail (address != NULL, FALSE);
+
+  if (cockpit_ws_address_rate == 0 || cockpit_ws_address_burst == 0)
+    return TRUE;
+
+  now = g_get_monotonic_time ();
+
+  G_LOCK (admission);
+
+  if (!addresses)
+    addresses = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  bucket = g_hash_table_lookup (addresses, address);
+  if (bucket)
+    {
+      bucket_refill (bucket, now);
+    }
+  else
+    {
+      if (g_hash_table_size (addresses) >= MAX_ADDRESSES)
+        prune_addresses (now);
+      if (g_hash_table_size (addresses) >= MAX_ADDRESSES)
+        {
+          addresses_untracked++;
+          G_UNLOCK (admission);
+          return TRUE;
+        }
+      bucket = g_new0 (Bucket, 1);
+      bucket->tokens = cockpit_ws_address_burst;
+      bucket->updated = now;
+      g_hash_table_insert (addresses, g_strdup (address), bucket);
+    }
+
+  ret = (bucket->tokens >= 1.0);
+  if (ret)
+    {
+      bucket->tokens -= 1.0;
+    }
+  else
+    {
+      addresses_rejected++;
+      /* Until the next whole token, rounded up to whole seconds */
+      usec = (gint64)((1.0 - bucket->tokens) * G_USEC_PER_SEC) / cockpit_ws_address_rate;
+      wait = MAX ((usec + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC, 1);
+    }
+
+  G_UNLOCK (admission);
+
+  if (!ret)
+    {
+      g_debug ("%s: turning away connection, over rate limit", address);
+      if (retry_after)
+        *retry_after = MAX (wait, 1);
+    }
+
+  return ret;
+}
+
+static JsonObject *
+build_counter (Counter *counter,
+               guint limit)
+{
+  JsonObject *object = json_object_new ();
+  json_object_set_int_member (object, "current", counter->current);
+  json_object_set_int_member (object, "peak", counter->peak);
+  json_object_set_int_member (object, "limit", limit);
+  json_object_set_int_member (object, "rejected", counter->rejected);
+  return object;
+}
+
+/**
+ * cockpit_admission_build_status:
+ *
+ * Describe the current load and the limits that apply to it.
+ *
+ * Returns: (transfer full): a new JSON object
+ */
+JsonObject *
+cockpit_admission_build_status (void)
+{
+  CockpitAdmissionKind kind;
+  JsonObject *status;
+  JsonObject *object;
+
+  status = json_object_new ();
+
+  G_LOCK (admission);
+
+  for (kind = COCKPIT_ADMISSION_CONNECTIONS; kind <= COCKPIT_ADMISSION_WEB_SOCKETS; kind++)
+    {
+      json_object_set_object_member (status, name_for_kind (kind),
+                                     build_counter (counters + kind, *limit_for_kind (kind)));
+    }
+
+  object = build_counter (&user_counter, cockpit_ws_max_user_sessions);
+  json_object_set_int_member (object, "users", users ? g_hash_table_size (users) : 0);
+  json_object_set_object_member (status, "user-sessions", object);
+
+  object = json_object_new ();
+  json_object_set_int_member (object, "tracked", addresses ? g_hash_table_size (addresses) : 0);
+  json_object_set_int_member (object, "rate", cockpit_ws_address_rate);
+  json_object_set_int_member (object, "burst", cockpit_ws_address_burst);
+  json_object_set_int_member (object, "rejected", addresses_rejected);
+  json_object_set_int_member (object, "untracked", addresses_untracked);
+  json_object_set_object_member (status, "addresses", object);
+
+  G_UNLOCK (admission);
+
+  return status;
+}
+
+/**
+ * cockpit_admission_reset:
+ *
+ * Forget all the load figures. Used by tests.
+ */
+void
+cockpit_admission_reset (void)
+{
+  G_LOCK (admission);
+  memset (counters, 0, sizeof (counters));
+  memset (&user_counter, 0, sizeof (user_counter));
+  if (users)
+    g_hash_table_remove_all (users);
+  if (addresses)
+    g_hash_table_remove_all (addresses);
+  addresses_rejected = 0;
+  addresses_untracked = 0;
+  addresses_pruned = 0;
+  G_UNLOCK (admission);
+}
@@ -0,0 +1,53 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __COCKPIT_ADMISSION_H__
+#define __COCKPIT_ADMISSION_H__
+
+#include <gio/gio.h>
+#include <json-glib/json-glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+  COCKPIT_ADMISSION_CONNECTIONS,
+  COCKPIT_ADMISSION_LOGINS,
+  COCKPIT_ADMISSION_WEB_SOCKETS,
+} CockpitAdmissionKind;
+
+gboolean       cockpit_admission_acquire          (CockpitAdmissionKind kind,
+                                                   guint *retry_after);
+
+void           cockpit_admission_release          (CockpitAdmissionKind kind);
+
+gboolean       cockpit_admission_acquire_user     (const gchar *user,
+                                                   guint *retry_after);
+
+void           cockpit_admission_release_user     (const gchar *user);
+
+gboolean       cockpit_admission_check_address    (const gchar *address,
+                                                   guint *retry_after);
+
+JsonObject *   cockpit_admission_build_status     (void);
+
+void           cockpit_admission_reset            (void);
+
+G_END_DECLS
+
+#endif /* __COCKPIT_ADMISSION_H__ */
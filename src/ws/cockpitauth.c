@@ -37,11 +37,14 @@
 
 
 #include <sys/types.h>
+#include <sys/file.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <pwd.h>
@@ -50,11 +53,160 @@
 #include <security/pam_appl.h>
 #include <stdlib.h>
 
+/*
+ * Login cookies are self contained: they carry the user, the remote host,
+ * when they were issued and when they expire, and a nonce for the login,
+ * signed with an HMAC. Any cockpit-ws process that has the key can check
+ * a cookie, without asking the process that did the login.
+ *
+ * The key is shared through a file that only its owner can read. When
+ * there's no key file, and it can't be created, each process uses its
+ * own random key and only accepts its own cookies.
+ *
+ * Revoked cookies are listed by nonce in a deny file that the processes
+ * append to, and which each of them follows. Once most of the listed
+ * cookies have expired anyway, the file is written again without them.
+ */
+
+/* Key for signing cookies, shared by all cockpit-ws processes */
+const gchar *cockpit_ws_cookie_key_file =
+    PACKAGE_LOCALSTATE_DIR "/lib/cockpit/cookie-key";
+
+/* Revoked cookies, shared by all cockpit-ws processes */
+const gchar *cockpit_ws_cookie_deny_file =
+    PACKAGE_LOCALSTATE_DIR "/lib/cockpit/cookie-deny";
+
+/* How long a login cookie is valid, in seconds */
+guint cockpit_ws_cookie_lifetime = 24 * 60 * 60;
+
+/* cockpit-session helpers started ahead of time, waiting for a login */
+guint cockpit_ws_session_pool = 2;
+
+/* Stashed session processes not picked up within this time are closed */
+#define READY_TIMEOUT 10
+
+/* Logins not followed by a first message within this time aren't traced */
+#define TRACE_TIMEOUT (5 * 60 * G_USEC_PER_SEC)
+
+/* The deny file is checked for changes at most this often */
+#define DENY_CHECK_INTERVAL G_USEC_PER_SEC
+
+/* Rewrite the deny file when more than half of at least this many lines are stale */
+#define DENY_REWRITE_LINES 64
+
+#define KEY_SIZE 128
+#define MIN_KEY_SIZE 32
+
 static char *     creds_to_cookie    (CockpitAuth *self,
                                       CockpitCreds *creds);
 
 G_DEFINE_TYPE (CockpitAuth, cockpit_auth, G_TYPE_OBJECT)
 
+/*
+ * The creds for a login that this process knows about. For its own
+ * logins these include the password.
+ */
+typedef struct {
+  CockpitCreds *creds;
+  gint64 expires;
+} AuthEntry;
+
+static void
+auth_entry_free (gpointer data)
+{
+  AuthEntry *entry = data;
+  cockpit_creds_unref (entry->creds);
+  g_free (entry);
+}
+
+/* The main context of the calling thread, never NULL */
+static GMainContext *
+thread_context (void)
+{
+  GMainContext *context = g_main_context_get_thread_default ();
+  return context ? context : g_main_context_default ();
+}
+
+/*
+ * A session process is tied to the main context of the thread
+ * that spawned it, and can only be reused by that thread.
+ */
+typedef struct {
+  CockpitPipe *pipe;
+  GMainContext *context;
+  CockpitAuth *auth;
+  CockpitCreds *creds;
+  GSource *timeout;
+} ReadySession;
+
+static gboolean
+unref_in_context (gpointer data)
+{
+  g_object_unref (data);
+  return FALSE;
+}
+
+static void
+ready_session_free (gpointer data)
+{
+  ReadySession *ready = data;
+
+  if (ready->timeout)
+    {
+      g_source_destroy (ready->timeout);
+      g_source_unref (ready->timeout);
+    }
+
+  if (ready->context == thread_context ())
+    g_object_unref (ready->pipe);
+  else
+    g_main_context_invoke (ready->context, unref_in_context, ready->pipe);
+
+  g_main_context_unref (ready->context);
+  g_free (ready);
+}
+
+/*
+ * A cockpit-session started ahead of time, and waiting for cockpit-ws to
+ * tell it who is logging in. Also belongs to the thread that spawned it.
+ */
+typedef struct {
+  CockpitPipe *pipe;
+  gint auth_fd;
+  GMainContext *context;
+  gulong sig_close;
+  gint closed;
+} PooledSession;
+
+static void
+pooled_session_free (gpointer data)
+{
+  PooledSession *pooled = data;
+
+  /* The helper exits quietly when it reads nothing */
+  shutdown (pooled->auth_fd, SHUT_WR);
+  close (pooled->auth_fd);
+
+  g_signal_handler_disconnect (pooled->pipe, pooled->sig_close);
+  if (pooled->context == thread_context ())
+    g_object_unref (pooled->pipe);
+  else
+    g_main_context_invoke (pooled->context, unref_in_context, pooled->pipe);
+
+  g_main_context_unref (pooled->context);
+  g_free (pooled);
+}
+
+static void
+on_pooled_close (CockpitPipe *pipe,
+                 const gchar *problem,
+                 gpointer user_data)
+{
+  PooledSession *pooled = user_data;
+  g_debug ("pooled session process went away: %s", problem ? problem : "closed");
+  g_atomic_int_set (&pooled->closed, 1);
+}
+
 static void
 cockpit_auth_finalize (GObject *object)
 {
@@ -62,28 +214,156 @@ cockpit_auth_finalize (GObject *object)
 
   g_byte_array_unref (self->key);
   g_hash_table_destroy (self->authenticated);
+  g_hash_table_destroy (self->denied);
   g_hash_table_destroy (self->ready_sessions);
+  g_queue_free_full (self->session_pool, pooled_session_free);
+  g_hash_table_destroy (self->login_starts);
+  g_mutex_clear (&self->mutex);
 
   G_OBJECT_CLASS (cockpit_auth_parent_class)->finalize (object);
 }
 
 static void
-cockpit_auth_init (CockpitAuth *self)
+read_random_key (guchar *data,
+                 gsize length)
 {
   gint fd;
 
-  self->key = g_byte_array_new ();
-  g_byte_array_set_size (self->key, 128);
   fd = g_open ("/dev/urandom", O_RDONLY, 0);
-  if (fd < 0 || read (fd, self->key->data, 128) != 128)
+  if (fd < 0 || read (fd, data, length) != (gssize)length)
     g_error ("couldn't read random key, startup aborted");
   close (fd);
+}
+
+static gboolean
+read_key_file (const gchar *path,
+               GByteArray *key,
+               gboolean *missing)
+{
+  gboolean ret = FALSE;
+  struct stat st;
+  gssize count;
+  gint fd;
+
+  fd = g_open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC, 0);
+  if (fd < 0)
+    {
+      if (errno == ENOENT)
+        *missing = TRUE;
+      else
+        g_message ("couldn't open cookie key: %s: %s", path, g_strerror (errno));
+      return FALSE;
+    }
+
+  if (fstat (fd, &st) < 0)
+    {
+      g_message ("couldn't stat cookie key: %s: %s", path, g_strerror (errno));
+    }
+  else if ((st.st_uid != 0 && st.st_uid != geteuid ()) || (st.st_mode & 077) != 0)
+    {
+      g_warning ("%s: cookie key must only be accessible by its owner", path);
+    }
+  else
+    {
+      g_byte_array_set_size (key, KEY_SIZE);
+      do
+        count = read (fd, key->data, KEY_SIZE);
+      while (count < 0 && errno == EINTR);
+
+      if (count < 0)
+        {
+          g_message ("couldn't read cookie key: %s: %s", path, g_strerror (errno));
+        }
+      else if (count < MIN_KEY_SIZE)
+        {
+          g_warning ("%s: cookie key is too short", path);
+        }
+      else
+        {
+          g_byte_array_set_size (key, count);
+          ret = TRUE;
+        }
+    }
+
+  close (fd);
+  return ret;
+}
+
+static void
+create_key_file (const gchar *path)
+{
+  guchar data[KEY_SIZE];
+  gchar *temp;
+  gint fd;
+
+  /* Written elsewhere, and linked into place, so others never see half a key */
+  temp = g_strdup_printf ("%s.XXXXXX", path);
+  fd = g_mkstemp_full (temp, O_WRONLY | O_CLOEXEC, 0600);
+  if (fd < 0)
+    {
+      g_debug ("couldn't create cookie key: %s: %s", path, g_strerror (errno));
+    }
+  else
+    {
+      read_random_key (data, sizeof (data));
+      if (write (fd, data, sizeof (data)) != (gssize)sizeof (data))
+        g_message ("couldn't write cookie key: %s: %s", temp, g_strerror (errno));
+
+      /* Another process may have got there first, that's fine */
+      else if (link (temp, path) < 0 && errno != EEXIST)
+        g_message ("couldn't create cookie key: %s: %s", path, g_strerror (errno));
+      else
+        g_debug ("created cookie key: %s", path);
+
+      close (fd);
+      g_unlink (temp);
+      cockpit_secclear (data, sizeof (data));
+    }
+
+  g_free (temp);
+}
+
+static gboolean
+load_shared_key (const gchar *path,
+                 GByteArray *key)
+{
+  gboolean missing = FALSE;
+
+  if (read_key_file (path, key, &missing))
+    return TRUE;
+  if (!missing)
+    return FALSE;
+
+  create_key_file (path);
+  return read_key_file (path, key, &missing);
+}
+
+static void
+cockpit_auth_init (CockpitAuth *self)
+{
+  self->key = g_byte_array_new ();
+  if (cockpit_ws_cookie_key_file && load_shared_key (cockpit_ws_cookie_key_file, self->key))
+    {
+      g_debug ("using shared cookie key: %s", cockpit_ws_cookie_key_file);
+    }
+  else
+    {
+      g_byte_array_set_size (self->key, KEY_SIZE);
+      read_random_key (self->key->data, KEY_SIZE);
+    }
 
   self->authenticated = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                               g_free, cockpit_creds_unref);
+                                               g_free, auth_entry_free);
+  self->denied = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
 
   self->ready_sessions = g_hash_table_new_full (cockpit_creds_hash, cockpit_creds_equal,
-                                                cockpit_creds_unref, g_object_unref);
+                                                cockpit_creds_unref, ready_session_free);
+  self->session_pool = g_queue_new ();
+
+  self->login_starts = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                              cockpit_creds_unref, g_free);
+
+  g_mutex_init (&self->mutex);
 }
 
 struct passwd *
@@ -115,11 +395,50 @@ cockpit_getpwnam_a (const gchar *user,
   return ret;
 }
 
+static gboolean
+on_ready_session_timeout (gpointer user_data)
+{
+  ReadySession *ready = user_data;
+  CockpitAuth *self = ready->auth;
+  CockpitCreds *orig = NULL;
+  ReadySession *found = NULL;
+
+  g_mutex_lock (&self->mutex);
+
+  /* Only if it's still this one waiting */
+  if (g_hash_table_lookup_extended (self->ready_sessions, ready->creds,
+                                    (gpointer *)&orig, (gpointer *)&found) && found == ready)
+    {
+      if (!g_hash_table_steal (self->ready_sessions, orig))
+        g_assert_not_reached ();
+    }
+  else
+    {
+      found = NULL;
+    }
+
+  g_mutex_unlock (&self->mutex);
+
+  if (found)
+    {
+      g_debug ("stashed session process was not used");
+      cockpit_creds_unref (orig);
+      ready_session_free (found);
+    }
+
+  return FALSE;
+}
+
 static void
 stash_session_process (CockpitAuth *self,
                        CockpitCreds *creds,
                        CockpitPipe *proc)
 {
+  ReadySession *ready;
+  gboolean stashed = FALSE;
+
+  g_mutex_lock (&self->mutex);
+
   /* Avoid calling destructors within the mutex */
   if (g_hash_table_lookup (self->ready_sessions, creds))
     {
@@ -128,9 +447,22 @@ stash_session_process (CockpitAuth *self,
   else
     {
       g_debug ("stashed session process for later");
-      g_hash_table_insert (self->ready_sessions,
-                           cockpit_creds_ref (creds), proc);
+      ready = g_new0 (ReadySession, 1);
+      ready->pipe = proc;
+      ready->context = g_main_context_ref_thread_default ();
+      ready->auth = self;
+      ready->creds = cockpit_creds_ref (creds);
+      ready->timeout = g_timeout_source_new_seconds (READY_TIMEOUT);
+      g_source_set_callback (ready->timeout, on_ready_session_timeout, ready, NULL);
+      g_source_attach (ready->timeout, ready->context);
+      g_hash_table_insert (self->ready_sessions, ready->creds, ready);
+      stashed = TRUE;
     }
+
+  g_mutex_unlock (&self->mutex);
+
+  if (!stashed)
+    g_object_unref (proc);
 }
 
 static CockpitPipe *
@@ -139,23 +471,50 @@ pop_session_process (CockpitAuth *self,
 {
   CockpitPipe *proc = NULL;
   CockpitCreds *orig = NULL;
+  ReadySession *ready = NULL;
+
+  g_mutex_lock (&self->mutex);
 
   if (g_hash_table_lookup_extended (self->ready_sessions, creds,
-                                    (gpointer *)&orig, (gpointer *)&proc))
+                                    (gpointer *)&orig, (gpointer *)&ready))
     {
       if (!g_hash_table_steal (self->ready_sessions, orig))
         g_assert_not_reached ();
+    }
+
+  g_mutex_unlock (&self->mutex);
+
+  if (ready)
+    {
       cockpit_creds_unref (orig);
+
+      /* Only usable from the thread that started it */
+      if (ready->context == thread_context ())
+        {
+          proc = ready->pipe;
+          g_source_destroy (ready->timeout);
+          g_source_unref (ready->timeout);
+          g_main_context_unref (ready->context);
+          g_free (ready);
+        }
+      else
+        {
+          g_debug ("stashed session process belongs to another thread");
+          ready_session_free (ready);
+        }
     }
 
   return proc;
 }
 
+/*
+ * Starts cockpit-session. With @auth_fd it authenticates with what gets
+ * written to the returned fd, otherwise it only opens a session.
+ */
 static CockpitPipe *
 spawn_session_process (const gchar *user,
-                       GBytes *password,
                        const gchar *remote_peer,
-                       CockpitPipe **auth_pipe)
+                       gint *auth_fd)
 {
   CockpitPipe *pipe;
   int pwfds[2] = { -1, -1 };
@@ -183,10 +542,14 @@ spawn_session_process (const gchar *user,
       NULL,
   };
 
-  if (password)
+  if (auth_fd)
     {
       if (socketpair (PF_UNIX, SOCK_STREAM, 0, pwfds) < 0)
         g_return_val_if_reached (NULL);
+
+      /* Other session processes mustn't hold on to our end */
+      fcntl (pwfds[0], F_SETFD, FD_CLOEXEC);
+
       g_snprintf (autharg, sizeof (autharg), "%d", pwfds[1]);
       argv = argv_password;
     }
@@ -201,31 +564,178 @@ spawn_session_process (const gchar *user,
     {
       g_warning ("failed to start %s: %s", cockpit_ws_session_program, error->message);
       g_error_free (error);
+      if (auth_fd)
+        {
+          close (pwfds[0]);
+          close (pwfds[1]);
+        }
       return NULL;
+    }
+
+  pipe = g_object_new (COCKPIT_TYPE_PIPE,
+                       "pid", pid,
+                       "in-fd", out_fd,
+                       "out-fd", in_fd,
+                       NULL);
 
+  if (auth_fd)
+    {
+      /* Child process end of pipe */
+      close (pwfds[1]);
+      *auth_fd = pwfds[0];
     }
-  else
+
+  return pipe;
+}
+
+/* Sends @input to cockpit-session, and reads back the result */
+static CockpitPipe *
+send_session_auth (gint auth_fd,
+                   GBytes *input)
+{
+  CockpitPipe *auth_pipe;
+
+  auth_pipe = cockpit_pipe_new ("password-pipe", auth_fd, auth_fd);
+  cockpit_pipe_write (auth_pipe, input);
+  cockpit_pipe_close (auth_pipe, NULL);
+
+  return auth_pipe;
+}
+
+static void
+secclear_byte_array (gpointer data)
+{
+  GByteArray *array = data;
+  cockpit_secclear (array->data, array->len);
+  g_byte_array_unref (array);
+}
+
+/* A pooled cockpit-session reads: user \n remote-host \n password */
+static GBytes *
+build_pooled_input (const gchar *user,
+                    const gchar *remote_peer,
+                    GBytes *password)
+{
+  GByteArray *array;
+  gconstpointer data;
+  gsize length;
+
+  array = g_byte_array_new ();
+  g_byte_array_append (array, (const guint8 *)user, strlen (user));
+  g_byte_array_append (array, (const guint8 *)"\n", 1);
+  if (remote_peer)
+    g_byte_array_append (array, (const guint8 *)remote_peer, strlen (remote_peer));
+  g_byte_array_append (array, (const guint8 *)"\n", 1);
+
+  data = g_bytes_get_data (password, &length);
+  g_byte_array_append (array, data, length);
+
+  return g_bytes_new_with_free_func (array->data, array->len, secclear_byte_array, array);
+}
+
+static CockpitPipe *
+pop_pooled_session (CockpitAuth *self,
+                    gint *auth_fd)
+{
+  GMainContext *context = thread_context ();
+  PooledSession *pooled = NULL;
+  PooledSession *candidate;
+  CockpitPipe *pipe = NULL;
+  GList *stale = NULL;
+  GList *l, *next;
+
+  g_mutex_lock (&self->mutex);
+
+  for (l = self->session_pool->head; l != NULL; l = next)
     {
-      pipe = g_object_new (COCKPIT_TYPE_PIPE,
-                           "pid", pid,
-                           "in-fd", out_fd,
-                           "out-fd", in_fd,
-                           NULL);
+      next = g_list_next (l);
+      candidate = l->data;
+      if (candidate->context != context)
+        continue;
 
-      if (password)
+      g_queue_delete_link (self->session_pool, l);
+      if (g_atomic_int_get (&candidate->closed))
         {
-          /* Child process end of pipe */
-          close (pwfds[1]);
-
-          *auth_pipe = cockpit_pipe_new ("password-pipe", pwfds[0], pwfds[0]);
-          cockpit_pipe_write (*auth_pipe, password);
-          cockpit_pipe_close (*auth_pipe, NULL);
+          stale = g_list_prepend (stale, candidate);
+          continue;
         }
+
+      pooled = candidate;
+      break;
+    }
+
+  g_mutex_unlock (&self->mutex);
+
+  g_list_free_full (stale, pooled_session_free);
+
+  if (pooled)
+    {
+      g_signal_handler_disconnect (pooled->pipe, pooled->sig_close);
+      pipe = pooled->pipe;
+      *auth_fd = pooled->auth_fd;
+      g_main_context_unref (pooled->context);
+      g_free (pooled);
     }
 
   return pipe;
 }
 
+/**
+ * cockpit_auth_fill_session_pool:
+ * @self: a CockpitAuth
+ *
+ * Start cockpit-session helpers for logins on the calling thread, up to
+ * cockpit_ws_session_pool of them. They wait for cockpit-ws to say who
+ * is logging in, so a login doesn't wait for them to start up.
+ */
+void
+cockpit_auth_fill_session_pool (CockpitAuth *self)
+{
+  GMainContext *context = thread_context ();
+  PooledSession *pooled;
+  CockpitPipe *pipe;
+  guint count = 0;
+  GList *l;
+  gint fd;
+
+  g_return_if_fail (self != NULL);
+
+  g_mutex_lock (&self->mutex);
+  for (l = self->session_pool->head; l != NULL; l = g_list_next (l))
+    {
+      pooled = l->data;
+      if (pooled->context == context && !g_atomic_int_get (&pooled->closed))
+        count++;
+    }
+  g_mutex_unlock (&self->mutex);
+
+  while (count < cockpit_ws_session_pool)
+    {
+      pipe = spawn_session_process ("-", "-", &fd);
+      if (!pipe)
+        break;
+
+      pooled = g_new0 (PooledSession, 1);
+      pooled->pipe = pipe;
+      pooled->auth_fd = fd;
+      pooled->context = g_main_context_ref (context);
+      pooled->sig_close = g_signal_connect (pipe, "close", G_CALLBACK (on_pooled_close), pooled);
+
+      g_mutex_lock (&self->mutex);
+      g_queue_push_tail (self->session_pool, pooled);
+      g_mutex_unlock (&self->mutex);
+
+      count++;
+    }
+}
+
+static gboolean
+on_fill_session_pool (gpointer user_data)
+{
+  cockpit_auth_fill_session_pool (user_data);
+  return FALSE;
+}
+
 gboolean
 cockpit_auth_parse_input (GBytes *input,
                           gchar **ret_user,
@@ -331,9 +841,12 @@ cockpit_auth_session_login_async (CockpitAuth *self,
 {
   GSimpleAsyncResult *result;
   GBytes *password = NULL;
+  GBytes *auth_input;
   gchar *user = NULL;
   LoginData *login;
   GError *error = NULL;
+  GSource *source;
+  gint auth_fd = -1;
 
   result = g_simple_async_result_new (G_OBJECT (self), callback, user_data,
                                       cockpit_auth_session_login_async);
@@ -351,11 +864,21 @@ cockpit_auth_session_login_async (CockpitAuth *self,
       g_simple_async_result_set_op_res_gpointer (result, login, login_data_free);
 
       g_assert (password != NULL);
-      login->session_pipe = spawn_session_process (user, password, remote_peer,
-                                                   &login->auth_pipe);
+      login->session_pipe = pop_pooled_session (self, &auth_fd);
+      if (login->session_pipe)
+        {
+          g_debug ("using pooled session process for login");
+          auth_input = build_pooled_input (user, remote_peer, password);
+        }
+      else
+        {
+          login->session_pipe = spawn_session_process (user, remote_peer, &auth_fd);
+          auth_input = g_bytes_ref (password);
+        }
 
       if (login->session_pipe)
         {
+          login->auth_pipe = send_session_auth (auth_fd, auth_input);
           g_signal_connect (login->auth_pipe, "close",
                             G_CALLBACK (on_login_done), g_object_ref (result));
         }
@@ -365,6 +888,17 @@ cockpit_auth_session_login_async (CockpitAuth *self,
                                            "Internal error starting session process");
           g_simple_async_result_complete_in_idle (result);
         }
+
+      g_bytes_unref (auth_input);
+
+      /* Replace the helper once this login is on its way */
+      if (cockpit_ws_session_pool > 0)
+        {
+          source = g_idle_source_new ();
+          g_source_set_callback (source, on_fill_session_pool, g_object_ref (self), g_object_unref);
+          g_source_attach (source, thread_context ());
+          g_source_unref (source);
+        }
     }
 
   g_free (user);
@@ -484,55 +1018,426 @@ cockpit_auth_class_init (CockpitAuthClass *klass)
   klass->login_finish = cockpit_auth_session_login_finish;
 }
 
+static gboolean
+remove_expired (gpointer key,
+                gpointer value,
+                gpointer user_data)
+{
+  AuthEntry *entry = value;
+  gint64 *now = user_data;
+  return entry->expires <= *now;
+}
+
+static gchar *
+sign_cookie (CockpitAuth *self,
+             const gchar *data,
+             gsize length)
+{
+  return g_compute_hmac_for_data (G_CHECKSUM_SHA256,
+                                  self->key->data, self->key->len,
+                                  (const guchar *)data, length);
+}
+
 static char *
 creds_to_cookie (CockpitAuth *self,
                  CockpitCreds *creds)
 {
-  guint64 seed;
+  gs_free gchar *user = NULL;
+  gs_free gchar *rhost = NULL;
+  gs_free gchar *data = NULL;
+  gs_free gchar *signature = NULL;
+  guint64 seed[3];
+  AuthEntry *entry;
+  gchar *nonce;
   gchar *cookie;
-  char *id;
+  gint64 now;
+
+  now = g_get_real_time () / G_USEC_PER_SEC;
+
+  g_mutex_lock (&self->mutex);
+  seed[0] = self->nonce_seed++;
+  g_mutex_unlock (&self->mutex);
+
+  /* Unique across the processes that share a key */
+  seed[1] = getpid ();
+  seed[2] = g_get_real_time ();
+  nonce = g_compute_hmac_for_data (G_CHECKSUM_SHA256,
+                                   self->key->data, self->key->len,
+                                   (guchar *)seed, sizeof (seed));
+  nonce[32] = '\0';
 
-  seed = self->nonce_seed++;
-  id = g_compute_hmac_for_data (G_CHECKSUM_SHA256,
-                                self->key->data, self->key->len,
-                                (guchar *)&seed, sizeof (seed));
+  user = g_uri_escape_string (cockpit_creds_get_user (creds), NULL, FALSE);
+  rhost = g_uri_escape_string (cockpit_creds_get_rhost (creds) ?
+                               cockpit_creds_get_rhost (creds) : "", NULL, FALSE);
 
-  cookie = g_strdup_printf ("v=2;k=%s", id);
-  g_hash_table_insert (self->authenticated, id,
-                       cockpit_creds_ref (creds));
+  data = g_strdup_printf ("v=3;u=%s;h=%s;i=%" G_GINT64_FORMAT ";e=%" G_GINT64_FORMAT ";n=%s",
+                          user, rhost, now, now + cockpit_ws_cookie_lifetime, nonce);
+  signature = sign_cookie (self, data, strlen (data));
+  cookie = g_strdup_printf ("%s;s=%s", data, signature);
 
-  g_debug ("sending credential id '%s' for user '%s'", id,
+  entry = g_new0 (AuthEntry, 1);
+  entry->creds = cockpit_creds_ref (creds);
+  entry->expires = now + cockpit_ws_cookie_lifetime;
+
+  g_mutex_lock (&self->mutex);
+  g_hash_table_foreach_remove (self->authenticated, remove_expired, &now);
+  g_hash_table_insert (self->authenticated, nonce, entry);
+  g_mutex_unlock (&self->mutex);
+
+  g_debug ("sending credential nonce '%s' for user '%s'", nonce,
            cockpit_creds_get_user (creds));
 
   return cookie;
 }
 
+static gboolean
+equal_signature (const gchar *one,
+                 const gchar *two)
+{
+  gsize len = strlen (one);
+  guchar diff = 0;
+  gsize i;
+
+  if (strlen (two) != len)
+    return FALSE;
+
+  /* Takes as long no matter where they differ */
+  for (i = 0; i < len; i++)
+    diff |= one[i] ^ two[i];
+  return diff == 0;
+}
+
+/*
+ * Checks the signature and expiry of a cookie, and returns its fields.
+ * The caller still needs to check if it has been revoked.
+ */
+static gboolean
+parse_cookie (CockpitAuth *self,
+              const gchar *cookie,
+              gchar **user,
+              gchar **rhost,
+              gint64 *expires,
+              gchar **nonce)
+{
+  gs_free gchar *signature = NULL;
+  gchar **fields = NULL;
+  const gchar *value;
+  const gchar *sig;
+  gboolean ret = FALSE;
+  gchar *end;
+  gint64 now;
+  gint i;
+
+  *user = *rhost = *nonce = NULL;
+  *expires = 0;
+
+  if (!g_str_has_prefix (cookie, "v=3;"))
+    {
+      g_debug ("invalid or unsupported cookie: %s", cookie);
+      return FALSE;
+    }
+
+  sig = g_strrstr (cookie, ";s=");
+  if (!sig)
+    {
+      g_debug ("unsigned cookie: %s", cookie);
+      return FALSE;
+    }
+
+  signature = sign_cookie (self, cookie, sig - cookie);
+  if (!equal_signature (signature, sig + 3))
+    {
+      g_debug ("received cookie with invalid signature");
+      return FALSE;
+    }
+
+  fields = g_strsplit (cookie, ";", -1);
+  for (i = 0; fields[i] != NULL; i++)
+    {
+      value = fields[i] + 2;
+      if (g_str_has_prefix (fields[i], "u="))
+        *user = g_uri_unescape_string (value, NULL);
+      else if (g_str_has_prefix (fields[i], "h="))
+        *rhost = g_uri_unescape_string (value, NULL);
+      else if (g_str_has_prefix (fields[i], "n="))
+        *nonce = g_strdup (value);
+      else if (g_str_has_prefix (fields[i], "e="))
+        {
+          *expires = g_ascii_strtoll (value, &end, 10);
+          if (*end != '\0')
+            *expires = 0;
+        }
+    }
+
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  if (!*user || !(*user)[0] || !*rhost || !*nonce || !(*nonce)[0])
+    g_debug ("received cookie with missing fields");
+  else if (*expires <= now)
+    g_debug ("received expired cookie for user '%s'", *user);
+  else
+    ret = TRUE;
+
+  if (!ret)
+    {
+      g_free (*user);
+      g_free (*rhost);
+      g_free (*nonce);
+      *user = *rhost = *nonce = NULL;
+    }
+
+  g_strfreev (fields);
+  return ret;
+}
+
+static void
+add_denied_inlock (CockpitAuth *self,
+                   const gchar *nonce,
+                   gint64 expires)
+{
+  gint64 *value = g_new (gint64, 1);
+  *value = expires;
+  g_hash_table_replace (self->denied, g_strdup (nonce), value);
+}
+
+static gboolean
+remove_expired_denied (gpointer key,
+                       gpointer value,
+                       gpointer user_data)
+{
+  gint64 *expires = value;
+  gint64 *now = user_data;
+  return *expires <= *now;
+}
+
+/* Reads the complete lines in @fd after what was read before */
+static void
+read_denied_inlock (CockpitAuth *self,
+                    gint fd,
+                    goffset size,
+                    gint64 now)
+{
+  gchar buffer[4096];
+  GString *text;
+  gchar **lines;
+  gchar **parts;
+  gchar *last;
+  gssize count;
+  gint64 expires;
+  gint i;
+
+  text = g_string_new ("");
+  while (self->denied_offset + text->len < size)
+    {
+      count = pread (fd, buffer, sizeof (buffer), self->denied_offset + text->len);
+      if (count < 0 && errno == EINTR)
+        continue;
+      if (count < 0)
+        g_message ("couldn't read cookie deny list: %s: %s", cockpit_ws_cookie_deny_file, g_strerror (errno));
+      if (count <= 0)
+        break;
+      g_string_append_len (text, buffer, count);
+    }
+
+  last = strrchr (text->str, '\n');
+  if (last)
+    {
+      last[0] = '\0';
+      self->denied_offset += (last - text->str) + 1;
+
+      /* Each line is a nonce followed by the expiry of its cookie */
+      lines = g_strsplit (text->str, "\n", -1);
+      for (i = 0; lines[i] != NULL; i++)
+        {
+          if (!lines[i][0])
+            continue;
+          self->denied_lines++;
+          parts = g_strsplit (lines[i], " ", 2);
+          expires = parts[1] ? g_ascii_strtoll (parts[1], NULL, 10) : G_MAXINT64;
+          if (parts[0][0] && expires > now)
+            add_denied_inlock (self, parts[0], expires);
+          g_strfreev (parts);
+        }
+      g_strfreev (lines);
+    }
+
+  g_string_free (text, TRUE);
+}
+
+/*
+ * Replaces the deny file with one that only lists the cookies that
+ * haven't expired. The caller holds a lock on the deny file, and has
+ * read all of it.
+ */
+static void
+rewrite_denied_inlock (CockpitAuth *self)
+{
+  GHashTableIter iter;
+  gpointer key;
+  gpointer value;
+  struct stat st;
+  GString *text;
+  gchar *temp;
+  gint fd;
+
+  text = g_string_new ("");
+  g_hash_table_iter_init (&iter, self->denied);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_string_append_printf (text, "%s %" G_GINT64_FORMAT "\n", (gchar *)key, *(gint64 *)value);
+
+  temp = g_strdup_printf ("%s.XXXXXX", cockpit_ws_cookie_deny_file);
+  fd = g_mkstemp_full (temp, O_WRONLY | O_CLOEXEC, 0600);
+  if (fd < 0)
+    {
+      g_message ("couldn't create cookie deny list: %s: %s", temp, g_strerror (errno));
+    }
+  else
+    {
+      if (write (fd, text->str, text->len) != (gssize)text->len || fstat (fd, &st) < 0)
+        {
+          g_message ("couldn't write cookie deny list: %s: %s", temp, g_strerror (errno));
+          g_unlink (temp);
+        }
+      else if (g_rename (temp, cockpit_ws_cookie_deny_file) < 0)
+        {
+          g_message ("couldn't replace cookie deny list: %s: %s", cockpit_ws_cookie_deny_file, g_strerror (errno));
+          g_unlink (temp);
+        }
+      else
+        {
+          g_debug ("rewrote cookie deny list without %u expired cookies",
+                   self->denied_lines - g_hash_table_size (self->denied));
+          self->denied_inode = st.st_ino;
+          self->denied_offset = text->len;
+          self->denied_lines = g_hash_table_size (self->denied);
+        }
+      close (fd);
+    }
+
+  g_string_free (text, TRUE);
+  g_free (temp);
+}
+
+/*
+ * Picks up what other processes have appended to the deny file. Only
+ * complete lines are read, and the file is read again from the start
+ * if it was replaced or truncated. This happens at most once every
+ * DENY_CHECK_INTERVAL.
+ */
+static void
+update_denied_inlock (CockpitAuth *self)
+{
+  struct stat st;
+  gint64 checked;
+  gint64 now;
+  gint fd;
+
+  if (!cockpit_ws_cookie_deny_file)
+    return;
+
+  checked = g_get_monotonic_time ();
+  if (self->denied_checked && checked - self->denied_checked < DENY_CHECK_INTERVAL)
+    return;
+  self->denied_checked = checked;
+
+  fd = g_open (cockpit_ws_cookie_deny_file, O_RDONLY | O_CLOEXEC, 0);
+  if (fd < 0)
+    {
+      if (errno != ENOENT)
+        g_message ("couldn't open cookie deny list: %s: %s", cockpit_ws_cookie_deny_file, g_strerror (errno));
+      return;
+    }
+
+  if (fstat (fd, &st) < 0)
+    {
+      g_message ("couldn't stat cookie deny list: %s: %s", cockpit_ws_cookie_deny_file, g_strerror (errno));
+      close (fd);
+      return;
+    }
+
+  if (st.st_ino != self->denied_inode || st.st_size < self->denied_offset)
+    {
+      g_hash_table_remove_all (self->denied);
+      self->denied_inode = st.st_ino;
+      self->denied_offset = 0;
+      self->denied_lines = 0;
+    }
+
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  read_denied_inlock (self, fd, st.st_size, now);
+  g_hash_table_foreach_remove (self->denied, remove_expired_denied, &now);
+
+  if (self->denied_lines >= DENY_REWRITE_LINES &&
+      g_hash_table_size (self->denied) * 2 < self->denied_lines)
+    {
+      /* Appends wait for this, and then go to the new file */
+      if (flock (fd, LOCK_EX) < 0)
+        {
+          g_message ("couldn't lock cookie deny list: %s: %s", cockpit_ws_cookie_deny_file, g_strerror (errno));
+        }
+      else
+        {
+          /* Only when nobody else replaced it in the meantime */
+          if (fstat (fd, &st) == 0 && st.st_nlink > 0)
+            {
+              read_denied_inlock (self, fd, st.st_size, now);
+              rewrite_denied_inlock (self);
+            }
+          flock (fd, LOCK_UN);
+        }
+    }
+
+  close (fd);
+}
+
 static CockpitCreds *
 cookie_to_creds  (CockpitAuth *self,
                   const char *cookie)
 {
+  gs_free gchar *user = NULL;
+  gs_free gchar *rhost = NULL;
+  gs_free gchar *nonce = NULL;
   CockpitCreds *creds = NULL;
-  const char *prefix = "v=2;k=";
-  const gsize n_prefix = 6;
-  const gchar *id;
+  AuthEntry *entry;
+  gint64 expires;
+
+  if (!parse_cookie (self, cookie, &user, &rhost, &expires, &nonce))
+    return NULL;
 
-  if (!g_str_has_prefix (cookie, prefix))
+  g_mutex_lock (&self->mutex);
+
+  update_denied_inlock (self);
+  if (g_hash_table_contains (self->denied, nonce))
     {
-      g_debug ("invalid or unsupported cookie: %s", cookie);
-      return NULL;
+      g_debug ("received revoked credential nonce '%s'", nonce);
     }
+  else
+    {
+      entry = g_hash_table_lookup (self->authenticated, nonce);
 
-  id = cookie + n_prefix;
+      /*
+       * Logged in with another process. Without the password local
+       * sessions are started without authenticating again.
+       */
+      if (!entry)
+        {
+          entry = g_new0 (AuthEntry, 1);
+          entry->creds = cockpit_creds_new (user,
+                                            COCKPIT_CRED_RHOST, rhost[0] ? rhost : NULL,
+                                            NULL);
+          entry->expires = expires;
+          g_hash_table_insert (self->authenticated, g_strdup (nonce), entry);
+        }
+
+      creds = cockpit_creds_ref (entry->creds);
+    }
+
+  g_mutex_unlock (&self->mutex);
 
-  creds = g_hash_table_lookup (self->authenticated, id);
   if (creds)
     {
-      g_debug ("received credential id '%s' for user '%s'", id,
+      g_debug ("received credential nonce '%s' for user '%s'", nonce,
                cockpit_creds_get_user (creds));
-      cockpit_creds_ref (creds);
     }
-  else
-    g_debug ("received unknown/invalid credential id '%s'", id);
 
   return creds;
 }
@@ -570,6 +1475,223 @@ cockpit_auth_check_cookie (CockpitAuth *auth,
   return cookie_to_creds (auth, auth_cookie);
 }
 
+/**
+ * cockpit_auth_revoke_cookie:
+ * @auth: a CockpitAuth
+ * @in_headers: request headers
+ *
+ * Revoke the login cookie in the request headers, if any, for all
+ * cockpit-ws processes that share the deny list.
+ */
+void
+cockpit_auth_revoke_cookie (CockpitAuth *auth,
+                            GHashTable *in_headers)
+{
+  gs_unref_hashtable GHashTable *cookies = NULL;
+  gs_free gchar *auth_cookie = NULL;
+  gs_free gchar *user = NULL;
+  gs_free gchar *rhost = NULL;
+  gs_free gchar *nonce = NULL;
+  gs_free gchar *line = NULL;
+  struct stat st;
+  gint64 expires;
+  gsize length;
+  gint fd;
+
+  g_return_if_fail (auth != NULL);
+  g_return_if_fail (in_headers != NULL);
+
+  if (!cockpit_web_server_parse_cookies (in_headers, &cookies, NULL))
+    return;
+
+  auth_cookie = base64_decode_string (g_hash_table_lookup (cookies, "CockpitAuth"));
+  if (auth_cookie == NULL)
+    return;
+
+  /* Only valid cookies go on the list */
+  if (!parse_cookie (auth, auth_cookie, &user, &rhost, &expires, &nonce))
+    return;
+
+  g_debug ("revoking credential nonce '%s' for user '%s'", nonce, user);
+
+  g_mutex_lock (&auth->mutex);
+  g_hash_table_remove (auth->authenticated, nonce);
+  add_denied_inlock (auth, nonce, expires);
+  g_mutex_unlock (&auth->mutex);
+
+  if (!cockpit_ws_cookie_deny_file)
+    return;
+
+  /* A single small append, so lines from several processes don't mix */
+  line = g_strdup_printf ("%s %" G_GINT64_FORMAT "\n", nonce, expires);
+  length = strlen (line);
+
+  for (;;)
+    {
+      fd = g_open (cockpit_ws_cookie_deny_file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+      if (fd < 0)
+        {
+          g_message ("couldn't open cookie deny list: %s: %s", cockpit_ws_cookie_deny_file, g_strerror (errno));
+          return;
+        }
+
+      /* Not while the file is being rewritten, nor to the file it replaced */
+      if (flock (fd, LOCK_EX) < 0 || fstat (fd, &st) < 0 || st.st_nlink > 0)
+        break;
+      close (fd);
+    }
+
+  if (write (fd, line, length) != (gssize)length)
+    g_message ("couldn't write cookie deny list: %s: %s", cockpit_ws_cookie_deny_file, g_strerror (errno));
+  close (fd);
+}
+
+/*
+ * Logins are traced from when they start until the first message
+ * from a session reaches the user's web socket.
+ */
+typedef struct {
+  GAsyncReadyCallback callback;
+  gpointer user_data;
+  gint64 start;
+} LoginTrace;
+
+static void
+on_login_ready (GObject *source,
+                GAsyncResult *result,
+                gpointer user_data)
+{
+  LoginTrace *trace = user_data;
+  gint64 *start;
+
+  start = g_new (gint64, 1);
+  *start = trace->start;
+  g_object_set_data_full (G_OBJECT (result), "cockpit-login-start", start, g_free);
+
+  if (trace->callback)
+    (trace->callback) (source, result, trace->user_data);
+  g_free (trace);
+}
+
+static gboolean
+remove_stale_trace (gpointer key,
+                    gpointer value,
+                    gpointer user_data)
+{
+  gint64 *start = value;
+  gint64 *now = user_data;
+  return *now - *start > TRACE_TIMEOUT;
+}
+
+static void
+trace_login (CockpitAuth *self,
+             CockpitCreds *creds,
+             gint64 start)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 *value;
+
+  value = g_new (gint64, 1);
+  *value = start;
+
+  g_mutex_lock (&self->mutex);
+  self->logins++;
+  self->login_last = now - start;
+  self->login_total += now - start;
+  g_hash_table_foreach_remove (self->login_starts, remove_stale_trace, &now);
+  g_hash_table_replace (self->login_starts, cockpit_creds_ref (creds), value);
+  g_mutex_unlock (&self->mutex);
+
+  g_debug ("%s: login took %.1f ms", cockpit_creds_get_user (creds),
+           (now - start) / 1000.0);
+}
+
+/**
+ * cockpit_auth_trace_first_message:
+ * @self: a CockpitAuth
+ * @creds: the credentials of a web socket
+ *
+ * Called when the first message from a session goes out on a web
+ * socket. The first time this happens after a login, the time since
+ * the login started is recorded.
+ */
+void
+cockpit_auth_trace_first_message (CockpitAuth *self,
+                                  CockpitCreds *creds)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 elapsed = -1;
+  gint64 *start;
+
+  g_return_if_fail (self != NULL);
+
+  if (!creds)
+    return;
+
+  g_mutex_lock (&self->mutex);
+  start = g_hash_table_lookup (self->login_starts, creds);
+  if (start)
+    {
+      elapsed = now - *start;
+      self->first_messages++;
+      self->first_message_last = elapsed;
+      self->first_message_total += elapsed;
+      g_hash_table_remove (self->login_starts, creds);
+    }
+  g_mutex_unlock (&self->mutex);
+
+  if (elapsed >= 0)
+    {
+      g_debug ("%s: first message %.1f ms after login started",
+               cockpit_creds_get_user (creds), elapsed / 1000.0);
+    }
+}
+
+/**
+ * cockpit_auth_build_status:
+ * @self: a CockpitAuth
+ *
+ * Describe how long logins take, and the state of the session pool.
+ *
+ * Returns: (transfer full): a new JSON object
+ */
+JsonObject *
+cockpit_auth_build_status (CockpitAuth *self)
+{
+  PooledSession *pooled;
+  JsonObject *object;
+  guint pooled_count = 0;
+  GList *l;
+
+  g_return_val_if_fail (self != NULL, NULL);
+
+  object = json_object_new ();
+
+  g_mutex_lock (&self->mutex);
+
+  json_object_set_int_member (object, "logins", self->logins);
+  json_object_set_double_member (object, "login-ms-last", self->login_last / 1000.0);
+  json_object_set_double_member (object, "login-ms-mean",
+                                 self->logins ? (self->login_total / self->logins) / 1000.0 : 0);
+  json_object_set_int_member (object, "first-messages", self->first_messages);
+  json_object_set_double_member (object, "first-message-ms-last", self->first_message_last / 1000.0);
+  json_object_set_double_member (object, "first-message-ms-mean",
+                                 self->first_messages ? (self->first_message_total / self->first_messages) / 1000.0 : 0);
+
+  for (l = self->session_pool->head; l != NULL; l = g_list_next (l))
+    {
+      pooled = l->data;
+      if (!g_atomic_int_get (&pooled->closed))
+        pooled_count++;
+    }
+  json_object_set_int_member (object, "session-pool", pooled_count);
+  json_object_set_int_member (object, "session-pool-limit", cockpit_ws_session_pool);
+
+  g_mutex_unlock (&self->mutex);
+
+  return object;
+}
+
 void
 cockpit_auth_login_async (CockpitAuth *self,
                           GHashTable *headers,
@@ -579,8 +1701,16 @@ cockpit_auth_login_async (CockpitAuth *self,
                           gpointer user_data)
 {
   CockpitAuthClass *klass = COCKPIT_AUTH_GET_CLASS (self);
+  LoginTrace *trace;
+
   g_return_if_fail (klass->login_async != NULL);
-  klass->login_async (self, headers, input, remote_peer, callback, user_data);
+
+  trace = g_new0 (LoginTrace, 1);
+  trace->callback = callback;
+  trace->user_data = user_data;
+  trace->start = g_get_monotonic_time ();
+
+  klass->login_async (self, headers, input, remote_peer, on_login_ready, trace);
 }
 
 CockpitCreds *
@@ -594,11 +1724,16 @@ cockpit_auth_login_finish (CockpitAuth *self,
   CockpitCreds *creds;
   gs_free char *cookie = NULL;
   gs_free gchar *cookie_b64 = NULL;
+  gint64 *start;
   gchar *header;
 
   g_return_val_if_fail (klass->login_finish != NULL, FALSE);
   creds = klass->login_finish (self, result, error);
 
+  start = g_object_get_data (G_OBJECT (result), "cockpit-login-start");
+  if (creds && start)
+    trace_login (self, creds, *start);
+
   if (creds && out_headers)
     {
       cookie = creds_to_cookie (self, creds);
@@ -637,9 +1772,10 @@ cockpit_auth_start_session (CockpitAuth *self,
                             CockpitCreds *creds)
 {
   CockpitPipe *pipe;
-  CockpitPipe *auth_pipe = NULL;
+  CockpitPipe *auth_pipe;
   const gchar *password;
   GBytes *bytes;
+  gint auth_fd;
 
   g_return_val_if_fail (creds != NULL, NULL);
 
@@ -649,24 +1785,26 @@ cockpit_auth_start_session (CockpitAuth *self,
       password = cockpit_creds_get_password (creds);
       if (password == NULL)
         {
-          bytes = NULL;
+          pipe = spawn_session_process (cockpit_creds_get_user (creds),
+                                        cockpit_creds_get_rhost (creds), NULL);
         }
       else
         {
-          bytes = g_bytes_new_with_free_func (password, strlen (password),
-                                              cockpit_creds_unref, creds);
-        }
-
-      pipe = spawn_session_process (cockpit_creds_get_user (creds),
-                                    bytes, cockpit_creds_get_rhost (creds),
-                                    &auth_pipe);
-      if (auth_pipe)
-        {
-          /*
-           * Any failure will come from the pipe exit code, but the session
-           * needs our password (if we have one) so let it get sent.
-           */
-          g_signal_connect (auth_pipe, "close", G_CALLBACK (g_object_unref), NULL);
+          pipe = spawn_session_process (cockpit_creds_get_user (creds),
+                                        cockpit_creds_get_rhost (creds), &auth_fd);
+          if (pipe)
+            {
+              bytes = g_bytes_new_with_free_func (password, strlen (password),
+                                                  cockpit_creds_unref, cockpit_creds_ref (creds));
+              auth_pipe = send_session_auth (auth_fd, bytes);
+              g_bytes_unref (bytes);
+
+              /*
+               * Any failure will come from the pipe exit code, but the session
+               * needs our password so let it get sent.
+               */
+              g_signal_connect (auth_pipe, "close", G_CALLBACK (g_object_unref), NULL);
+            }
         }
     }
 
@@ -679,3 +1817,28 @@ cockpit_auth_start_session (CockpitAuth *self,
 
   return pipe;
 }
+
+/**
+ * cockpit_auth_prepare_session:
+ * @self: a CockpitAuth
+ * @creds: credentials for the session
+ *
+ * Start the local session process for @creds ahead of time, unless one
+ * is already waiting, so that cockpit_auth_start_session() finds it.
+ */
+void
+cockpit_auth_prepare_session (CockpitAuth *self,
+                              CockpitCreds *creds)
+{
+  gboolean ready;
+
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (creds != NULL);
+
+  g_mutex_lock (&self->mutex);
+  ready = g_hash_table_contains (self->ready_sessions, creds);
+  g_mutex_unlock (&self->mutex);
+
+  if (!ready)
+    stash_session_process (self, creds, cockpit_auth_start_session (self, creds));
+}
@@ -22,6 +22,7 @@
 
 #include <pwd.h>
 #include <gio/gio.h>
+#include <json-glib/json-glib.h>
 
 #include "cockpitcreds.h"
 
@@ -43,8 +44,26 @@ struct _CockpitAuth
 
   GByteArray *key;
   GHashTable *authenticated;
+  GHashTable *denied;
+  ino_t denied_inode;
+  goffset denied_offset;
+  guint denied_lines;
+  gint64 denied_checked;
   GHashTable *ready_sessions;
+  GQueue *session_pool;
   guint64 nonce_seed;
+
+  /* Login tracing */
+  GHashTable *login_starts;
+  guint64 logins;
+  gint64 login_last;
+  gint64 login_total;
+  guint64 first_messages;
+  gint64 first_message_last;
+  gint64 first_message_total;
+
+  /* Protects the above, used from several web server workers */
+  GMutex mutex;
 };
 
 struct _CockpitAuthClass
@@ -84,9 +103,22 @@ CockpitCreds *  cockpit_auth_login_finish    (CockpitAuth *self,
 CockpitCreds *  cockpit_auth_check_cookie    (CockpitAuth *auth,
                                               GHashTable *in_headers);
 
+void            cockpit_auth_revoke_cookie   (CockpitAuth *auth,
+                                              GHashTable *in_headers);
+
 CockpitPipe *   cockpit_auth_start_session   (CockpitAuth *auth,
                                               CockpitCreds *creds);
 
+void            cockpit_auth_prepare_session (CockpitAuth *auth,
+                                              CockpitCreds *creds);
+
+void            cockpit_auth_fill_session_pool (CockpitAuth *auth);
+
+void            cockpit_auth_trace_first_message (CockpitAuth *auth,
+                                                  CockpitCreds *creds);
+
+JsonObject *    cockpit_auth_build_status    (CockpitAuth *auth);
+
 gboolean        cockpit_auth_parse_input     (GBytes *input,
                                               gchar **user,
                                               GBytes **password,
@@ -20,6 +20,7 @@
 #include "config.h"
 
 #include "cockpithandlers.h"
+#include "cockpitadmission.h"
 #include "cockpitwebservice.h"
 #include "cockpitws.h"
 
@@ -37,8 +38,34 @@
 
 #include <string.h>
 
+#include <sys/stat.h>
+
 const char *cockpit_ws_static_directory = PACKAGE_DATA_DIR "/static";
 
+static void
+respond_unavailable (CockpitWebResponse *response,
+                     guint retry_after)
+{
+  GHashTable *out_headers;
+
+  out_headers = cockpit_web_server_new_table ();
+  g_hash_table_insert (out_headers, g_strdup ("Retry-After"), g_strdup_printf ("%u", retry_after));
+  cockpit_web_response_error (response, 503, out_headers, NULL);
+  g_hash_table_unref (out_headers);
+}
+
+static void
+on_service_finalized (gpointer data,
+                      GObject *where_the_object_was)
+{
+  gchar *user = data;
+
+  if (user)
+    cockpit_admission_release_user (user);
+  cockpit_admission_release (COCKPIT_ADMISSION_WEB_SOCKETS);
+  g_free (user);
+}
+
 /* Called by @server when handling HTTP requests to /socket - runs in a separate
  * thread dedicated to the request so it may do blocking I/O
  */
@@ -53,7 +80,11 @@ cockpit_handler_socket (CockpitWebServer *server,
                         CockpitHandlerData *ws)
 {
   CockpitWebService *service;
+  CockpitWebResponse *response;
   CockpitCreds *creds;
+  const gchar *user = NULL;
+  gboolean admitted;
+  guint retry_after;
 
   if (!g_str_equal (path, "/socket"))
     return FALSE;
@@ -63,11 +94,32 @@ cockpit_handler_socket (CockpitWebServer *server,
    * if user failed to authenticate, ie: creds == NULL
    */
   creds = cockpit_auth_check_cookie (ws->auth, headers);
+  if (creds)
+    user = cockpit_creds_get_user (creds);
+
+  admitted = cockpit_admission_acquire (COCKPIT_ADMISSION_WEB_SOCKETS, &retry_after);
+  if (admitted && user && !cockpit_admission_acquire_user (user, &retry_after))
+    {
+      cockpit_admission_release (COCKPIT_ADMISSION_WEB_SOCKETS);
+      admitted = FALSE;
+    }
+
+  if (admitted)
+    {
+      service = cockpit_web_service_socket (io_stream, headers, input, ws->auth, creds);
 
-  service = cockpit_web_service_socket (io_stream, headers, input, ws->auth, creds);
+      /* Released once the web socket has closed and the service is gone */
+      g_object_weak_ref (G_OBJECT (service), on_service_finalized, g_strdup (user));
 
-  /* Keeps a ref on itself until web socket closes */
-  g_object_unref (service);
+      /* Keeps a ref on itself until web socket closes */
+      g_object_unref (service);
+    }
+  else
+    {
+      response = cockpit_web_response_new (io_stream, path, headers);
+      respond_unavailable (response, retry_after);
+      g_object_unref (response);
+    }
 
   if (creds)
     cockpit_creds_unref (creds);
@@ -172,6 +224,7 @@ on_login_complete (GObject *object,
 
   g_hash_table_unref (out_headers);
 
+  cockpit_admission_release (COCKPIT_ADMISSION_LOGINS);
   g_object_unref (response);
 }
 
@@ -187,6 +240,7 @@ cockpit_handler_login (CockpitWebServer *server,
   CockpitCreds *creds = NULL;
   gchar *remote_peer = NULL;
   GIOStream *io_stream;
+  guint retry_after;
 
   if (reqtype == COCKPIT_WEB_SERVER_REQUEST_GET)
     {
@@ -203,6 +257,13 @@ cockpit_handler_login (CockpitWebServer *server,
     }
   else if (reqtype == COCKPIT_WEB_SERVER_REQUEST_POST)
     {
+      /* Each login spawns a process, don't let them pile up */
+      if (!cockpit_admission_acquire (COCKPIT_ADMISSION_LOGINS, &retry_after))
+        {
+          respond_unavailable (response, retry_after);
+          return TRUE;
+        }
+
       io_stream = cockpit_web_response_get_stream (response);
       remote_peer = get_remote_address (io_stream);
       cockpit_auth_login_async (ws->auth, headers, input, remote_peer,
@@ -234,6 +295,9 @@ cockpit_handler_logout (CockpitWebServer *server,
   body ="<html><head><title>Logged out</title></head>"
     "<body>Logged out</body></html>";
 
+  /* The cookie stops working for all cockpit-ws processes */
+  cockpit_auth_revoke_cookie (ws->auth, headers);
+
   io_stream = cockpit_web_response_get_stream (response);
   cookie = g_strdup_printf ("CockpitAuth=blank; Path=/; Expires=Wed, 13-Jan-2021 22:23:01 GMT;%s HttpOnly",
                             !G_IS_SOCKET_CONNECTION (io_stream) ? " Secure;" : "");
@@ -281,13 +345,79 @@ cockpit_handler_deauthorize (CockpitWebServer *server,
   return TRUE;
 }
 
+gboolean
+cockpit_handler_status (CockpitWebServer *server,
+                        CockpitWebServerRequestType reqtype,
+                        const gchar *path,
+                        GHashTable *headers,
+                        GBytes *input,
+                        CockpitWebResponse *response,
+                        CockpitHandlerData *ws)
+{
+  GHashTable *out_headers;
+  CockpitCreds *creds;
+  JsonObject *status;
+  GBytes *content;
+
+  creds = cockpit_auth_check_cookie (ws->auth, headers);
+  if (!creds)
+    {
+      cockpit_web_response_error (response, 401, NULL, "Unauthorized");
+      return TRUE;
+    }
+  cockpit_creds_unref (creds);
+
+  status = cockpit_admission_build_status ();
+  json_object_set_object_member (status, "logins", cockpit_auth_build_status (ws->auth));
+  content = cockpit_json_write_bytes (status);
+  json_object_unref (status);
+
+  out_headers = cockpit_web_server_new_table ();
+  g_hash_table_insert (out_headers, g_strdup ("Content-Type"), g_strdup ("application/json"));
+  g_hash_table_insert (out_headers, g_strdup ("Cache-Control"), g_strdup ("no-cache"));
+  cockpit_web_response_content (response, out_headers, content, NULL);
+  g_hash_table_unref (out_headers);
+  g_bytes_unref (content);
+
+  return TRUE;
+}
+
 
 /* ---------------------------------------------------------------------------------------------------- */
 
+#define AVATAR_FILE PACKAGE_SYSCONF_DIR "/cockpit/avatar.png"
+
+/*
+ * The generated /cockpitdyn.js is cached, and shared between all
+ * threads. It's regenerated when the hostname changes, or when the
+ * avatar monitor says the avatar file changed.
+ */
+G_LOCK_DEFINE_STATIC (cockpitdyn);
+static GBytes *cockpitdyn_content = NULL;
+static gchar *cockpitdyn_etag = NULL;
+static gchar *cockpitdyn_hostname = NULL;
+static GFileMonitor *cockpitdyn_monitor = NULL;
+
+static void
+on_avatar_changed (GFileMonitor *monitor,
+                   GFile *file,
+                   GFile *other_file,
+                   GFileMonitorEvent event_type,
+                   gpointer user_data)
+{
+  g_debug ("avatar changed, invalidating cockpitdyn.js");
+
+  G_LOCK (cockpitdyn);
+  if (cockpitdyn_content)
+    g_bytes_unref (cockpitdyn_content);
+  cockpitdyn_content = NULL;
+  G_UNLOCK (cockpitdyn);
+}
+
 static gchar *
 get_avatar_data_url (void)
 {
-  const gchar *file = PACKAGE_SYSCONF_DIR "/cockpit/avatar.png";
+  const gchar *file = AVATAR_FILE;
 
   gs_free gchar *raw_data = NULL;
   gsize raw_size;
@@ -300,18 +430,9 @@ get_avatar_data_url (void)
   return g_strdup_printf ("data:image/png;base64,%s", base64_data);
 }
 
-gboolean
-cockpit_handler_cockpitdyn (CockpitWebServer *server,
-                            CockpitWebServerRequestType reqtype,
-                            const gchar *path,
-                            GHashTable *headers,
-                            GBytes *input,
-                            CockpitWebResponse *response,
-                            CockpitHandlerData *data)
+static GBytes *
+build_cockpitdyn (const gchar *hostname)
 {
-  gchar *hostname;
-  GHashTable *out_headers;
-  GBytes *content;
   GString *str;
   gchar *s;
   guint n;
@@ -327,13 +448,8 @@ cockpit_handler_cockpitdyn (CockpitWebServer *server,
 
   str = g_string_new (NULL);
 
-  hostname = g_malloc0 (HOST_NAME_MAX + 1);
-  gethostname (hostname, HOST_NAME_MAX);
-  hostname[HOST_NAME_MAX] = '\0';
-
   g_string_append_printf (str, "cockpitdyn_hostname = \"%s\";\n", hostname);
   g_string_append (str, "cockpitdyn_pretty_hostname = \"\";\n");
-  g_free (hostname);
 
   s = get_avatar_data_url ();
   s = g_strescape (s? s : "", NULL);
@@ -359,15 +475,301 @@ cockpit_handler_cockpitdyn (CockpitWebServer *server,
     }
   g_string_append (str, "};\n");
 
-  out_headers = web_socket_util_new_headers ();
-  g_hash_table_insert (out_headers, g_strdup ("Content-Type"), g_strdup ("application/javascript"));
-  content = g_string_free_to_bytes (str);
-  cockpit_web_response_content (response, out_headers, content, NULL);
-  g_hash_table_unref (out_headers);
+  return g_string_free_to_bytes (str);
+}
+
+static gboolean
+etag_matches (const gchar *if_none_match,
+              const gchar *etag)
+{
+  return if_none_match != NULL &&
+         (g_str_equal (if_none_match, "*") || strstr (if_none_match, etag) != NULL);
+}
+
+gboolean
+cockpit_handler_cockpitdyn (CockpitWebServer *server,
+                            CockpitWebServerRequestType reqtype,
+                            const gchar *path,
+                            GHashTable *headers,
+                            GBytes *input,
+                            CockpitWebResponse *response,
+                            CockpitHandlerData *data)
+{
+  gchar hostname[HOST_NAME_MAX + 1];
+  GHashTable *out_headers;
+  GBytes *content;
+  GFile *file;
+  gchar *checksum;
+  gchar *etag;
+
+  memset (hostname, 0, sizeof (hostname));
+  gethostname (hostname, HOST_NAME_MAX);
+  hostname[HOST_NAME_MAX] = '\0';
+
+  G_LOCK (cockpitdyn);
+
+  /* Dispatched on the context of the thread that first got here */
+  if (!cockpitdyn_monitor)
+    {
+      file = g_file_new_for_path (AVATAR_FILE);
+      cockpitdyn_monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE, NULL, NULL);
+      if (cockpitdyn_monitor)
+        g_signal_connect (cockpitdyn_monitor, "changed", G_CALLBACK (on_avatar_changed), NULL);
+      g_object_unref (file);
+    }
+
+  if (!cockpitdyn_content || g_strcmp0 (cockpitdyn_hostname, hostname) != 0)
+    {
+      if (cockpitdyn_content)
+        g_bytes_unref (cockpitdyn_content);
+      cockpitdyn_content = build_cockpitdyn (hostname);
+
+      checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA1, cockpitdyn_content);
+      g_free (cockpitdyn_etag);
+      cockpitdyn_etag = g_strdup_printf ("\"%s\"", checksum);
+      g_free (checksum);
+
+      g_free (cockpitdyn_hostname);
+      cockpitdyn_hostname = g_strdup (hostname);
+    }
+
+  content = g_bytes_ref (cockpitdyn_content);
+  etag = g_strdup (cockpitdyn_etag);
+
+  /* Without a monitor we can't tell when the avatar changes */
+  if (!cockpitdyn_monitor)
+    {
+      g_bytes_unref (cockpitdyn_content);
+      cockpitdyn_content = NULL;
+    }
+
+  G_UNLOCK (cockpitdyn);
+
+  if (etag_matches (g_hash_table_lookup (headers, "If-None-Match"), etag))
+    {
+      cockpit_web_response_headers (response, 304, "Not Modified", -1,
+                                    "ETag", etag,
+                                    NULL);
+      cockpit_web_response_complete (response);
+    }
+  else
+    {
+      out_headers = web_socket_util_new_headers ();
+      g_hash_table_insert (out_headers, g_strdup ("Content-Type"), g_strdup ("application/javascript"));
+      g_hash_table_insert (out_headers, g_strdup ("Cache-Control"), g_strdup ("no-cache"));
+      g_hash_table_insert (out_headers, g_strdup ("ETag"), g_strdup (etag));
+      cockpit_web_response_content (response, out_headers, content, NULL);
+      g_hash_table_unref (out_headers);
+    }
+
   g_bytes_unref (content);
+  g_free (etag);
   return TRUE;
 }
 
+/* ---------------------------------------------------------------------------------------------------- */
+
+#define INDEX_SCRIPT "<script src=\"cockpit.js\"></script>"
+
+/*
+ * When the web content is built into content hashed bundles, index.html
+ * is rewritten to load the core bundle from /static/bundles/ and carry the
+ * manifest so cockpit-page.js can load the others on demand. The result
+ * is cached until either index.html or the manifest changes on disk, and
+ * is revalidated by the browser with its ETag.
+ */
+G_LOCK_DEFINE_STATIC (index);
+static GBytes *index_content = NULL;
+static gchar *index_etag = NULL;
+static gchar *index_key = NULL;
+
+static gchar *
+find_index_html (CockpitWebServer *server)
+{
+  gchar **roots = NULL;
+  gchar *path = NULL;
+  guint i;
+
+  g_object_get (server, "document-roots", &roots, NULL);
+  for (i = 0; roots && roots[i] != NULL; i++)
+    {
+      path = g_build_filename (roots[i], "index.html", NULL);
+      if (g_file_test (path, G_FILE_TEST_IS_REGULAR))
+        break;
+      g_free (path);
+      path = NULL;
+    }
+
+  g_strfreev (roots);
+  return path;
+}
+
+static GBytes *
+build_index (const gchar *index_path,
+             const gchar *manifest_path)
+{
+  GBytes *result = NULL;
+  JsonObject *manifest = NULL;
+  GError *error = NULL;
+  gchar *manifest_data = NULL;
+  gchar *index_data = NULL;
+  gchar *escaped = NULL;
+  gchar *json = NULL;
+  const gchar *core;
+  gchar **parts;
+  GString *str;
+  gsize length;
+
+  if (!g_file_get_contents (manifest_path, &manifest_data, &length, &error) ||
+      !g_file_get_contents (index_path, &index_data, NULL, &error))
+    {
+      g_warning ("%s", error->message);
+      goto out;
+    }
+
+  manifest = cockpit_json_parse_object (manifest_data, length, &error);
+  if (!manifest)
+    {
+      g_warning ("%s: %s", manifest_path, error->message);
+      goto out;
+    }
+
+  if (!cockpit_json_get_string (manifest, "core", NULL, &core) || !core ||
+      strchr (core, '/') || strchr (core, '"'))
+    {
+      g_warning ("%s: invalid or missing core bundle", manifest_path);
+      goto out;
+    }
+
+  if (!strstr (index_data, INDEX_SCRIPT))
+    {
+      g_warning ("%s: couldn't find script to replace with core bundle", index_path);
+      goto out;
+    }
+
+  /* Don't let the manifest close the script element */
+  json = cockpit_json_write_object (manifest, NULL);
+  parts = g_strsplit (json, "</", -1);
+  escaped = g_strjoinv ("<\\/", parts);
+  g_strfreev (parts);
+
+  str = g_string_new (NULL);
+  g_string_append_printf (str, "<script>var cockpit_manifest = %s;</script>"
+                          "<script src=\"/static/bundles/%s\"></script>", escaped, core);
+
+  parts = g_strsplit (index_data, INDEX_SCRIPT, 2);
+  g_string_prepend (str, parts[0]);
+  g_string_append (str, parts[1]);
+  g_strfreev (parts);
+
+  result = g_string_free_to_bytes (str);
+
+out:
+  g_clear_error (&error);
+  if (manifest)
+    json_object_unref (manifest);
+  g_free (manifest_data);
+  g_free (index_data);
+  g_free (escaped);
+  g_free (json);
+  return result;
+}
+
+gboolean
+cockpit_handler_index (CockpitWebServer *server,
+                       CockpitWebServerRequestType reqtype,
+                       const gchar *path,
+                       GHashTable *headers,
+                       GBytes *input,
+                       CockpitWebResponse *response,
+                       CockpitHandlerData *data)
+{
+  GHashTable *out_headers;
+  GBytes *content = NULL;
+  gchar *manifest_path;
+  gchar *index_path;
+  gchar *checksum;
+  gchar *etag = NULL;
+  struct stat msb;
+  struct stat isb;
+  gchar *key;
+
+  if (reqtype != COCKPIT_WEB_SERVER_REQUEST_GET)
+    return FALSE;
+
+  /* Without a manifest, just serve index.html as is */
+  manifest_path = g_build_filename (cockpit_ws_static_directory, "bundles", "manifest.json", NULL);
+  index_path = find_index_html (server);
+  if (!index_path || stat (manifest_path, &msb) < 0 || stat (index_path, &isb) < 0)
+    {
+      g_free (manifest_path);
+      g_free (index_path);
+      return FALSE;
+    }
+
+  key = g_strdup_printf ("%s:%ld:%ld:%ld:%ld", index_path,
+                         (long)isb.st_mtime, (long)isb.st_size,
+                         (long)msb.st_mtime, (long)msb.st_size);
+
+  G_LOCK (index);
+
+  if (!index_content || g_strcmp0 (index_key, key) != 0)
+    {
+      if (index_content)
+        g_bytes_unref (index_content);
+      g_free (index_key);
+      index_key = NULL;
+
+      index_content = build_index (index_path, manifest_path);
+      if (index_content)
+        {
+          checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA1, index_content);
+          g_free (index_etag);
+          index_etag = g_strdup_printf ("\"%s\"", checksum);
+          g_free (checksum);
+          index_key = key;
+          key = NULL;
+        }
+    }
+
+  if (index_content)
+    {
+      content = g_bytes_ref (index_content);
+      etag = g_strdup (index_etag);
+    }
+
+  G_UNLOCK (index);
+
+  if (!content)
+    {
+      /* Fall through to the default handler */
+    }
+  else if (etag_matches (g_hash_table_lookup (headers, "If-None-Match"), etag))
+    {
+      cockpit_web_response_headers (response, 304, "Not Modified", -1,
+                                    "ETag", etag,
+                                    NULL);
+      cockpit_web_response_complete (response);
+    }
+  else
+    {
+      out_headers = web_socket_util_new_headers ();
+      g_hash_table_insert (out_headers, g_strdup ("Content-Type"), g_strdup ("text/html"));
+      g_hash_table_insert (out_headers, g_strdup ("Cache-Control"), g_strdup ("no-cache"));
+      g_hash_table_insert (out_headers, g_strdup ("ETag"), g_strdup (etag));
+      cockpit_web_response_content (response, out_headers, content, NULL);
+      g_hash_table_unref (out_headers);
+    }
+
+  if (content)
+    g_bytes_unref (content);
+  g_free (manifest_path);
+  g_free (index_path);
+  g_free (etag);
+  g_free (key);
+  return content != NULL;
+}
+
 gboolean
 cockpit_handler_static (CockpitWebServer *server,
                         CockpitWebServerRequestType reqtype,
@@ -61,6 +61,14 @@ gboolean       cockpit_handler_deauthorize       (CockpitWebServer *server,
                                                   CockpitWebResponse *response,
                                                   CockpitHandlerData *data);
 
+gboolean       cockpit_handler_status            (CockpitWebServer *server,
+                                                  CockpitWebServerRequestType reqtype,
+                                                  const gchar *path,
+                                                  GHashTable *headers,
+                                                  GBytes *input,
+                                                  CockpitWebResponse *response,
+                                                  CockpitHandlerData *data);
+
 gboolean       cockpit_handler_cockpitdyn        (CockpitWebServer *server,
                                                   CockpitWebServerRequestType reqtype,
                                                   const gchar *path,
@@ -69,6 +77,14 @@ gboolean       cockpit_handler_cockpitdyn        (CockpitWebServer *server,
                                                   CockpitWebResponse *response,
                                                   CockpitHandlerData *data);
 
+gboolean       cockpit_handler_index             (CockpitWebServer *server,
+                                                  CockpitWebServerRequestType reqtype,
+                                                  const gchar *path,
+                                                  GHashTable *headers,
+                                                  GBytes *input,
+                                                  CockpitWebResponse *response,
+                                                  CockpitHandlerData *data);
+
 gboolean       cockpit_handler_static            (CockpitWebServer *server,
                                                   CockpitWebServerRequestType reqtype,
                                                   const gchar *path,
@@ -26,14 +26,21 @@
 #include "config.h"
 
 #include "cockpitsshtransport.h"
+#include "cockpitws.h"
 
 #include "cockpit/cockpitpipe.h"
+#include "cockpit/cockpitqueue.h"
 
 #include <libssh/libssh.h>
 #include <libssh/callbacks.h>
 
 #include <glib/gstdio.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -63,18 +70,23 @@
  * We pass CockpitSshData to the thread. Everything here should be either
  * thread-safe or only accessed by the thread.
  *
- * The connecting flag is set by the connect thread when it's done. It's also
- * used as a way for the main thread to cancel the connect thread. In that case
- * the main thread also closes the socket, to cause the connect/auth to stop
- * immediately.
+ * The connecting flag is cleared when the transport no longer wants the
+ * connection, so that the connect thread doesn't complain about the failures
+ * that follow.
  */
 
-typedef struct {
-  /* context of the main thread */
-  GMainContext *context;
+/* Threads shared by all transports for connecting and authenticating */
+guint cockpit_ws_ssh_connect_threads = 16;
+
+/* Connects in flight to any one host and port, the rest wait their turn */
+guint cockpit_ws_ssh_host_connects = 4;
+
+/* Seconds of idle before TCP keepalive probes are sent on connections */
+guint cockpit_ws_ssh_keepalive = 60;
 
+typedef struct {
   /* Input to the connect thread*/
-  const gchar *logname;
+  gchar *logname;
   ssh_session session;
   CockpitCreds *creds;
   gchar *command;
@@ -87,7 +99,7 @@ typedef struct {
   gchar *host_key;
   gchar *host_fingerprint;
 
-  /* When connect is done this flag is cleared */
+  /* Cleared when the transport no longer wants the result */
   gint *connecting;
 } CockpitSshData;
 
@@ -280,6 +292,31 @@ done:
   return ret;
 }
 
+static void
+set_keepalive (CockpitSshData *data)
+{
+  int fd = ssh_get_fd (data->session);
+  int idle = cockpit_ws_ssh_keepalive;
+  int count = 3;
+  int on = 1;
+
+  /*
+   * libssh has no keepalive of its own. Let the kernel probe idle
+   * connections, so dead hosts close their sessions rather than
+   * having new channels sent into a void.
+   */
+  if (idle <= 0)
+    return;
+
+  if (setsockopt (fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof (on)) < 0 ||
+      setsockopt (fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof (idle)) < 0 ||
+      setsockopt (fd, IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof (idle)) < 0 ||
+      setsockopt (fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof (count)) < 0)
+    {
+      g_debug ("%s: couldn't set keepalive: %s", data->logname, g_strerror (errno));
+    }
+}
+
 static const gchar *
 cockpit_ssh_connect (CockpitSshData *data)
 {
@@ -290,7 +327,7 @@ cockpit_ssh_connect (CockpitSshData *data)
   int rc;
 
   /*
-   * If connect_done is set prematurely by another thread then the
+   * If connecting is cleared prematurely by another thread then the
    * connection attempt was cancelled.
    */
 
@@ -305,6 +342,8 @@ cockpit_ssh_connect (CockpitSshData *data)
 
   g_debug ("%s: connected", data->logname);
 
+  set_keepalive (data);
+
   problem = verify_knownhost (data);
   if (problem != NULL)
     return problem;
@@ -381,21 +420,13 @@ cockpit_ssh_connect (CockpitSshData *data)
   return NULL;
 }
 
-static gpointer
-cockpit_ssh_connect_thread (gpointer user_data)
-{
-  CockpitSshData *data = user_data;
-  data->problem = cockpit_ssh_connect (data);
-  g_atomic_int_set (data->connecting, 0);
-  g_main_context_wakeup (data->context);
-  return data; /* give the data back */
-}
-
 static void
 cockpit_ssh_data_free (CockpitSshData *data)
 {
-  if (data->context)
-    g_main_context_unref (data->context);
+  if (!data)
+    return;
+
+  g_free (data->logname);
   g_free (data->command);
   if (data->creds)
     cockpit_creds_unref (data->creds);
@@ -408,8 +439,386 @@ cockpit_ssh_data_free (CockpitSshData *data)
   g_free (data);
 }
 
+/* ----------------------------------------------------------------------------
+ * Connect Pool
+ *
+ * Connects run on a bounded thread pool shared by all transports. Only
+ * cockpit_ws_ssh_host_connects of them run against any one destination at
+ * a time, the others wait in a queue for that destination. Without this a
+ * dashboard opening many machines at once would start a thread for each,
+ * and several logins would all hit the same host at once.
+ *
+ * A CockpitSshConnect owns the CockpitSshData until the transport takes it
+ * back, either once connecting is done, or when cancelling. A connect that
+ * is cancelled while running can't be interrupted, so the pool thread frees
+ * the data once it's done instead.
+ */
+
+typedef enum {
+  CONNECT_WAITING,    /* In the queue for its destination */
+  CONNECT_QUEUED,     /* Pushed to the thread pool */
+  CONNECT_RUNNING,
+  CONNECT_CANCELLED,
+  CONNECT_DONE,
+} CockpitSshConnectState;
+
+typedef struct {
+  gint refs;
+  CockpitSshConnectState state;
+  gchar *destination;
+  GMainContext *context;
+  CockpitSshData *data;
+  gint connecting;
+} CockpitSshConnect;
+
+typedef struct {
+  guint running;
+  GQueue *waiting;
+} CockpitSshDestination;
+
+static GMutex connect_mutex;
+static GThreadPool *connect_pool = NULL;
+static GHashTable *destinations = NULL;
+
+static CockpitSshConnect *
+cockpit_ssh_connect_ref (CockpitSshConnect *connect)
+{
+  g_atomic_int_inc (&connect->refs);
+  return connect;
+}
+
+static void
+cockpit_ssh_connect_unref (CockpitSshConnect *connect)
+{
+  if (!g_atomic_int_dec_and_test (&connect->refs))
+    return;
+
+  g_assert (connect->data == NULL);
+  if (connect->context)
+    g_main_context_unref (connect->context);
+  g_free (connect->destination);
+  g_free (connect);
+}
+
+static void
+cockpit_ssh_destination_free (gpointer data)
+{
+  CockpitSshDestination *dest = data;
+  g_queue_free (dest->waiting);
+  g_free (dest);
+}
+
+static void
+dispatch_destination_inlock (const gchar *destination,
+                             CockpitSshDestination *dest)
+{
+  CockpitSshConnect *connect;
+
+  while (cockpit_ws_ssh_host_connects == 0 || dest->running < cockpit_ws_ssh_host_connects)
+    {
+      connect = g_queue_pop_head (dest->waiting);
+      if (!connect)
+        break;
+
+      connect->state = CONNECT_QUEUED;
+      dest->running++;
+      g_thread_pool_push (connect_pool, connect, NULL);
+    }
+
+  if (dest->running == 0 && g_queue_is_empty (dest->waiting))
+    g_hash_table_remove (destinations, destination);
+}
+
+static void
+finish_destination_inlock (CockpitSshConnect *connect)
+{
+  CockpitSshDestination *dest;
+
+  dest = g_hash_table_lookup (destinations, connect->destination);
+  g_return_if_fail (dest != NULL && dest->running > 0);
+
+  dest->running--;
+  dispatch_destination_inlock (connect->destination, dest);
+}
+
+static void
+cockpit_ssh_connect_run (gpointer user_data,
+                         gpointer unused)
+{
+  CockpitSshConnect *connect = user_data;
+  CockpitSshData *data;
+
+  g_mutex_lock (&connect_mutex);
+  if (connect->state == CONNECT_CANCELLED)
+    {
+      finish_destination_inlock (connect);
+      g_mutex_unlock (&connect_mutex);
+      cockpit_ssh_connect_unref (connect);
+      return;
+    }
+
+  g_assert (connect->state == CONNECT_QUEUED);
+  connect->state = CONNECT_RUNNING;
+  data = connect->data;
+  g_mutex_unlock (&connect_mutex);
+
+  data->problem = cockpit_ssh_connect (data);
+
+  g_mutex_lock (&connect_mutex);
+  if (connect->state == CONNECT_CANCELLED)
+    {
+      /* Nobody wants the data any more */
+      connect->data = NULL;
+    }
+  else
+    {
+      connect->state = CONNECT_DONE;
+      data = NULL;
+    }
+  finish_destination_inlock (connect);
+  g_mutex_unlock (&connect_mutex);
+
+  if (data)
+    cockpit_ssh_data_free (data);
+  else
+    g_main_context_wakeup (connect->context);
+  cockpit_ssh_connect_unref (connect);
+}
+
+static CockpitSshConnect *
+cockpit_ssh_connect_start (const gchar *destination,
+                           CockpitSshData *data,
+                           GMainContext *context)
+{
+  CockpitSshDestination *dest;
+  CockpitSshConnect *connect;
+  GError *error = NULL;
+
+  connect = g_new0 (CockpitSshConnect, 1);
+  connect->refs = 1;
+  connect->state = CONNECT_WAITING;
+  connect->destination = g_strdup (destination);
+  connect->data = data;
+  connect->connecting = 1;
+  data->connecting = &connect->connecting;
+  if (context)
+    connect->context = g_main_context_ref (context);
+
+  g_mutex_lock (&connect_mutex);
+
+  if (!connect_pool)
+    {
+      connect_pool = g_thread_pool_new (cockpit_ssh_connect_run, NULL,
+                                        cockpit_ws_ssh_connect_threads ? (gint)cockpit_ws_ssh_connect_threads : -1,
+                                        FALSE, &error);
+      g_assert_no_error (error);
+      destinations = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, cockpit_ssh_destination_free);
+    }
+
+  dest = g_hash_table_lookup (destinations, destination);
+  if (!dest)
+    {
+      dest = g_new0 (CockpitSshDestination, 1);
+      dest->waiting = g_queue_new ();
+      g_hash_table_insert (destinations, g_strdup (destination), dest);
+    }
+
+  /* The pool holds a reference until it's done with the connect */
+  g_queue_push_tail (dest->waiting, cockpit_ssh_connect_ref (connect));
+  if (dest->running > 0 && dest->running >= cockpit_ws_ssh_host_connects)
+    g_debug ("%s: waiting for %u other connects", destination, dest->running);
+  dispatch_destination_inlock (destination, dest);
+
+  g_mutex_unlock (&connect_mutex);
+
+  return connect;
+}
+
+static CockpitSshData *
+cockpit_ssh_connect_finish (CockpitSshConnect *connect)
+{
+  CockpitSshData *data = NULL;
+
+  g_mutex_lock (&connect_mutex);
+  if (connect->state == CONNECT_DONE)
+    {
+      data = connect->data;
+      connect->data = NULL;
+    }
+  g_mutex_unlock (&connect_mutex);
+
+  return data;
+}
+
+static CockpitSshData *
+cockpit_ssh_connect_cancel (CockpitSshConnect *connect)
+{
+  CockpitSshDestination *dest;
+  CockpitSshData *data = NULL;
+  gboolean take = TRUE;
+
+  /* Tell the connect thread to keep quiet about failures */
+  g_atomic_int_set (&connect->connecting, 0);
+
+  g_mutex_lock (&connect_mutex);
+
+  switch (connect->state)
+    {
+    case CONNECT_WAITING:
+      dest = g_hash_table_lookup (destinations, connect->destination);
+      g_assert (dest != NULL);
+      if (g_queue_remove (dest->waiting, connect))
+        cockpit_ssh_connect_unref (connect);
+      connect->state = CONNECT_CANCELLED;
+      dispatch_destination_inlock (connect->destination, dest);
+      break;
+    case CONNECT_QUEUED:
+      /* The pool thread skips it */
+      connect->state = CONNECT_CANCELLED;
+      break;
+    case CONNECT_RUNNING:
+      /* Can't interrupt libssh, the pool thread frees the data */
+      connect->state = CONNECT_CANCELLED;
+      take = FALSE;
+      break;
+    case CONNECT_CANCELLED:
+      take = FALSE;
+      break;
+    case CONNECT_DONE:
+      break;
+    }
+
+  if (take)
+    {
+      data = connect->data;
+      connect->data = NULL;
+    }
+
+  g_mutex_unlock (&connect_mutex);
+
+  return data;
+}
+
+/* ----------------------------------------------------------------------------
+ * I/O Threads
+ *
+ * Once connected, all the libssh reading, writing and crypto for a transport
+ * happens on one of a small number of I/O threads, each with its own main
+ * context. Transports are spread over the threads, so busy ssh sessions use
+ * more than one core, and don't hold up the web sockets.
+ *
+ * Frames travel between the I/O thread and the transport's own context on
+ * lock free single producer, single consumer queues. A transport has one
+ * queue for each direction.
+ */
+
+/* Threads that do ssh I/O, or zero to do it on the transport's context */
+guint cockpit_ws_ssh_io_threads = 4;
+
+typedef struct {
+  GMainContext *context;
+  guint transports;
+} CockpitSshIoThread;
+
+G_LOCK_DEFINE_STATIC (io_threads);
+static CockpitSshIoThread *io_threads = NULL;
+static guint n_io_threads = 0;
+
+static gpointer
+cockpit_ssh_io_thread (gpointer user_data)
+{
+  GMainContext *context = user_data;
+
+  g_main_context_push_thread_default (context);
+  for (;;)
+    g_main_context_iteration (context, TRUE);
+
+  return NULL;
+}
+
+static GMainContext *
+cockpit_ssh_io_context_acquire (void)
+{
+  CockpitSshIoThread *least = NULL;
+  GThread *thread;
+  guint i;
+
+  /* Checked each time, so it can be turned off later */
+  if (cockpit_ws_ssh_io_threads == 0)
+    return NULL;
+
+  G_LOCK (io_threads);
+
+  if (!io_threads)
+    {
+      n_io_threads = cockpit_ws_ssh_io_threads;
+      io_threads = g_new0 (CockpitSshIoThread, n_io_threads);
+      for (i = 0; i < n_io_threads; i++)
+        {
+          io_threads[i].context = g_main_context_new ();
+          thread = g_thread_new ("ssh-transport-io", cockpit_ssh_io_thread, io_threads[i].context);
+          g_thread_unref (thread);
+        }
+    }
+
+  for (i = 0; i < n_io_threads; i++)
+    {
+      if (!least || io_threads[i].transports < least->transports)
+        least = io_threads + i;
+    }
+
+  if (least)
+    least->transports++;
+
+  G_UNLOCK (io_threads);
+
+  return least ? g_main_context_ref (least->context) : NULL;
+}
+
+static void
+cockpit_ssh_io_context_release (GMainContext *context)
+{
+  guint i;
+
+  G_LOCK (io_threads);
+  for (i = 0; i < n_io_threads; i++)
+    {
+      if (io_threads[i].context == context)
+        {
+          g_warn_if_fail (io_threads[i].transports > 0);
+          io_threads[i].transports--;
+          break;
+        }
+    }
+  G_UNLOCK (io_threads);
+
+  g_main_context_unref (context);
+}
+
+typedef struct {
+  gchar *channel;
+  GBytes *payload;
+  gboolean closed;
+  gchar *problem;
+} CockpitSshEvent;
+
+static void
+cockpit_ssh_event_free (gpointer data)
+{
+  CockpitSshEvent *event = data;
+  g_free (event->channel);
+  if (event->payload)
+    g_bytes_unref (event->payload);
+  g_free (event->problem);
+  g_slice_free (CockpitSshEvent, event);
+}
+
 /* ----------------------------------------------------------------------------
  * CockpitSshTransport implementation
+ *
+ * Fields are either used on the I/O context or on the transport's own
+ * context, as noted. The queues and the close request are shared.
  */
 
 enum {
@@ -429,11 +838,26 @@ struct _CockpitSshTransport {
 
   /* Name used for logging */
   gchar *logname;
+  guint port;
 
-  /* Connecting happens in a thread */
-  GThread *connect_thread;
-  gint connecting;
-  gint connect_fd;
+  /* The transport's own context */
+  GMainContext *context;
+  GSource *dispatch;
+  gboolean requested_close;
+  gboolean emitted_close;
+
+  /* Shared between the two contexts */
+  GMainContext *io_context;
+  CockpitQueue *outbound;
+  CockpitQueue *inbound;
+  gint close_request;
+  gchar *close_problem;
+  gboolean io_done;
+
+  /* Everything below is used on the I/O context */
+
+  /* Connecting happens in the connect pool */
+  CockpitSshConnect *connect;
 
   /* Data shared with connect thread*/
   CockpitSshData *data;
@@ -441,7 +865,7 @@ struct _CockpitSshTransport {
   GSource *io;
   gboolean closing;
   gboolean closed;
-  guint timeout_close;
+  GSource *timeout_close;
   const gchar *problem;
   ssh_event event;
   struct ssh_channel_callbacks_struct channel_cbs;
@@ -468,13 +892,19 @@ struct _CockpitSshTransportClass {
 static void close_immediately (CockpitSshTransport *self,
                                const gchar *problem);
 
+/* Signals io_done */
+static GMutex io_done_mutex;
+static GCond io_done_cond;
+
 G_DEFINE_TYPE (CockpitSshTransport, cockpit_ssh_transport, COCKPIT_TYPE_TRANSPORT);
 
 static gboolean
 on_timeout_close (gpointer data)
 {
   CockpitSshTransport *self = COCKPIT_SSH_TRANSPORT (data);
-  self->timeout_close = 0;
+
+  g_source_unref (self->timeout_close);
+  self->timeout_close = NULL;
 
   g_debug ("%s: forcing close after timeout", self->logname);
   close_immediately (self, NULL);
@@ -508,7 +938,11 @@ close_maybe (CockpitSshTransport *self,
    * exit signal and or drain its buffers. Otherwise force.
    */
   if (!self->timeout_close)
-    self->timeout_close = g_timeout_add_seconds (3, on_timeout_close, self);
+    {
+      self->timeout_close = g_timeout_source_new_seconds (3);
+      g_source_set_callback (self->timeout_close, on_timeout_close, self, NULL);
+      g_source_attach (self->timeout_close, self->io_context);
+    }
 
   return FALSE;
 }
@@ -652,9 +1086,10 @@ cockpit_ssh_transport_init (CockpitSshTransport *self)
 
   self->data = g_new0 (CockpitSshData, 1);
 
-  self->data->context = g_main_context_get_thread_default ();
-  if (self->data->context)
-    g_main_context_ref (self->data->context);
+  self->context = g_main_context_get_thread_default ();
+  if (!self->context)
+    self->context = g_main_context_default ();
+  g_main_context_ref (self->context);
 
   self->data->session = ssh_new ();
   g_return_if_fail (self->data->session != NULL);
@@ -662,6 +1097,9 @@ cockpit_ssh_transport_init (CockpitSshTransport *self)
   self->buffer = g_byte_array_new ();
   self->queue = g_queue_new ();
 
+  self->outbound = cockpit_queue_new ((GDestroyNotify)g_bytes_unref);
+  self->inbound = cockpit_queue_new (cockpit_ssh_event_free);
+
   memcpy (&self->channel_cbs, &channel_cbs, sizeof (channel_cbs));
   self->channel_cbs.userdata = self;
   ssh_callbacks_init (&self->channel_cbs);
@@ -669,17 +1107,26 @@ cockpit_ssh_transport_init (CockpitSshTransport *self)
   self->event = ssh_event_new ();
 }
 
+static void
+push_event (CockpitSshTransport *self,
+            CockpitSshEvent *event)
+{
+  cockpit_queue_push (self->inbound, event);
+  g_main_context_wakeup (self->context);
+}
+
 static void
 close_immediately (CockpitSshTransport *self,
                    const gchar *problem)
 {
+  CockpitSshEvent *event;
   GSource *source;
-  GThread *thread;
 
   if (self->timeout_close)
     {
-      g_source_remove (self->timeout_close);
-      self->timeout_close = 0;
+      g_source_destroy (self->timeout_close);
+      g_source_unref (self->timeout_close);
+      self->timeout_close = NULL;
     }
 
   if (self->closed)
@@ -687,21 +1134,14 @@ close_immediately (CockpitSshTransport *self,
 
   self->closed = TRUE;
 
-  if (self->connect_thread)
+  if (self->connect)
     {
-      thread = self->connect_thread;
-      self->connect_thread = NULL;
-
-      /* This causes thread to fail */
-      g_atomic_int_set (&self->connecting, 0);
-      close (self->connect_fd);
-      self->connect_fd = -1;
       g_assert (self->data == NULL);
-      self->data = g_thread_join (thread);
+      self->data = cockpit_ssh_connect_cancel (self->connect);
+      cockpit_ssh_connect_unref (self->connect);
+      self->connect = NULL;
     }
 
-  g_assert (self->data != NULL);
-
   if (problem == NULL)
     problem = self->problem;
 
@@ -716,16 +1156,24 @@ close_immediately (CockpitSshTransport *self,
       g_source_unref (source);
     }
 
-  if (self->data->channel && ssh_channel_is_open (self->data->channel))
-    ssh_channel_close (self->data->channel);
-  ssh_disconnect (self->data->session);
+  /* No data when cancelled in the middle of connecting */
+  if (self->data)
+    {
+      if (self->data->channel && ssh_channel_is_open (self->data->channel))
+        ssh_channel_close (self->data->channel);
+      ssh_disconnect (self->data->session);
+    }
 
-  cockpit_transport_emit_closed (COCKPIT_TRANSPORT (self), problem);
+  event = g_slice_new0 (CockpitSshEvent);
+  event->closed = TRUE;
+  event->problem = g_strdup (problem);
+  push_event (self, event);
 }
 
 static void
 drain_buffer (CockpitSshTransport *self)
 {
+  CockpitSshEvent *event;
   GBytes *message;
   GBytes *payload;
   gchar *channel;
@@ -754,9 +1202,10 @@ drain_buffer (CockpitSshTransport *self)
       if (payload)
         {
           g_debug ("%s: received a %d byte payload", self->logname, (int)g_bytes_get_size (payload));
-          cockpit_transport_emit_recv ((CockpitTransport *)self, channel, payload);
-          g_bytes_unref (payload);
-          g_free (channel);
+          event = g_slice_new0 (CockpitSshEvent);
+          event->channel = channel;
+          event->payload = payload;
+          push_event (self, event);
         }
       g_bytes_unref (message);
     }
@@ -886,23 +1335,40 @@ cockpit_ssh_source_prepare (GSource *source,
 {
   CockpitSshSource *cs = (CockpitSshSource *)source;
   CockpitSshTransport *self = cs->transport;
-  GThread *thread;
+  const gchar *problem;
+  GBytes *block;
   gint status;
 
   *timeout = 1;
 
+  /* Look at the close request before the frames queued ahead of it */
+  if (G_UNLIKELY (g_atomic_int_compare_and_exchange (&self->close_request, 1, 2)))
+    {
+      self->closing = TRUE;
+      problem = g_atomic_pointer_get (&self->close_problem);
+      if (problem)
+        {
+          close_immediately (self, problem);
+          return FALSE;
+        }
+    }
+
+  while ((block = cockpit_queue_pop (self->outbound)) != NULL)
+    g_queue_push_tail (self->queue, block);
+
   /* Connecting, check if done */
   if (G_UNLIKELY (!self->data))
     {
-      if (g_atomic_int_get (&self->connecting))
-        return FALSE;
+      /* Get the result from connecting thread, which wakes us when done */
+      self->data = cockpit_ssh_connect_finish (self->connect);
+      if (!self->data)
+        {
+          *timeout = -1;
+          return FALSE;
+        }
 
-      /* Get the result from connecting thread */
-      thread = self->connect_thread;
-      self->connect_fd = -1;
-      self->connect_thread = NULL;
-      self->data = g_thread_join (thread);
-      g_assert (self->data != NULL);
+      cockpit_ssh_connect_unref (self->connect);
+      self->connect = NULL;
 
       if (self->data->problem)
         {
@@ -1049,11 +1515,79 @@ cockpit_ssh_source_dispatch (GSource *source,
   return TRUE;
 }
 
+/*
+ * Delivers what the I/O context pushed onto the inbound queue as
+ * signals on the transport's own context.
+ */
+
+typedef struct {
+  GSource source;
+  CockpitSshTransport *transport;
+} CockpitSshDispatch;
+
+static void
+deliver_events (CockpitSshTransport *self)
+{
+  CockpitSshEvent *event;
+
+  while (!self->emitted_close)
+    {
+      event = cockpit_queue_pop (self->inbound);
+      if (!event)
+        break;
+
+      if (event->closed)
+        {
+          self->emitted_close = TRUE;
+          cockpit_transport_emit_closed (COCKPIT_TRANSPORT (self), event->problem);
+        }
+
+      /* Nothing more is received after closing with a problem */
+      else if (!self->close_problem)
+        {
+          cockpit_transport_emit_recv (COCKPIT_TRANSPORT (self), event->channel, event->payload);
+        }
+
+      cockpit_ssh_event_free (event);
+    }
+}
+
+static gboolean
+cockpit_ssh_dispatch_check (GSource *source)
+{
+  CockpitSshDispatch *cd = (CockpitSshDispatch *)source;
+  return !cockpit_queue_is_empty (cd->transport->inbound);
+}
+
+static gboolean
+cockpit_ssh_dispatch_prepare (GSource *source,
+                              gint *timeout)
+{
+  *timeout = -1;
+  return cockpit_ssh_dispatch_check (source);
+}
+
+static gboolean
+cockpit_ssh_dispatch_dispatch (GSource *source,
+                               GSourceFunc callback,
+                               gpointer user_data)
+{
+  CockpitSshDispatch *cd = (CockpitSshDispatch *)source;
+  CockpitSshTransport *self = cd->transport;
+
+  g_object_ref (self);
+  deliver_events (self);
+  g_object_unref (self);
+
+  return TRUE;
+}
+
 static void
 cockpit_ssh_transport_constructed (GObject *object)
 {
   CockpitSshTransport *self = COCKPIT_SSH_TRANSPORT (object);
   CockpitSshData *data;
+  gchar *destination;
 
   static GSourceFuncs source_funcs = {
     cockpit_ssh_source_prepare,
@@ -1062,25 +1596,40 @@ cockpit_ssh_transport_constructed (GObject *object)
     NULL,
   };
 
+  static GSourceFuncs dispatch_funcs = {
+    cockpit_ssh_dispatch_prepare,
+    cockpit_ssh_dispatch_check,
+    cockpit_ssh_dispatch_dispatch,
+    NULL,
+  };
+
   G_OBJECT_CLASS (cockpit_ssh_transport_parent_class)->constructed (object);
 
   g_return_if_fail (self->data->creds != NULL);
   g_warn_if_fail (ssh_options_set (self->data->session, SSH_OPTIONS_USER,
                                    cockpit_creds_get_user (self->data->creds)) == 0);
 
-  self->io = g_source_new (&source_funcs, sizeof (CockpitSshSource));
-  ((CockpitSshSource *)self->io)->transport = self;
-  g_source_attach (self->io, self->data->context);
+  self->io_context = cockpit_ssh_io_context_acquire ();
+  if (!self->io_context)
+    self->io_context = g_main_context_ref (self->context);
+
+  self->dispatch = g_source_new (&dispatch_funcs, sizeof (CockpitSshDispatch));
+  ((CockpitSshDispatch *)self->dispatch)->transport = self;
+  g_source_attach (self->dispatch, self->context);
 
-  /* Setup for connect thread */
-  self->connect_fd = ssh_get_fd (self->data->session);
-  g_atomic_int_set (&self->connecting, 1);
-  self->data->connecting = &self->connecting;
+  /* Setup for connect thread, which wakes the I/O context when done */
   data = self->data;
   self->data = NULL;
 
-  self->connect_thread = g_thread_new ("ssh-transport-connect",
-                                       cockpit_ssh_connect_thread, data);
+  destination = g_strdup_printf ("%s:%u", self->logname ? self->logname : "localhost",
+                                 self->port ? self->port : 22);
+  self->connect = cockpit_ssh_connect_start (destination, data, self->io_context);
+  g_free (destination);
+
+  /* From here on the I/O context runs the ssh side of things */
+  self->io = g_source_new (&source_funcs, sizeof (CockpitSshSource));
+  ((CockpitSshSource *)self->io)->transport = self;
+  g_source_attach (self->io, self->io_context);
 
   g_debug ("%s: constructed", self->logname);
 }
@@ -1099,7 +1648,7 @@ cockpit_ssh_transport_set_property (GObject *obj,
     {
     case PROP_HOST:
       self->logname = g_value_dup_string (value);
-      self->data->logname = self->logname;
+      self->data->logname = g_strdup (self->logname);
       g_warn_if_fail (ssh_options_set (self->data->session, SSH_OPTIONS_HOST,
                                        g_value_get_string (value)) == 0);
       break;
@@ -1107,6 +1656,7 @@ cockpit_ssh_transport_set_property (GObject *obj,
       port = g_value_get_uint (value);
       if (port == 0)
         port = 22;
+      self->port = port;
       g_warn_if_fail (ssh_options_set (self->data->session, SSH_OPTIONS_PORT, &port) == 0);
       break;
     case PROP_KNOWN_HOSTS:
@@ -1158,14 +1708,54 @@ cockpit_ssh_transport_get_property (GObject *obj,
     }
 }
 
+static gboolean
+on_io_shutdown (gpointer user_data)
+{
+  CockpitSshTransport *self = user_data;
+
+  close_immediately (self, "disconnected");
+
+  g_mutex_lock (&io_done_mutex);
+  self->io_done = TRUE;
+  g_cond_broadcast (&io_done_cond);
+  g_mutex_unlock (&io_done_mutex);
+
+  return FALSE;
+}
+
 static void
 cockpit_ssh_transport_dispose (GObject *object)
 {
   CockpitSshTransport *self = COCKPIT_SSH_TRANSPORT (object);
 
-  close_immediately (self, "disconnected");
+  /* Wait for the I/O context to let go of the transport */
+  if (self->io_context && !self->io_done)
+    {
+      if (self->io_context == self->context)
+        {
+          on_io_shutdown (self);
+        }
+      else
+        {
+          g_main_context_invoke (self->io_context, on_io_shutdown, self);
+          g_mutex_lock (&io_done_mutex);
+          while (!self->io_done)
+            g_cond_wait (&io_done_cond, &io_done_mutex);
+          g_mutex_unlock (&io_done_mutex);
+        }
+    }
 
-  G_OBJECT_CLASS (cockpit_ssh_transport_parent_class)->finalize (object);
+  /* Emits closed if not yet done */
+  deliver_events (self);
+
+  if (self->dispatch)
+    {
+      g_source_destroy (self->dispatch);
+      g_source_unref (self->dispatch);
+      self->dispatch = NULL;
+    }
+
+  G_OBJECT_CLASS (cockpit_ssh_transport_parent_class)->dispose (object);
 }
 
 static void
@@ -1183,7 +1773,14 @@ cockpit_ssh_transport_finalize (GObject *object)
   g_queue_free_full (self->queue, (GDestroyNotify)g_bytes_unref);
   g_byte_array_free (self->buffer, TRUE);
 
+  cockpit_queue_free (self->outbound);
+  cockpit_queue_free (self->inbound);
+  g_free (self->close_problem);
+
   g_assert (self->io == NULL);
+  if (self->io_context)
+    cockpit_ssh_io_context_release (self->io_context);
+  g_main_context_unref (self->context);
 
   G_OBJECT_CLASS (cockpit_ssh_transport_parent_class)->finalize (object);
 }
@@ -1198,7 +1795,7 @@ cockpit_ssh_transport_send (CockpitTransport *transport,
   gsize length;
   guint32 size;
 
-  g_return_if_fail (!self->closing);
+  g_return_if_fail (!self->requested_close);
 
   prefix = g_strdup_printf ("xxxx%s\n", channel ? channel : "");
   length = strlen (prefix);
@@ -1207,8 +1804,10 @@ cockpit_ssh_transport_send (CockpitTransport *transport,
   size = GUINT32_TO_BE (g_bytes_get_size (payload) + length - 4);
   memcpy (prefix, &size, 4);
 
-  g_queue_push_tail (self->queue, g_bytes_new_take (prefix, length));
-  g_queue_push_tail (self->queue, g_bytes_ref (payload));
+  /* Written on the I/O context */
+  cockpit_queue_push (self->outbound, g_bytes_new_take (prefix, length));
+  cockpit_queue_push (self->outbound, g_bytes_ref (payload));
+  g_main_context_wakeup (self->io_context);
 
   g_debug ("%s: queued %d byte payload", self->logname, (int)g_bytes_get_size (payload));
 }
@@ -1219,10 +1818,13 @@ cockpit_ssh_transport_close (CockpitTransport *transport,
 {
   CockpitSshTransport *self = COCKPIT_SSH_TRANSPORT (transport);
 
-  self->closing = TRUE;
+  self->requested_close = TRUE;
+  if (problem && !self->close_problem)
+    g_atomic_pointer_set (&self->close_problem, g_strdup (problem));
 
-  if (problem)
-    close_immediately (self, problem);
+  /* Closed on the I/O context, after sending what's queued */
+  g_atomic_int_set (&self->close_request, 1);
+  g_main_context_wakeup (self->io_context);
 }
 
 static void
@@ -29,9 +29,14 @@
 
 #include "cockpit/cockpiterror.h"
 
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 /**
  * CockpitWebResponse:
@@ -42,6 +47,7 @@
  *
  * cockpit_web_response_headers() send the headers
  * cockpit_web_response_queue() send a block of data.
+ * cockpit_web_response_queue_fd() send the contents of a file.
  * cockpit_web_response_complete() finish.
  */
 
@@ -50,6 +56,7 @@ struct _CockpitWebResponse {
   GIOStream *io;
   const gchar *logname;
   gchar *path;
+  GHashTable *in_headers;
 
   /* The output queue */
   GPollableOutputStream *out;
@@ -57,6 +64,11 @@ struct _CockpitWebResponse {
   gsize partial_offset;
   GSource *source;
 
+  /* File body sent with sendfile() after the queue */
+  int sendfile_fd;
+  off_t sendfile_offset;
+  off_t sendfile_end;
+
   /* Status flags */
   guint count;
   gboolean complete;
@@ -74,6 +86,7 @@ static void
 cockpit_web_response_init (CockpitWebResponse *self)
 {
   self->queue = g_queue_new ();
+  self->sendfile_fd = -1;
 }
 
 static void
@@ -86,6 +99,12 @@ cockpit_web_response_done (CockpitWebResponse *self)
   self->io = NULL;
   self->out = NULL;
 
+  if (self->sendfile_fd >= 0)
+    {
+      close (self->sendfile_fd);
+      self->sendfile_fd = -1;
+    }
+
   if (self->source)
     {
       g_source_destroy (self->source);
@@ -121,6 +140,8 @@ cockpit_web_response_finalize (GObject *object)
   CockpitWebResponse *self = COCKPIT_WEB_RESPONSE (object);
 
   g_free (self->path);
+  if (self->in_headers)
+    g_hash_table_unref (self->in_headers);
   g_assert (self->io == NULL);
   g_assert (self->out == NULL);
   g_queue_free_full (self->queue, (GDestroyNotify)g_bytes_unref);
@@ -141,9 +162,13 @@ cockpit_web_response_class_init (CockpitWebResponseClass *klass)
  * cockpit_web_response_new:
  * @io: the stream to send on
  * @path: the path resource or NULL
+ * @in_headers: the request headers or NULL
  *
  * Create a new web response.
  *
+ * The request headers are used to negotiate things like the
+ * Content-Encoding when serving files.
+ *
  * The returned refference belongs to the caller. Additionally
  * once cockpit_web_response_complete() is called, an additional
  * reference is held until the response is sent and flushed.
@@ -152,7 +177,8 @@ cockpit_web_response_class_init (CockpitWebResponseClass *klass)
  */
 CockpitWebResponse *
 cockpit_web_response_new (GIOStream *io,
-                          const gchar *path)
+                          const gchar *path,
+                          GHashTable *in_headers)
 {
   CockpitWebResponse *self;
   GOutputStream *out;
@@ -173,6 +199,8 @@ cockpit_web_response_new (GIOStream *io,
     }
 
   self->path = g_strdup (path);
+  if (in_headers)
+    self->in_headers = g_hash_table_ref (in_headers);
   if (self->path)
     self->logname = self->path;
   else
@@ -205,6 +233,18 @@ cockpit_web_response_get_stream  (CockpitWebResponse *self)
   return self->io;
 }
 
+/**
+ * cockpit_web_response_get_in_headers:
+ * @self: the response
+ *
+ * Returns: the headers of the request, or NULL
+ */
+GHashTable *
+cockpit_web_response_get_in_headers (CockpitWebResponse *self)
+{
+  return self->in_headers;
+}
+
 static gboolean
 should_suppress_output_error (CockpitWebResponse *self,
                               GError *error)
@@ -218,6 +258,58 @@ should_suppress_output_error (CockpitWebResponse *self,
   return FALSE;
 }
 
+/* Size of a single sendfile() call, so we don't block the main loop */
+#define SENDFILE_CHUNK (1024 * 1024)
+
+static gboolean
+on_response_sendfile (CockpitWebResponse *self)
+{
+  GSocket *socket;
+  gssize count;
+  gsize len;
+
+  len = MIN (self->sendfile_end - self->sendfile_offset, SENDFILE_CHUNK);
+  if (len > 0)
+    {
+      socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (self->io));
+      count = sendfile (g_socket_get_fd (socket), self->sendfile_fd,
+                        &self->sendfile_offset, len);
+
+      if (count < 0)
+        {
+          /* Just wait and try again */
+          if (errno == EAGAIN || errno == EINTR)
+            return TRUE;
+
+          if (errno == EPIPE || errno == ECONNRESET)
+            g_debug ("%s: output error: %s", self->logname, g_strerror (errno));
+          else
+            g_warning ("%s: couldn't send file: %s", self->logname, g_strerror (errno));
+
+          self->failed = TRUE;
+          cockpit_web_response_done (self);
+          return FALSE;
+        }
+      else if (count == 0)
+        {
+          g_warning ("%s: file was truncated while sending", self->logname);
+          self->failed = TRUE;
+          cockpit_web_response_done (self);
+          return FALSE;
+        }
+
+      g_debug ("%s: sent %d bytes from file", self->logname, (int)count);
+    }
+
+  if (self->sendfile_offset >= self->sendfile_end)
+    {
+      close (self->sendfile_fd);
+      self->sendfile_fd = -1;
+    }
+
+  return TRUE;
+}
+
 static void
 on_output_closed (GObject *stream,
                   GAsyncResult *result,
@@ -331,6 +423,10 @@ on_response_output (GObject *pollable,
         }
       return TRUE;
     }
+  else if (self->sendfile_fd >= 0)
+    {
+      return on_response_sendfile (self);
+    }
   else
     {
       g_source_destroy (self->source);
@@ -348,6 +444,17 @@ on_response_output (GObject *pollable,
     }
 }
 
+static void
+start_output (CockpitWebResponse *self)
+{
+  if (!self->source)
+    {
+      self->source = g_pollable_output_stream_create_source (self->out, NULL);
+      g_source_set_callback (self->source, (GSourceFunc)on_response_output, self, NULL);
+      g_source_attach (self->source, g_main_context_get_thread_default ());
+    }
+}
+
 /**
  * cockpit_web_response_queue:
  * @self: the response
@@ -381,18 +488,105 @@ cockpit_web_response_queue (CockpitWebResponse *self,
       return FALSE;
     }
 
+  if (self->sendfile_fd >= 0)
+    {
+      g_critical ("Cannot queue blocks after a file. This is a programmer error.");
+      return FALSE;
+    }
+
   self->count++;
   g_debug ("%s: queued %d bytes", self->logname, (int)g_bytes_get_size (block));
   g_queue_push_tail (self->queue, g_bytes_ref (block));
 
-  if (!self->source)
+  start_output (self);
+  return TRUE;
+}
+
+/**
+ * cockpit_web_response_queue_fd:
+ * @self: the response
+ * @fd: an open file descriptor, which is consumed
+ * @offset: offset in the file to start sending at
+ * @length: number of bytes to send
+ *
+ * Queue a part of a file on the response. The file descriptor
+ * is owned by the response, and will be closed when done.
+ *
+ * When the response is sent over an unencrypted socket, then the
+ * data is sent with sendfile() without being copied into our
+ * address space. Otherwise the file is mapped and queued as a
+ * normal block.
+ *
+ * This must be the last block queued before calling
+ * cockpit_web_response_complete().
+ *
+ * Returns: Whether queuing more blocks makes sense
+ */
+gboolean
+cockpit_web_response_queue_fd (CockpitWebResponse *self,
+                               int fd,
+                               goffset offset,
+                               gsize length)
+{
+  GMappedFile *mapped;
+  GError *error = NULL;
+  GBytes *bytes;
+  GBytes *block;
+  gboolean ret;
+
+  g_return_val_if_fail (fd >= 0, FALSE);
+  g_return_val_if_fail (self->complete == FALSE, FALSE);
+  g_return_val_if_fail (self->sendfile_fd < 0, FALSE);
+
+  if (self->failed)
     {
-      self->source = g_pollable_output_stream_create_source (self->out, NULL);
-      g_source_set_callback (self->source, (GSourceFunc)on_response_output, self, NULL);
-      g_source_attach (self->source, NULL);
+      g_debug ("%s: ignoring queued file after failure", self->logname);
+      close (fd);
+      return FALSE;
     }
 
-  return TRUE;
+  if (G_IS_SOCKET_CONNECTION (self->io))
+    {
+      self->count++;
+      g_debug ("%s: queued %" G_GSIZE_FORMAT " bytes from file", self->logname, length);
+      self->sendfile_fd = fd;
+      self->sendfile_offset = offset;
+      self->sendfile_end = offset + length;
+      start_output (self);
+      return TRUE;
+    }
+
+  /* Fall back to mapping the file into memory, eg: for TLS */
+  mapped = g_mapped_file_new_from_fd (fd, FALSE, &error);
+  close (fd);
+
+  if (!mapped)
+    {
+      g_warning ("%s: couldn't map file: %s", self->logname, error->message);
+      g_error_free (error);
+      self->failed = TRUE;
+      cockpit_web_response_done (self);
+      return FALSE;
+    }
+
+  bytes = g_mapped_file_get_bytes (mapped);
+  g_mapped_file_unref (mapped);
+
+  if (offset + length > g_bytes_get_size (bytes))
+    {
+      g_warning ("%s: file was truncated while sending", self->logname);
+      g_bytes_unref (bytes);
+      self->failed = TRUE;
+      cockpit_web_response_done (self);
+      return FALSE;
+    }
+
+  block = g_bytes_new_from_bytes (bytes, offset, length);
+  ret = cockpit_web_response_queue (self, block);
+  g_bytes_unref (block);
+  g_bytes_unref (bytes);
+
+  return ret;
 }
 
 /**
@@ -754,9 +948,15 @@ cockpit_web_response_error (CockpitWebResponse *self,
         case 413:
           message = "Request Entity Too Large";
           break;
+        case 416:
+          message = "Requested Range Not Satisfiable";
+          break;
         case 500:
           message = "Internal Server Error";
           break;
+        case 503:
+          message = "Service Unavailable";
+          break;
         default:
           if (code < 100)
             reason = g_strdup_printf ("%u Continue", code);
@@ -833,13 +1033,301 @@ path_has_prefix (const gchar *path,
   return FALSE;
 }
 
+/* Compressed copies of files that have no pre-compressed sibling */
+typedef struct {
+  GBytes *data;
+  time_t mtime;
+  goffset size;
+} CompressedEntry;
+
+G_LOCK_DEFINE_STATIC (compressed);
+static GHashTable *compressed_cache = NULL;
+static gsize compressed_cache_size = 0;
+
+/* Don't let the cache grow without bounds */
+static const gsize compressed_cache_maximum = 16 * 1024 * 1024;
+
+static void
+compressed_entry_free (gpointer data)
+{
+  CompressedEntry *entry = data;
+  g_bytes_unref (entry->data);
+  g_free (entry);
+}
+
+static gboolean
+is_compressible (const gchar *path)
+{
+  static const gchar *extensions[] = {
+    ".css", ".html", ".js", ".json", ".svg", ".ttf", ".txt", ".xml",
+  };
+
+  gint i;
+
+  for (i = 0; i < G_N_ELEMENTS (extensions); i++)
+    {
+      if (g_str_has_suffix (path, extensions[i]))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+accepts_gzip (CockpitWebResponse *self)
+{
+  gboolean ret = FALSE;
+  const gchar *value;
+  gchar **codings;
+  gchar *params;
+  gchar *qvalue;
+  gint i;
+
+  if (!self->in_headers)
+    return FALSE;
+
+  value = g_hash_table_lookup (self->in_headers, "Accept-Encoding");
+  if (!value)
+    return FALSE;
+
+  codings = g_strsplit (value, ",", -1);
+  for (i = 0; codings[i] != NULL; i++)
+    {
+      params = strchr (codings[i], ';');
+      if (params)
+        *(params++) = '\0';
+      g_strstrip (codings[i]);
+
+      if (g_ascii_strcasecmp (codings[i], "gzip") != 0 &&
+          g_ascii_strcasecmp (codings[i], "x-gzip") != 0)
+        continue;
+
+      /* An explicit q=0 means the client refuses this coding */
+      ret = TRUE;
+      if (params)
+        {
+          qvalue = strstr (params, "q=");
+          if (qvalue && g_ascii_strtod (qvalue + 2, NULL) <= 0.0)
+            ret = FALSE;
+        }
+      break;
+    }
+
+  g_strfreev (codings);
+  return ret;
+}
+
+static GBytes *
+compress_bytes (GBytes *input)
+{
+  GConverter *converter;
+  GConverterResult result;
+  GError *error = NULL;
+  GByteArray *output;
+  const guint8 *data;
+  gsize offset;
+  gsize length;
+  gsize chunk;
+  gsize bytes_read;
+  gsize bytes_written;
+
+  converter = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1));
+  data = g_bytes_get_data (input, &length);
+  output = g_byte_array_sized_new (length / 3 + 64);
+  chunk = MAX (length / 3, 4096);
+
+  do
+    {
+      offset = output->len;
+      g_byte_array_set_size (output, offset + chunk);
+
+      result = g_converter_convert (converter, data, length,
+                                    output->data + offset, chunk,
+                                    G_CONVERTER_INPUT_AT_END,
+                                    &bytes_read, &bytes_written, &error);
+
+      if (result == G_CONVERTER_ERROR)
+        {
+          g_byte_array_set_size (output, offset);
+          if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE))
+            {
+              g_clear_error (&error);
+              chunk *= 2;
+              continue;
+            }
+
+          g_warning ("couldn't compress data: %s", error->message);
+          g_error_free (error);
+          g_byte_array_unref (output);
+          g_object_unref (converter);
+          return NULL;
+        }
+
+      data += bytes_read;
+      length -= bytes_read;
+      g_byte_array_set_size (output, offset + bytes_written);
+    }
+  while (result != G_CONVERTER_FINISHED);
+
+  g_object_unref (converter);
+  return g_byte_array_free_to_bytes (output);
+}
+
+static GBytes *
+lookup_or_compress (const gchar *path,
+                    int fd,
+                    struct stat *sb)
+{
+  CompressedEntry *entry;
+  GMappedFile *mapped;
+  GError *error = NULL;
+  GBytes *result = NULL;
+  GBytes *body;
+
+  G_LOCK (compressed);
+
+  if (!compressed_cache)
+    {
+      compressed_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, compressed_entry_free);
+    }
+
+  entry = g_hash_table_lookup (compressed_cache, path);
+  if (entry && entry->mtime == sb->st_mtime && entry->size == sb->st_size)
+    result = g_bytes_ref (entry->data);
+
+  G_UNLOCK (compressed);
+
+  if (result)
+    return result;
+
+  mapped = g_mapped_file_new_from_fd (fd, FALSE, &error);
+  if (!mapped)
+    {
+      g_warning ("%s: couldn't map file: %s", path, error->message);
+      g_error_free (error);
+      return NULL;
+    }
+
+  body = g_mapped_file_get_bytes (mapped);
+  g_mapped_file_unref (mapped);
+  result = compress_bytes (body);
+  g_bytes_unref (body);
+
+  if (!result)
+    return NULL;
+
+  entry = g_new0 (CompressedEntry, 1);
+  entry->data = g_bytes_ref (result);
+  entry->mtime = sb->st_mtime;
+  entry->size = sb->st_size;
+
+  G_LOCK (compressed);
+
+  if (compressed_cache_size + g_bytes_get_size (result) > compressed_cache_maximum)
+    {
+      g_debug ("flushing compressed file cache");
+      g_hash_table_remove_all (compressed_cache);
+      compressed_cache_size = 0;
+    }
+
+  compressed_cache_size += g_bytes_get_size (result);
+  g_hash_table_replace (compressed_cache, g_strdup (path), entry);
+
+  G_UNLOCK (compressed);
+
+  return result;
+}
+
+/*
+ * Parses a single "bytes=first-last" range against a file of @size.
+ * Returns 1 when the range is valid, 0 when it should be ignored
+ * and -1 when it cannot be satisfied.
+ */
+static gint
+parse_range (const gchar *value,
+             goffset size,
+             goffset *out_first,
+             goffset *out_length)
+{
+  guint64 first;
+  guint64 last;
+  gchar *end;
+
+  if (!g_str_has_prefix (value, "bytes="))
+    return 0;
+  value += 6;
+
+  /* We don't support multiple ranges */
+  if (strchr (value, ','))
+    return 0;
+
+  while (g_ascii_isspace (*value))
+    value++;
+
+  /* A suffix range: the last N bytes */
+  if (value[0] == '-')
+    {
+      if (!g_ascii_isdigit (value[1]))
+        return 0;
+      last = g_ascii_strtoull (value + 1, &end, 10);
+      if (*end != '\0')
+        return 0;
+      if (last == 0 || size == 0)
+        return -1;
+      if (last > (guint64)size)
+        last = size;
+      *out_first = size - last;
+      *out_length = last;
+      return 1;
+    }
+
+  if (!g_ascii_isdigit (value[0]))
+    return 0;
+  first = g_ascii_strtoull (value, &end, 10);
+  if (*end != '-')
+    return 0;
+
+  value = end + 1;
+  if (*value == '\0')
+    {
+      last = size - 1;
+    }
+  else
+    {
+      if (!g_ascii_isdigit (value[0]))
+        return 0;
+      last = g_ascii_strtoull (value, &end, 10);
+      if (*end != '\0' || last < first)
+        return 0;
+    }
+
+  if (first >= (guint64)size)
+    return -1;
+  if (last >= (guint64)size)
+    last = size - 1;
+
+  *out_first = first;
+  *out_length = (last - first) + 1;
+  return 1;
+}
+
 /**
  * cockpit_web_response_file:
  * @response: the response
  * @path: escaped path, or NULL to get from response
+ * @cache_forever: whether the file name changes along with its contents
  * @roots: directories to look for file in
  *
- * Serve a file from disk as an HTTP response.
+ * Serve a file from disk as an HTTP response. Files that are cached
+ * forever are marked immutable, so browsers don't revalidate them.
+ *
+ * If the request accepts gzip Content-Encoding, then a pre-compressed
+ * sibling file with a ".gz" suffix is served if present. Otherwise
+ * text files are compressed on the fly and the result is cached.
+ *
+ * A single byte Range in the request results in a 206 Partial
+ * Content response.
  */
 void
 cockpit_web_response_file (CockpitWebResponse *response,
@@ -848,20 +1336,32 @@ cockpit_web_response_file (CockpitWebResponse *response,
                            const gchar **roots)
 {
   const gchar *cache_control;
-  GError *error = NULL;
+  const gchar *content_encoding = NULL;
+  const gchar *vary = NULL;
+  const gchar *range = NULL;
+  gchar *content_range = NULL;
+  GHashTable *out_headers;
+  gboolean compress = FALSE;
   gchar *query = NULL;
   gchar *unescaped;
   char *path = NULL;
   gchar *built = NULL;
-  GMappedFile *file = NULL;
+  gchar *gzipped = NULL;
   const gchar *root;
   GBytes *body;
+  struct stat sb;
+  goffset offset;
+  goffset length;
+  int fd = -1;
 
   if (!escaped)
     escaped = cockpit_web_response_get_path (response);
 
   g_return_if_fail (escaped != NULL);
 
+  if (response->in_headers)
+    range = g_hash_table_lookup (response->in_headers, "Range");
+
   query = strchr (escaped, '?');
   if (query != NULL)
     *query++ = 0;
@@ -919,40 +1419,129 @@ again:
       goto out;
     }
 
-  file = g_mapped_file_new (path, FALSE, &error);
-  if (file == NULL)
+  if (is_compressible (path))
     {
-      if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_PERM) ||
-          g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_ACCES) ||
-          g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_ISDIR))
+      vary = "Accept-Encoding";
+
+      /* Ranges are always served from the identity encoding */
+      if (range == NULL && accepts_gzip (response))
         {
-          cockpit_web_response_error (response, 403, NULL, "Access denied");
-          g_clear_error (&error);
-          goto out;
+          /* Prefer a sibling compressed at build time */
+          gzipped = g_strconcat (path, ".gz", NULL);
+          fd = open (gzipped, O_RDONLY | O_CLOEXEC);
+          if (fd >= 0)
+            {
+              g_debug ("%s: serving pre-compressed file", gzipped);
+              content_encoding = "gzip";
+            }
+          else
+            {
+              compress = TRUE;
+            }
         }
-      else
+    }
+
+  if (fd < 0)
+    {
+      fd = open (path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
         {
-          g_warning ("%s: %s", path, error->message);
-          cockpit_web_response_error (response, 500, NULL, "Internal server error");
-          g_clear_error (&error);
+          if (errno == EPERM || errno == EACCES || errno == EISDIR)
+            {
+              cockpit_web_response_error (response, 403, NULL, "Access denied");
+              goto out;
+            }
+          else
+            {
+              g_warning ("%s: couldn't open file: %m", path);
+              cockpit_web_response_error (response, 500, NULL, "Internal server error");
+              goto out;
+            }
+        }
+    }
+
+  if (fstat (fd, &sb) < 0)
+    {
+      g_warning ("%s: couldn't stat file: %m", path);
+      cockpit_web_response_error (response, 500, NULL, "Internal server error");
+      goto out;
+    }
+
+  cache_control = cache_forever ? "max-age=31556926, public, immutable" : NULL;
+
+  if (compress)
+    {
+      body = lookup_or_compress (path, fd, &sb);
+      if (body)
+        {
+          cockpit_web_response_headers (response, 200, "OK", g_bytes_get_size (body),
+                                        "Cache-Control", cache_control,
+                                        "Content-Encoding", "gzip",
+                                        "Vary", vary,
+                                        NULL);
+          if (cockpit_web_response_queue (response, body))
+            cockpit_web_response_complete (response);
+          g_bytes_unref (body);
           goto out;
         }
+
+      /* Couldn't compress, send as is */
     }
 
-  body = g_mapped_file_get_bytes (file);
+  offset = 0;
+  length = sb.st_size;
 
-  cache_control = cache_forever ? "max-age=31556926, public" : NULL;
-  cockpit_web_response_headers (response, 200, "OK", g_bytes_get_size (body),
-                                "Cache-Control", cache_control,
-                                NULL);
+  if (range)
+    {
+      switch (parse_range (range, sb.st_size, &offset, &length))
+        {
+        case 1:
+          content_range = g_strdup_printf ("bytes %" G_GINT64_FORMAT "-%" G_GINT64_FORMAT
+                                           "/%" G_GINT64_FORMAT, (gint64)offset,
+                                           (gint64)(offset + length - 1), (gint64)sb.st_size);
+          break;
+        case -1:
+          content_range = g_strdup_printf ("bytes */%" G_GINT64_FORMAT, (gint64)sb.st_size);
+          out_headers = g_hash_table_new (g_str_hash, g_str_equal);
+          g_hash_table_insert (out_headers, "Content-Range", content_range);
+          cockpit_web_response_error (response, 416, out_headers, NULL);
+          g_hash_table_unref (out_headers);
+          goto out;
+        default:
+          offset = 0;
+          length = sb.st_size;
+          break;
+        }
+    }
 
-  if (cockpit_web_response_queue (response, body))
-    cockpit_web_response_complete (response);
+  if (content_range)
+    {
+      cockpit_web_response_headers (response, 206, "Partial Content", length,
+                                    "Cache-Control", cache_control,
+                                    "Content-Range", content_range,
+                                    "Accept-Ranges", "bytes",
+                                    "Vary", vary,
+                                    NULL);
+    }
+  else
+    {
+      cockpit_web_response_headers (response, 200, "OK", length,
+                                    "Cache-Control", cache_control,
+                                    "Content-Encoding", content_encoding,
+                                    "Accept-Ranges", content_encoding ? NULL : "bytes",
+                                    "Vary", vary,
+                                    NULL);
+    }
 
-  g_bytes_unref (body);
+  /* Consumes the file descriptor */
+  if (cockpit_web_response_queue_fd (response, fd, offset, length))
+    cockpit_web_response_complete (response);
+  fd = -1;
 
 out:
   free (path);
-  if (file)
-    g_mapped_file_unref (file);
+  g_free (gzipped);
+  g_free (content_range);
+  if (fd >= 0)
+    close (fd);
 }
@@ -32,12 +32,15 @@ typedef struct _CockpitWebResponse        CockpitWebResponse;
 GType                 cockpit_web_response_get_type      (void) G_GNUC_CONST;
 
 CockpitWebResponse *  cockpit_web_response_new           (GIOStream *io,
-                                                          const gchar *path);
+                                                          const gchar *path,
+                                                          GHashTable *in_headers);
 
 const gchar *         cockpit_web_response_get_path      (CockpitWebResponse *self);
 
 GIOStream *           cockpit_web_response_get_stream    (CockpitWebResponse *self);
 
+GHashTable *          cockpit_web_response_get_in_headers (CockpitWebResponse *self);
+
 void                  cockpit_web_response_headers       (CockpitWebResponse *self,
                                                           guint status,
                                                           const gchar *reason,
@@ -53,6 +56,11 @@ void                  cockpit_web_response_headers_full  (CockpitWebResponse *se
 gboolean              cockpit_web_response_queue         (CockpitWebResponse *self,
                                                           GBytes *block);
 
+gboolean              cockpit_web_response_queue_fd      (CockpitWebResponse *self,
+                                                          int fd,
+                                                          goffset offset,
+                                                          gsize length);
+
 void                  cockpit_web_response_complete      (CockpitWebResponse *self);
 
 void                  cockpit_web_response_content       (CockpitWebResponse *self,
@@ -34,8 +34,10 @@
 
 #include "cockpitws.h"
 #include "cockpitwebresponse.h"
+#include "cockpitadmission.h"
 
 #include "cockpit/cockpitmemory.h"
+#include "cockpit/cockpittimerwheel.h"
 
 #include "websocket/websocket.h"
 
@@ -43,9 +45,23 @@
 
 guint cockpit_ws_request_timeout = 30;
 gsize cockpit_ws_request_maximum = 4096;
+guint cockpit_ws_worker_threads = 0;
+guint cockpit_ws_handshake_threads = 4;
 
 typedef struct _CockpitWebServerClass CockpitWebServerClass;
 
+/*
+ * Each connection is confined to one worker, which has its own
+ * main context. The requests table owns the requests of the worker
+ * and is only touched from that worker's thread.
+ */
+typedef struct {
+  GMainContext *context;
+  GMainLoop *loop;
+  GThread *thread;
+  GHashTable *requests;
+} CockpitWebWorker;
+
 struct _CockpitWebServer {
   GObject parent_instance;
 
@@ -57,7 +73,16 @@ struct _CockpitWebServer {
 
   GSocketService *socket_service;
   GMainContext *main_context;
-  GHashTable *requests;
+
+  /* Connections handled on the main context */
+  CockpitWebWorker main_worker;
+
+  /* Additional worker threads, or empty */
+  GPtrArray *workers;
+  guint next_worker;
+
+  /* Runs blocking TLS handshakes off the main loops */
+  GThreadPool *handshake_pool;
 };
 
 struct _CockpitWebServerClass {
@@ -92,6 +117,8 @@ static gint sig_handle_resource = 0;
 
 static void cockpit_request_free (gpointer data);
 
+static void cockpit_web_worker_free (gpointer data);
+
 static void initable_iface_init (GInitableIface *iface);
 
 G_DEFINE_TYPE_WITH_CODE (CockpitWebServer, cockpit_web_server, G_TYPE_OBJECT,
@@ -102,9 +129,11 @@ G_DEFINE_TYPE_WITH_CODE (CockpitWebServer, cockpit_web_server, G_TYPE_OBJECT,
 static void
 cockpit_web_server_init (CockpitWebServer *server)
 {
-  server->requests = g_hash_table_new_full (g_direct_hash, g_direct_equal,
-                                            cockpit_request_free, NULL);
   server->main_context = g_main_context_ref_thread_default ();
+  server->main_worker.context = server->main_context;
+  server->main_worker.requests = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                        cockpit_request_free, NULL);
+  server->workers = g_ptr_array_new_with_free_func (cockpit_web_worker_free);
 }
 
 static void
@@ -124,7 +153,16 @@ cockpit_web_server_dispose (GObject *object)
 {
   CockpitWebServer *self = COCKPIT_WEB_SERVER (object);
 
-  g_hash_table_remove_all (self->requests);
+  /* Stops and joins the worker threads */
+  g_ptr_array_set_size (self->workers, 0);
+  g_hash_table_remove_all (self->main_worker.requests);
+
+  /* Handshakes in flight were cancelled above */
+  if (self->handshake_pool)
+    {
+      g_thread_pool_free (self->handshake_pool, FALSE, TRUE);
+      self->handshake_pool = NULL;
+    }
 
   G_OBJECT_CLASS (cockpit_web_server_parent_class)->dispose (object);
 }
@@ -136,7 +174,8 @@ cockpit_web_server_finalize (GObject *object)
 
   g_clear_object (&server->certificate);
   g_strfreev (server->document_roots);
-  g_hash_table_destroy (server->requests);
+  g_hash_table_destroy (server->main_worker.requests);
+  g_ptr_array_unref (server->workers);
   if (server->main_context)
     g_main_context_unref (server->main_context);
   g_clear_object (&server->socket_service);
@@ -281,7 +320,7 @@ cockpit_web_server_default_handle_stream (CockpitWebServer *self,
     }
 
   /* TODO: Correct HTTP version for response */
-  response = cockpit_web_response_new (io_stream, path);
+  response = cockpit_web_response_new (io_stream, path, headers);
 
   detail = g_quark_try_string (path);
 
@@ -557,9 +596,13 @@ typedef struct {
   GIOStream *io;
   GByteArray *buffer;
   gint delayed_reply;
+  guint retry_after;
+  gboolean admitted;
   CockpitWebServer *web_server;
+  CockpitWebWorker *worker;
   GSource *source;
-  GSource *timeout;
+  CockpitTimer *timeout;
+  GCancellable *handshake;
 } CockpitRequest;
 
 static void
@@ -567,15 +610,20 @@ cockpit_request_free (gpointer data)
 {
   CockpitRequest *request = data;
   if (request->timeout)
-    {
-      g_source_destroy (request->timeout);
-      g_source_unref (request->timeout);
-    }
+    cockpit_timer_remove (request->timeout);
   if (request->source)
     {
       g_source_destroy (request->source);
       g_source_unref (request->source);
     }
+  if (request->handshake)
+    {
+      /* Tells the handshake completion that the request is gone */
+      g_cancellable_cancel (request->handshake);
+      g_object_unref (request->handshake);
+    }
+  if (request->admitted)
+    cockpit_admission_release (COCKPIT_ADMISSION_CONNECTIONS);
 
   /*
    * Request memory is either cleared or used elsewhere, by
@@ -589,7 +637,7 @@ cockpit_request_free (gpointer data)
 static void
 cockpit_request_finish (CockpitRequest *request)
 {
-  g_hash_table_remove (request->web_server->requests, request);
+  g_hash_table_remove (request->worker->requests, request);
 }
 
 static void
@@ -598,6 +646,7 @@ process_delayed_reply (CockpitRequest *request,
                        GHashTable *headers)
 {
   CockpitWebResponse *response;
+  GHashTable *retry = NULL;
   const gchar *host;
   const gchar *body;
   GBytes *bytes;
@@ -606,7 +655,7 @@ process_delayed_reply (CockpitRequest *request,
 
   g_assert (request->delayed_reply > 299);
 
-  response = cockpit_web_response_new (request->io, NULL);
+  response = cockpit_web_response_new (request->io, NULL, headers);
 
   if (request->delayed_reply == 301)
     {
@@ -628,8 +677,17 @@ process_delayed_reply (CockpitRequest *request,
       return;
     }
 
-  cockpit_web_response_error (response, request->delayed_reply, NULL, NULL);
+  if (request->delayed_reply == 503)
+    {
+      retry = cockpit_web_server_new_table ();
+      g_hash_table_insert (retry, g_strdup ("Retry-After"), g_strdup_printf ("%u", request->retry_after));
+    }
+
+  cockpit_web_response_error (response, request->delayed_reply, retry, NULL);
   g_object_unref (response);
+
+  if (retry)
+    g_hash_table_unref (retry);
 }
 
 static void
@@ -662,20 +720,46 @@ process_request (CockpitRequest *request,
     g_critical ("no handler responded to request: %s", path);
 }
 
+static gboolean
+parse_content_length (const WebSocketSlice *value,
+                      guint64 *length)
+{
+  guint64 num = 0;
+  gsize i;
+
+  for (i = 0; i < value->length; i++)
+    {
+      if (!g_ascii_isdigit (value->data[i]) || num > (G_MAXUINT64 - 9) / 10)
+        return FALSE;
+      num = num * 10 + (value->data[i] - '0');
+    }
+
+  *length = num;
+  return TRUE;
+}
+
 static gboolean
 parse_and_process_request (CockpitRequest *request)
 {
   CockpitWebServerRequestType reqtype = 0;
   gboolean again = FALSE;
+  WebSocketHeaders parsed;
   GHashTable *headers = NULL;
-  gchar *method = NULL;
+  WebSocketSlice method;
+  WebSocketSlice resource;
   gchar *path = NULL;
-  const gchar *str;
-  gchar *end = NULL;
+  const WebSocketSlice *str;
   gssize off1;
   gssize off2;
   guint64 length;
 
+  /*
+   * This runs on every read until the whole request has arrived, so
+   * headers are parsed as slices into the buffer. The table and path
+   * that handlers get are only built once the request is complete.
+   */
+  web_socket_headers_init (&parsed);
+
   /* The hard input limit, we just terminate the connection */
   if (request->buffer->len > cockpit_ws_request_maximum * 2)
     {
@@ -683,10 +767,10 @@ parse_and_process_request (CockpitRequest *request)
       goto out;
     }
 
-  off1 = web_socket_util_parse_req_line ((const gchar *)request->buffer->data,
-                                         request->buffer->len,
-                                         &method,
-                                         &path);
+  off1 = web_socket_util_parse_req_line_slices ((const gchar *)request->buffer->data,
+                                                request->buffer->len,
+                                                &method,
+                                                &resource);
   if (off1 == 0)
     {
       again = TRUE;
@@ -699,9 +783,9 @@ parse_and_process_request (CockpitRequest *request)
       goto out;
     }
 
-  off2 = web_socket_util_parse_headers ((const gchar *)request->buffer->data + off1,
-                                        request->buffer->len - off1,
-                                        &headers);
+  off2 = web_socket_util_parse_header_slices ((const gchar *)request->buffer->data + off1,
+                                              request->buffer->len - off1,
+                                              &parsed);
   if (off2 == 0)
     {
       again = TRUE;
@@ -716,12 +800,10 @@ parse_and_process_request (CockpitRequest *request)
 
   /* If we get a Content-Length then we have to read that much data */
   length = 0;
-  str = g_hash_table_lookup (headers, "Content-Length");
+  str = web_socket_headers_lookup (&parsed, "Content-Length");
   if (str != NULL)
     {
-      end = NULL;
-      length = g_ascii_strtoull (str, &end, 10);
-      if (!end || end[0])
+      if (!parse_content_length (str, &length))
         {
           g_message ("received invalid Content-Length");
           request->delayed_reply = 400;
@@ -743,9 +825,9 @@ parse_and_process_request (CockpitRequest *request)
       goto out;
     }
 
-  if (g_str_equal (method, "GET"))
+  if (web_socket_slice_equal (&method, "GET"))
     reqtype = COCKPIT_WEB_SERVER_REQUEST_GET;
-  else if (g_str_equal (method, "POST"))
+  else if (web_socket_slice_equal (&method, "POST"))
     reqtype = COCKPIT_WEB_SERVER_REQUEST_POST;
   else
     {
@@ -761,13 +843,17 @@ parse_and_process_request (CockpitRequest *request)
    *  * keep-alives
    */
 
+  /* Slices point into the buffer, so copy them out before consuming it */
+  headers = web_socket_headers_to_table (&parsed);
+  path = web_socket_slice_dup (&resource);
+
   g_byte_array_remove_range (request->buffer, 0, off1 + off2);
   process_request (request, reqtype, path, headers, length);
 
 out:
+  web_socket_headers_clear (&parsed);
   if (headers)
     g_hash_table_unref (headers);
-  g_free (method);
   g_free (path);
   if (!again)
     cockpit_request_finish (request);
@@ -860,7 +946,92 @@ start_request_input (CockpitRequest *request)
 
   request->source = g_pollable_input_stream_create_source (poll_in, NULL);
   g_source_set_callback (request->source, (GSourceFunc)on_request_input, request, NULL);
-  g_source_attach (request->source, request->web_server->main_context);
+  g_source_attach (request->source, request->worker->context);
+}
+
+/*
+ * A TLS handshake running in the handshake pool. Only the pool thread
+ * touches this until it's handed back to the request's context. The
+ * request itself is only touched back in its own context, and only if
+ * the handshake wasn't cancelled by the request going away.
+ */
+typedef struct {
+  CockpitRequest *request;
+  GTlsConnection *tls;
+  GCancellable *cancellable;
+  GMainContext *context;
+  GError *error;
+} CockpitHandshake;
+
+static void
+cockpit_handshake_free (gpointer data)
+{
+  CockpitHandshake *handshake = data;
+  g_object_unref (handshake->tls);
+  g_object_unref (handshake->cancellable);
+  if (handshake->context)
+    g_main_context_unref (handshake->context);
+  g_clear_error (&handshake->error);
+  g_free (handshake);
+}
+
+static gboolean
+on_handshake_done (gpointer data)
+{
+  CockpitHandshake *handshake = data;
+  CockpitRequest *request = handshake->request;
+
+  if (g_cancellable_is_cancelled (handshake->cancellable))
+    return FALSE;
+
+  g_clear_object (&request->handshake);
+
+  if (handshake->error)
+    {
+      if (!should_suppress_request_error (handshake->error))
+        g_message ("couldn't complete TLS handshake: %s", handshake->error->message);
+      cockpit_request_finish (request);
+    }
+  else
+    {
+      start_request_input (request);
+    }
+
+  return FALSE;
+}
+
+static void
+on_handshake_thread (gpointer data,
+                     gpointer user_data)
+{
+  CockpitHandshake *handshake = data;
+  GSource *source;
+
+  g_tls_connection_handshake (handshake->tls, handshake->cancellable, &handshake->error);
+
+  source = g_idle_source_new ();
+  g_source_set_callback (source, on_handshake_done, handshake, cockpit_handshake_free);
+  g_source_attach (source, handshake->context);
+  g_source_unref (source);
+
+  /* The context now owns the handshake, and frees it if destroyed */
+  g_main_context_unref (handshake->context);
+  handshake->context = NULL;
+}
+
+static void
+start_tls_handshake (CockpitRequest *request)
+{
+  CockpitHandshake *handshake;
+
+  handshake = g_new0 (CockpitHandshake, 1);
+  handshake->request = request;
+  handshake->tls = g_object_ref (request->io);
+  handshake->cancellable = g_cancellable_new ();
+  handshake->context = g_main_context_ref (request->worker->context);
+  request->handshake = g_object_ref (handshake->cancellable);
+
+  g_thread_pool_push (request->web_server->handshake_pool, handshake, NULL);
 }
 
 static gboolean
@@ -941,8 +1112,15 @@ on_socket_input (GSocket *socket,
 
       g_object_unref (request->io);
       request->io = G_IO_STREAM (tls_stream);
+
+      /* Don't stall the loop with the handshake, input starts once it's done */
+      if (request->web_server->handshake_pool)
+        {
+          start_tls_handshake (request);
+          return FALSE;
+        }
     }
-  else if (redirect_tls)
+  else if (redirect_tls && !request->delayed_reply)
     {
       request->delayed_reply = 301;
     }
@@ -962,6 +1140,64 @@ on_request_timeout (gpointer data)
   return FALSE;
 }
 
+static gboolean
+start_request (gpointer data)
+{
+  CockpitRequest *request = data;
+  CockpitWebWorker *worker = request->worker;
+  GSocketConnection *connection = G_SOCKET_CONNECTION (request->io);
+
+  /* One shared wheel per worker, rather than a source per connection */
+  request->timeout = cockpit_timer_wheel_add (cockpit_timer_wheel_for_context (worker->context),
+                                              (guint64)cockpit_ws_request_timeout * 1000,
+                                              on_request_timeout, request);
+
+  /* Owns the request */
+  g_hash_table_add (worker->requests, request);
+
+  if (request->web_server->certificate)
+    {
+      request->source = g_socket_create_source (g_socket_connection_get_socket (connection),
+                                                G_IO_IN, NULL);
+      g_source_set_callback (request->source, (GSourceFunc)on_socket_input, request, NULL);
+      g_source_attach (request->source, worker->context);
+    }
+  else
+    {
+      start_request_input (request);
+    }
+
+  return FALSE;
+}
+
+static gboolean
+admit_connection (GSocketConnection *connection,
+                  guint *retry_after)
+{
+  GSocketAddress *addr;
+  GInetAddress *inet;
+  gboolean ret = TRUE;
+  gchar *str;
+
+  addr = g_socket_connection_get_remote_address (connection, NULL);
+  if (G_IS_INET_SOCKET_ADDRESS (addr))
+    {
+      inet = g_inet_socket_address_get_address (G_INET_SOCKET_ADDRESS (addr));
+      if (!g_inet_address_get_is_loopback (inet))
+        {
+          str = g_inet_address_to_string (inet);
+          ret = cockpit_admission_check_address (str, retry_after);
+          g_free (str);
+        }
+    }
+  g_clear_object (&addr);
+
+  if (ret)
+    ret = cockpit_admission_acquire (COCKPIT_ADMISSION_CONNECTIONS, retry_after);
+
+  return ret;
+}
+
 static gboolean
 on_incoming (GSocketService *service,
              GSocketConnection *connection,
@@ -977,32 +1213,98 @@ on_incoming (GSocketService *service,
   request->io = g_object_ref (connection);
   request->buffer = g_byte_array_new ();
 
-  request->timeout = g_timeout_source_new_seconds (cockpit_ws_request_timeout);
-  g_source_set_callback (request->timeout, on_request_timeout, request, NULL);
-  g_source_attach (request->timeout, self->main_context);
-
   socket = g_socket_connection_get_socket (connection);
   g_socket_set_blocking (socket, FALSE);
 
-  /* Owns the request */
-  g_hash_table_add (self->requests, request);
+  /*
+   * Over the limits the request is still read, but it is answered with
+   * a 503 straight away, rather than left waiting in line.
+   */
+  if (!admit_connection (connection, &request->retry_after))
+    request->delayed_reply = 503;
+  else
+    request->admitted = TRUE;
 
-  if (self->certificate)
+  if (self->workers->len == 0)
     {
-      request->source = g_socket_create_source (g_socket_connection_get_socket (connection),
-                                                G_IO_IN, NULL);
-      g_source_set_callback (request->source, (GSourceFunc)on_socket_input, request, NULL);
-      g_source_attach (request->source, self->main_context);
+      request->worker = &self->main_worker;
+      start_request (request);
     }
   else
     {
-      start_request_input (request);
+      /* Hand off the connection to the next worker thread */
+      request->worker = self->workers->pdata[self->next_worker];
+      self->next_worker = (self->next_worker + 1) % self->workers->len;
+      g_main_context_invoke (request->worker->context, start_request, request);
     }
 
   /* handled */
   return TRUE;
 }
 
+static gpointer
+cockpit_web_worker_thread (gpointer data)
+{
+  CockpitWebWorker *worker = data;
+
+  /* Everything created by handlers attaches to this context */
+  g_main_context_push_thread_default (worker->context);
+  g_main_loop_run (worker->loop);
+
+  /* Requests still in flight belong to this thread */
+  g_hash_table_remove_all (worker->requests);
+
+  g_main_context_pop_thread_default (worker->context);
+  return NULL;
+}
+
+static CockpitWebWorker *
+cockpit_web_worker_new (guint number)
+{
+  CockpitWebWorker *worker;
+  gchar *name;
+
+  worker = g_new0 (CockpitWebWorker, 1);
+  worker->context = g_main_context_new ();
+  worker->loop = g_main_loop_new (worker->context, FALSE);
+  worker->requests = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                            cockpit_request_free, NULL);
+
+  name = g_strdup_printf ("web-worker-%u", number);
+  worker->thread = g_thread_new (name, cockpit_web_worker_thread, worker);
+  g_free (name);
+
+  return worker;
+}
+
+static gboolean
+on_worker_quit (gpointer data)
+{
+  CockpitWebWorker *worker = data;
+  g_main_loop_quit (worker->loop);
+  return FALSE;
+}
+
+static void
+cockpit_web_worker_free (gpointer data)
+{
+  CockpitWebWorker *worker = data;
+  GSource *source;
+
+  /* Quit from within the loop, in case it hasn't started running yet */
+  source = g_idle_source_new ();
+  g_source_set_callback (source, on_worker_quit, worker, NULL);
+  g_source_attach (source, worker->context);
+  g_source_unref (source);
+
+  g_thread_join (worker->thread);
+
+  g_hash_table_destroy (worker->requests);
+  g_main_loop_unref (worker->loop);
+  g_main_context_unref (worker->context);
+  g_free (worker);
+}
+
 /* ---------------------------------------------------------------------------------------------------- */
 
 static gboolean
@@ -1014,6 +1316,7 @@ cockpit_web_server_initable_init (GInitable *initable,
   gboolean ret = FALSE;
   gboolean failed;
   int n, fd;
+  guint i;
 
   server->socket_service = g_socket_service_new ();
 
@@ -1066,6 +1369,16 @@ cockpit_web_server_initable_init (GInitable *initable,
         }
     }
 
+  for (i = 0; i < cockpit_ws_worker_threads; i++)
+    g_ptr_array_add (server->workers, cockpit_web_worker_new (i));
+
+  if (server->certificate && cockpit_ws_handshake_threads > 0)
+    {
+      server->handshake_pool = g_thread_pool_new (on_handshake_thread, NULL,
+                                                  cockpit_ws_handshake_threads,
+                                                  FALSE, NULL);
+    }
+
   g_signal_connect (server->socket_service,
                     "incoming",
                     G_CALLBACK (on_incoming),
@@ -21,8 +21,12 @@
 
 #include "cockpitwebservice.h"
 
+#include <errno.h>
 #include <string.h>
 
+#include <sys/stat.h>
+
+#include <glib/gstdio.h>
 #include <json-glib/json-glib.h>
 #include <gio/gunixinputstream.h>
 #include <gio/gunixoutputstream.h>
@@ -30,6 +34,7 @@
 #include <cockpit/cockpit.h>
 #include "cockpit/cockpitjson.h"
 #include "cockpit/cockpitpipetransport.h"
+#include "cockpit/cockpittimerwheel.h"
 
 #include "cockpitsshtransport.h"
 
@@ -56,102 +61,214 @@ gint cockpit_ws_specific_ssh_port = 0;
 
 guint cockpit_ws_ping_interval = 5;
 
+/* Seconds that a session without channels is kept for reuse */
+guint cockpit_ws_session_timeout = 30;
+
+/* Machines listed by cockpitd, connected to ahead of time */
+const gchar *cockpit_ws_machines_file =
+    PACKAGE_LOCALSTATE_DIR "/lib/cockpit/machines";
+
 /* ----------------------------------------------------------------------------
- * CockpitSession
+ * Web Socket Routing
  */
 
-/* The session timeout when no channels */
-#define TIMEOUT 30
+struct _CockpitWebService {
+  GObject parent;
+
+  WebSocketConnection      *web_socket;
+  GSocketConnection        *connection;
+  CockpitAuth              *auth;
+  CockpitCreds             *authenticated;
+
+  GHashTable *channels;
+  gboolean closing;
+  GBytes *control_prefix;
+  CockpitTimer *ping_timeout;
+  gboolean traced_first;
+};
+
+typedef struct {
+  GObjectClass parent;
+} CockpitWebServiceClass;
+
+G_DEFINE_TYPE (CockpitWebService, cockpit_web_service, G_TYPE_OBJECT);
+
+static void
+report_close_options (CockpitWebService *self,
+                      ...) G_GNUC_NULL_TERMINATED;
+
+static void
+report_close_options (CockpitWebService *self,
+                      ...)
+{
+  JsonObject *object;
+  GBytes *message;
+  const gchar *name;
+  const gchar *value;
+  va_list va;
+
+  object = json_object_new ();
+  json_object_set_string_member (object, "command", "close");
+
+  va_start (va, self);
+  for (;;)
+    {
+      name = va_arg (va, const gchar *);
+      if (!name)
+        break;
+      value = va_arg (va, const gchar *);
+      if (value)
+        json_object_set_string_member (object, name, value);
+    }
+  va_end (va);
+
+  message = cockpit_json_write_bytes (object);
+  json_object_unref (object);
+
+  if (web_socket_connection_get_ready_state (self->web_socket) == WEB_SOCKET_STATE_OPEN)
+    web_socket_connection_send (self->web_socket, WEB_SOCKET_DATA_TEXT, self->control_prefix, message);
+  g_bytes_unref (message);
+}
+
+static void
+report_close (CockpitWebService *self,
+              const gchar *channel,
+              const gchar *reason)
+{
+  report_close_options (self,
+                        "channel", channel,
+                        "reason", reason,
+                        NULL);
+}
+
+/* ----------------------------------------------------------------------------
+ * CockpitSession
+ *
+ * A session is a transport to an agent for a given host and user. The
+ * sessions are shared by all the web sockets of the same login that are
+ * served on the same thread, so several browser tabs use one agent.
+ *
+ * Each web socket picks its own channel numbers, so every channel gets a
+ * CockpitRoute which maps it to a channel number unique within the session.
+ */
 
 typedef struct
 {
   gchar *host;
   gchar *user;
-} CockpitHostUser;
+  gconstpointer owner;
+  GMainContext *context;
+} CockpitSessionKey;
 
 typedef struct
 {
-  CockpitHostUser key;
+  gint refs;
+  CockpitSessionKey key;
   GHashTable *channels;
+  guint last_channel;
   CockpitTransport *transport;
-  gboolean sent_eof;
-  guint timeout;
+  gboolean registered;
+  gboolean closed;
+  CockpitTimer *timeout;
   CockpitCreds *creds;
+  gulong recv_sig;
+  gulong closed_sig;
 } CockpitSession;
 
 typedef struct
 {
-  GHashTable *by_host_user;
-  GHashTable *by_channel;
-  GHashTable *by_transport;
-} CockpitSessions;
+  CockpitSession *session;
+  CockpitWebService *service;
+  gchar *channel;
+  gchar *id;
+} CockpitRoute;
+
+/* All the sessions in the process, owns a reference to each */
+G_LOCK_DEFINE_STATIC (sessions);
+static GHashTable *sessions = NULL;
 
 static guint
-host_user_hash (gconstpointer v)
+session_key_hash (gconstpointer v)
 {
-  const CockpitHostUser *hu = v;
-  return g_str_hash (hu->host) ^ g_str_hash (hu->user);
+  const CockpitSessionKey *key = v;
+  return g_str_hash (key->host) ^ g_str_hash (key->user) ^
+         g_direct_hash (key->owner) ^ g_direct_hash (key->context);
 }
 
 static gboolean
-host_user_equal (gconstpointer v1,
-                 gconstpointer v2)
+session_key_equal (gconstpointer v1,
+                   gconstpointer v2)
 {
-  const CockpitHostUser *hu1 = v1;
-  const CockpitHostUser *hu2 = v2;
-  return g_str_equal (hu1->host, hu2->host) &&
-         g_str_equal (hu1->user, hu2->user);
+  const CockpitSessionKey *key1 = v1;
+  const CockpitSessionKey *key2 = v2;
+  return key1->owner == key2->owner &&
+         key1->context == key2->context &&
+         g_str_equal (key1->host, key2->host) &&
+         g_str_equal (key1->user, key2->user);
+}
+
+static CockpitSession *
+cockpit_session_ref (CockpitSession *session)
+{
+  g_atomic_int_inc (&session->refs);
+  return session;
 }
 
-/* Should only called as a hash table GDestroyNotify */
 static void
-cockpit_session_free (gpointer data)
+cockpit_session_unref (CockpitSession *session)
 {
-  CockpitSession *session = data;
+  if (!g_atomic_int_dec_and_test (&session->refs))
+    return;
 
   g_debug ("%s: freeing session", session->key.host);
 
+  g_assert (!session->registered);
+  g_assert (g_hash_table_size (session->channels) == 0);
+
   if (session->timeout)
-    g_source_remove (session->timeout);
-  g_hash_table_unref (session->channels);
+    cockpit_timer_remove (session->timeout);
+  g_signal_handler_disconnect (session->transport, session->recv_sig);
+  g_signal_handler_disconnect (session->transport, session->closed_sig);
+  if (!session->closed)
+    cockpit_transport_close (session->transport, NULL);
   g_object_unref (session->transport);
+  g_hash_table_unref (session->channels);
+  cockpit_creds_unref (session->creds);
+  g_main_context_unref (session->key.context);
   g_free (session->key.host);
   g_free (session->key.user);
   g_free (session);
 }
 
-static void
-cockpit_sessions_init (CockpitSessions *sessions)
+static CockpitSession *
+cockpit_session_lookup (const gchar *host,
+                        const gchar *user,
+                        gconstpointer owner,
+                        GMainContext *context)
 {
-  sessions->by_channel = g_hash_table_new (g_str_hash, g_str_equal);
-  sessions->by_host_user = g_hash_table_new (host_user_hash, host_user_equal);
+  const CockpitSessionKey key = { (gchar *)host, (gchar *)user, owner, context };
+  CockpitSession *session = NULL;
 
-  /* This owns the session */
-  sessions->by_transport = g_hash_table_new_full (g_direct_hash, g_direct_equal,
-                                                  NULL, cockpit_session_free);
-}
+  G_LOCK (sessions);
+  if (sessions)
+    session = g_hash_table_lookup (sessions, &key);
+  G_UNLOCK (sessions);
 
-inline static CockpitSession *
-cockpit_session_by_channel (CockpitSessions *sessions,
-                            const gchar *channel)
-{
-  return g_hash_table_lookup (sessions->by_channel, channel);
+  return session;
 }
 
-inline static CockpitSession *
-cockpit_session_by_transport (CockpitSessions *sessions,
-                              CockpitTransport *transport)
+static void
+cockpit_session_unregister (CockpitSession *session)
 {
-  return g_hash_table_lookup (sessions->by_transport, transport);
-}
+  if (!session->registered)
+    return;
 
-inline static CockpitSession *
-cockpit_session_by_host_user (CockpitSessions *sessions,
-                              const gchar *host,
-                              const gchar *user)
-{
-  const CockpitHostUser hu = { (gchar *)host, (gchar *)user };
-  return g_hash_table_lookup (sessions->by_host_user, &hu);
+  G_LOCK (sessions);
+  g_hash_table_remove (sessions, &session->key);
+  G_UNLOCK (sessions);
+
+  session->registered = FALSE;
+  cockpit_session_unref (session);
 }
 
 static gboolean
@@ -159,226 +276,139 @@ on_timeout_cleanup_session (gpointer user_data)
 {
   CockpitSession *session = user_data;
 
-  session->timeout = 0;
+  session->timeout = NULL;
   if (g_hash_table_size (session->channels) == 0)
     {
-      /*
-       * This should cause the transport to immediately be closed
-       * and on_session_closed() will react and remove it from
-       * the main session lookup tables.
-       */
+      /* No longer handed out to web sockets from here on */
       g_debug ("%s: session timed out without channels", session->key.host);
+      cockpit_session_ref (session);
+      session->closed = TRUE;
       cockpit_transport_close (session->transport, "timeout");
+      cockpit_session_unregister (session);
+      cockpit_session_unref (session);
     }
 
   return FALSE;
 }
 
 static void
-cockpit_session_remove_channel (CockpitSessions *sessions,
-                                CockpitSession *session,
-                                const gchar *channel)
+cockpit_session_linger (CockpitSession *session)
 {
-  g_hash_table_remove (sessions->by_channel, channel);
-  g_hash_table_remove (session->channels, channel);
-
-  if (g_hash_table_size (session->channels) == 0)
-    {
-      /*
-       * Close sessions that are no longer in use after N seconds
-       * of them being that way.
-       */
-      g_debug ("%s: removed last channel %s for session", session->key.host, channel);
-      session->timeout = g_timeout_add_seconds (TIMEOUT, on_timeout_cleanup_session, session);
-    }
-  else
-    {
-      g_debug ("%s: removed channel %s for session", session->key.host, channel);
-    }
+  /*
+   * Close sessions that are no longer in use after N seconds
+   * of them being that way. Until then another web socket,
+   * or a reload of this one, can pick the session back up.
+   */
+  session->timeout = cockpit_timer_wheel_add (cockpit_timer_wheel_for_context (session->key.context),
+                                              (guint64)cockpit_ws_session_timeout * 1000,
+                                              on_timeout_cleanup_session, session);
 }
 
-static void
-cockpit_session_add_channel (CockpitSessions *sessions,
-                             CockpitSession *session,
-                             const gchar *channel)
+static CockpitRoute *
+cockpit_route_new (CockpitSession *session,
+                   CockpitWebService *service,
+                   const gchar *channel)
 {
-  gchar *chan;
+  CockpitRoute *route;
+
+  route = g_new0 (CockpitRoute, 1);
+  route->session = cockpit_session_ref (session);
+  route->service = service;
+  route->channel = g_strdup (channel);
+  route->id = g_strdup_printf ("%u", ++session->last_channel);
 
-  chan = g_strdup (channel);
-  g_hash_table_insert (sessions->by_channel, chan, session);
-  g_hash_table_add (session->channels, chan);
+  g_hash_table_insert (session->channels, route->id, route);
+  g_hash_table_insert (service->channels, route->channel, route);
 
-  g_debug ("%s: added channel %s to session", session->key.host, channel);
+  g_debug ("%s: added channel %s as %s to session", session->key.host, channel, route->id);
 
   if (session->timeout)
     {
-      g_source_remove (session->timeout);
-      session->timeout = 0;
+      cockpit_timer_remove (session->timeout);
+      session->timeout = NULL;
     }
-}
-
-static CockpitSession *
-cockpit_session_track (CockpitSessions *sessions,
-                       const gchar *host,
-                       CockpitCreds *creds,
-                       CockpitTransport *transport)
-{
-  CockpitSession *session;
-
-  g_debug ("%s: new session", host);
-
-  session = g_new0 (CockpitSession, 1);
-  session->channels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-  session->transport = g_object_ref (transport);
-  session->key.host = g_strdup (host);
-  session->key.user = g_strdup (cockpit_creds_get_user (creds));
-  session->creds = cockpit_creds_ref (creds);
 
-  g_hash_table_insert (sessions->by_host_user, &session->key, session);
-
-  /* This owns the session */
-  g_hash_table_insert (sessions->by_transport, transport, session);
-
-  return session;
+  return route;
 }
 
 static void
-cockpit_session_destroy (CockpitSessions *sessions,
-                         CockpitSession *session)
+cockpit_route_destroy (CockpitRoute *route)
 {
-  GHashTableIter iter;
-  const gchar *chan;
+  CockpitSession *session = route->session;
 
-  g_debug ("%s: destroy session", session->key.host);
+  if (route->service)
+    g_hash_table_remove (route->service->channels, route->channel);
+  g_hash_table_remove (session->channels, route->id);
 
-  g_hash_table_iter_init (&iter, session->channels);
-  while (g_hash_table_iter_next (&iter, (gpointer *)&chan, NULL))
-    g_hash_table_remove (sessions->by_channel, chan);
-  g_hash_table_remove_all (session->channels);
+  if (g_hash_table_size (session->channels) == 0 && !session->closed && !session->timeout)
+    {
+      g_debug ("%s: removed last channel %s for session", session->key.host, route->id);
+      cockpit_session_linger (session);
+    }
+  else
+    {
+      g_debug ("%s: removed channel %s for session", session->key.host, route->id);
+    }
 
-  g_hash_table_remove (sessions->by_host_user, &session->key);
+  g_free (route->channel);
+  g_free (route->id);
+  g_free (route);
 
-  /* This owns the session */
-  g_hash_table_remove (sessions->by_transport, session->transport);
+  cockpit_session_unref (session);
 }
 
-static void
-cockpit_sessions_cleanup (CockpitSessions *sessions)
+static gboolean
+cockpit_session_had_channel (CockpitSession *session,
+                             const gchar *id)
 {
-  g_hash_table_destroy (sessions->by_channel);
-  g_hash_table_destroy (sessions->by_host_user);
-  g_hash_table_destroy (sessions->by_transport);
-}
-
-/* ----------------------------------------------------------------------------
- * Web Socket Routing
- */
-
-struct _CockpitWebService {
-  GObject parent;
-
-  WebSocketConnection      *web_socket;
-  GSocketConnection        *connection;
-  CockpitAuth              *auth;
-  CockpitCreds             *authenticated;
-
-  CockpitSessions sessions;
-  gboolean closing;
-  GBytes *control_prefix;
-  guint ping_timeout;
-};
-
-typedef struct {
-  GObjectClass parent;
-} CockpitWebServiceClass;
+  guint64 value;
+  gchar *end;
 
-G_DEFINE_TYPE (CockpitWebService, cockpit_web_service, G_TYPE_OBJECT);
+  /* Channel numbers are never reused, so anything lower was ours */
+  value = g_ascii_strtoull (id, &end, 10);
+  return id[0] != '\0' && end[0] == '\0' && value > 0 && value <= session->last_channel;
+}
 
 static void
-cockpit_web_service_finalize (GObject *object)
+send_command_to_session (CockpitSession *session,
+                         const gchar *id,
+                         JsonObject *options)
 {
-  CockpitWebService *self = COCKPIT_WEB_SERVICE (object);
+  GBytes *message;
 
-  cockpit_sessions_cleanup (&self->sessions);
-  g_object_unref (self->web_socket);
-  g_bytes_unref (self->control_prefix);
-  g_object_unref (self->auth);
-  if (self->authenticated)
-    cockpit_creds_unref (self->authenticated);
-  if (self->ping_timeout)
-    g_source_remove (self->ping_timeout);
+  if (session->closed)
+    return;
 
-  G_OBJECT_CLASS (cockpit_web_service_parent_class)->finalize (object);
+  json_object_set_string_member (options, "channel", id);
+  message = cockpit_json_write_bytes (options);
+  cockpit_transport_send (session->transport, NULL, message);
+  g_bytes_unref (message);
 }
 
 static void
-report_close_options (CockpitWebService *self,
-                      ...) G_GNUC_NULL_TERMINATED;
-
-static void
-report_close_options (CockpitWebService *self,
-                      ...)
+send_command_to_web_socket (CockpitWebService *self,
+                            const gchar *channel,
+                            JsonObject *options)
 {
-  JsonObject *object;
   GBytes *message;
-  const gchar *name;
-  const gchar *value;
-  va_list va;
 
-  object = json_object_new ();
-  json_object_set_string_member (object, "command", "close");
-
-  va_start (va, self);
-  for (;;)
-    {
-      name = va_arg (va, const gchar *);
-      if (!name)
-        break;
-      value = va_arg (va, const gchar *);
-      if (value)
-        json_object_set_string_member (object, name, value);
-    }
-  va_end (va);
-
-  message = cockpit_json_write_bytes (object);
-  json_object_unref (object);
+  if (web_socket_connection_get_ready_state (self->web_socket) != WEB_SOCKET_STATE_OPEN)
+    return;
 
-  if (web_socket_connection_get_ready_state (self->web_socket) == WEB_SOCKET_STATE_OPEN)
-    web_socket_connection_send (self->web_socket, WEB_SOCKET_DATA_TEXT, self->control_prefix, message);
+  json_object_set_string_member (options, "channel", channel);
+  message = cockpit_json_write_bytes (options);
+  web_socket_connection_send (self->web_socket, WEB_SOCKET_DATA_TEXT, self->control_prefix, message);
   g_bytes_unref (message);
 }
 
 static void
-report_close (CockpitWebService *self,
-              const gchar *channel,
-              const gchar *reason)
+outbound_protocol_error (CockpitSession *session)
 {
-  report_close_options (self,
-                        "channel", channel,
-                        "reason", reason,
-                        NULL);
-}
-
-static void
-outbound_protocol_error (CockpitWebService *self,
-                         CockpitTransport *session)
-{
-  cockpit_transport_close (session, "protocol-error");
+  cockpit_transport_close (session->transport, "protocol-error");
 }
 
 static gboolean
-process_close (CockpitWebService *self,
-               CockpitSession *session,
-               const gchar *channel,
-               JsonObject *options)
-{
-  cockpit_session_remove_channel (&self->sessions, session, channel);
-  return TRUE;
-}
-
-static gboolean
-process_authorize (CockpitWebService *self,
-                   CockpitSession *session,
+process_authorize (CockpitSession *session,
                    JsonObject *options)
 {
   JsonObject *object = NULL;
@@ -438,7 +468,7 @@ process_authorize (CockpitWebService *self,
   json_object_set_string_member (object, "response", response ? response : "");
   bytes = cockpit_json_write_bytes (object);
 
-  if (!session->sent_eof)
+  if (!session->closed)
     cockpit_transport_send (session->transport, 0, bytes);
   ret = TRUE;
 
@@ -454,31 +484,22 @@ out:
 }
 
 static void
-dispatch_outbound_command (CockpitWebService *self,
-                           CockpitTransport *source,
+dispatch_outbound_command (CockpitSession *session,
                            GBytes *payload)
 {
-  CockpitSession *session = NULL;
+  CockpitRoute *route;
   const gchar *command;
   const gchar *channel;
-  JsonObject *options;
+  JsonObject *options = NULL;
   gboolean valid = FALSE;
-  gboolean forward = TRUE;
 
   if (cockpit_transport_parse_command (payload, &command, &channel, &options))
     {
       if (!channel)
         {
-          forward = FALSE;
-          session = cockpit_session_by_transport (&self->sessions, source);
-          if (!session)
-            {
-              g_critical ("received control command for transport that isn't present");
-              valid = FALSE;
-            }
-          else if (g_strcmp0 (command, "authorize") == 0)
+          if (g_strcmp0 (command, "authorize") == 0)
             {
-              valid = process_authorize (self, session, options);
+              valid = process_authorize (session, options);
             }
           else if (g_strcmp0 (command, "ping") == 0)
             {
@@ -497,40 +518,32 @@ dispatch_outbound_command (CockpitWebService *self,
            * must have a channel, and it must match one of the channels opened
            * to that particular session.
            */
-          session = cockpit_session_by_channel (&self->sessions, channel);
-          if (!session)
+          route = g_hash_table_lookup (session->channels, channel);
+          if (!route)
             {
-              g_warning ("Channel does not exist: %s", channel);
-              valid = FALSE;
-            }
-          else if (session->transport != source)
-            {
-              g_warning ("Received a command with wrong channel from session");
-              valid = FALSE;
-            }
-          else if (g_strcmp0 (command, "close") == 0)
-            {
-              valid = process_close (self, session, channel, options);
+              /* A channel whose web socket went away, and was closed */
+              valid = cockpit_session_had_channel (session, channel);
+              if (!valid)
+                g_warning ("Channel does not exist: %s", channel);
             }
           else
             {
-              g_debug ("forwarding a '%s' control command", command);
-              valid = TRUE; /* forward other messages */
+              valid = TRUE;
+              if (g_strcmp0 (command, "close") != 0)
+                g_debug ("forwarding a '%s' control command", command);
+              if (route->service)
+                send_command_to_web_socket (route->service, route->channel, options);
+              if (g_strcmp0 (command, "close") == 0)
+                cockpit_route_destroy (route);
             }
         }
     }
 
-  if (valid && !session->sent_eof)
-    {
-      if (forward && web_socket_connection_get_ready_state (self->web_socket) == WEB_SOCKET_STATE_OPEN)
-        web_socket_connection_send (self->web_socket, WEB_SOCKET_DATA_TEXT, self->control_prefix, payload);
-    }
-  else
-    {
-      outbound_protocol_error (self, source);
-    }
+  if (!valid)
+    outbound_protocol_error (session);
 
-  json_object_unref (options);
+  if (options)
+    json_object_unref (options);
 }
 
 static gboolean
@@ -539,37 +552,42 @@ on_session_recv (CockpitTransport *transport,
                  GBytes *payload,
                  gpointer user_data)
 {
-  CockpitWebService *self = user_data;
-  CockpitSession *session;
+  CockpitSession *session = user_data;
+  CockpitWebService *service;
+  CockpitRoute *route;
   gchar *string;
   GBytes *prefix;
 
-  if (channel == 0)
+  if (channel == NULL)
     {
-      dispatch_outbound_command (self, transport, payload);
+      dispatch_outbound_command (session, payload);
       return TRUE;
     }
 
-  session = cockpit_session_by_channel (&self->sessions, channel);
-  if (session == NULL)
+  route = g_hash_table_lookup (session->channels, channel);
+  if (route == NULL)
     {
-      g_warning ("Rceived message with unknown channel from session");
-      outbound_protocol_error (self, transport);
-      return FALSE;
-    }
-  else if (session->transport != transport)
-    {
-      g_warning ("Received message with wrong channel from session");
-      outbound_protocol_error (self, transport);
+      if (cockpit_session_had_channel (session, channel))
+        return TRUE;
+
+      g_warning ("Received message with unknown channel from session");
+      outbound_protocol_error (session);
       return FALSE;
     }
 
-  if (web_socket_connection_get_ready_state (self->web_socket) == WEB_SOCKET_STATE_OPEN)
+  service = route->service;
+  if (service && web_socket_connection_get_ready_state (service->web_socket) == WEB_SOCKET_STATE_OPEN)
     {
-      string = g_strdup_printf ("%s\n", channel);
+      string = g_strdup_printf ("%s\n", route->channel);
       prefix = g_bytes_new_take (string, strlen (string));
-      web_socket_connection_send (self->web_socket, WEB_SOCKET_DATA_TEXT, prefix, payload);
+      web_socket_connection_send (service->web_socket, WEB_SOCKET_DATA_TEXT, prefix, payload);
       g_bytes_unref (prefix);
+
+      if (!service->traced_first)
+        {
+          service->traced_first = TRUE;
+          cockpit_auth_trace_first_message (service->auth, service->authenticated);
+        }
       return TRUE;
     }
 
@@ -581,38 +599,128 @@ on_session_closed (CockpitTransport *transport,
                    const gchar *problem,
                    gpointer user_data)
 {
-  CockpitWebService *self = user_data;
-  const gchar *channel = NULL;
-  CockpitSession *session;
+  CockpitSession *session = user_data;
   CockpitSshTransport *ssh;
-  GHashTableIter iter;
+  CockpitRoute *route;
   const gchar *key = NULL;
   const gchar *fp = NULL;
+  GList *routes, *l;
 
-  session = cockpit_session_by_transport (&self->sessions, transport);
-  if (session != NULL)
+  g_debug ("%s: session closed", session->key.host);
+
+  if (g_strcmp0 (problem, "unknown-hostkey") == 0 &&
+      COCKPIT_IS_SSH_TRANSPORT (transport))
     {
-      if (g_strcmp0 (problem, "unknown-hostkey") == 0 &&
-          COCKPIT_IS_SSH_TRANSPORT (transport))
-        {
-          ssh = COCKPIT_SSH_TRANSPORT (transport);
-          key = cockpit_ssh_transport_get_host_key (ssh);
-          fp = cockpit_ssh_transport_get_host_fingerprint (ssh);
-        }
+      ssh = COCKPIT_SSH_TRANSPORT (transport);
+      key = cockpit_ssh_transport_get_host_key (ssh);
+      fp = cockpit_ssh_transport_get_host_fingerprint (ssh);
+    }
+
+  cockpit_session_ref (session);
+  session->closed = TRUE;
+  cockpit_session_unregister (session);
 
-      g_hash_table_iter_init (&iter, session->channels);
-      while (g_hash_table_iter_next (&iter, (gpointer *)&channel, NULL))
+  routes = g_hash_table_get_values (session->channels);
+  for (l = routes; l != NULL; l = g_list_next (l))
+    {
+      route = l->data;
+      if (route->service)
         {
-          report_close_options (self,
-                                "channel", channel,
+          report_close_options (route->service,
+                                "channel", route->channel,
                                 "reason", problem,
                                 "host-key", key,
                                 "host-fingerprint", fp,
                                 NULL);
         }
+      cockpit_route_destroy (route);
+    }
+  g_list_free (routes);
+
+  cockpit_session_unref (session);
+}
 
-      cockpit_session_destroy (&self->sessions, session);
+static CockpitSession *
+cockpit_session_new (const gchar *host,
+                     CockpitCreds *creds,
+                     gconstpointer owner,
+                     GMainContext *context,
+                     CockpitTransport *transport)
+{
+  CockpitSession *session;
+
+  g_debug ("%s: new session", host);
+
+  session = g_new0 (CockpitSession, 1);
+  session->refs = 1;
+  session->channels = g_hash_table_new (g_str_hash, g_str_equal);
+  session->transport = g_object_ref (transport);
+  session->key.host = g_strdup (host);
+  session->key.user = g_strdup (cockpit_creds_get_user (creds));
+  session->key.owner = owner;
+  session->key.context = g_main_context_ref (context);
+  session->creds = cockpit_creds_ref (creds);
+
+  session->recv_sig = g_signal_connect (transport, "recv", G_CALLBACK (on_session_recv), session);
+  session->closed_sig = g_signal_connect (transport, "closed", G_CALLBACK (on_session_closed), session);
+
+  /* The table owns the session until the transport closes */
+  G_LOCK (sessions);
+  if (!sessions)
+    sessions = g_hash_table_new (session_key_hash, session_key_equal);
+  g_hash_table_insert (sessions, &session->key, session);
+  G_UNLOCK (sessions);
+  session->registered = TRUE;
+
+  return session;
+}
+
+static CockpitSession *
+lookup_or_open_session (CockpitWebService *self,
+                        const gchar *host,
+                        CockpitCreds *creds,
+                        gconstpointer owner,
+                        const gchar *host_key)
+{
+  CockpitSession *session;
+  CockpitTransport *transport;
+  GMainContext *context;
+  CockpitPipe *pipe;
+
+  /* Transports are only used from the thread that created them */
+  context = g_main_context_get_thread_default ();
+  if (!context)
+    context = g_main_context_default ();
+
+  session = cockpit_session_lookup (host, cockpit_creds_get_user (creds), owner, context);
+  if (session)
+    {
+      g_debug ("%s: sharing session", host);
+      return session;
     }
+
+  if (g_strcmp0 (host, "localhost") == 0)
+    {
+      /* Any failures happen asyncronously */
+      pipe = cockpit_auth_start_session (self->auth, self->authenticated);
+      transport = cockpit_pipe_transport_new (pipe);
+      g_object_unref (pipe);
+    }
+  else
+    {
+      transport = g_object_new (COCKPIT_TYPE_SSH_TRANSPORT,
+                                "host", host,
+                                "port", cockpit_ws_specific_ssh_port,
+                                "command", cockpit_ws_agent_program,
+                                "creds", creds,
+                                "known-hosts", cockpit_ws_known_hosts,
+                                "host-key", host_key,
+                                NULL);
+    }
+
+  session = cockpit_session_new (host, creds, owner, context, transport);
+  g_object_unref (transport);
+  return session;
 }
 
 static gboolean
@@ -621,14 +729,12 @@ process_open (CockpitWebService *self,
               JsonObject *options)
 {
   CockpitSession *session;
-  CockpitTransport *transport;
   CockpitCreds *creds;
-  CockpitPipe *pipe;
+  gconstpointer owner;
   const gchar *specific_user;
   const gchar *password;
   const gchar *host;
   const gchar *host_key;
-  const gchar *rhost;
 
   if (self->closing)
     {
@@ -636,7 +742,13 @@ process_open (CockpitWebService *self,
       return TRUE;
     }
 
-  if (cockpit_session_by_channel (&self->sessions, channel))
+  if (!channel)
+    {
+      g_warning ("Caller tried to open channel without an id");
+      return FALSE;
+    }
+
+  if (g_hash_table_lookup (self->channels, channel))
     {
       g_warning ("Cannot open a channel with the same number as another channel");
       return FALSE;
@@ -653,60 +765,229 @@ process_open (CockpitWebService *self,
                                  COCKPIT_CRED_PASSWORD, password,
                                  COCKPIT_CRED_RHOST, cockpit_creds_get_rhost (self->authenticated),
                                  NULL);
+
+      /* Sessions with other credentials are not shared with other web sockets */
+      owner = self;
     }
   else
     {
       creds = cockpit_creds_ref (self->authenticated);
+
+      /* Shared with every web socket of the same login */
+      owner = self->authenticated;
     }
 
   if (!cockpit_json_get_string (options, "host-key", NULL, &host_key))
     host_key = NULL;
 
-  session = cockpit_session_by_host_user (&self->sessions, host,
-                                          cockpit_creds_get_user (creds));
-  if (!session)
+  /* Used during testing */
+  if (g_strcmp0 (host, "localhost") == 0)
+    {
+      if (cockpit_ws_specific_ssh_port != 0)
+        host = "127.0.0.1";
+    }
+
+  session = lookup_or_open_session (self, host, creds, owner, host_key);
+
+  cockpit_creds_unref (creds);
+  cockpit_route_new (session, self, channel);
+  return TRUE;
+}
+
+/*
+ * Addresses from the machines file, reparsed only when it changes.
+ * Web sockets are opened on any worker thread, so this is locked.
+ */
+G_LOCK_DEFINE_STATIC (machines);
+static struct {
+  gchar *path;
+  time_t mtime;
+  off_t size;
+  gchar **addresses;
+} machines_cache;
+
+static void
+machines_cache_clear (void)
+{
+  g_free (machines_cache.path);
+  g_strfreev (machines_cache.addresses);
+  memset (&machines_cache, 0, sizeof (machines_cache));
+}
+
+static gchar **
+load_machine_addresses (const gchar *path)
+{
+  GError *error = NULL;
+  GPtrArray *addresses;
+  GKeyFile *file;
+  gchar **groups;
+  gchar *address;
+  gint i;
+
+  file = g_key_file_new ();
+  if (!g_key_file_load_from_file (file, path, G_KEY_FILE_NONE, &error))
+    {
+      g_message ("couldn't read machines: %s", error->message);
+      g_error_free (error);
+      g_key_file_free (file);
+      return NULL;
+    }
+
+  addresses = g_ptr_array_new ();
+  groups = g_key_file_get_groups (file, NULL);
+  for (i = 0; groups[i] != NULL; i++)
+    {
+      address = g_key_file_get_string (file, groups[i], "address", NULL);
+      if (address && address[0] && !g_str_equal (address, "localhost"))
+        g_ptr_array_add (addresses, address);
+      else
+        g_free (address);
+    }
+  g_ptr_array_add (addresses, NULL);
+
+  g_strfreev (groups);
+  g_key_file_free (file);
+  return (gchar **)g_ptr_array_free (addresses, FALSE);
+}
+
+/* Returns a copy that the caller frees with g_strfreev() */
+static gchar **
+lookup_machine_addresses (void)
+{
+  gchar **result = NULL;
+  struct stat sb;
+
+  G_LOCK (machines);
+
+  if (g_stat (cockpit_ws_machines_file, &sb) < 0)
     {
-      /* Used during testing */
-      if (g_strcmp0 (host, "localhost") == 0)
+      if (errno != ENOENT)
+        g_message ("couldn't read machines: %s: %s", cockpit_ws_machines_file, g_strerror (errno));
+      machines_cache_clear ();
+    }
+  else
+    {
+      if (!machines_cache.path || !g_str_equal (machines_cache.path, cockpit_ws_machines_file) ||
+          machines_cache.mtime != sb.st_mtime || machines_cache.size != sb.st_size)
         {
-          if (cockpit_ws_specific_ssh_port != 0)
-            host = "127.0.0.1";
+          machines_cache_clear ();
+          machines_cache.addresses = load_machine_addresses (cockpit_ws_machines_file);
+          if (machines_cache.addresses)
+            {
+              machines_cache.path = g_strdup (cockpit_ws_machines_file);
+              machines_cache.mtime = sb.st_mtime;
+              machines_cache.size = sb.st_size;
+            }
         }
 
-      rhost = cockpit_creds_get_rhost (creds);
-      if (rhost == NULL)
-        rhost = "<unknown>";
+      result = g_strdupv (machines_cache.addresses);
+    }
+
+  G_UNLOCK (machines);
+
+  return result;
+}
+
+static void
+prewarm_sessions (CockpitWebService *self)
+{
+  CockpitSession *session;
+  gchar **addresses;
+  gint i;
 
-      if (g_strcmp0 (host, "localhost") == 0)
+  if (!cockpit_ws_machines_file)
+    return;
+
+  /*
+   * Connect to the machines that cockpitd knows about, so that by the
+   * time the dashboard opens channels to them the ssh connections are
+   * authenticated. Sessions that aren't used time out as usual.
+   */
+  addresses = lookup_machine_addresses ();
+  for (i = 0; addresses && addresses[i] != NULL; i++)
+    {
+      session = lookup_or_open_session (self, addresses[i], self->authenticated,
+                                        self->authenticated, NULL);
+      if (g_hash_table_size (session->channels) == 0 && !session->timeout)
         {
-          /* Any failures happen asyncronously */
-          pipe = cockpit_auth_start_session (self->auth, self->authenticated);
-          transport = cockpit_pipe_transport_new (pipe);
-          g_object_unref (pipe);
+          g_debug ("%s: prewarming session", addresses[i]);
+          cockpit_session_linger (session);
+        }
+    }
+
+  g_strfreev (addresses);
+}
+
+static void
+cockpit_web_service_detach (CockpitWebService *self)
+{
+  CockpitSession *session;
+  CockpitRoute *route;
+  GHashTableIter iter;
+  JsonObject *object;
+  GList *owned = NULL;
+  GList *routes, *l;
+
+  /*
+   * Close this web socket's channels on shared sessions. The agent's
+   * reply is ignored, the session knows the channel numbers it used.
+   * Sessions that only this web socket could use are closed outright.
+   */
+  routes = g_hash_table_get_values (self->channels);
+  for (l = routes; l != NULL; l = g_list_next (l))
+    {
+      route = l->data;
+      session = route->session;
+
+      if (session->key.owner == self)
+        {
+          if (!g_list_find (owned, session))
+            owned = g_list_prepend (owned, cockpit_session_ref (session));
         }
       else
         {
-          transport = g_object_new (COCKPIT_TYPE_SSH_TRANSPORT,
-                                    "host", host,
-                                    "port", cockpit_ws_specific_ssh_port,
-                                    "command", cockpit_ws_agent_program,
-                                    "creds", creds,
-                                    "known-hosts", cockpit_ws_known_hosts,
-                                    "host-key", host_key,
-                                    NULL);
+          object = json_object_new ();
+          json_object_set_string_member (object, "command", "close");
+          json_object_set_string_member (object, "reason", "disconnected");
+          send_command_to_session (session, route->id, object);
+          json_object_unref (object);
         }
 
-      g_signal_connect (transport, "recv", G_CALLBACK (on_session_recv), self);
-      g_signal_connect (transport, "closed", G_CALLBACK (on_session_closed), self);
-      session = cockpit_session_track (&self->sessions, host, creds, transport);
-      g_object_unref (transport);
+      cockpit_route_destroy (route);
     }
+  g_list_free (routes);
 
-  cockpit_creds_unref (creds);
-  cockpit_session_add_channel (&self->sessions, session, channel);
-  return TRUE;
+  for (l = owned; l != NULL; l = g_list_next (l))
+    {
+      session = l->data;
+      cockpit_session_unregister (session);
+      if (!session->closed)
+        {
+          session->closed = TRUE;
+          cockpit_transport_close (session->transport, NULL);
+        }
+      cockpit_session_unref (session);
+    }
+  g_list_free (owned);
 }
 
+static void
+cockpit_web_service_finalize (GObject *object)
+{
+  CockpitWebService *self = COCKPIT_WEB_SERVICE (object);
+
+  cockpit_web_service_detach (self);
+  g_hash_table_destroy (self->channels);
+  g_object_unref (self->web_socket);
+  g_bytes_unref (self->control_prefix);
+  g_object_unref (self->auth);
+  if (self->authenticated)
+    cockpit_creds_unref (self->authenticated);
+  if (self->ping_timeout)
+    cockpit_timer_remove (self->ping_timeout);
+
+  G_OBJECT_CLASS (cockpit_web_service_parent_class)->finalize (object);
+}
 
 static void
 inbound_protocol_error (CockpitWebService *self)
@@ -724,10 +1005,12 @@ dispatch_inbound_command (CockpitWebService *self,
 {
   const gchar *command;
   const gchar *channel;
-  JsonObject *options;
+  JsonObject *options = NULL;
   gboolean valid = FALSE;
   gboolean forward = TRUE;
   CockpitSession *session;
+  CockpitRoute *route;
+  GHashTable *seen;
   GHashTableIter iter;
 
   if (cockpit_transport_parse_command (payload, &command, &channel, &options))
@@ -753,27 +1036,31 @@ dispatch_inbound_command (CockpitWebService *self,
   else if (forward && channel == 0)
     {
       /* Control messages without a channel get sent to all sessions */
-      g_hash_table_iter_init (&iter, self->sessions.by_transport);
-      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&session))
+      seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+      g_hash_table_iter_init (&iter, self->channels);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&route))
         {
-          if (!session->sent_eof)
-            cockpit_transport_send (session->transport, 0, payload);
+          session = route->session;
+          if (!session->closed && !g_hash_table_lookup (seen, session))
+            {
+              g_hash_table_add (seen, session);
+              cockpit_transport_send (session->transport, NULL, payload);
+            }
         }
+      g_hash_table_destroy (seen);
     }
   else if (forward)
     {
       /* Control messages with a channel get forward to that session */
-      session = cockpit_session_by_channel (&self->sessions, channel);
-      if (session)
-        {
-          if (!session->sent_eof)
-            cockpit_transport_send (session->transport, 0, payload);
-        }
+      route = g_hash_table_lookup (self->channels, channel);
+      if (route)
+        send_command_to_session (route->session, route->id, options);
       else
         g_debug ("Dropping control message with unknown channel: %s", channel);
     }
 
-  json_object_unref (options);
+  if (options)
+    json_object_unref (options);
 }
 
 static void
@@ -782,7 +1069,7 @@ on_web_socket_message (WebSocketConnection *web_socket,
                        GBytes *message,
                        CockpitWebService *self)
 {
-  CockpitSession *session;
+  CockpitRoute *route;
   gchar *channel;
   GBytes *payload;
 
@@ -799,11 +1086,11 @@ on_web_socket_message (WebSocketConnection *web_socket,
   /* An actual payload message */
   else if (!self->closing)
     {
-      session = cockpit_session_by_channel (&self->sessions, channel);
-      if (session)
+      route = g_hash_table_lookup (self->channels, channel);
+      if (route)
         {
-          if (!session->sent_eof)
-            cockpit_transport_send (session->transport, channel, payload);
+          if (!route->session->closed)
+            cockpit_transport_send (route->session->transport, route->id, payload);
         }
       else
         {
@@ -839,6 +1126,7 @@ on_web_socket_open (WebSocketConnection *web_socket,
               cockpit_creds_get_user (self->authenticated));
       g_signal_connect (web_socket, "message",
                         G_CALLBACK (on_web_socket_message), self);
+      prewarm_sessions (self);
     }
 }
 
@@ -854,30 +1142,16 @@ static gboolean
 on_web_socket_closing (WebSocketConnection *web_socket,
                        CockpitWebService *self)
 {
-  CockpitSession *session;
-  GHashTableIter iter;
-  gint sent = 0;
-
   g_debug ("web socket closing");
 
+  /* Sessions stay open for other web sockets, or until they time out */
   if (!self->closing)
     {
       self->closing = TRUE;
-      g_hash_table_iter_init (&iter, self->sessions.by_transport);
-      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&session))
-        {
-          session->sent_eof = TRUE;
-          cockpit_transport_close (session->transport, NULL);
-          sent++;
-        }
+      cockpit_web_service_detach (self);
     }
 
-  /*
-   * If no sessions, we can close immediately. If we closed some sessions
-   * they should have their 'closed' signals fired, in which case we'll
-   * close the web socket from there
-   */
-  return sent == 0;
+  return TRUE;
 }
 
 static void
@@ -920,7 +1194,7 @@ static void
 cockpit_web_service_init (CockpitWebService *self)
 {
   self->control_prefix = g_bytes_new_static ("\n", 1);
-  cockpit_sessions_init (&self->sessions);
+  self->channels = g_hash_table_new (g_str_hash, g_str_equal);
 }
 
 static void
@@ -954,6 +1228,7 @@ cockpit_web_service_socket (GIOStream *io_stream,
 {
   const gchar *protocols[] = { "cockpit1", NULL };
   CockpitWebService *self;
+  GMainContext *context;
   const gchar *host = NULL;
   gboolean secure;
   gchar *origin;
@@ -975,6 +1250,19 @@ cockpit_web_service_socket (GIOStream *io_stream,
   if (creds)
     self->authenticated = cockpit_creds_ref (creds);
 
+  /*
+   * Start the local session while the web socket handshake completes,
+   * unless another web socket of this login already has one to share.
+   */
+  if (creds && cockpit_ws_session_pool > 0)
+    {
+      context = g_main_context_get_thread_default ();
+      if (!context)
+        context = g_main_context_default ();
+      if (!cockpit_session_lookup ("localhost", cockpit_creds_get_user (creds), creds, context))
+        cockpit_auth_prepare_session (auth, creds);
+    }
+
   if (headers)
     host = g_hash_table_lookup (headers, "Host");
   if (!host)
@@ -1001,7 +1289,31 @@ cockpit_web_service_socket (GIOStream *io_stream,
   g_signal_connect (self->web_socket, "close", G_CALLBACK (on_web_socket_close), self);
   g_signal_connect (self->web_socket, "error", G_CALLBACK (on_web_socket_error), self);
 
-  self->ping_timeout = g_timeout_add_seconds (cockpit_ws_ping_interval, on_ping_time, self);
+  /* On the wheel of the context of the thread serving this connection */
+  self->ping_timeout = cockpit_timer_wheel_add (cockpit_timer_wheel_for_context (g_main_context_get_thread_default ()),
+                                                (guint64)cockpit_ws_ping_interval * 1000,
+                                                on_ping_time, self);
 
   return self;
 }
+
+/**
+ * cockpit_web_service_count_sessions:
+ *
+ * Count the sessions open in this process, including ones that
+ * are idle and waiting to time out.
+ *
+ * Returns: the number of sessions
+ */
+guint
+cockpit_web_service_count_sessions (void)
+{
+  guint count = 0;
+
+  G_LOCK (sessions);
+  if (sessions)
+    count = g_hash_table_size (sessions);
+  G_UNLOCK (sessions);
+
+  return count;
+}
@@ -39,6 +39,8 @@ CockpitWebService *  cockpit_web_service_socket      (GIOStream *io_stream,
                                                       CockpitAuth *auth,
                                                       CockpitCreds *creds);
 
+guint                cockpit_web_service_count_sessions (void);
+
 G_END_DECLS
 
 #endif /* __COCKPIT_WEB_SERVICE_H__ */
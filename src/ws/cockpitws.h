@@ -37,10 +37,38 @@ extern const gchar *cockpit_ws_known_hosts;
 extern const gchar *cockpit_ws_default_host_header;
 extern gint cockpit_ws_specific_ssh_port;
 extern guint cockpit_ws_ping_interval;
+extern guint cockpit_ws_session_timeout;
+extern const gchar *cockpit_ws_machines_file;
 
 /* From cockpitwebserver */
 extern guint cockpit_ws_request_timeout;
 extern gsize cockpit_ws_request_maximum;
+extern guint cockpit_ws_worker_threads;
+extern guint cockpit_ws_handshake_threads;
+
+/* From cockpithandlers.c */
+extern const gchar *cockpit_ws_static_directory;
+
+/* From cockpitsshtransport.c */
+extern guint cockpit_ws_ssh_connect_threads;
+extern guint cockpit_ws_ssh_host_connects;
+extern guint cockpit_ws_ssh_keepalive;
+extern guint cockpit_ws_ssh_io_threads;
+
+/* From cockpitauth.c */
+extern const gchar *cockpit_ws_cookie_key_file;
+extern const gchar *cockpit_ws_cookie_deny_file;
+extern guint cockpit_ws_cookie_lifetime;
+extern guint cockpit_ws_session_pool;
+
+/* From cockpitadmission.c */
+extern guint cockpit_ws_max_connections;
+extern guint cockpit_ws_max_logins;
+extern guint cockpit_ws_max_user_sessions;
+extern guint cockpit_ws_max_web_sockets;
+extern guint cockpit_ws_address_rate;
+extern guint cockpit_ws_address_burst;
+extern guint cockpit_ws_retry_after;
 
 G_END_DECLS
 
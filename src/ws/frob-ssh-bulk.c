@@ -0,0 +1,281 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures ssh transport throughput. Starts a mock-sshd for each
+ * transfer, and pushes frames through mock-echo on all of them at
+ * once, keeping a window of frames in flight on each transport. Prints
+ * the aggregate rate at which the data came back.
+ *
+ * Run it at 1, 8 and 32 concurrent transfers, with --io-threads=0 to
+ * compare against doing the ssh I/O on the main context.
+ */
+
+#include "config.h"
+
+#include "cockpitws.h"
+#include "cockpitsshtransport.h"
+
+#include <libssh/libssh.h>
+
+#include <glib.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define PASSWORD "this is the password"
+#define FRAME_SIZE (64 * 1024)
+#define WINDOW 8
+
+typedef struct {
+  GPid pid;
+  guint16 port;
+  CockpitTransport *transport;
+  GBytes *frame;
+  guint sent;
+  guint received;
+  guint frames;
+  gchar *problem;
+} Transfer;
+
+static void
+start_mock_sshd (Transfer *transfer)
+{
+  GError *error = NULL;
+  GString *port;
+  gchar buffer[64];
+  gssize count;
+  gint out_fd;
+
+  const gchar *argv[] = {
+      BUILDDIR "/mock-sshd",
+      "--user", g_get_user_name (),
+      "--password", PASSWORD,
+      NULL
+  };
+
+  if (!g_spawn_async_with_pipes (BUILDDIR, (gchar **)argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL,
+                                 &transfer->pid, NULL, &out_fd, NULL, &error))
+    g_error ("couldn't start mock-sshd: %s", error->message);
+
+  /* mock-sshd prints its port on stdout, and then closes stdout */
+  port = g_string_new ("");
+  for (;;)
+    {
+      count = read (out_fd, buffer, sizeof (buffer));
+      if (count < 0 && errno == EINTR)
+        continue;
+      if (count <= 0)
+        break;
+      g_string_append_len (port, buffer, count);
+    }
+  close (out_fd);
+
+  transfer->port = atoi (port->str);
+  if (transfer->port == 0)
+    g_error ("invalid port printed by mock-sshd: %s", port->str);
+
+  g_string_free (port, TRUE);
+}
+
+static void
+send_frame (Transfer *transfer)
+{
+  cockpit_transport_send (transfer->transport, "1", transfer->frame);
+  transfer->sent++;
+}
+
+static gboolean
+on_transport_recv (CockpitTransport *transport,
+                   const gchar *channel,
+                   GBytes *payload,
+                   gpointer user_data)
+{
+  Transfer *transfer = user_data;
+
+  transfer->received++;
+  if (transfer->sent < transfer->frames)
+    send_frame (transfer);
+
+  return TRUE;
+}
+
+static void
+on_transport_closed (CockpitTransport *transport,
+                     const gchar *problem,
+                     gpointer user_data)
+{
+  Transfer *transfer = user_data;
+  if (!transfer->problem)
+    transfer->problem = g_strdup (problem ? problem : "closed");
+}
+
+static void
+open_transport (Transfer *transfer,
+                CockpitCreds *creds)
+{
+  transfer->transport = g_object_new (COCKPIT_TYPE_SSH_TRANSPORT,
+                                      "host", "127.0.0.1",
+                                      "port", (guint)transfer->port,
+                                      "command", BUILDDIR "/mock-echo",
+                                      "creds", creds,
+                                      "known-hosts", SRCDIR "/src/ws/mock_known_hosts",
+                                      NULL);
+  g_signal_connect (transfer->transport, "recv", G_CALLBACK (on_transport_recv), transfer);
+  g_signal_connect (transfer->transport, "closed", G_CALLBACK (on_transport_closed), transfer);
+}
+
+static void
+run_transfers (Transfer *transfers,
+               guint count,
+               guint frames)
+{
+  guint waiting;
+  guint i, j;
+
+  for (i = 0; i < count; i++)
+    {
+      transfers[i].sent = transfers[i].received = 0;
+      transfers[i].frames = frames;
+      for (j = 0; j < WINDOW && j < frames; j++)
+        send_frame (transfers + i);
+    }
+
+  do
+    {
+      g_main_context_iteration (NULL, TRUE);
+      waiting = 0;
+      for (i = 0; i < count; i++)
+        {
+          if (transfers[i].received < transfers[i].frames && !transfers[i].problem)
+            waiting++;
+        }
+    }
+  while (waiting > 0);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *options;
+  GError *error = NULL;
+  CockpitCreds *creds;
+  Transfer *transfers;
+  gchar *data;
+  guint64 bytes = 0;
+  gint64 start;
+  gint64 elapsed;
+  guint failures = 0;
+  guint frames;
+  guint i;
+
+  gint opt_transfers = 1;
+  gint opt_megabytes = 64;
+  gint opt_io_threads = -1;
+
+  GOptionEntry entries[] = {
+    { "transfers", 'n', 0, G_OPTION_ARG_INT, &opt_transfers, "Concurrent bulk transfers (1)", "count" },
+    { "megabytes", 'm', 0, G_OPTION_ARG_INT, &opt_megabytes, "Megabytes echoed by each transfer (64)", "count" },
+    { "io-threads", 't', 0, G_OPTION_ARG_INT, &opt_io_threads, "I/O threads, zero for the main context", "count" },
+    { NULL }
+  };
+
+  signal (SIGPIPE, SIG_IGN);
+  g_type_init ();
+  ssh_init ();
+
+  options = g_option_context_new (NULL);
+  g_option_context_add_main_entries (options, entries, NULL);
+  if (!g_option_context_parse (options, &argc, &argv, &error))
+    {
+      g_printerr ("frob-ssh-bulk: %s\n", error->message);
+      return 2;
+    }
+
+  if (opt_transfers <= 0 || opt_megabytes <= 0)
+    {
+      g_printerr ("frob-ssh-bulk: invalid number of transfers or megabytes\n");
+      return 2;
+    }
+
+  if (opt_io_threads >= 0)
+    cockpit_ws_ssh_io_threads = opt_io_threads;
+
+  frames = (opt_megabytes * 1024 * 1024) / FRAME_SIZE;
+
+  transfers = g_new0 (Transfer, opt_transfers);
+  for (i = 0; i < opt_transfers; i++)
+    start_mock_sshd (transfers + i);
+
+  creds = cockpit_creds_new (g_get_user_name (), COCKPIT_CRED_PASSWORD, PASSWORD, NULL);
+
+  data = g_malloc (FRAME_SIZE);
+  memset (data, 'x', FRAME_SIZE);
+
+  /* Connect and authenticate outside of the measurement */
+  for (i = 0; i < opt_transfers; i++)
+    {
+      transfers[i].frame = g_bytes_new_static (data, FRAME_SIZE);
+      open_transport (transfers + i, creds);
+    }
+  run_transfers (transfers, opt_transfers, 1);
+
+  start = g_get_monotonic_time ();
+  run_transfers (transfers, opt_transfers, frames);
+  elapsed = g_get_monotonic_time () - start;
+
+  for (i = 0; i < opt_transfers; i++)
+    {
+      if (transfers[i].problem)
+        {
+          g_printerr ("frob-ssh-bulk: transfer %u failed: %s\n", i, transfers[i].problem);
+          failures++;
+        }
+      bytes += (guint64)transfers[i].received * FRAME_SIZE;
+    }
+
+  g_print ("%d transfers, %u io threads\n", opt_transfers, cockpit_ws_ssh_io_threads);
+  g_print ("echoed %.1f MB in %.1f ms: %.1f MB/s\n",
+           bytes / (1024.0 * 1024.0), elapsed / 1000.0,
+           (bytes / (1024.0 * 1024.0)) / (elapsed / 1000000.0));
+  if (failures)
+    g_print ("%u transfers failed\n", failures);
+
+  for (i = 0; i < opt_transfers; i++)
+    {
+      g_object_unref (transfers[i].transport);
+      g_bytes_unref (transfers[i].frame);
+      g_free (transfers[i].problem);
+      kill (transfers[i].pid, SIGTERM);
+      waitpid (transfers[i].pid, NULL, 0);
+      g_spawn_close_pid (transfers[i].pid);
+    }
+
+  g_free (data);
+  cockpit_creds_unref (creds);
+  g_free (transfers);
+  g_option_context_free (options);
+
+  return failures ? 1 : 0;
+}
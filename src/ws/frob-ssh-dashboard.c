@@ -0,0 +1,286 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures dashboard time-to-first-data. Starts a mock-sshd for each
+ * machine, then opens ssh transports to all of them at once the way the
+ * dashboard does, and prints how long it took until each machine echoed
+ * back its first message.
+ *
+ * With --prewarm the transports are connected and authenticated first,
+ * as cockpit-ws does for the machines listed by cockpitd, and only the
+ * first message is timed.
+ */
+
+#include "config.h"
+
+#include "cockpitws.h"
+#include "cockpitsshtransport.h"
+
+#include <libssh/libssh.h>
+
+#include <glib.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define PASSWORD "this is the password"
+
+typedef struct {
+  GPid pid;
+  guint16 port;
+  CockpitTransport *transport;
+  gint64 received;
+  gchar *problem;
+} Machine;
+
+static void
+start_mock_sshd (Machine *machine)
+{
+  GError *error = NULL;
+  GString *port;
+  gchar buffer[64];
+  gssize count;
+  gint out_fd;
+
+  const gchar *argv[] = {
+      BUILDDIR "/mock-sshd",
+      "--user", g_get_user_name (),
+      "--password", PASSWORD,
+      NULL
+  };
+
+  if (!g_spawn_async_with_pipes (BUILDDIR, (gchar **)argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL,
+                                 &machine->pid, NULL, &out_fd, NULL, &error))
+    g_error ("couldn't start mock-sshd: %s", error->message);
+
+  /* mock-sshd prints its port on stdout, and then closes stdout */
+  port = g_string_new ("");
+  for (;;)
+    {
+      count = read (out_fd, buffer, sizeof (buffer));
+      if (count < 0 && errno == EINTR)
+        continue;
+      if (count <= 0)
+        break;
+      g_string_append_len (port, buffer, count);
+    }
+  close (out_fd);
+
+  machine->port = atoi (port->str);
+  if (machine->port == 0)
+    g_error ("invalid port printed by mock-sshd: %s", port->str);
+
+  g_string_free (port, TRUE);
+}
+
+static gboolean
+on_transport_recv (CockpitTransport *transport,
+                   const gchar *channel,
+                   GBytes *payload,
+                   gpointer user_data)
+{
+  Machine *machine = user_data;
+  if (!machine->received)
+    machine->received = g_get_monotonic_time ();
+  return TRUE;
+}
+
+static void
+on_transport_closed (CockpitTransport *transport,
+                     const gchar *problem,
+                     gpointer user_data)
+{
+  Machine *machine = user_data;
+  if (!machine->problem)
+    machine->problem = g_strdup (problem ? problem : "closed");
+}
+
+static void
+open_transport (Machine *machine,
+                CockpitCreds *creds)
+{
+  machine->transport = g_object_new (COCKPIT_TYPE_SSH_TRANSPORT,
+                                     "host", "127.0.0.1",
+                                     "port", (guint)machine->port,
+                                     "command", BUILDDIR "/mock-echo",
+                                     "creds", creds,
+                                     "known-hosts", SRCDIR "/src/ws/mock_known_hosts",
+                                     NULL);
+  g_signal_connect (machine->transport, "recv", G_CALLBACK (on_transport_recv), machine);
+  g_signal_connect (machine->transport, "closed", G_CALLBACK (on_transport_closed), machine);
+}
+
+static void
+send_and_wait (Machine *machines,
+               guint count)
+{
+  GBytes *payload;
+  guint waiting;
+  guint i;
+
+  payload = g_bytes_new_static ("dashboard", 9);
+  for (i = 0; i < count; i++)
+    {
+      machines[i].received = 0;
+      cockpit_transport_send (machines[i].transport, "1", payload);
+    }
+  g_bytes_unref (payload);
+
+  do
+    {
+      g_main_context_iteration (NULL, TRUE);
+      waiting = 0;
+      for (i = 0; i < count; i++)
+        {
+          if (!machines[i].received && !machines[i].problem)
+            waiting++;
+        }
+    }
+  while (waiting > 0);
+}
+
+static gint
+compare_gint64 (gconstpointer a,
+                gconstpointer b)
+{
+  const gint64 *one = a;
+  const gint64 *two = b;
+  return (*one > *two) - (*one < *two);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *options;
+  GError *error = NULL;
+  CockpitCreds *creds;
+  Machine *machines;
+  GArray *times;
+  gint64 start;
+  gint64 elapsed;
+  guint failures = 0;
+  guint i;
+
+  gint opt_machines = 50;
+  gint opt_threads = -1;
+  gint opt_host_connects = -1;
+  gboolean opt_prewarm = FALSE;
+
+  GOptionEntry entries[] = {
+    { "machines", 'm', 0, G_OPTION_ARG_INT, &opt_machines, "Number of machines on the dashboard (50)", "count" },
+    { "threads", 't', 0, G_OPTION_ARG_INT, &opt_threads, "Connect threads, zero for unlimited", "count" },
+    { "host-connects", 0, 0, G_OPTION_ARG_INT, &opt_host_connects, "Connects in flight per host, zero for unlimited", "count" },
+    { "prewarm", 0, 0, G_OPTION_ARG_NONE, &opt_prewarm, "Connect before the dashboard opens", NULL },
+    { NULL }
+  };
+
+  signal (SIGPIPE, SIG_IGN);
+  g_type_init ();
+  ssh_init ();
+
+  options = g_option_context_new (NULL);
+  g_option_context_add_main_entries (options, entries, NULL);
+  if (!g_option_context_parse (options, &argc, &argv, &error))
+    {
+      g_printerr ("frob-ssh-dashboard: %s\n", error->message);
+      return 2;
+    }
+
+  if (opt_machines <= 0)
+    {
+      g_printerr ("frob-ssh-dashboard: invalid number of machines\n");
+      return 2;
+    }
+
+  if (opt_threads >= 0)
+    cockpit_ws_ssh_connect_threads = opt_threads;
+  if (opt_host_connects >= 0)
+    cockpit_ws_ssh_host_connects = opt_host_connects;
+
+  machines = g_new0 (Machine, opt_machines);
+  for (i = 0; i < opt_machines; i++)
+    start_mock_sshd (machines + i);
+
+  creds = cockpit_creds_new (g_get_user_name (), COCKPIT_CRED_PASSWORD, PASSWORD, NULL);
+
+  if (opt_prewarm)
+    {
+      for (i = 0; i < opt_machines; i++)
+        open_transport (machines + i, creds);
+      send_and_wait (machines, opt_machines);
+    }
+
+  start = g_get_monotonic_time ();
+  if (!opt_prewarm)
+    {
+      for (i = 0; i < opt_machines; i++)
+        open_transport (machines + i, creds);
+    }
+  send_and_wait (machines, opt_machines);
+
+  times = g_array_new (FALSE, FALSE, sizeof (gint64));
+  for (i = 0; i < opt_machines; i++)
+    {
+      if (machines[i].problem)
+        {
+          g_printerr ("frob-ssh-dashboard: machine %u failed: %s\n", i, machines[i].problem);
+          failures++;
+          continue;
+        }
+      elapsed = machines[i].received - start;
+      g_array_append_val (times, elapsed);
+    }
+  g_array_sort (times, compare_gint64);
+
+  g_print ("%d machines, %u connect threads, %u connects per host%s\n",
+           opt_machines, cockpit_ws_ssh_connect_threads, cockpit_ws_ssh_host_connects,
+           opt_prewarm ? ", prewarmed" : "");
+  if (times->len > 0)
+    {
+      g_print ("time to first data: first %.1f ms, median %.1f ms, p90 %.1f ms, last %.1f ms\n",
+               g_array_index (times, gint64, 0) / 1000.0,
+               g_array_index (times, gint64, times->len / 2) / 1000.0,
+               g_array_index (times, gint64, (times->len * 9) / 10) / 1000.0,
+               g_array_index (times, gint64, times->len - 1) / 1000.0);
+    }
+  if (failures)
+    g_print ("%u machines failed\n", failures);
+
+  for (i = 0; i < opt_machines; i++)
+    {
+      g_object_unref (machines[i].transport);
+      g_free (machines[i].problem);
+      kill (machines[i].pid, SIGTERM);
+      waitpid (machines[i].pid, NULL, 0);
+      g_spawn_close_pid (machines[i].pid);
+    }
+
+  g_array_free (times, TRUE);
+  cockpit_creds_unref (creds);
+  g_free (machines);
+  g_option_context_free (options);
+
+  return failures ? 1 : 0;
+}
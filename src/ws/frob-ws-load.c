@@ -0,0 +1,573 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Load generator for cockpit-ws. Runs an in-process web server with an
+ * increasing number of worker threads, and hammers it with concurrent
+ * clients: first with /login requests, then with websocket echo traffic
+ * through mock-sshd and mock-echo. Prints logins/sec and messages/sec
+ * for each thread count.
+ *
+ * With --handshakes it instead floods a TLS server with new handshakes
+ * while the websocket clients echo, and prints handshakes/sec and the
+ * p99 echo latency with and without the handshake pool.
+ */
+
+#include "config.h"
+
+#include "mock-auth.h"
+#include "cockpitws.h"
+#include "cockpithandlers.h"
+#include "cockpitwebserver.h"
+
+#include "websocket/websocket.h"
+
+#include <glib.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PASSWORD "this is the password"
+
+static gint opt_threads = -1;
+static gint opt_clients = 16;
+static gint opt_seconds = 3;
+static gboolean opt_handshakes = FALSE;
+
+typedef struct {
+  guint16 port;
+  gint64 deadline;
+  gchar *cookie;
+  volatile gint count;
+  volatile gint failures;
+  volatile gint finished;
+  volatile gint handshakes;
+  GMutex mutex;
+  GArray *latencies;
+} LoadRun;
+
+static GPid
+start_mock_sshd (void)
+{
+  GError *error = NULL;
+  GString *port;
+  gchar buffer[64];
+  gssize count;
+  GPid pid;
+  gint out_fd;
+
+  const gchar *argv[] = {
+      BUILDDIR "/mock-sshd",
+      "--user", g_get_user_name (),
+      "--password", PASSWORD,
+      NULL
+  };
+
+  if (!g_spawn_async_with_pipes (BUILDDIR, (gchar **)argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL,
+                                 &pid, NULL, &out_fd, NULL, &error))
+    g_error ("couldn't start mock-sshd: %s", error->message);
+
+  /* mock-sshd prints its port on stdout, and then closes stdout */
+  port = g_string_new ("");
+  for (;;)
+    {
+      count = read (out_fd, buffer, sizeof (buffer));
+      if (count < 0 && errno == EINTR)
+        continue;
+      if (count <= 0)
+        break;
+      g_string_append_len (port, buffer, count);
+    }
+  close (out_fd);
+
+  cockpit_ws_specific_ssh_port = atoi (port->str);
+  if (cockpit_ws_specific_ssh_port <= 0)
+    g_error ("invalid port printed by mock-sshd: %s", port->str);
+  cockpit_ws_known_hosts = SRCDIR "/src/ws/mock_known_hosts";
+  cockpit_ws_agent_program = BUILDDIR "/mock-echo";
+  cockpit_ws_session_pool = 0;
+
+  g_string_free (port, TRUE);
+  return pid;
+}
+
+static gchar *
+login_once (guint16 port)
+{
+  GSocketClient *client;
+  GSocketConnection *conn;
+  GOutputStream *out;
+  GInputStream *in;
+  GString *resp;
+  gchar *request;
+  gchar *body;
+  gchar buffer[1024];
+  gchar *cookie = NULL;
+  const gchar *pos;
+  gssize count;
+
+  client = g_socket_client_new ();
+  conn = g_socket_client_connect_to_host (client, "127.0.0.1", port, NULL, NULL);
+  g_object_unref (client);
+  if (!conn)
+    return NULL;
+
+  body = g_strdup_printf ("%s\n%s", g_get_user_name (), PASSWORD);
+  request = g_strdup_printf ("POST /login HTTP/1.0\r\nContent-Length: %d\r\n\r\n%s",
+                             (gint)strlen (body), body);
+
+  out = g_io_stream_get_output_stream (G_IO_STREAM (conn));
+  in = g_io_stream_get_input_stream (G_IO_STREAM (conn));
+
+  resp = g_string_new ("");
+  if (g_output_stream_write_all (out, request, strlen (request), NULL, NULL, NULL))
+    {
+      for (;;)
+        {
+          count = g_input_stream_read (in, buffer, sizeof (buffer), NULL, NULL);
+          if (count <= 0)
+            break;
+          g_string_append_len (resp, buffer, count);
+        }
+    }
+
+  if (g_str_has_prefix (resp->str, "HTTP/1.1 200"))
+    {
+      pos = strstr (resp->str, "Set-Cookie: ");
+      if (pos)
+        {
+          pos += strlen ("Set-Cookie: ");
+          cookie = g_strndup (pos, strcspn (pos, ";\r\n"));
+        }
+    }
+
+  g_string_free (resp, TRUE);
+  g_object_unref (conn);
+  g_free (request);
+  g_free (body);
+  return cookie;
+}
+
+static gpointer
+login_thread (gpointer data)
+{
+  LoadRun *run = data;
+  gchar *cookie;
+
+  while (g_get_monotonic_time () < run->deadline)
+    {
+      cookie = login_once (run->port);
+      if (cookie)
+        g_atomic_int_inc (&run->count);
+      else
+        g_atomic_int_inc (&run->failures);
+      g_free (cookie);
+    }
+
+  g_atomic_int_inc (&run->finished);
+  return NULL;
+}
+
+static gboolean
+on_accept_certificate (GTlsConnection *conn,
+                       GTlsCertificate *peer_cert,
+                       GTlsCertificateFlags errors,
+                       gpointer user_data)
+{
+  return TRUE;
+}
+
+static gpointer
+handshake_thread (gpointer data)
+{
+  LoadRun *run = data;
+  GSocketConnectable *identity;
+  GSocketClient *client;
+  GSocketConnection *conn;
+  GIOStream *tls;
+
+  /* The identity lets the client cache and resume sessions */
+  identity = g_network_address_new ("127.0.0.1", run->port);
+  client = g_socket_client_new ();
+
+  while (g_get_monotonic_time () < run->deadline)
+    {
+      conn = g_socket_client_connect (client, identity, NULL, NULL);
+      tls = conn ? g_tls_client_connection_new (G_IO_STREAM (conn), identity, NULL) : NULL;
+      if (tls)
+        {
+          g_signal_connect (tls, "accept-certificate", G_CALLBACK (on_accept_certificate), NULL);
+          if (g_tls_connection_handshake (G_TLS_CONNECTION (tls), NULL, NULL))
+            g_atomic_int_inc (&run->handshakes);
+          else
+            g_atomic_int_inc (&run->failures);
+          g_io_stream_close (tls, NULL, NULL);
+          g_object_unref (tls);
+        }
+      else
+        {
+          g_atomic_int_inc (&run->failures);
+        }
+      if (conn)
+        g_object_unref (conn);
+    }
+
+  g_object_unref (client);
+  g_object_unref (identity);
+  g_atomic_int_inc (&run->finished);
+  return NULL;
+}
+
+typedef struct {
+  LoadRun *run;
+  GBytes *message;
+  gboolean done;
+  gint64 sent;
+  GArray *latencies;
+} EchoClient;
+
+static void
+send_echo (WebSocketConnection *ws,
+           EchoClient *echo)
+{
+  echo->sent = g_get_monotonic_time ();
+  web_socket_connection_send (ws, WEB_SOCKET_DATA_TEXT, NULL, echo->message);
+}
+
+static void
+on_echo_open (WebSocketConnection *ws,
+              gpointer user_data)
+{
+  static const gchar command[] = "\n{\"command\":\"open\",\"channel\":\"4\",\"payload\":\"test-text\"}";
+  EchoClient *echo = user_data;
+  GBytes *control;
+
+  control = g_bytes_new_static (command, sizeof (command) - 1);
+  web_socket_connection_send (ws, WEB_SOCKET_DATA_TEXT, NULL, control);
+  send_echo (ws, echo);
+  g_bytes_unref (control);
+}
+
+static void
+on_echo_message (WebSocketConnection *ws,
+                 WebSocketDataType type,
+                 GBytes *message,
+                 gpointer user_data)
+{
+  EchoClient *echo = user_data;
+  gint64 latency;
+  gint64 now;
+
+  /* Control messages have a zero channel */
+  if (g_str_has_prefix (g_bytes_get_data (message, NULL), "\n"))
+    return;
+
+  now = g_get_monotonic_time ();
+  latency = now - echo->sent;
+  g_array_append_val (echo->latencies, latency);
+
+  g_atomic_int_inc (&echo->run->count);
+  if (now < echo->run->deadline)
+    send_echo (ws, echo);
+  else
+    web_socket_connection_close (ws, 0, NULL);
+}
+
+static void
+on_echo_close (WebSocketConnection *ws,
+               gpointer user_data)
+{
+  EchoClient *echo = user_data;
+  if (g_get_monotonic_time () < echo->run->deadline)
+    g_atomic_int_inc (&echo->run->failures);
+  echo->done = TRUE;
+}
+
+static gpointer
+echo_thread (gpointer data)
+{
+  LoadRun *run = data;
+  WebSocketConnection *ws;
+  GMainContext *context;
+  EchoClient echo = { run, NULL, FALSE, 0, NULL };
+  gchar *url;
+  gchar *origin;
+
+  /* Each client runs its own loop, so it scales independently of the server */
+  context = g_main_context_new ();
+  g_main_context_push_thread_default (context);
+
+  url = g_strdup_printf ("ws://127.0.0.1:%d/socket", run->port);
+  origin = g_strdup_printf ("http://127.0.0.1:%d", run->port);
+  echo.message = g_bytes_new_static ("4\nthe message", 13);
+  echo.latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+  ws = web_socket_client_new (url, origin, NULL);
+  web_socket_client_include_header (WEB_SOCKET_CLIENT (ws), "Cookie", run->cookie);
+  g_signal_connect (ws, "open", G_CALLBACK (on_echo_open), &echo);
+  g_signal_connect (ws, "message", G_CALLBACK (on_echo_message), &echo);
+  g_signal_connect (ws, "close", G_CALLBACK (on_echo_close), &echo);
+
+  while (!echo.done)
+    g_main_context_iteration (context, TRUE);
+
+  g_mutex_lock (&run->mutex);
+  g_array_append_vals (run->latencies, echo.latencies->data, echo.latencies->len);
+  g_mutex_unlock (&run->mutex);
+  g_array_free (echo.latencies, TRUE);
+
+  g_object_unref (ws);
+  g_bytes_unref (echo.message);
+  g_free (url);
+  g_free (origin);
+
+  g_main_context_pop_thread_default (context);
+  g_main_context_unref (context);
+  g_atomic_int_inc (&run->finished);
+  return NULL;
+}
+
+/* Runs opt_clients threads of each function, returns elapsed seconds */
+static gdouble
+run_clients (LoadRun *run,
+             GThreadFunc func,
+             GThreadFunc also)
+{
+  GThread **threads;
+  gint64 start;
+  gint total;
+  gint i;
+
+  run->count = 0;
+  run->failures = 0;
+  run->finished = 0;
+  run->handshakes = 0;
+  g_array_set_size (run->latencies, 0);
+  start = g_get_monotonic_time ();
+  run->deadline = start + opt_seconds * G_USEC_PER_SEC;
+
+  total = also ? opt_clients * 2 : opt_clients;
+  threads = g_new0 (GThread *, total);
+  for (i = 0; i < total; i++)
+    threads[i] = g_thread_new ("load-client", i < opt_clients ? func : also, run);
+
+  /* The main thread accepts connections, and serves them when there are no workers */
+  while (g_atomic_int_get (&run->finished) < total)
+    {
+      if (!g_main_context_iteration (NULL, FALSE))
+        g_usleep (1000);
+    }
+
+  for (i = 0; i < total; i++)
+    g_thread_join (threads[i]);
+  g_free (threads);
+
+  return (g_get_monotonic_time () - start) / (gdouble)G_USEC_PER_SEC;
+}
+
+static gint
+compare_latency (gconstpointer a,
+                 gconstpointer b)
+{
+  gint64 la = *(const gint64 *)a;
+  gint64 lb = *(const gint64 *)b;
+  return la < lb ? -1 : (la > lb ? 1 : 0);
+}
+
+static gdouble
+latency_percentile_ms (GArray *latencies,
+                       guint percent)
+{
+  if (latencies->len == 0)
+    return 0.0;
+  g_array_sort (latencies, compare_latency);
+  return g_array_index (latencies, gint64, (latencies->len - 1) * percent / 100) / 1000.0;
+}
+
+static void
+start_load (LoadRun *run,
+            GTlsCertificate *certificate,
+            CockpitHandlerData *data,
+            CockpitWebServer **server)
+{
+  const gchar *roots[] = { SRCDIR "/src/ws", NULL };
+  GError *error = NULL;
+  gint port;
+
+  /* Measure throughput, not admission control */
+  cockpit_ws_max_connections = 0;
+  cockpit_ws_max_logins = 0;
+  cockpit_ws_max_user_sessions = 0;
+  cockpit_ws_max_web_sockets = 0;
+
+  memset (data, 0, sizeof (CockpitHandlerData));
+  data->auth = mock_auth_new (g_get_user_name (), PASSWORD);
+
+  *server = cockpit_web_server_new (0, certificate, roots, NULL, &error);
+  if (!*server)
+    g_error ("couldn't start web server: %s", error->message);
+
+  g_signal_connect (*server, "handle-stream", G_CALLBACK (cockpit_handler_socket), data);
+  g_signal_connect (*server, "handle-resource::/login", G_CALLBACK (cockpit_handler_login), data);
+
+  g_object_get (*server, "port", &port, NULL);
+  run->port = port;
+  run->latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+  g_mutex_init (&run->mutex);
+}
+
+static void
+stop_load (LoadRun *run,
+           CockpitHandlerData *data,
+           CockpitWebServer *server)
+{
+  g_object_unref (server);
+  g_object_unref (data->auth);
+  g_array_free (run->latencies, TRUE);
+  g_mutex_clear (&run->mutex);
+  g_free (run->cookie);
+}
+
+static void
+run_load (guint workers)
+{
+  CockpitHandlerData data;
+  CockpitWebServer *server;
+  LoadRun run = { 0, };
+  gdouble logins;
+  gdouble messages;
+
+  cockpit_ws_worker_threads = workers;
+  start_load (&run, NULL, &data, &server);
+
+  logins = run.count / run_clients (&run, login_thread, NULL);
+  if (run.failures)
+    g_printerr ("frob-ws-load: %d logins failed\n", run.failures);
+
+  run.cookie = login_once (run.port);
+  if (!run.cookie)
+    g_error ("couldn't log in for websocket load");
+
+  messages = run.count / run_clients (&run, echo_thread, NULL);
+  if (run.failures)
+    g_printerr ("frob-ws-load: %d websockets closed early\n", run.failures);
+
+  g_print ("%7u %12.1f %14.1f\n", workers, logins, messages);
+
+  stop_load (&run, &data, server);
+}
+
+static void
+run_handshakes (GTlsCertificate *certificate,
+                guint pool)
+{
+  CockpitHandlerData data;
+  CockpitWebServer *server;
+  LoadRun run = { 0, };
+  gdouble seconds;
+
+  cockpit_ws_handshake_threads = pool;
+  start_load (&run, certificate, &data, &server);
+
+  /* Loopback clients may speak plain HTTP to a TLS server */
+  run.cookie = login_once (run.port);
+  if (!run.cookie)
+    g_error ("couldn't log in for websocket load");
+
+  seconds = run_clients (&run, echo_thread, handshake_thread);
+  if (run.failures)
+    g_printerr ("frob-ws-load: %d failures\n", run.failures);
+
+  g_print ("%4u %16.1f %14.1f %12.2f %12.2f\n", pool,
+           run.handshakes / seconds, run.count / seconds,
+           latency_percentile_ms (run.latencies, 50),
+           latency_percentile_ms (run.latencies, 99));
+
+  stop_load (&run, &data, server);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  GOptionContext *options;
+  GTlsCertificate *certificate;
+  GError *error = NULL;
+  guint max;
+  guint n;
+  GPid pid;
+
+  GOptionEntry entries[] = {
+    { "threads", 't', 0, G_OPTION_ARG_INT, &opt_threads, "Maximum worker threads, or handshake pool size (number of processors)", "count" },
+    { "clients", 'c', 0, G_OPTION_ARG_INT, &opt_clients, "Concurrent clients (16)", "count" },
+    { "seconds", 's', 0, G_OPTION_ARG_INT, &opt_seconds, "Seconds to run each measurement (3)", "secs" },
+    { "handshakes", 0, 0, G_OPTION_ARG_NONE, &opt_handshakes, "Measure echo latency during a TLS handshake flood", NULL },
+    { NULL }
+  };
+
+  signal (SIGPIPE, SIG_IGN);
+  g_type_init ();
+
+  options = g_option_context_new (NULL);
+  g_option_context_add_main_entries (options, entries, NULL);
+  if (!g_option_context_parse (options, &argc, &argv, &error))
+    {
+      g_printerr ("frob-ws-load: %s\n", error->message);
+      return 2;
+    }
+
+  max = opt_threads >= 0 ? opt_threads : g_get_num_processors ();
+  if (opt_clients <= 0 || opt_seconds <= 0)
+    {
+      g_printerr ("frob-ws-load: invalid clients or seconds\n");
+      return 2;
+    }
+
+  pid = start_mock_sshd ();
+
+  g_print ("%d clients, %d seconds per measurement, %u processors\n",
+           opt_clients, opt_seconds, g_get_num_processors ());
+
+  if (opt_handshakes)
+    {
+      certificate = g_tls_certificate_new_from_file (SRCDIR "/src/ws/mock_cert", &error);
+      if (!certificate)
+        g_error ("couldn't load certificate: %s", error->message);
+
+      g_print ("pool   handshakes/sec   messages/sec   p50 (ms)     p99 (ms)\n");
+      run_handshakes (certificate, 0);
+      run_handshakes (certificate, MAX (max, 1));
+      g_object_unref (certificate);
+    }
+  else
+    {
+      g_print ("workers   logins/sec   messages/sec\n");
+      run_load (0);
+      for (n = 1; n <= max; n = (n < max && n * 2 > max) ? max : n * 2)
+        run_load (n);
+    }
+
+  kill (pid, SIGTERM);
+  g_spawn_close_pid (pid);
+  g_option_context_free (options);
+  return 0;
+}
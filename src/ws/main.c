@@ -40,13 +40,27 @@ static gchar   **opt_http_roots   = NULL;
 static gboolean  opt_no_tls       = FALSE;
 static gboolean  opt_disable_auth = FALSE;
 static gboolean  opt_debug = FALSE;
+static gint      opt_threads = 0;
 static gchar    *opt_agent_program;
+static gint      opt_max_connections = -1;
+static gint      opt_max_logins = -1;
+static gint      opt_max_user_sessions = -1;
+static gint      opt_max_web_sockets = -1;
+static gint      opt_address_rate = -1;
+static gint      opt_address_burst = -1;
 
 static GOptionEntry cmd_entries[] = {
   {"port", 'p', 0, G_OPTION_ARG_INT, &opt_port, "Local port to bind to (1001 if unset)", NULL},
   {"http-root", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_http_roots, "Path to serve HTTP GET requests from", NULL},
   {"no-tls", 0, 0, G_OPTION_ARG_NONE, &opt_no_tls, "Don't use TLS", NULL},
+  {"threads", 't', 0, G_OPTION_ARG_INT, &opt_threads, "Number of worker threads to serve connections on (0 to use the main thread)", NULL},
   {"debug", 'd', 0, G_OPTION_ARG_NONE, &opt_debug, "Debug mode: log messages to output", NULL},
+  {"max-connections", 0, 0, G_OPTION_ARG_INT, &opt_max_connections, "Maximum unauthenticated connections being read (0 for no limit)", "count"},
+  {"max-logins", 0, 0, G_OPTION_ARG_INT, &opt_max_logins, "Maximum logins in progress (0 for no limit)", "count"},
+  {"max-user-sessions", 0, 0, G_OPTION_ARG_INT, &opt_max_user_sessions, "Maximum web sockets per user (0 for no limit)", "count"},
+  {"max-web-sockets", 0, 0, G_OPTION_ARG_INT, &opt_max_web_sockets, "Maximum web sockets in total (0 for no limit)", "count"},
+  {"address-rate", 0, 0, G_OPTION_ARG_INT, &opt_address_rate, "New connections per second from each remote address (0 for no limit)", "count"},
+  {"address-burst", 0, 0, G_OPTION_ARG_INT, &opt_address_burst, "New connections in a burst from each remote address (0 for no limit)", "count"},
 #ifdef WITH_DEBUG
   {"no-auth", 0, 0, G_OPTION_ARG_NONE, &opt_disable_auth, "Don't require authentication", NULL},
   {"agent-path", 0, 0, G_OPTION_ARG_FILENAME, &opt_agent_program, "Change path to agent program", NULL},
@@ -281,6 +295,26 @@ main (int argc,
   if (opt_agent_program)
     cockpit_ws_agent_program = opt_agent_program;
 
+  if (opt_threads > 0)
+    cockpit_ws_worker_threads = opt_threads;
+
+  /* Without worker threads logins happen on the main context */
+  if (data.auth && cockpit_ws_worker_threads == 0)
+    cockpit_auth_fill_session_pool (data.auth);
+
+  if (opt_max_connections >= 0)
+    cockpit_ws_max_connections = opt_max_connections;
+  if (opt_max_logins >= 0)
+    cockpit_ws_max_logins = opt_max_logins;
+  if (opt_max_user_sessions >= 0)
+    cockpit_ws_max_user_sessions = opt_max_user_sessions;
+  if (opt_max_web_sockets >= 0)
+    cockpit_ws_max_web_sockets = opt_max_web_sockets;
+  if (opt_address_rate >= 0)
+    cockpit_ws_address_rate = opt_address_rate;
+  if (opt_address_burst >= 0)
+    cockpit_ws_address_burst = opt_address_burst;
+
   server = cockpit_web_server_new (opt_port,
                                    certificate,
                                    (const gchar **)opt_http_roots,
@@ -311,11 +345,25 @@ main (int argc,
                     G_CALLBACK (cockpit_handler_deauthorize),
                     &data);
 
+  g_signal_connect (server,
+                    "handle-resource::/status",
+                    G_CALLBACK (cockpit_handler_status),
+                    &data);
+
   g_signal_connect (server,
                     "handle-resource::/cockpitdyn.js",
                     G_CALLBACK (cockpit_handler_cockpitdyn),
                     &data);
 
+  g_signal_connect (server,
+                    "handle-resource::/",
+                    G_CALLBACK (cockpit_handler_index),
+                    &data);
+  g_signal_connect (server,
+                    "handle-resource::/index.html",
+                    G_CALLBACK (cockpit_handler_index),
+                    &data);
+
   /* static handler, ignores stuff it shouldn't handle */
   g_signal_connect (server,
                     "handle-resource",
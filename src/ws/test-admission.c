@@ -0,0 +1,241 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitadmission.h"
+#include "cockpitws.h"
+
+#include "cockpit/cockpittest.h"
+
+#include <glib.h>
+
+typedef struct {
+  guint max_connections;
+  guint max_user_sessions;
+  guint address_rate;
+  guint address_burst;
+} TestCase;
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  tc->max_connections = cockpit_ws_max_connections;
+  tc->max_user_sessions = cockpit_ws_max_user_sessions;
+  tc->address_rate = cockpit_ws_address_rate;
+  tc->address_burst = cockpit_ws_address_burst;
+  cockpit_admission_reset ();
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  cockpit_ws_max_connections = tc->max_connections;
+  cockpit_ws_max_user_sessions = tc->max_user_sessions;
+  cockpit_ws_address_rate = tc->address_rate;
+  cockpit_ws_address_burst = tc->address_burst;
+  cockpit_admission_reset ();
+
+  cockpit_assert_expected ();
+}
+
+static gint64
+status_member (const gchar *section,
+               const gchar *member)
+{
+  JsonObject *status;
+  gint64 ret;
+
+  status = cockpit_admission_build_status ();
+  ret = json_object_get_int_member (json_object_get_object_member (status, section), member);
+  json_object_unref (status);
+  return ret;
+}
+
+static void
+test_limit (TestCase *tc,
+            gconstpointer data)
+{
+  guint retry_after = 0;
+
+  cockpit_ws_max_connections = 2;
+
+  g_assert (cockpit_admission_acquire (COCKPIT_ADMISSION_CONNECTIONS, &retry_after));
+  g_assert (cockpit_admission_acquire (COCKPIT_ADMISSION_CONNECTIONS, &retry_after));
+  g_assert_cmpuint (retry_after, ==, 0);
+
+  g_assert (!cockpit_admission_acquire (COCKPIT_ADMISSION_CONNECTIONS, &retry_after));
+  g_assert_cmpuint (retry_after, ==, cockpit_ws_retry_after);
+
+  g_assert_cmpint (status_member ("connections", "current"), ==, 2);
+  g_assert_cmpint (status_member ("connections", "limit"), ==, 2);
+  g_assert_cmpint (status_member ("connections", "rejected"), ==, 1);
+
+  /* Room again after a release */
+  cockpit_admission_release (COCKPIT_ADMISSION_CONNECTIONS);
+  g_assert (cockpit_admission_acquire (COCKPIT_ADMISSION_CONNECTIONS, NULL));
+
+  cockpit_admission_release (COCKPIT_ADMISSION_CONNECTIONS);
+  cockpit_admission_release (COCKPIT_ADMISSION_CONNECTIONS);
+  g_assert_cmpint (status_member ("connections", "current"), ==, 0);
+  g_assert_cmpint (status_member ("connections", "peak"), ==, 2);
+}
+
+static void
+test_unlimited (TestCase *tc,
+                gconstpointer data)
+{
+  guint i;
+
+  cockpit_ws_max_connections = 0;
+
+  for (i = 0; i < 1000; i++)
+    g_assert (cockpit_admission_acquire (COCKPIT_ADMISSION_CONNECTIONS, NULL));
+  for (i = 0; i < 1000; i++)
+    cockpit_admission_release (COCKPIT_ADMISSION_CONNECTIONS);
+
+  g_assert_cmpint (status_member ("connections", "rejected"), ==, 0);
+}
+
+static void
+test_user (TestCase *tc,
+           gconstpointer data)
+{
+  guint retry_after = 0;
+
+  cockpit_ws_max_user_sessions = 1;
+
+  g_assert (cockpit_admission_acquire_user ("scruffy", NULL));
+  g_assert (cockpit_admission_acquire_user ("amy", NULL));
+
+  cockpit_expect_message ("scruffy: too many sessions for user: 1");
+  g_assert (!cockpit_admission_acquire_user ("scruffy", &retry_after));
+  g_assert_cmpuint (retry_after, ==, cockpit_ws_retry_after);
+
+  g_assert_cmpint (status_member ("user-sessions", "current"), ==, 2);
+  g_assert_cmpint (status_member ("user-sessions", "users"), ==, 2);
+  g_assert_cmpint (status_member ("user-sessions", "rejected"), ==, 1);
+
+  cockpit_admission_release_user ("scruffy");
+  g_assert (cockpit_admission_acquire_user ("scruffy", NULL));
+
+  cockpit_admission_release_user ("scruffy");
+  cockpit_admission_release_user ("amy");
+  g_assert_cmpint (status_member ("user-sessions", "users"), ==, 0);
+}
+
+static void
+test_address (TestCase *tc,
+              gconstpointer data)
+{
+  guint retry_after = 0;
+
+  cockpit_ws_address_rate = 1;
+  cockpit_ws_address_burst = 3;
+
+  g_assert (cockpit_admission_check_address ("10.1.1.1", NULL));
+  g_assert (cockpit_admission_check_address ("10.1.1.1", NULL));
+  g_assert (cockpit_admission_check_address ("10.1.1.1", NULL));
+
+  /* Bucket is empty, and refills one token per second */
+  g_assert (!cockpit_admission_check_address ("10.1.1.1", &retry_after));
+  g_assert_cmpuint (retry_after, ==, 1);
+
+  /* Other addresses have their own bucket */
+  g_assert (cockpit_admission_check_address ("10.2.2.2", NULL));
+
+  g_assert_cmpint (status_member ("addresses", "tracked"), ==, 2);
+  g_assert_cmpint (status_member ("addresses", "rejected"), ==, 1);
+}
+
+static void
+test_address_refill (TestCase *tc,
+                     gconstpointer data)
+{
+  cockpit_ws_address_rate = 20;
+  cockpit_ws_address_burst = 1;
+
+  g_assert (cockpit_admission_check_address ("10.1.1.1", NULL));
+  g_assert (!cockpit_admission_check_address ("10.1.1.1", NULL));
+
+  /* A token every 50 ms */
+  g_usleep (100 * 1000);
+  g_assert (cockpit_admission_check_address ("10.1.1.1", NULL));
+}
+
+static void
+test_address_unlimited (TestCase *tc,
+                        gconstpointer data)
+{
+  guint i;
+
+  cockpit_ws_address_rate = 0;
+
+  for (i = 0; i < 1000; i++)
+    g_assert (cockpit_admission_check_address ("10.1.1.1", NULL));
+
+  g_assert_cmpint (status_member ("addresses", "tracked"), ==, 0);
+}
+
+static void
+test_address_full (TestCase *tc,
+                   gconstpointer data)
+{
+  gchar address[32];
+  guint i;
+
+  cockpit_ws_address_rate = 1;
+  cockpit_ws_address_burst = 2;
+
+  /* None of these buckets are full, so none can be pruned */
+  for (i = 0; i < 5000; i++)
+    {
+      g_snprintf (address, sizeof (address), "10.%u.%u.1", i / 256, i % 256);
+      g_assert (cockpit_admission_check_address (address, NULL));
+    }
+
+  g_assert_cmpint (status_member ("addresses", "tracked"), ==, 4096);
+  g_assert_cmpint (status_member ("addresses", "untracked"), ==, 5000 - 4096);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/admission/limit", TestCase, NULL,
+              setup, test_limit, teardown);
+  g_test_add ("/admission/unlimited", TestCase, NULL,
+              setup, test_unlimited, teardown);
+  g_test_add ("/admission/user", TestCase, NULL,
+              setup, test_user, teardown);
+  g_test_add ("/admission/address", TestCase, NULL,
+              setup, test_address, teardown);
+  g_test_add ("/admission/address-refill", TestCase, NULL,
+              setup, test_address_refill, teardown);
+  g_test_add ("/admission/address-unlimited", TestCase, NULL,
+              setup, test_address_unlimited, teardown);
+  g_test_add ("/admission/address-full", TestCase, NULL,
+              setup, test_address_full, teardown);
+
+  return g_test_run ();
+}
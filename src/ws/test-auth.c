@@ -25,8 +25,12 @@
 #include "cockpit/cockpiterror.h"
 #include "cockpit/cockpittest.h"
 #include "ws/cockpitauth.h"
+#include "ws/cockpitws.h"
 #include "websocket/websocket.h"
 
+#include <glib/gstdio.h>
+
+#include <sys/stat.h>
 #include <string.h>
 
 typedef struct {
@@ -212,17 +216,309 @@ test_headers_bad (Test *test,
   g_hash_table_destroy (headers);
 }
 
+static GHashTable *
+login_with_cookie (CockpitAuth *auth)
+{
+  GAsyncResult *result = NULL;
+  CockpitCreds *creds;
+  GError *error = NULL;
+  GHashTable *headers;
+  GBytes *input;
+  gchar *cookie;
+  gchar *end;
+
+  input = g_bytes_new_static ("me\nthis is the password", 23);
+  cockpit_auth_login_async (auth, NULL, input, NULL, on_ready_get_result, &result);
+  g_bytes_unref (input);
+
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  headers = web_socket_util_new_headers ();
+  creds = cockpit_auth_login_finish (auth, result, TRUE, headers, &error);
+  g_object_unref (result);
+  g_assert_no_error (error);
+  g_assert (creds != NULL);
+  cockpit_creds_unref (creds);
+
+  cookie = g_strdup (g_hash_table_lookup (headers, "Set-Cookie"));
+  g_assert (cookie != NULL);
+  end = strchr (cookie, ';');
+  g_assert (end != NULL);
+  end[0] = '\0';
+
+  g_hash_table_insert (headers, g_strdup ("Cookie"), cookie);
+  return headers;
+}
+
+static void
+test_cookie_shared (void)
+{
+  CockpitAuth *one;
+  CockpitAuth *two;
+  CockpitCreds *creds;
+  GHashTable *headers;
+  struct stat st;
+  gchar *directory;
+  gchar *key_file;
+  gchar *deny_file;
+
+  directory = g_dir_make_tmp ("test-cockpit-auth.XXXXXX", NULL);
+  g_assert (directory != NULL);
+  key_file = g_build_filename (directory, "cookie-key", NULL);
+  deny_file = g_build_filename (directory, "cookie-deny", NULL);
+  cockpit_ws_cookie_key_file = key_file;
+  cockpit_ws_cookie_deny_file = deny_file;
+
+  /* Same as two cockpit-ws processes */
+  one = mock_auth_new ("me", "this is the password");
+  two = mock_auth_new ("me", "this is the password");
+
+  g_assert_cmpint (g_stat (key_file, &st), ==, 0);
+  g_assert_cmpint (st.st_mode & 0777, ==, 0600);
+
+  headers = login_with_cookie (one);
+
+  /* The process that did the login has the password */
+  creds = cockpit_auth_check_cookie (one, headers);
+  g_assert (creds != NULL);
+  g_assert_cmpstr (cockpit_creds_get_password (creds), ==, "this is the password");
+  cockpit_creds_unref (creds);
+
+  /* Any other process can check the cookie */
+  creds = cockpit_auth_check_cookie (two, headers);
+  g_assert (creds != NULL);
+  g_assert_cmpstr (cockpit_creds_get_user (creds), ==, "me");
+  g_assert_cmpstr (cockpit_creds_get_password (creds), ==, NULL);
+  cockpit_creds_unref (creds);
+
+  /* Revoking in one process applies to the other, within a second */
+  cockpit_auth_revoke_cookie (two, headers);
+  g_assert (cockpit_auth_check_cookie (two, headers) == NULL);
+  g_usleep (1100 * 1000);
+  g_assert (cockpit_auth_check_cookie (one, headers) == NULL);
+
+  g_hash_table_destroy (headers);
+  g_object_unref (one);
+  g_object_unref (two);
+
+  cockpit_ws_cookie_key_file = NULL;
+  cockpit_ws_cookie_deny_file = NULL;
+
+  g_unlink (key_file);
+  g_unlink (deny_file);
+  g_rmdir (directory);
+  g_free (key_file);
+  g_free (deny_file);
+  g_free (directory);
+}
+
+static void
+test_cookie_deny_prune (void)
+{
+  CockpitAuth *auth;
+  CockpitCreds *creds;
+  GHashTable *headers;
+  GString *text;
+  gchar *contents;
+  gchar *directory;
+  gchar *deny_file;
+  gchar **lines;
+  gint64 now;
+  guint i;
+
+  directory = g_dir_make_tmp ("test-cockpit-auth.XXXXXX", NULL);
+  g_assert (directory != NULL);
+  deny_file = g_build_filename (directory, "cookie-deny", NULL);
+  cockpit_ws_cookie_deny_file = deny_file;
+
+  /* Mostly cookies that have expired in the meantime */
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  text = g_string_new ("");
+  for (i = 0; i < 100; i++)
+    g_string_append_printf (text, "expired%u %" G_GINT64_FORMAT "\n", i, now - 10);
+  g_string_append_printf (text, "valid %" G_GINT64_FORMAT "\n", now + 3600);
+  g_assert (g_file_set_contents (deny_file, text->str, text->len, NULL));
+  g_string_free (text, TRUE);
+
+  auth = mock_auth_new ("me", "this is the password");
+  headers = login_with_cookie (auth);
+
+  creds = cockpit_auth_check_cookie (auth, headers);
+  g_assert (creds != NULL);
+  cockpit_creds_unref (creds);
+
+  /* Only the cookie that is still valid is left */
+  g_assert (g_file_get_contents (deny_file, &contents, NULL, NULL));
+  lines = g_strsplit (contents, "\n", -1);
+  g_assert_cmpuint (g_strv_length (lines), ==, 2);
+  g_assert (g_str_has_prefix (lines[0], "valid "));
+  g_assert_cmpstr (lines[1], ==, "");
+  g_strfreev (lines);
+  g_free (contents);
+
+  /* Revoking still works after the rewrite */
+  cockpit_auth_revoke_cookie (auth, headers);
+  g_assert (cockpit_auth_check_cookie (auth, headers) == NULL);
+  g_assert (g_file_get_contents (deny_file, &contents, NULL, NULL));
+  lines = g_strsplit (contents, "\n", -1);
+  g_assert_cmpuint (g_strv_length (lines), ==, 3);
+  g_strfreev (lines);
+  g_free (contents);
+
+  g_hash_table_destroy (headers);
+  g_object_unref (auth);
+
+  cockpit_ws_cookie_deny_file = NULL;
+
+  g_unlink (deny_file);
+  g_rmdir (directory);
+  g_free (deny_file);
+  g_free (directory);
+}
+
+static void
+test_cookie_tampered (Test *test,
+                      gconstpointer data)
+{
+  GHashTable *headers;
+  gchar *decoded;
+  gchar *encoded;
+  gchar *user;
+  gsize length;
+
+  headers = login_with_cookie (test->auth);
+
+  decoded = (gchar *)g_base64_decode ((gchar *)g_hash_table_lookup (headers, "Cookie") + 12, &length);
+  decoded = g_realloc (decoded, length + 1);
+  decoded[length] = '\0';
+
+  /* Change the user, but keep the signature */
+  user = strstr (decoded, ";u=me;");
+  g_assert (user != NULL);
+  user[3] = 'y';
+  user[4] = 'o';
+
+  encoded = g_base64_encode ((guchar *)decoded, length);
+  g_hash_table_insert (headers, g_strdup ("Cookie"), g_strdup_printf ("CockpitAuth=%s", encoded));
+  g_assert (cockpit_auth_check_cookie (test->auth, headers) == NULL);
+
+  g_free (encoded);
+  g_free (decoded);
+  g_hash_table_destroy (headers);
+}
+
+static void
+test_cookie_revoke (Test *test,
+                    gconstpointer data)
+{
+  CockpitCreds *creds;
+  GHashTable *headers;
+
+  headers = login_with_cookie (test->auth);
+
+  creds = cockpit_auth_check_cookie (test->auth, headers);
+  g_assert (creds != NULL);
+  cockpit_creds_unref (creds);
+
+  cockpit_auth_revoke_cookie (test->auth, headers);
+  g_assert (cockpit_auth_check_cookie (test->auth, headers) == NULL);
+
+  g_hash_table_destroy (headers);
+}
+
+static gint64
+status_member (CockpitAuth *auth,
+               const gchar *member)
+{
+  JsonObject *status;
+  gint64 ret;
+
+  status = cockpit_auth_build_status (auth);
+  ret = json_object_get_int_member (status, member);
+  json_object_unref (status);
+  return ret;
+}
+
+static void
+test_trace_login (Test *test,
+                  gconstpointer data)
+{
+  CockpitCreds *creds;
+  GHashTable *headers;
+
+  headers = login_with_cookie (test->auth);
+  g_assert_cmpint (status_member (test->auth, "logins"), ==, 1);
+  g_assert_cmpint (status_member (test->auth, "first-messages"), ==, 0);
+
+  creds = cockpit_auth_check_cookie (test->auth, headers);
+  g_assert (creds != NULL);
+
+  /* Only the first message after the login counts */
+  cockpit_auth_trace_first_message (test->auth, creds);
+  cockpit_auth_trace_first_message (test->auth, creds);
+  g_assert_cmpint (status_member (test->auth, "first-messages"), ==, 1);
+
+  cockpit_creds_unref (creds);
+  g_hash_table_destroy (headers);
+}
+
+/*
+ * Run with -m perf. Logs in over and over with mock-auth, and reports
+ * how long it takes from the start of a login until the first message,
+ * with the cookie checked in between as a web socket would.
+ */
+static void
+test_login_perf (Test *test,
+                 gconstpointer data)
+{
+  CockpitCreds *creds;
+  GHashTable *headers;
+  JsonObject *status;
+  gint i;
+
+  for (i = 0; i < 1000; i++)
+    {
+      headers = login_with_cookie (test->auth);
+      creds = cockpit_auth_check_cookie (test->auth, headers);
+      g_assert (creds != NULL);
+      cockpit_auth_trace_first_message (test->auth, creds);
+      cockpit_creds_unref (creds);
+      g_hash_table_destroy (headers);
+    }
+
+  status = cockpit_auth_build_status (test->auth);
+  g_assert_cmpint (json_object_get_int_member (status, "first-messages"), ==, 1000);
+  g_test_minimized_result (json_object_get_double_member (status, "login-ms-mean"),
+                           "login: %.3f ms", json_object_get_double_member (status, "login-ms-mean"));
+  g_test_minimized_result (json_object_get_double_member (status, "first-message-ms-mean"),
+                           "login to first message: %.3f ms",
+                           json_object_get_double_member (status, "first-message-ms-mean"));
+  json_object_unref (status);
+}
+
 int
 main (int argc,
       char *argv[])
 {
   cockpit_test_init (&argc, &argv);
 
+  /* Only the shared cookie test uses these */
+  cockpit_ws_cookie_key_file = NULL;
+  cockpit_ws_cookie_deny_file = NULL;
+
   g_test_add ("/auth/userpass-header-check", Test, NULL, setup, test_userpass_cookie_check, teardown);
   g_test_add ("/auth/userpass-bad", Test, NULL, setup, test_userpass_bad, teardown);
   g_test_add ("/auth/userpass-invalid", Test, NULL, setup, test_userpass_invalid, teardown);
   g_test_add ("/auth/userpass-emptypass", Test, NULL, setup, test_userpass_emptypass, teardown);
   g_test_add ("/auth/headers-bad", Test, NULL, setup, test_headers_bad, teardown);
+  g_test_add ("/auth/cookie-tampered", Test, NULL, setup, test_cookie_tampered, teardown);
+  g_test_add ("/auth/cookie-revoke", Test, NULL, setup, test_cookie_revoke, teardown);
+  g_test_add_func ("/auth/cookie-shared", test_cookie_shared);
+  g_test_add_func ("/auth/cookie-deny-prune", test_cookie_deny_prune);
+  g_test_add ("/auth/trace-login", Test, NULL, setup, test_trace_login, teardown);
+  if (g_test_perf ())
+    g_test_add ("/auth/login-perf", Test, NULL, setup, test_login_perf, teardown);
 
   return g_test_run ();
 }
@@ -24,10 +24,13 @@
 
 #include "cockpitwebserver.h"
 #include "cockpithandlers.h"
+#include "cockpitadmission.h"
+#include "cockpitws.h"
 
 #include "cockpit/cockpittest.h"
 
 #include <glib.h>
+#include <glib/gstdio.h>
 
 #include <string.h>
 
@@ -87,7 +90,7 @@ setup (Test *test,
   test->io = mock_io_stream_new (G_INPUT_STREAM (test->input),
                                  G_OUTPUT_STREAM (test->output));
 
-  test->response = cockpit_web_response_new (test->io, NULL);
+  test->response = cockpit_web_response_new (test->io, NULL, test->headers);
 }
 
 static void
@@ -231,6 +234,90 @@ test_login_post_fail (Test *test,
   cockpit_assert_strmatch (output_as_string (test), "HTTP/1.1 401 Authentication failed\r\n*");
 }
 
+static void
+test_login_post_overloaded (Test *test,
+                            gconstpointer data)
+{
+  guint max_logins = cockpit_ws_max_logins;
+  gboolean ret;
+  GBytes *input;
+
+  /* Another login is already in progress */
+  cockpit_admission_reset ();
+  cockpit_ws_max_logins = 1;
+  g_assert (cockpit_admission_acquire (COCKPIT_ADMISSION_LOGINS, NULL));
+
+  input = g_bytes_new_static ("booo\nyah", 8);
+  ret = cockpit_handler_login (test->server, COCKPIT_WEB_SERVER_REQUEST_POST, "/login",
+                               test->headers, input, test->response, &test->data);
+  g_bytes_unref (input);
+
+  g_assert (ret == TRUE);
+  cockpit_assert_strmatch (output_as_string (test),
+                           "HTTP/1.1 503 Service Unavailable\r\n*Retry-After: 5\r\n*");
+
+  cockpit_admission_release (COCKPIT_ADMISSION_LOGINS);
+  cockpit_ws_max_logins = max_logins;
+}
+
+static void
+test_status_no_cookie (Test *test,
+                       gconstpointer data)
+{
+  GBytes *input;
+  gboolean ret;
+
+  input = g_bytes_new_static ("", 0);
+  ret = cockpit_handler_status (test->server,
+                                COCKPIT_WEB_SERVER_REQUEST_GET, "/status",
+                                test->headers, input, test->response, &test->data);
+  g_bytes_unref (input);
+
+  g_assert (ret == TRUE);
+  cockpit_assert_strmatch (output_as_string (test), "HTTP/1.1 401 Unauthorized\r\n*");
+}
+
+static void
+test_status (Test *test,
+             gconstpointer data)
+{
+  GError *error = NULL;
+  GAsyncResult *result = NULL;
+  CockpitCreds *creds;
+  gchar *userpass;
+  GBytes *input;
+  gboolean ret;
+
+  userpass = g_strdup_printf ("%s\n%s", g_get_user_name (), PASSWORD);
+  input = g_bytes_new_take (userpass, strlen (userpass));
+  cockpit_auth_login_async (test->auth, NULL, input, NULL, on_ready_get_result, &result);
+  g_bytes_unref (input);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  creds = cockpit_auth_login_finish (test->auth, result, TRUE, test->headers, &error);
+  g_object_unref (result);
+  g_assert_no_error (error);
+  cockpit_creds_unref (creds);
+  include_cookie_as_if_client (test->headers, test->headers);
+
+  cockpit_admission_reset ();
+  g_assert (cockpit_admission_acquire (COCKPIT_ADMISSION_WEB_SOCKETS, NULL));
+
+  input = g_bytes_new_static ("", 0);
+  ret = cockpit_handler_status (test->server,
+                                COCKPIT_WEB_SERVER_REQUEST_GET, "/status",
+                                test->headers, input, test->response, &test->data);
+  g_bytes_unref (input);
+
+  g_assert (ret == TRUE);
+  cockpit_assert_strmatch (output_as_string (test),
+                           "HTTP/1.1 200 OK\r\n*Cache-Control: no-cache\r\n*"
+                           "\"web-sockets\":{\"current\":1,*\"limit\":1000,*"
+                           "\"logins\":{\"logins\":1,*");
+
+  cockpit_admission_release (COCKPIT_ADMISSION_WEB_SOCKETS);
+}
+
 static GHashTable *
 split_headers (const gchar *output)
 {
@@ -320,6 +407,178 @@ test_cockpitdyn (Test *test,
   g_free (expected);
 }
 
+static void
+test_cockpitdyn_not_modified (Test *test,
+                              gconstpointer data)
+{
+  GMemoryOutputStream *output;
+  CockpitWebResponse *response;
+  GIOStream *io;
+  const gchar *text;
+  gchar *etag;
+  gchar *reply;
+  GBytes *input;
+  gsize length;
+
+  input = g_bytes_new_static ("", 0);
+  cockpit_handler_cockpitdyn (test->server,
+                              COCKPIT_WEB_SERVER_REQUEST_GET, "/cockpitdyn.js",
+                              test->headers, input, test->response, &test->data);
+
+  text = output_as_string (test);
+  cockpit_assert_strmatch (text, "HTTP/1.1 200 OK\r\n*ETag: \"*\"\r\n*");
+  text = strstr (text, "ETag: ") + 6;
+  length = strcspn (text, "\r");
+  etag = g_strndup (text, length);
+
+  /* Conditional request with the same ETag */
+  g_hash_table_insert (test->headers, g_strdup ("If-None-Match"), g_strdup (etag));
+  output = G_MEMORY_OUTPUT_STREAM (g_memory_output_stream_new (NULL, 0, g_realloc, g_free));
+  io = mock_io_stream_new (G_INPUT_STREAM (test->input), G_OUTPUT_STREAM (output));
+  response = cockpit_web_response_new (io, NULL, test->headers);
+
+  cockpit_handler_cockpitdyn (test->server,
+                              COCKPIT_WEB_SERVER_REQUEST_GET, "/cockpitdyn.js",
+                              test->headers, input, response, &test->data);
+  g_bytes_unref (input);
+
+  while (!g_output_stream_is_closed (G_OUTPUT_STREAM (output)))
+    g_main_context_iteration (NULL, TRUE);
+
+  reply = g_strndup (g_memory_output_stream_get_data (output),
+                     g_memory_output_stream_get_data_size (output));
+  cockpit_assert_strmatch (reply, "HTTP/1.1 304 Not Modified\r\n*ETag: *\r\n\r\n");
+  g_assert (strstr (reply, "cockpitdyn_hostname") == NULL);
+  g_assert (strstr (reply, etag) != NULL);
+
+  g_object_unref (response);
+  g_object_unref (io);
+  g_object_unref (output);
+  g_free (reply);
+  g_free (etag);
+}
+
+static const gchar MOCK_INDEX[] =
+  "<html><head>\n"
+  "<script src=\"cockpitdyn.js\"></script>\n"
+  "<script src=\"cockpit.js\"></script>\n"
+  "</head></html>\n";
+
+static const gchar MOCK_MANIFEST[] =
+  "{ \"core\": \"cockpit-core-0123456789abcdef.js\","
+  "  \"bundles\": { \"storage\": { \"file\": \"cockpit-storage-fedcba9876543210.js\", \"requires\": [ ] } },"
+  "  \"pages\": { \"storage\": \"storage\" } }";
+
+typedef struct {
+  Test test;
+  gchar *directory;
+  const gchar *old_static;
+} TestIndex;
+
+static void
+setup_index (TestIndex *ti,
+             gconstpointer data)
+{
+  const gchar *roots[] = { NULL, NULL };
+  GError *error = NULL;
+  gchar *path;
+
+  setup (&ti->test, data);
+
+  ti->directory = g_dir_make_tmp ("test-handlers.XXXXXX", &error);
+  g_assert_no_error (error);
+
+  path = g_build_filename (ti->directory, "index.html", NULL);
+  g_file_set_contents (path, MOCK_INDEX, -1, &error);
+  g_assert_no_error (error);
+  g_free (path);
+
+  path = g_build_filename (ti->directory, "bundles", NULL);
+  g_assert (g_mkdir (path, 0700) == 0);
+  g_free (path);
+
+  ti->old_static = cockpit_ws_static_directory;
+  cockpit_ws_static_directory = ti->directory;
+
+  /* Serve index.html from the temporary directory */
+  roots[0] = ti->directory;
+  g_object_unref (ti->test.server);
+  ti->test.server = cockpit_web_server_new (0, NULL, roots, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+teardown_index (TestIndex *ti,
+                gconstpointer data)
+{
+  gchar *path;
+
+  cockpit_ws_static_directory = ti->old_static;
+
+  path = g_build_filename (ti->directory, "bundles", "manifest.json", NULL);
+  g_unlink (path);
+  g_free (path);
+  path = g_build_filename (ti->directory, "bundles", NULL);
+  g_rmdir (path);
+  g_free (path);
+  path = g_build_filename (ti->directory, "index.html", NULL);
+  g_unlink (path);
+  g_free (path);
+  g_rmdir (ti->directory);
+  g_free (ti->directory);
+
+  teardown (&ti->test, data);
+}
+
+static void
+test_index_bundles (TestIndex *ti,
+                    gconstpointer data)
+{
+  GError *error = NULL;
+  const gchar *output;
+  gboolean ret;
+  GBytes *input;
+  gchar *path;
+
+  path = g_build_filename (ti->directory, "bundles", "manifest.json", NULL);
+  g_file_set_contents (path, MOCK_MANIFEST, -1, &error);
+  g_assert_no_error (error);
+  g_free (path);
+
+  input = g_bytes_new_static ("", 0);
+  ret = cockpit_handler_index (ti->test.server,
+                               COCKPIT_WEB_SERVER_REQUEST_GET, "/",
+                               ti->test.headers, input, ti->test.response, &ti->test.data);
+  g_bytes_unref (input);
+
+  g_assert (ret == TRUE);
+
+  output = output_as_string (&ti->test);
+  cockpit_assert_strmatch (output, "HTTP/1.1 200 OK\r\n*ETag: \"*\"\r\n*");
+  cockpit_assert_strmatch (output, "*<script src=\"cockpitdyn.js\"></script>\n"
+                           "<script>var cockpit_manifest = {*\"storage\"*};</script>"
+                           "<script src=\"/static/bundles/cockpit-core-0123456789abcdef.js\"></script>\n"
+                           "</head>*");
+  g_assert (strstr (output, "\"cockpit.js\"") == NULL);
+}
+
+static void
+test_index_no_manifest (TestIndex *ti,
+                        gconstpointer data)
+{
+  gboolean ret;
+  GBytes *input;
+
+  /* Default handler serves index.html as is */
+  input = g_bytes_new_static ("", 0);
+  ret = cockpit_handler_index (ti->test.server,
+                               COCKPIT_WEB_SERVER_REQUEST_GET, "/",
+                               ti->test.headers, input, ti->test.response, &ti->test.data);
+  g_bytes_unref (input);
+
+  g_assert (ret == FALSE);
+}
+
 static void
 test_logout (Test *test,
              gconstpointer data)
@@ -346,6 +605,10 @@ main (int argc,
 {
   cockpit_test_init (&argc, &argv);
 
+  /* Each test process signs its own cookies */
+  cockpit_ws_cookie_key_file = NULL;
+  cockpit_ws_cookie_deny_file = NULL;
+
   g_test_add ("/handlers/login/no-cookie", Test, NULL,
               setup, test_login_no_cookie, teardown);
   g_test_add ("/handlers/login/with-cookie", Test, NULL,
@@ -357,11 +620,26 @@ main (int argc,
   g_test_add ("/handlers/login/post-accept", Test, NULL,
               setup, test_login_post_accept, teardown);
 
+  g_test_add ("/handlers/login/post-overloaded", Test, NULL,
+              setup, test_login_post_overloaded, teardown);
+
+  g_test_add ("/handlers/status/no-cookie", Test, NULL,
+              setup, test_status_no_cookie, teardown);
+  g_test_add ("/handlers/status", Test, NULL,
+              setup, test_status, teardown);
+
   g_test_add ("/handlers/logout", Test, NULL,
               setup, test_logout, teardown);
 
   g_test_add ("/handlers/cockpitdyn", Test, NULL,
               setup, test_cockpitdyn, teardown);
+  g_test_add ("/handlers/cockpitdyn-not-modified", Test, NULL,
+              setup, test_cockpitdyn_not_modified, teardown);
+
+  g_test_add ("/handlers/index/bundles", TestIndex, NULL,
+              setup_index, test_index_bundles, teardown_index);
+  g_test_add ("/handlers/index/no-manifest", TestIndex, NULL,
+              setup_index, test_index_no_manifest, teardown_index);
 
   return g_test_run ();
 }
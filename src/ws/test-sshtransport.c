@@ -23,6 +23,7 @@
 #include "config.h"
 
 #include "cockpitsshtransport.h"
+#include "cockpitws.h"
 
 #include "cockpit/cockpittest.h"
 
@@ -51,6 +52,7 @@ typedef struct {
   GPid mock_sshd;
   guint16 ssh_port;
   int old_log_level;
+  guint old_io_threads;
 } TestCase;
 
 typedef struct {
@@ -60,6 +62,7 @@ typedef struct {
     const char *client_password;
     const char *expect_key;
     int ssh_log_level;
+    gboolean no_io_threads;
 } TestFixture;
 
 #if WITH_MOCK
@@ -154,6 +157,10 @@ setup_transport (TestCase *tc,
   if (fixture->ssh_log_level)
     ssh_set_log_level (fixture->ssh_log_level);
 
+  tc->old_io_threads = cockpit_ws_ssh_io_threads;
+  if (fixture->no_io_threads)
+    cockpit_ws_ssh_io_threads = 0;
+
 #if WITH_MOCK
   setup_mock_sshd (tc, data);
 #endif
@@ -211,6 +218,7 @@ teardown (TestCase *tc,
   g_assert (tc->transport == NULL);
 
   ssh_set_log_level (tc->old_log_level);
+  cockpit_ws_ssh_io_threads = tc->old_io_threads;
 }
 
 static gboolean
@@ -268,6 +276,11 @@ static const TestFixture fixture_cat = {
   .ssh_command = "cat"
 };
 
+static const TestFixture fixture_cat_no_io_threads = {
+  .ssh_command = "cat",
+  .no_io_threads = TRUE
+};
+
 static void
 test_echo_and_close (TestCase *tc,
                      gconstpointer data)
@@ -668,6 +681,125 @@ test_cannot_connect (void)
   g_free (problem);
 }
 
+static void
+on_accept_connection (GObject *object,
+                      GAsyncResult *result,
+                      gpointer user_data)
+{
+  GPtrArray *accepted = user_data;
+  GSocketConnection *connection;
+  GError *error = NULL;
+
+  connection = g_socket_listener_accept_finish (G_SOCKET_LISTENER (object), result, NULL, &error);
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      g_error_free (error);
+      return;
+    }
+
+  g_assert_no_error (error);
+  g_ptr_array_add (accepted, connection);
+  g_socket_listener_accept_async (G_SOCKET_LISTENER (object), g_object_get_data (object, "cancellable"),
+                                  on_accept_connection, accepted);
+}
+
+static gboolean
+on_timeout_set_flag (gpointer user_data)
+{
+  gboolean *flag = user_data;
+  *flag = TRUE;
+  return FALSE;
+}
+
+static void
+wait_a_little (void)
+{
+  gboolean done = FALSE;
+  g_timeout_add (200, on_timeout_set_flag, &done);
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+test_host_connects (void)
+{
+  CockpitTransport *transports[3];
+  gchar *problems[3] = { NULL, };
+  GSocketListener *listener;
+  GCancellable *cancellable;
+  GPtrArray *accepted;
+  GError *error = NULL;
+  CockpitCreds *creds;
+  guint old_limit;
+  guint16 port;
+  gint i;
+
+  old_limit = cockpit_ws_ssh_host_connects;
+  cockpit_ws_ssh_host_connects = 1;
+
+  /* A server that accepts connections but never says anything */
+  listener = g_socket_listener_new ();
+  port = g_socket_listener_add_any_inet_port (listener, NULL, &error);
+  g_assert_no_error (error);
+  accepted = g_ptr_array_new_with_free_func (g_object_unref);
+  cancellable = g_cancellable_new ();
+  g_object_set_data (G_OBJECT (listener), "cancellable", cancellable);
+  g_socket_listener_accept_async (listener, cancellable, on_accept_connection, accepted);
+
+  creds = cockpit_creds_new ("user", COCKPIT_CRED_PASSWORD, "unused password", NULL);
+  for (i = 0; i < 3; i++)
+    {
+      transports[i] = cockpit_ssh_transport_new ("127.0.0.1", port, creds);
+      g_signal_connect (transports[i], "closed", G_CALLBACK (on_closed_get_problem), problems + i);
+    }
+
+  /* Only one connects at a time to the same host and port */
+  while (accepted->len == 0)
+    g_main_context_iteration (NULL, TRUE);
+  wait_a_little ();
+  g_assert_cmpuint (accepted->len, ==, 1);
+
+  /* A transport waiting its turn closes straight away */
+  cockpit_transport_close (transports[2], "cancelled");
+  while (problems[2] == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (problems[2], ==, "cancelled");
+
+  cockpit_expect_message ("*couldn't connect*");
+  cockpit_expect_message ("*couldn't connect*");
+
+  /* Once the first is done, the next one gets to go */
+  g_io_stream_close (accepted->pdata[0], NULL, NULL);
+  while (problems[0] == NULL || accepted->len < 2)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (problems[0], ==, "no-host");
+
+  g_io_stream_close (accepted->pdata[1], NULL, NULL);
+  while (problems[1] == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (problems[1], ==, "no-host");
+
+  /* And the cancelled one never connected */
+  wait_a_little ();
+  g_assert_cmpuint (accepted->len, ==, 2);
+
+  for (i = 0; i < 3; i++)
+    {
+      g_object_unref (transports[i]);
+      g_free (problems[i]);
+    }
+
+  cockpit_creds_unref (creds);
+  g_cancellable_cancel (cancellable);
+  g_socket_listener_close (listener);
+  g_object_unref (listener);
+  g_object_unref (cancellable);
+  g_ptr_array_free (accepted, TRUE);
+  cockpit_ws_ssh_host_connects = old_limit;
+
+  cockpit_assert_expected ();
+}
+
 static void
 test_close_while_connecting (TestCase *tc,
                              gconstpointer data)
@@ -699,6 +831,8 @@ main (int argc,
               setup_transport, test_echo_queue, teardown);
   g_test_add ("/ssh-transport/echo-large", TestCase, &fixture_cat,
               setup_transport, test_echo_large, teardown);
+  g_test_add ("/ssh-transport/echo-large-no-io-threads", TestCase, &fixture_cat_no_io_threads,
+              setup_transport, test_echo_large, teardown);
 
   g_test_add ("/ssh-transport/close-problem", TestCase, &fixture_cat,
               setup_transport, test_close_problem, teardown);
@@ -715,6 +849,7 @@ main (int argc,
   g_test_add ("/ssh-transport/close-while-connecting", TestCase, &fixture_cat,
               setup_transport, test_close_while_connecting, teardown);
   g_test_add_func ("/ssh-transport/cannot-connect", test_cannot_connect);
+  g_test_add_func ("/ssh-transport/host-connects", test_host_connects);
 
   g_test_add ("/ssh-transport/unknown-hostkey", TestCase, &fixture_unknown_hostkey,
               setup_transport, test_unknown_hostkey, teardown);
@@ -40,6 +40,8 @@ typedef struct {
 
 typedef struct {
     const gchar *path;
+    const gchar *accept_encoding;
+    const gchar *range;
 } TestFixture;
 
 static void
@@ -48,19 +50,34 @@ setup (TestCase *tc,
 {
   const TestFixture *fixture = data;
   const gchar *path = NULL;
+  GHashTable *headers = NULL;
   GInputStream *input;
   GIOStream *io;
 
   if (fixture)
-    path = fixture->path;
+    {
+      path = fixture->path;
+      if (fixture->accept_encoding || fixture->range)
+        headers = cockpit_web_server_new_table ();
+      if (fixture->accept_encoding)
+        {
+          g_hash_table_insert (headers, g_strdup ("Accept-Encoding"),
+                               g_strdup (fixture->accept_encoding));
+        }
+      if (fixture->range)
+        g_hash_table_insert (headers, g_strdup ("Range"), g_strdup (fixture->range));
+    }
 
   input = g_memory_input_stream_new ();
   tc->output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
   io = mock_io_stream_new (input, tc->output);
   g_object_unref (input);
 
-  tc->response = cockpit_web_response_new (io, path);
+  tc->response = cockpit_web_response_new (io, path, headers);
   g_object_unref (io);
+
+  if (headers)
+    g_hash_table_unref (headers);
 }
 
 static void
@@ -274,6 +291,147 @@ test_content_type (TestCase *tc,
   g_hash_table_unref (headers);
 }
 
+static const TestFixture gzip_fixture = {
+  .path = "/dbus-test.html",
+  .accept_encoding = "deflate, gzip",
+};
+
+static void
+test_content_encoding (TestCase *tc,
+                       gconstpointer user_data)
+{
+  const gchar *roots[] = { BUILDDIR, NULL };
+  GConverter *converter;
+  GHashTable *headers;
+  const gchar *resp;
+  gchar *contents;
+  gsize contents_len;
+  gchar *inflated;
+  gsize length;
+  gsize bytes_read;
+  gsize bytes_written;
+  guint status;
+  gssize off1;
+  gssize off2;
+
+  cockpit_web_response_file (tc->response, NULL, FALSE, roots);
+
+  /* Wait until everything is written */
+  output_as_string (tc);
+  resp = g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (tc->output));
+  length = g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (tc->output));
+
+  off1 = web_socket_util_parse_status_line (resp, length, &status, NULL);
+  g_assert_cmpuint (off1, >, 0);
+  g_assert_cmpint (status, ==, 200);
+
+  off2 = web_socket_util_parse_headers (resp + off1, length - off1, &headers);
+  g_assert_cmpuint (off2, >, 0);
+
+  g_assert_cmpstr (g_hash_table_lookup (headers, "Content-Type"), ==, "text/html");
+  g_assert_cmpstr (g_hash_table_lookup (headers, "Content-Encoding"), ==, "gzip");
+  g_assert_cmpstr (g_hash_table_lookup (headers, "Vary"), ==, "Accept-Encoding");
+  g_hash_table_unref (headers);
+
+  if (!g_file_get_contents (BUILDDIR "/dbus-test.html", &contents, &contents_len, NULL))
+    g_assert_not_reached ();
+
+  inflated = g_malloc (contents_len + 1);
+  converter = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+  g_assert_cmpint (g_converter_convert (converter, resp + off1 + off2, length - (off1 + off2),
+                                        inflated, contents_len + 1, G_CONVERTER_INPUT_AT_END,
+                                        &bytes_read, &bytes_written, NULL), ==, G_CONVERTER_FINISHED);
+  g_assert_cmpuint (bytes_written, ==, contents_len);
+  g_assert (memcmp (inflated, contents, contents_len) == 0);
+
+  g_object_unref (converter);
+  g_free (inflated);
+  g_free (contents);
+}
+
+static const TestFixture gzip_refused_fixture = {
+  .path = "/dbus-test.html",
+  .accept_encoding = "gzip;q=0, identity",
+};
+
+static void
+test_content_encoding_refused (TestCase *tc,
+                               gconstpointer user_data)
+{
+  const gchar *roots[] = { BUILDDIR, NULL };
+  const gchar *resp;
+
+  cockpit_web_response_file (tc->response, NULL, FALSE, roots);
+
+  resp = output_as_string (tc);
+  cockpit_assert_strmatch (resp, "HTTP/1.1 200 OK*");
+  g_assert (strstr (resp, "Content-Encoding") == NULL);
+  g_assert (strstr (resp, "Vary: Accept-Encoding\r\n") != NULL);
+}
+
+static const TestFixture range_fixture = {
+  .path = "/dbus-test.html",
+  .accept_encoding = "gzip",
+  .range = "bytes=1-6",
+};
+
+static void
+test_range (TestCase *tc,
+            gconstpointer user_data)
+{
+  const gchar *roots[] = { BUILDDIR, NULL };
+  GHashTable *headers;
+  const gchar *resp;
+  gchar *contents;
+  gchar *expected;
+  gsize length;
+  guint status;
+  gssize off1;
+  gssize off2;
+
+  if (!g_file_get_contents (BUILDDIR "/dbus-test.html", &contents, &length, NULL))
+    g_assert_not_reached ();
+
+  cockpit_web_response_file (tc->response, NULL, FALSE, roots);
+
+  resp = output_as_string (tc);
+  off1 = web_socket_util_parse_status_line (resp, strlen (resp), &status, NULL);
+  g_assert_cmpuint (off1, >, 0);
+  g_assert_cmpint (status, ==, 206);
+
+  off2 = web_socket_util_parse_headers (resp + off1, strlen (resp) - off1, &headers);
+  g_assert_cmpuint (off2, >, 0);
+
+  /* Ranges are never compressed */
+  g_assert (g_hash_table_lookup (headers, "Content-Encoding") == NULL);
+  g_assert_cmpstr (g_hash_table_lookup (headers, "Content-Length"), ==, "6");
+
+  expected = g_strdup_printf ("bytes 1-6/%d", (gint)length);
+  g_assert_cmpstr (g_hash_table_lookup (headers, "Content-Range"), ==, expected);
+  g_free (expected);
+
+  g_assert (strncmp (resp + off1 + off2, contents + 1, 6) == 0);
+  g_assert_cmpuint (strlen (resp + off1 + off2), ==, 6);
+
+  g_hash_table_unref (headers);
+  g_free (contents);
+}
+
+static const TestFixture range_unsatisfiable_fixture = {
+  .path = "/dbus-test.html",
+  .range = "bytes=100000000-",
+};
+
+static void
+test_range_unsatisfiable (TestCase *tc,
+                          gconstpointer user_data)
+{
+  const gchar *roots[] = { BUILDDIR, NULL };
+
+  cockpit_web_response_file (tc->response, NULL, FALSE, roots);
+  cockpit_assert_strmatch (output_as_string (tc), "HTTP/1.1 416 *\r\nContent-Range: bytes */*");
+}
+
 int
 main (int argc,
       char *argv[])
@@ -302,6 +460,14 @@ main (int argc,
               setup, test_file_breakout_non_existant, teardown);
   g_test_add ("/web-response/content-type", TestCase, &content_type_fixture,
               setup, test_content_type, teardown);
+  g_test_add ("/web-response/content-encoding", TestCase, &gzip_fixture,
+              setup, test_content_encoding, teardown);
+  g_test_add ("/web-response/content-encoding-refused", TestCase, &gzip_refused_fixture,
+              setup, test_content_encoding_refused, teardown);
+  g_test_add ("/web-response/file/range", TestCase, &range_fixture,
+              setup, test_range, teardown);
+  g_test_add ("/web-response/file/range-unsatisfiable", TestCase, &range_unsatisfiable_fixture,
+              setup, test_range_unsatisfiable, teardown);
 
   return g_test_run ();
 }
@@ -160,9 +160,10 @@ on_ready_get_result (GObject *source,
 }
 
 static gchar *
-perform_http_request (const gchar *hostport,
-                      const gchar *request,
-                      gsize *length)
+perform_request (const gchar *hostport,
+                 gboolean tls,
+                 const gchar *request,
+                 gsize *length)
 {
   GSocketClient *client;
   GSocketConnection *conn;
@@ -174,6 +175,12 @@ perform_http_request (const gchar *hostport,
   gssize ret;
 
   client = g_socket_client_new ();
+  if (tls)
+    {
+      /* The mock certificate is self-signed */
+      g_socket_client_set_tls (client, TRUE);
+      g_socket_client_set_tls_validation_flags (client, 0);
+    }
 
   result = NULL;
   g_socket_client_connect_to_host_async (client, hostport, 1, NULL, on_ready_get_result, &result);
@@ -215,6 +222,14 @@ perform_http_request (const gchar *hostport,
   return g_string_free (reply, FALSE);
 }
 
+static gchar *
+perform_http_request (const gchar *hostport,
+                      const gchar *request,
+                      gsize *length)
+{
+  return perform_request (hostport, FALSE, request, length);
+}
+
 static void
 test_webserver_content_type (TestCase *tc,
                              gconstpointer user_data)
@@ -283,6 +298,65 @@ test_webserver_not_authorized (TestCase *tc,
   g_free (resp);
 }
 
+static void
+test_webserver_range (TestCase *tc,
+                      gconstpointer user_data)
+{
+  GHashTable *headers;
+  gchar *contents;
+  gchar *resp;
+  gsize length;
+  gsize size;
+  guint status;
+  gssize off1;
+  gssize off2;
+
+  if (!g_file_get_contents (BUILDDIR "/dbus-test.html", &contents, &size, NULL))
+    g_assert_not_reached ();
+  g_assert_cmpuint (size, >, 10);
+
+  /* The body is sent with sendfile() over the plain socket */
+  resp = perform_http_request (tc->localport, "GET /dbus-test.html HTTP/1.0\r\n"
+                               "Range: bytes=-10\r\n\r\n", &length);
+  g_assert (resp != NULL);
+
+  off1 = web_socket_util_parse_status_line (resp, length, &status, NULL);
+  g_assert_cmpuint (off1, >, 0);
+  g_assert_cmpint (status, ==, 206);
+
+  off2 = web_socket_util_parse_headers (resp + off1, length - off1, &headers);
+  g_assert_cmpuint (off2, >, 0);
+  g_assert_cmpstr (g_hash_table_lookup (headers, "Content-Length"), ==, "10");
+
+  g_assert_cmpuint (length - (off1 + off2), ==, 10);
+  g_assert (memcmp (resp + off1 + off2, contents + size - 10, 10) == 0);
+
+  g_hash_table_unref (headers);
+  g_free (contents);
+  g_free (resp);
+}
+
+static void
+test_webserver_sendfile (TestCase *tc,
+                         gconstpointer user_data)
+{
+  gchar *contents;
+  gchar *resp;
+  gsize length;
+  gsize size;
+
+  if (!g_file_get_contents (BUILDDIR "/dbus-test.html", &contents, &size, NULL))
+    g_assert_not_reached ();
+
+  resp = perform_http_request (tc->localport, "GET /dbus-test.html HTTP/1.0\r\n\r\n", &length);
+  g_assert (resp != NULL);
+  g_assert_cmpuint (length, >, size);
+  g_assert (memcmp (resp + length - size, contents, size) == 0);
+
+  g_free (contents);
+  g_free (resp);
+}
+
 static const TestFixture fixture_with_cert = {
     .cert_file = SRCDIR "/src/ws/mock_cert"
 };
@@ -315,6 +389,22 @@ test_webserver_noredirect_localhost (TestCase *tc,
   g_free (resp);
 }
 
+static void
+test_webserver_tls_handshake (TestCase *tc,
+                              gconstpointer data)
+{
+  gchar *resp;
+  gint i;
+
+  /* Handshakes complete in the pool, and input starts afterwards */
+  for (i = 0; i < 3; i++)
+    {
+      resp = perform_request (tc->localport, TRUE, "GET /dbus-test.html HTTP/1.0\r\n\r\n", NULL);
+      cockpit_assert_strmatch (resp, "HTTP/* 200 *\r\n*");
+      g_free (resp);
+    }
+}
+
 int
 main (int argc,
       char *argv[])
@@ -333,9 +423,15 @@ main (int argc,
               setup, test_webserver_not_found, teardown);
   g_test_add ("/web-server/not-authorized", TestCase, NULL,
               setup, test_webserver_not_authorized, teardown);
+  g_test_add ("/web-server/range", TestCase, NULL,
+              setup, test_webserver_range, teardown);
+  g_test_add ("/web-server/sendfile", TestCase, NULL,
+              setup, test_webserver_sendfile, teardown);
 
   g_test_add ("/web-server/redirect-notls", TestCase, &fixture_with_cert,
               setup, test_webserver_redirect_notls, teardown);
+  g_test_add ("/web-server/tls-handshake", TestCase, &fixture_with_cert,
+              setup, test_webserver_tls_handshake, teardown);
   g_test_add ("/web-server/no-redirect-localhost", TestCase, &fixture_with_cert,
               setup, test_webserver_noredirect_localhost, teardown);
 
@@ -31,8 +31,10 @@
 #include "websocket/websocket.h"
 
 #include <glib.h>
+#include <glib/gstdio.h>
 
 #include <string.h>
+#include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -564,6 +566,101 @@ test_echo_large (TestCase *test,
   close_client_and_stop_web_service (test, ws, service);
 }
 
+static void
+expect_echo (WebSocketConnection *ws,
+             const gchar *data)
+{
+  GBytes *received = NULL;
+  GBytes *sent;
+  gulong handler;
+
+  handler = g_signal_connect (ws, "message", G_CALLBACK (on_message_get_non_control), &received);
+
+  sent = g_bytes_new_static (data, strlen (data));
+  web_socket_connection_send (ws, WEB_SOCKET_DATA_TEXT, NULL, sent);
+  WAIT_UNTIL (received != NULL);
+  g_assert (g_bytes_equal (received, sent));
+  g_bytes_unref (sent);
+  g_bytes_unref (received);
+
+  g_signal_handler_disconnect (ws, handler);
+}
+
+static void
+test_shared_session (TestCase *test,
+                     gconstpointer data)
+{
+  WebSocketConnection *ws1, *ws2;
+  CockpitWebService *service1, *service2;
+  GIOStream *io_a, *io_b;
+
+  /* Sessions from earlier tests close once their mock-sshd is gone */
+  WAIT_UNTIL (cockpit_web_service_count_sessions () == 0);
+
+  start_web_service_and_connect_client (test, data, &ws1, &service1);
+
+  /* A second web socket, as if from another browser tab */
+  io_a = test->io_a;
+  io_b = test->io_b;
+  setup_io_streams (test, data);
+  start_web_service_and_connect_client (test, data, &ws2, &service2);
+
+  /* Both use channel 4, and each gets its own messages back */
+  expect_echo (ws1, "4\nfirst tab");
+  expect_echo (ws2, "4\nsecond tab");
+  expect_echo (ws1, "4\nfirst tab again");
+
+  g_assert_cmpuint (cockpit_web_service_count_sessions (), ==, 1);
+
+  /* The session outlives the first web socket */
+  close_client_and_stop_web_service (test, ws1, service1);
+  g_assert_cmpuint (cockpit_web_service_count_sessions (), ==, 1);
+  expect_echo (ws2, "4\nstill here");
+
+  close_client_and_stop_web_service (test, ws2, service2);
+
+  g_object_unref (io_a);
+  g_object_unref (io_b);
+}
+
+static void
+test_prewarm (TestCase *test,
+              gconstpointer data)
+{
+  WebSocketConnection *ws;
+  CockpitWebService *service;
+  GError *error = NULL;
+  gchar *machines;
+  GBytes *sent;
+
+  WAIT_UNTIL (cockpit_web_service_count_sessions () == 0);
+
+  machines = g_strdup ("/tmp/test-webservice-machines-XXXXXX");
+  close (g_mkstemp (machines));
+  g_file_set_contents (machines, "[0]\naddress=127.0.0.1\n", -1, &error);
+  g_assert_no_error (error);
+  cockpit_ws_machines_file = machines;
+
+  /* Connects as soon as the web socket is open, before any channel */
+  start_web_service_and_create_client (test, data, &ws, &service);
+  WAIT_UNTIL (web_socket_connection_get_ready_state (ws) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert_cmpuint (cockpit_web_service_count_sessions (), ==, 1);
+
+  /* mock-sshd only accepts one connection, so this must reuse it */
+  sent = build_control_message ("open", "4", "host", "127.0.0.1", NULL);
+  web_socket_connection_send (ws, WEB_SOCKET_DATA_TEXT, NULL, sent);
+  g_bytes_unref (sent);
+
+  expect_echo (ws, "4\nwarm");
+  g_assert_cmpuint (cockpit_web_service_count_sessions (), ==, 1);
+
+  close_client_and_stop_web_service (test, ws, service);
+
+  cockpit_ws_machines_file = NULL;
+  g_unlink (machines);
+  g_free (machines);
+}
+
 static void
 test_close_error (TestCase *test,
                   gconstpointer data)
@@ -830,6 +927,16 @@ main (int argc,
   /* We don't want to test the ping functionality in these tests */
   cockpit_ws_ping_interval = G_MAXUINT;
 
+  /* Only connect to machines ahead of time when testing that */
+  cockpit_ws_machines_file = NULL;
+
+  /* Each test process signs its own cookies */
+  cockpit_ws_cookie_key_file = NULL;
+  cockpit_ws_cookie_deny_file = NULL;
+
+  /* No local sessions are started in these tests */
+  cockpit_ws_session_pool = 0;
+
   static const TestFixture fixture_rfc6455 = {
       .web_socket_flavor = WEB_SOCKET_FLAVOR_RFC6455,
   };
@@ -855,6 +962,13 @@ main (int argc,
               &fixture_rfc6455, setup_for_socket,
               test_echo_large, teardown_for_socket);
 
+  g_test_add ("/web-service/shared-session", TestCase,
+              &fixture_rfc6455, setup_for_socket,
+              test_shared_session, teardown_for_socket);
+  g_test_add ("/web-service/prewarm", TestCase,
+              &fixture_rfc6455, setup_for_socket,
+              test_prewarm, teardown_for_socket);
+
   g_test_add ("/web-service/close-error", TestCase,
               NULL, setup_for_socket,
               test_close_error, teardown_for_socket);